@@ -0,0 +1,445 @@
+#include "pch.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "Benchmarks.h"
+#include "DelayProxy.h"
+#include "FileBundle.h"
+#include "Harness.h"
+#include "Pipeline.h"
+#include "Remote.h"
+#include "StatBatch.h"
+#include "SyncStream.h"
+#include "TreeManifest.h"
+
+#ifndef WIN32
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace connection;
+
+
+
+// reads the bundle following an MGET's OK response, writing it into directory, or discarding it if
+// that's empty. Returns bytes of file contents received; names, if given, collects the files' names
+static uint64_t receive_mget_data(Connection& channel, const Message& response, const std::string& directory, std::vector<std::string>* names = nullptr) {
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("MGET failed: " + response.to_string());
+
+    if (!directory.empty()) {
+        const auto result = receive_bundle(channel, directory, nullptr, 10000);
+
+        if (!result.failed.empty())
+            throw std::runtime_error("MGET failed to write " + result.failed.front());
+
+        return result.bytes;
+    }
+
+    BundleReader reader(channel, 10000);
+    BundleEntry entry;
+    uint64_t bytes = 0;
+
+    while (reader.next(&entry)) {
+        reader.read([&bytes](const char*, size_t len) { bytes += len; });
+
+        if (names)
+            names->push_back(entry.name);
+    }
+
+    return bytes;
+}
+
+
+// one MGET over a v1 session, its bundle arriving on a data connection of its own
+static uint64_t remote_mget(const Connection::Ptr& control, const std::string& pattern, const std::string& directory) {
+    auto command = MAKE_MSG(MSGID::MESSAGE_MGET, pattern);
+    Message response;
+    uint64_t received = 0;
+
+    Connection::StopListeningQuery stopListening = []() { return false; };
+    Connection::ErrorCallback onError = [](const ConnectionException& ce) -> bool { throw ce; };
+
+    Connection::SocketCreatedCallback onListen = [&](const std::string&, port_t port) {
+        command.port = port;
+        control->send(command);
+        control->receive(&response, 10000);
+
+        if (response.msgid != MSGID::MESSAGE_OK)
+            throw std::runtime_error("MGET " + pattern + " failed: " + response.to_string());
+    };
+
+    Connection::ConnectionEstablishedCallback onEstablished = [&](Connection::Ptr dataChannel) {
+        received = receive_mget_data(*dataChannel, response, directory);
+        dataChannel->shutdown();
+    };
+
+    Connection::welcome(Connection::PORT_ANY, stopListening, onListen, onEstablished, onError, true, 10000);
+
+    return received;
+}
+
+
+// one MGET over its own stream of a v2 session
+static uint64_t remote_mget(const Multiplexer::Ptr& mux, const std::string& pattern, const std::string& directory, std::vector<std::string>* names = nullptr) {
+    auto stream = mux->open_stream();
+    Message response;
+
+    stream->send(MAKE_MSG(MSGID::MESSAGE_MGET, pattern));
+    stream->receive(&response, 10000);
+
+    const auto received = receive_mget_data(*stream, response, directory, names);
+
+    stream->shutdown();
+    return received;
+}
+
+
+// every file matching pattern, fetched one GET at a time and as a single MGET bundle. Inline
+// responses are off, so under v1 each GET really does open a data connection
+void bench_mget(const std::string& host, port_t port, const std::string& pattern) {
+    Multiplexer::Ptr mux;
+    auto v1 = open_session(host, port, 0);
+    auto v2 = open_session(host, port, 0, &mux);
+    std::vector<std::string> files;
+
+    remote_mget(mux, pattern, "", &files);
+
+    const auto perFile = [&files](BenchResult result) {
+        result.iterations *= files.size();
+        return result;
+    };
+
+    const auto param = [&files](const std::string& mode) { return mode + "_" + std::to_string(files.size()) + "_files"; };
+
+    report(perFile(run_timed("mget", param("v1_get_each"), [&]() -> uint64_t {
+        uint64_t bytes = 0;
+
+        for (const auto& file : files)
+            bytes += remote_get(v1, file);
+
+        return bytes;
+    }, 1)));
+
+    report(perFile(run_timed("mget", param("v2_get_pipelined"), [&]() -> uint64_t {
+        CommandPipeline pipeline(mux, 32, 10000);
+        uint64_t bytes = 0;
+
+        for (const auto& file : files) {
+            pipeline.submit(MAKE_MSG(MSGID::MESSAGE_GET, file), [&](uint64_t, const Message& response, const Connection::Ptr& stream) {
+                bytes += discard_get_data(stream, response, file);
+            });
+        }
+
+        pipeline.drain();
+        return bytes;
+    }, 1)));
+
+    report(perFile(run_timed("mget", param("v1_mget"), [&]() { return remote_mget(v1, pattern, ""); }, 1)));
+    report(perFile(run_timed("mget", param("v2_mget"), [&]() { return remote_mget(mux, pattern, ""); }, 1)));
+
+#ifndef WIN32
+    // the same again, with the receiving side's writer pool putting every file on disk
+    char scratch[] = "/tmp/mget_bench_XXXXXX";
+
+    if (mkdtemp(scratch)) {
+        report(perFile(run_timed("mget", param("v2_mget_to_disk"), [&]() { return remote_mget(mux, pattern, scratch); }, 1)));
+
+        for (const auto& file : files)
+            ::unlink((std::string(scratch) + "/" + file).c_str());
+
+        ::rmdir(scratch);
+    }
+#endif
+
+    close_session(v1);
+    close_session(v2, mux);
+}
+
+
+// the manifest of directory, from a TREE over its own stream of a v2 session
+static std::vector<TreeEntry> remote_tree(const Multiplexer::Ptr& mux, const std::string& directory) {
+    auto stream = mux->open_stream();
+    Message response;
+
+    stream->send(MAKE_MSG(MSGID::MESSAGE_TREE, directory));
+    stream->receive(&response, 10000);
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("TREE " + directory + " failed: " + response.to_string());
+
+    std::string manifest(static_cast<size_t>(response.datalen), '\0');
+
+    if (response.flags & FLAG_INLINE) {
+        manifest = response.payload;
+    } else {
+        for (size_t got = 0; got < manifest.size();) {
+            bool timedOut = false;
+            const auto received = stream->transport().receive(&manifest[got], static_cast<int>(manifest.size() - got), 10000, &timedOut);
+
+            if (received <= 0)
+                throw std::runtime_error("TREE " + directory + ": manifest cut short");
+
+            got += received;
+        }
+    }
+
+    stream->shutdown();
+    return decode_manifest(manifest);
+}
+
+
+// a whole tree, fetched GET by GET on as many streams at once as there are workers. Reporting
+// one op per tree makes ns_per_op the time to the last file (the makespan) and mb_per_sec the
+// tree's throughput. Largest first keeps a big file from being started last and finishing alone
+void bench_tree(const std::string& host, port_t port, const std::string& directory, long rttMs) {
+    std::unique_ptr<DelayProxy> proxy(rttMs > 0 ? new DelayProxy(host, port, rttMs) : nullptr);
+    const auto rtt = rttMs > 0 ? "_rtt" + std::to_string(rttMs) + "ms" : std::string();
+    Multiplexer::Ptr mux;
+    auto v2 = proxy ? open_session("127.0.0.1", proxy->port(), 0, &mux) : open_session(host, port, 0, &mux);
+    std::vector<TreeEntry> listed;
+
+    for (auto& entry : remote_tree(mux, directory)) {
+        if (entry.type == TreeEntry::FILE)
+            listed.push_back(std::move(entry));
+    }
+
+    auto largestFirst = listed;
+
+    std::stable_sort(largestFirst.begin(), largestFirst.end(), [](const TreeEntry& lhs, const TreeEntry& rhs) { return lhs.size > rhs.size; });
+
+    const std::pair<const char*, const std::vector<TreeEntry>*> orders[] = { { "listed", &listed }, { "largest_first", &largestFirst } };
+
+    for (const size_t workers : { 1, 4, 16 }) {
+        for (const auto& order : orders) {
+            const auto& files = *order.second;
+
+            report(run_timed("tree_get", "w" + std::to_string(workers) + "_" + order.first + "_" + std::to_string(files.size()) + "_files" + rtt, [&]() -> uint64_t {
+                std::atomic<size_t> next(0);
+                std::atomic<uint64_t> bytes(0);
+                std::vector<std::thread> threads;
+
+                for (size_t i = 0; i < workers; ++i) {
+                    threads.emplace_back([&]() {
+                        for (size_t f = next++; f < files.size(); f = next++)
+                            bytes += remote_get(mux, files[f].path);
+                    });
+                }
+
+                for (auto& thread : threads)
+                    thread.join();
+
+                return bytes.load();
+            }, 1));
+        }
+    }
+
+    close_session(v2, mux);
+}
+
+
+static void send_all(Connection& channel, const std::string& data) {
+    for (size_t sent = 0; sent < data.size();)
+        sent += channel.transport().send(data.data() + sent, static_cast<int>(data.size() - sent));
+}
+
+
+// a STAT command for names: the request goes in the payload if it fits, else as data
+static Message make_stat_command(const std::string& request) {
+    auto command = MAKE_MSG(MSGID::MESSAGE_STAT);
+
+    if (request.length() <= MAX_PAYLOAD_LEN)
+        command.payload = request;
+    else command.datalen = request.length();
+
+    return command;
+}
+
+
+// one STAT over its own stream of a v2 session. Returns the number of entries answered
+static uint64_t remote_stat(const Multiplexer::Ptr& mux, const std::vector<std::string>& names, uint8_t options) {
+    const auto request = encode_stat_request(names, options);
+    const auto command = make_stat_command(request);
+    auto stream = mux->open_stream();
+    Message response;
+
+    stream->send(command);
+    stream->receive(&response, 10000);
+
+    if (command.datalen > 0 && response.msgid == MSGID::MESSAGE_OK) {
+        send_all(*stream, request);
+        stream->receive(&response, 10000);
+    }
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("STAT failed: " + response.to_string());
+
+    const auto entries = (response.flags & FLAG_INLINE) ? response.payload : receive_exactly(*stream, response.datalen);
+
+    stream->shutdown();
+    return decode_stats(entries, names.size()).size();
+}
+
+
+// the same over a v1 session, where the request (if long) and the entries use a data connection
+static uint64_t remote_stat(const Connection::Ptr& control, const std::vector<std::string>& names, uint8_t options) {
+    const auto request = encode_stat_request(names, options);
+    auto command = make_stat_command(request);
+    Message response;
+    std::string entries;
+    bool bListen = true;
+
+    Connection::StopListeningQuery stopListening = [&bListen]() { return !bListen; };
+    Connection::ErrorCallback onError = [](const ConnectionException& ce) -> bool { throw ce; };
+
+    Connection::SocketCreatedCallback onListen = [&](const std::string&, port_t port) {
+        command.port = port;
+        control->send(command);
+        control->receive(&response, 10000);
+
+        if (response.msgid != MSGID::MESSAGE_OK)
+            throw std::runtime_error("STAT failed: " + response.to_string());
+
+        if (response.flags & FLAG_INLINE) {
+            entries = response.payload;
+            bListen = false;
+        }
+    };
+
+    Connection::ConnectionEstablishedCallback onEstablished = [&](Connection::Ptr dataChannel) {
+        if (command.datalen > 0) {
+            send_all(*dataChannel, request);
+            control->receive(&response, 10000);
+
+            if (response.msgid != MSGID::MESSAGE_OK)
+                throw std::runtime_error("STAT failed: " + response.to_string());
+        }
+
+        entries = receive_exactly(*dataChannel, response.datalen);
+        dataChannel->shutdown();
+    };
+
+    Connection::welcome(Connection::PORT_ANY, stopListening, onListen, onEstablished, onError, true, 10000);
+
+    return decode_stats(entries, names.size()).size();
+}
+
+
+// what a client deciding what to sync can do: probe every file on its own (a GET, or a STAT
+// each), or ask about all of them at once. Inline responses are on, as a client would have them
+void bench_stat(const std::string& host, port_t port, const std::string& directory) {
+    Multiplexer::Ptr mux;
+    auto v1 = open_session(host, port, MAX_INLINE_PAYLOAD_LEN);
+    auto v2 = open_session(host, port, MAX_INLINE_PAYLOAD_LEN, &mux);
+    std::vector<std::string> files;
+
+    for (const auto& entry : remote_tree(mux, directory)) {
+        if (entry.type == TreeEntry::FILE)
+            files.push_back(entry.path);
+    }
+
+    const auto perFile = [&files](BenchResult result) {
+        result.iterations *= files.size();
+        return result;
+    };
+
+    const auto param = [&files](const std::string& mode) { return mode + "_" + std::to_string(files.size()) + "_files"; };
+
+    report(perFile(run_timed("stat", param("v2_get_each"), [&]() -> uint64_t {
+        uint64_t bytes = 0;
+
+        for (const auto& file : files)
+            bytes += remote_get(mux, file);
+
+        return bytes;
+    }, 1)));
+
+    report(perFile(run_timed("stat", param("v2_stat_each"), [&]() -> uint64_t {
+        for (const auto& file : files)
+            remote_stat(mux, std::vector<std::string>(1, file), 0);
+
+        return 0;
+    }, 1)));
+
+    report(perFile(run_timed("stat", param("v1_stat_batch"), [&]() { remote_stat(v1, files, 0); return uint64_t(0); }, 1)));
+    report(perFile(run_timed("stat", param("v2_stat_batch"), [&]() { remote_stat(mux, files, 0); return uint64_t(0); }, 1)));
+    report(perFile(run_timed("stat", param("v2_stat_batch_crc"), [&]() { remote_stat(mux, files, STAT_WANT_CRC); return uint64_t(0); }, 1)));
+
+    close_session(v1);
+    close_session(v2, mux);
+}
+
+
+constexpr int PUT_STAT_CHECK_ROUNDS = 20;
+constexpr long PUT_STAT_CHECK_HOLD_MS = 50;             // how long each PUT's data is held back after the STAT has gone
+
+
+// pipelines a PUT of a new file and a STAT of it over v2, holding the PUT's data back until well after
+// the STAT has been sent: a server that keeps a session's commands in order answers the STAT only once
+// the whole file is in place. Returns whether the STAT saw the file as PUT every time
+bool check_put_then_stat(const std::string& host, port_t port, const std::string& serverDirectory) {
+    Multiplexer::Ptr mux;
+    auto control = open_session(host, port, 0, &mux);
+
+    if (!mux)
+        throw std::runtime_error("the server doesn't speak protocol v2: commands can't be pipelined");
+
+    const auto prefix = "put_stat_check_" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+    int stale = 0;
+
+    for (int i = 0; i < PUT_STAT_CHECK_ROUNDS; ++i) {
+        const auto name = prefix + "_" + std::to_string(i);
+        const std::string contents(static_cast<size_t>(1000 * (i + 1) + i), 'p');
+        auto put = MAKE_MSG(MSGID::MESSAGE_PUT, name);
+        auto putStream = mux->open_stream();
+        auto statStream = mux->open_stream();
+        Message response;
+
+        put.datalen = contents.size();
+        putStream->send(put);
+        statStream->send(make_stat_command(encode_stat_request(std::vector<std::string>(1, name), 0)));
+
+        putStream->receive(&response, 10000);
+
+        if (response.msgid != MSGID::MESSAGE_OK)
+            throw std::runtime_error("PUT " + name + " failed: " + response.to_string());
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(PUT_STAT_CHECK_HOLD_MS));
+        send_all(*putStream, contents);
+        putStream->receive(&response, 10000);
+
+        if (response.msgid != MSGID::MESSAGE_OK)
+            throw std::runtime_error("PUT " + name + " failed: " + response.to_string());
+
+        putStream->shutdown();
+        statStream->receive(&response, 10000);
+
+        if (response.msgid != MSGID::MESSAGE_OK)
+            throw std::runtime_error("STAT " + name + " failed: " + response.to_string());
+
+        const auto entries = (response.flags & FLAG_INLINE) ? response.payload : receive_exactly(*statStream, response.datalen);
+        const auto stat = decode_stats(entries, 1).front();
+
+        statStream->shutdown();
+
+        if (stat.type != STAT_FILE || stat.size != contents.size())
+            ++stale;
+
+        std::remove((serverDirectory + "/" + name).c_str());
+    }
+
+    close_session(control, mux);
+
+    std::ostringstream line;
+    line << "bench=put_then_stat param=pipelined_v2 rounds=" << PUT_STAT_CHECK_ROUNDS << " stale=" << stale;
+    sync_cout.print(line.str(), sync_endl);
+
+    return stale == 0;
+}
@@ -0,0 +1,331 @@
+#include "pch.h"
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include "Benchmarks.h"
+#include "Harness.h"
+#include "SyncStream.h"
+
+using namespace std;
+using namespace connection;
+
+// Microbenchmarks for the serialization and framing code in Common. Every result is
+// printed as a single line of space-separated key=value pairs so runs can be diffed
+// or parsed for regression comparison:
+//
+//   bench=<name> param=<value> iters=<n> ns_per_op=<f> ops_per_sec=<f> mb_per_sec=<f> allocs_per_op=<f>
+//
+// followed by a final peak_rss_kb=<n> line for the whole run (where the platform reports it).
+//
+// usage: Benchmark [filter]    (only benchmarks whose name contains filter are run)
+//        Benchmark get <server> <port> <file>
+//            repeatedly GETs file from a running server, once with inline responses
+//            enabled and once with every transfer forced through a data channel
+//        Benchmark mux <server> <port> <small file> <large file>
+//            GETs mixes of small and large files from a running server: one at a time
+//            over protocol v1 (a data connection per transfer) and v2 (a stream per
+//            transfer), then all of a mix at once over v2
+//        Benchmark pipeline <server> <port> <file> [rtt ms]
+//            GETs a batch of files through a proxy adding rtt ms (default 20) of round trip:
+//            one at a time over v1 and v2, then pipelined over v2 at increasing depths
+//        Benchmark local <server> <port> <local socket> <small file> <large file>
+//            GETs each file over loopback TCP (v1 and v2) and over the server's local
+//            socket, where the file arrives as a descriptor and is read or mapped
+//        Benchmark mget <server> <port> <pattern>
+//            fetches every file matching pattern: GET by GET over v1 (a data connection per
+//            file) and pipelined over v2, then as one MGET bundle over each, discarded or
+//            written out to a scratch directory. Reported per file
+//        Benchmark tree <server> <port> <directory> [rtt ms]
+//            fetches every file under directory over v2 with 1 to 16 workers, in manifest
+//            order and largest first, optionally through a proxy adding rtt ms of round
+//            trip (default 0: direct). ns_per_op is the time to fetch the whole tree
+//        Benchmark stat <server> <port> <directory>
+//            learns about every file under directory: probing each with a GET or a STAT of
+//            its own, then with one batched STAT over v1 and v2, with and without checksums.
+//            Reported per file
+//        Benchmark putstat <server> <port> <server directory>
+//            a check rather than a benchmark: PUTs new files over v2 with a STAT of each pipelined behind,
+//            sent before the PUT's data, and exits with failure if any STAT didn't see the whole file
+//        Benchmark copy <server> <port> <server directory> <file>
+//            duplicates file on a server on this host: by a GET here and a PUT back, then by
+//            COPY. The server directory is needed to remove each duplicate again
+//        Benchmark put <server> <port> <server directory> [file size]
+//            uploads small files (default 4096 bytes) from 1 to 128 sessions at once, each
+//            waiting for its PUT to be confirmed: uploads per second, then latency percentiles.
+//            Compare servers started with each FTP_DURABILITY mode
+//        Benchmark putrange <server> <port> <server directory> <file>
+//            uploads file as one PUT, then as ranges over 2 to 8 streams at once
+//        Benchmark resume <server> <port> <file> [rtt ms]
+//            drops a v2 session again and again, through a proxy adding rtt ms (default 20)
+//            of round trip, and times reconnecting until file's data arrives: greeting a new
+//            session, then resuming the dropped one. Latency percentiles
+//        Benchmark restart <server executable> <port> <server directory> [restarts]
+//            starts a server of its own on port, serving directory, and hot restarts it 5 times (or as
+//            many as asked for) while sessions come and go and others stay connected GETting a file.
+//            Counts connections refused, sessions broken and GETs failed, and how long each old
+//            process took to hand over; exits with failure if anything was refused or broken
+//        Benchmark watch <server> <port> <server pid> <server directory> [sessions]
+//            as files appear in directory on a server on this host, has 1000 sessions (or as many
+//            as asked for) find out: polling with LS every 2 seconds, then subscribed with WATCH.
+//            Reports the server's CPU time per second and how long files took to be noticed
+//        Benchmark follow <server> <port> <server directory>
+//            ships a log growing by a line every 10 ms in directory on a server on this host: by GETting
+//            all of it again every second or 100 ms, then with one GET following it. Latency
+//            percentiles from a line being appended to its arrival, and bytes transferred per line
+//        Benchmark readahead <server> <port> <server directory> [files] [file size]
+//            fetches 64 files of 1 MiB (or as many and as large as asked for) put in directory on a
+//            server on this host, one after another from cold: in a shuffled order, in that order
+//            again from a new session, then in name order. How many were in the page cache by the
+//            time they were asked for, time to first byte, and throughput. Compare a server
+//            started with FTP_READAHEAD=off
+//        Benchmark warmup <server executable> <port> <server directory> [files] [file size]
+//            restarts a server of its own on port, serving directory, with 512 files of 64 KiB (or as
+//            many and as large as asked for) put there dropped from the page cache, and GETs them,
+//            some far more often than others: without a hot set, then warmed from one saved by an
+//            earlier run (FTP_HOTSET). GET latency p99 second by second, and how long until it settled
+//        Benchmark archive <server> <port> <member> <file>
+//            GETs a member of an archive the server serves (FTP_ARCHIVES) and the same file
+//            extracted onto its disk, over v1 and v2 with every transfer through the data path
+
+
+bool should_run(const std::string& filter, const std::string& name) {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+
+int main(int argc, const char** argv) {
+    const std::string filter = argc > 1 ? argv[1] : "";
+
+    Connection::initialize();
+
+    try {
+        if (filter == "get") {
+            if (argc != 5)
+                throw std::invalid_argument("usage: Benchmark get <server> <port> <file>");
+
+            bench_remote_get(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "mux") {
+            if (argc != 6)
+                throw std::invalid_argument("usage: Benchmark mux <server> <port> <small file> <large file>");
+
+            bench_mux(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argv[5]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "pipeline") {
+            if (argc != 5 && argc != 6)
+                throw std::invalid_argument("usage: Benchmark pipeline <server> <port> <file> [rtt ms]");
+
+            bench_pipeline(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argc == 6 ? std::stol(argv[5]) : 20);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "resume") {
+            if (argc != 5 && argc != 6)
+                throw std::invalid_argument("usage: Benchmark resume <server> <port> <file> [rtt ms]");
+
+            bench_resume(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argc == 6 ? std::stol(argv[5]) : 20);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "mget") {
+            if (argc != 5)
+                throw std::invalid_argument("usage: Benchmark mget <server> <port> <pattern>");
+
+            bench_mget(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "stat") {
+            if (argc != 5)
+                throw std::invalid_argument("usage: Benchmark stat <server> <port> <directory>");
+
+            bench_stat(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "putstat") {
+            if (argc != 5)
+                throw std::invalid_argument("usage: Benchmark putstat <server> <port> <server directory>");
+
+            const bool ordered = check_put_then_stat(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4]);
+
+            Connection::deinitialize();
+            return ordered ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        if (filter == "tree") {
+            if (argc != 5 && argc != 6)
+                throw std::invalid_argument("usage: Benchmark tree <server> <port> <directory> [rtt ms]");
+
+            bench_tree(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argc == 6 ? std::stol(argv[5]) : 0);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "archive") {
+            if (argc != 6)
+                throw std::invalid_argument("usage: Benchmark archive <server> <port> <member> <file>");
+
+            bench_archive(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argv[5]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+#ifndef WIN32
+        if (filter == "copy") {
+            if (argc != 6)
+                throw std::invalid_argument("usage: Benchmark copy <server> <port> <server directory> <file>");
+
+            bench_copy(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argv[5]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "put") {
+            if (argc != 5 && argc != 6)
+                throw std::invalid_argument("usage: Benchmark put <server> <port> <server directory> [file size]");
+
+            bench_put(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argc == 6 ? std::stoul(argv[5]) : 4096);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "putrange") {
+            if (argc != 6)
+                throw std::invalid_argument("usage: Benchmark putrange <server> <port> <server directory> <file>");
+
+            bench_put_ranges(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argv[5]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "restart") {
+            if (argc != 5 && argc != 6)
+                throw std::invalid_argument("usage: Benchmark restart <server executable> <port> <server directory> [restarts]");
+
+            const bool clean = bench_hot_restart(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argc == 6 ? std::stoi(argv[5]) : 5);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return clean ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        if (filter == "watch") {
+            if (argc != 6 && argc != 7)
+                throw std::invalid_argument("usage: Benchmark watch <server> <port> <server pid> <server directory> [sessions]");
+
+            bench_watch(argv[2], static_cast<port_t>(std::stoi(argv[3])), static_cast<pid_t>(std::stol(argv[4])), argv[5], argc == 7 ? std::stoul(argv[6]) : 1000);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "follow") {
+            if (argc != 5)
+                throw std::invalid_argument("usage: Benchmark follow <server> <port> <server directory>");
+
+            bench_follow(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "readahead") {
+            if (argc < 5 || argc > 7)
+                throw std::invalid_argument("usage: Benchmark readahead <server> <port> <server directory> [files] [file size]");
+
+            bench_readahead(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argc > 5 ? std::stoul(argv[5]) : 64, argc > 6 ? std::stoull(argv[6]) : 1024 * 1024);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "warmup") {
+            if (argc < 5 || argc > 7)
+                throw std::invalid_argument("usage: Benchmark warmup <server executable> <port> <server directory> [files] [file size]");
+
+            bench_warmup(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argc > 5 ? std::stoul(argv[5]) : 512, argc > 6 ? std::stoull(argv[6]) : 64 * 1024);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+
+        if (filter == "local") {
+            if (argc != 7)
+                throw std::invalid_argument("usage: Benchmark local <server> <port> <local socket> <small file> <large file>");
+
+            bench_local(argv[2], static_cast<port_t>(std::stoi(argv[3])), argv[4], argv[5], argv[6]);
+            sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+
+            Connection::deinitialize();
+            return EXIT_SUCCESS;
+        }
+#endif
+
+        if (should_run(filter, "message_encode") || should_run(filter, "message_decode"))
+            bench_message_codec({ 0, 32, 256, MAX_PAYLOAD_LEN });
+
+        if (should_run(filter, "read_str") || should_run(filter, "write_str"))
+            bench_strings({ 16, 256, MAX_PAYLOAD_LEN, UINT16_MAX });
+
+        if (should_run(filter, "stream_send_receive"))
+            bench_stream({ 512, 4096, 16384, CHUNK_SIZE });
+
+        if (should_run(filter, "message_roundtrip"))
+            bench_message_roundtrip();
+
+        // the same framing code over each Transport backend
+        if (should_run(filter, "transport")) {
+            for (const auto& backend : { "tcp", "unix", "shm" }) {
+                bench_message_roundtrip(backend);
+                bench_stream({ 4096, CHUNK_SIZE }, backend, "transport_throughput");
+            }
+        }
+
+        sync_cout.print("peak_rss_kb=", peak_rss_kb(), sync_endl);
+    }
+    catch (const std::exception& e) {
+        sync_cerr.print("benchmark failed: ", e.what(), sync_endl);
+        Connection::deinitialize();
+        return EXIT_FAILURE;
+    }
+
+    Connection::deinitialize();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include "Message.h"
+
+#ifndef WIN32
+#include <sys/types.h>
+#endif
+
+// What Benchmark can run (see Benchmark.cpp for how to ask for each). Every one reports through
+// Harness.h; those with a server to talk to take its host and port first
+
+// MicroBenchmarks.cpp: the serialization and framing code in Common, and the transports under it.
+// backend is one of "tcp" (loopback), "unix" (socketpair) or "shm" (shared memory ring)
+void bench_message_codec(const std::vector<size_t>& payloadSizes);
+void bench_strings(const std::vector<size_t>& sizes);
+void bench_stream(const std::vector<int>& chunkSizes, const std::string& backend = "unix", const std::string& name = "stream_send_receive");
+void bench_message_roundtrip(const std::string& backend = "unix");
+
+// GetBenchmarks.cpp: the ways a GET's data can travel
+void bench_remote_get(const std::string& host, connection::port_t port, const std::string& filename);
+void bench_mux(const std::string& host, connection::port_t port, const std::string& smallFile, const std::string& largeFile);
+void bench_pipeline(const std::string& host, connection::port_t port, const std::string& filename, long rttMs);
+void bench_archive(const std::string& host, connection::port_t port, const std::string& member, const std::string& extracted);
+#ifndef WIN32
+void bench_local(const std::string& host, connection::port_t port, const std::string& path, const std::string& smallFile, const std::string& largeFile);
+#endif
+
+// BatchBenchmarks.cpp: many files at once, by MGET, TREE and STAT
+void bench_mget(const std::string& host, connection::port_t port, const std::string& pattern);
+void bench_tree(const std::string& host, connection::port_t port, const std::string& directory, long rttMs);
+void bench_stat(const std::string& host, connection::port_t port, const std::string& directory);
+// not a benchmark: false if a STAT pipelined behind a PUT of the same file didn't see it (the server
+// directory is for removing the files again)
+bool check_put_then_stat(const std::string& host, connection::port_t port, const std::string& serverDirectory);
+
+// SessionBenchmarks.cpp: what it costs to carry on after a connection drops
+void bench_resume(const std::string& host, connection::port_t port, const std::string& filename, long rttMs);
+#ifndef WIN32
+// restarts a server of its own under load; false if any connection was refused or broken by it
+bool bench_hot_restart(const std::string& executable, connection::port_t port, const std::string& serverDirectory, int restarts);
+#endif
+
+#ifndef WIN32
+// UploadBenchmarks.cpp: PUT, ranged PUT and COPY
+void bench_copy(const std::string& host, connection::port_t port, const std::string& serverDirectory, const std::string& file);
+void bench_put(const std::string& host, connection::port_t port, const std::string& serverDirectory, size_t fileSize);
+void bench_put_ranges(const std::string& host, connection::port_t port, const std::string& serverDirectory, const std::string& path);
+
+// WatchBenchmarks.cpp: noticing changes to the server's files, and following one as it grows
+void bench_watch(const std::string& host, connection::port_t port, pid_t pid, const std::string& serverDirectory, size_t sessions);
+void bench_follow(const std::string& host, connection::port_t port, const std::string& serverDirectory);
+
+// CacheBenchmarks.cpp: how much of what GET asks for is already in the page cache
+void bench_readahead(const std::string& host, connection::port_t port, const std::string& serverDirectory, size_t files, uint64_t fileSize);
+void bench_warmup(const std::string& executable, connection::port_t port, const std::string& serverDirectory, size_t files, uint64_t fileSize);
+#endif
@@ -0,0 +1,269 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "Benchmarks.h"
+#include "BufferPool.h"
+#include "Remote.h"
+#include "SyncStream.h"
+
+using namespace std;
+using namespace connection;
+
+constexpr long WARMUP_BENCH_TRAIN_MS = 5000;             // load served before the restart, for the hot set to be learned from
+constexpr long WARMUP_BENCH_DURATION_MS = 20000;
+constexpr long WARMUP_BENCH_WINDOW_MS = 1000;
+constexpr double WARMUP_BENCH_SETTLED = 1.1;            // a p99 within this factor of the steady state's counts as settled
+
+
+// a GET over its own stream of a v2 session, discarding the data. Returns the time from asking to
+// the first byte of the file arriving, in microseconds
+static double first_byte_us(const Multiplexer::Ptr& mux, const std::string& filename, uint64_t* bytes) {
+    const auto start = std::chrono::steady_clock::now();
+    auto stream = mux->open_stream();
+    auto lease = BufferPool::shared().acquire();
+    Message response;
+    double us = 0;
+
+    stream->send(MAKE_MSG(MSGID::MESSAGE_GET, filename));
+    stream->receive(&response, 10000);
+
+    if (response.msgid != MSGID::MESSAGE_OK || (response.flags & FLAG_INLINE))
+        throw std::runtime_error("GET " + filename + " failed: " + response.to_string());
+
+    for (uint64_t received = 0; received < response.datalen;) {
+        const auto got = stream->transport().receive(lease.data(), static_cast<int>(std::min<uint64_t>(response.datalen - received, lease.size())), 10000, nullptr);
+
+        if (got <= 0)
+            throw std::runtime_error("GET " + filename + " cut short");
+
+        if (received == 0)
+            us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+        received += static_cast<uint64_t>(got);
+    }
+
+    stream->shutdown();
+    *bytes += response.datalen;
+
+    return us;
+}
+
+
+// true if the first page of path is in the page cache
+static bool first_page_cached(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    unsigned char resident = 0;
+
+    if (fd < 0)
+        return false;
+
+    void* page = ::mmap(nullptr, 1, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (page != MAP_FAILED) {
+        ::mincore(page, 1, &resident);
+        ::munmap(page, 1);
+    }
+
+    ::close(fd);
+    return (resident & 1) != 0;
+}
+
+
+// as if path hadn't been read since the machine started
+static void drop_from_cache(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        throw std::runtime_error("can't open " + path);
+
+    // only clean pages can be dropped
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+
+// files in directory on a server on this host, fetched one after another from cold (dropped from the
+// page cache before each pass): in an order of no pattern, then in that order again by a new session,
+// which only what the server remembers of the first can predict, then in name order. Reports how
+// many files were already in the page cache when asked for, and time to first byte, which readahead
+// is for; compare a server started with FTP_READAHEAD=off
+void bench_readahead(const std::string& host, port_t port, const std::string& serverDirectory, size_t files, uint64_t fileSize) {
+    std::vector<std::string> names;
+    std::vector<char> contents(static_cast<size_t>(fileSize), 'r');
+
+    for (size_t i = 0; i < files; ++i) {
+        char name[64];
+
+        snprintf(name, sizeof(name), "readahead_bench_%d_part-%04zu", static_cast<int>(::getpid()), i);
+        names.push_back(name);
+
+        std::ofstream(serverDirectory + "/" + name, std::ios::binary).write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    }
+
+    auto shuffled = names;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(42));
+
+    const std::vector<std::pair<std::string, const std::vector<std::string>*>> passes = {
+        { "shuffled", &shuffled }, { "shuffled_again", &shuffled }, { "in_order", &names }
+    };
+
+    for (const auto& pass : passes) {
+        for (const auto& name : names)
+            drop_from_cache(serverDirectory + "/" + name);
+
+        Multiplexer::Ptr mux;
+        auto control = open_session(host, port, 0, &mux);
+        std::vector<double> latenciesUs;
+        uint64_t bytes = 0;
+        size_t cached = 0;
+        double checkingS = 0;
+        const auto start = std::chrono::steady_clock::now();
+
+        for (const auto& name : *pass.second) {
+            const auto checking = std::chrono::steady_clock::now();
+
+            cached += first_page_cached(serverDirectory + "/" + name) ? 1 : 0;
+            checkingS += std::chrono::duration<double>(std::chrono::steady_clock::now() - checking).count();
+
+            latenciesUs.push_back(first_byte_us(mux, name, &bytes));
+        }
+
+        const auto elapsedS = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() - checkingS;
+
+        close_session(control, mux);
+        std::sort(latenciesUs.begin(), latenciesUs.end());
+
+        const auto percentile = [&latenciesUs](double p) {
+            return latenciesUs[std::min(latenciesUs.size() - 1, static_cast<size_t>(p * latenciesUs.size()))];
+        };
+
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(1);
+
+        line << "bench=readahead_get param=" << pass.first << " files=" << files << " cached=" << cached << " ttfb_p50_us=" << percentile(0.5)
+             << " ttfb_p99_us=" << percentile(0.99) << " mb_per_sec=" << bytes / elapsedS / (1024 * 1024);
+
+        sync_cout.print(line.str(), sync_endl);
+    }
+
+    for (const auto& name : names)
+        ::unlink((serverDirectory + "/" + name).c_str());
+}
+
+
+// GETs for durationMs over one session, of names drawn by popularity: the first twice as often as the
+// second, three times as often as the third, and so on. The latency of each GET, in microseconds,
+// by the window of WARMUP_BENCH_WINDOW_MS it was made in
+static std::vector<std::vector<double>> popular_gets(port_t port, const std::vector<std::string>& names, long durationMs) {
+    std::vector<double> weights;
+
+    for (size_t i = 0; i < names.size(); ++i)
+        weights.push_back(1.0 / static_cast<double>(i + 1));
+
+    std::mt19937 random(42);
+    std::discrete_distribution<size_t> popularity(weights.begin(), weights.end());
+    std::vector<std::vector<double>> windows(static_cast<size_t>(durationMs / WARMUP_BENCH_WINDOW_MS));
+    Multiplexer::Ptr mux;
+    auto control = open_session("127.0.0.1", port, 0, &mux);
+    const auto start = std::chrono::steady_clock::now();
+    uint64_t bytes = 0;
+
+    while (true) {
+        const auto asked = std::chrono::steady_clock::now();
+        const auto window = static_cast<size_t>(std::chrono::duration_cast<std::chrono::milliseconds>(asked - start).count() / WARMUP_BENCH_WINDOW_MS);
+
+        if (window >= windows.size())
+            break;
+
+        first_byte_us(mux, names[popularity(random)], &bytes);
+        windows[window].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - asked).count());
+    }
+
+    close_session(control, mux);
+    return windows;
+}
+
+
+// a server restarted with nothing of its files in the page cache, as after a reboot, and serving a
+// load where a few files are far more popular than the rest: left to warm up by serving them, then
+// warmed from the hot set saved by the server before it. The hot set is learned by a server run under
+// the same load first. Reports the p99 of GET latency for each second after the restart, and how
+// long it took to come within WARMUP_BENCH_SETTLED of the p99 of the second half of the run
+void bench_warmup(const std::string& executable, port_t port, const std::string& serverDirectory, size_t files, uint64_t fileSize) {
+    const auto prefix = "warmup_bench_" + std::to_string(::getpid());
+    const auto hotSet = "FTP_HOTSET=" + prefix + ".hotset";
+    std::vector<std::string> names;
+    std::vector<char> contents(static_cast<size_t>(fileSize), 'w');
+
+    for (size_t i = 0; i < files; ++i) {
+        names.push_back(prefix + "_" + std::to_string(i));
+        std::ofstream(serverDirectory + "/" + names.back(), std::ios::binary).write(contents.data(), static_cast<std::streamsize>(contents.size()));
+    }
+
+    auto pid = start_server(executable, port, serverDirectory, { hotSet });
+
+    popular_gets(port, names, WARMUP_BENCH_TRAIN_MS);
+    stop_server(pid);
+
+    for (const bool warmed : { false, true }) {
+        for (const auto& name : names)
+            drop_from_cache(serverDirectory + "/" + name);
+
+        pid = start_server(executable, port, serverDirectory, warmed ? std::vector<std::string>{ hotSet } : std::vector<std::string>{});
+
+        const auto windows = popular_gets(port, names, WARMUP_BENCH_DURATION_MS);
+
+        stop_server(pid);
+
+        const auto p99 = [](std::vector<double> latenciesUs) {
+            std::sort(latenciesUs.begin(), latenciesUs.end());
+            return latenciesUs.empty() ? 0.0 : latenciesUs[std::min(latenciesUs.size() - 1, static_cast<size_t>(0.99 * latenciesUs.size()))];
+        };
+
+        std::vector<double> steady;
+        std::vector<double> windowP99s;
+
+        for (size_t i = 0; i < windows.size(); ++i) {
+            windowP99s.push_back(p99(windows[i]));
+
+            if (i >= windows.size() / 2)
+                steady.insert(steady.end(), windows[i].begin(), windows[i].end());
+        }
+
+        const auto steadyP99 = p99(steady);
+        size_t settled = windowP99s.size();
+
+        while (settled > 0 && windowP99s[settled - 1] <= WARMUP_BENCH_SETTLED * steadyP99)
+            --settled;
+
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(1);
+
+        line << "bench=restart_warmup param=" << (warmed ? "hotset" : "cold") << " files=" << files << " steady_p99_us=" << steadyP99
+             << " steady_after_ms=" << settled * WARMUP_BENCH_WINDOW_MS << " p99_by_window_us=";
+
+        for (size_t i = 0; i < windowP99s.size(); ++i)
+            line << (i > 0 ? "," : "") << windowP99s[i];
+
+        sync_cout.print(line.str(), sync_endl);
+    }
+
+    for (const auto& name : names)
+        ::unlink((serverDirectory + "/" + name).c_str());
+
+    ::unlink((serverDirectory + "/" + prefix + ".hotset").c_str());
+}
+#endif
@@ -0,0 +1,99 @@
+#include "pch.h"
+#include "DelayProxy.h"
+
+#ifndef WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+using namespace connection;
+
+
+DelayProxy::DelayProxy(const std::string& host, port_t serverPort, long rttMs)
+    : host_(host), serverPort_(serverPort), oneWay_(rttMs * 500), stop_(false), port_(0) {
+    listener_ = std::thread([this]() {
+        Connection::StopListeningQuery stop = [this]() { return stop_.load(); };
+        Connection::SocketCreatedCallback onCreate = [this](const std::string&, port_t port) { port_.store(port); };
+        Connection::ErrorCallback onError = [](const ConnectionException&) { return true; };
+        Connection::ConnectionEstablishedCallback onConnection = [this](Connection::Ptr client) {
+            auto server = Connection::connect(host_, serverPort_);
+
+            relay(client, server);
+            relay(server, client);
+        };
+
+        Connection::welcome(Connection::PORT_ANY, stop, onCreate, onConnection, onError);
+    });
+
+    while (port_.load() == 0)
+        std::this_thread::yield();
+}
+
+
+DelayProxy::~DelayProxy() {
+    stop_.store(true);
+    listener_.join();
+}
+
+
+void DelayProxy::relay(Connection::Ptr from, Connection::Ptr to) {
+    auto pipe = std::make_shared<Pipe>();
+    const auto delay = oneWay_;
+    int noDelay = 1;
+
+    // chunks are already held back on purpose: Nagle would add its own wait on top
+    setsockopt(to->transport().native_handle(), IPPROTO_TCP, TCP_NODELAY, (char*)&noDelay, sizeof(noDelay));
+
+    std::thread([pipe, to]() {
+        while (true) {
+            std::unique_lock<std::mutex> lock(pipe->mutex);
+            pipe->arrived.wait(lock, [&]() { return !pipe->chunks.empty(); });
+
+            auto chunk = std::move(pipe->chunks.front());
+            pipe->chunks.pop_front();
+            lock.unlock();
+
+            std::this_thread::sleep_until(chunk.due);
+
+            try {
+                if (chunk.data.empty()) {
+                    to->transport().shutdown_send();
+                    return;
+                }
+
+                for (size_t sent = 0; sent < chunk.data.size();)
+                    sent += to->transport().send(chunk.data.data() + sent, static_cast<int>(chunk.data.size() - sent));
+            }
+            catch (const std::exception&) {
+                return;
+            }
+        }
+    }).detach();
+
+    std::thread([pipe, from, delay]() {
+        std::vector<char> buf(CHUNK_SIZE);
+
+        while (true) {
+            bool timedOut = false;
+            int received = 0;
+
+            try {
+                received = from->transport().receive(buf.data(), static_cast<int>(buf.size()), 100, &timedOut);
+            }
+            catch (const std::exception&) {
+                received = 0;
+            }
+
+            if (timedOut)
+                continue;
+
+            std::lock_guard<std::mutex> lock(pipe->mutex);
+            pipe->chunks.push_back(Chunk{ std::chrono::steady_clock::now() + delay, std::vector<char>(buf.data(), buf.data() + received) });
+            pipe->arrived.notify_one();
+
+            if (received == 0)
+                return;
+        }
+    }).detach();
+}
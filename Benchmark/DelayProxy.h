@@ -0,0 +1,44 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Connection.h"
+
+// ------------------------------------------------------------------
+// high-latency link simulation: a loopback proxy in front of the server
+// that holds everything passing through for half the round trip, each
+// way. Data connections the server opens back to a v1 client bypass it
+// ------------------------------------------------------------------
+class DelayProxy {
+    struct Chunk {
+        std::chrono::steady_clock::time_point due;
+        std::vector<char> data;                         // empty: the sender has closed its end
+    };
+
+    // one direction of one proxied connection
+    struct Pipe {
+        std::mutex mutex;
+        std::condition_variable arrived;
+        std::deque<Chunk> chunks;
+    };
+
+    std::string host_;
+    connection::port_t serverPort_;
+    std::chrono::microseconds oneWay_;
+    std::atomic_bool stop_;
+    std::atomic<connection::port_t> port_;
+    std::thread listener_;
+
+    void relay(connection::Connection::Ptr from, connection::Connection::Ptr to);
+
+    public:
+        DelayProxy(const std::string& host, connection::port_t serverPort, long rttMs);
+        ~DelayProxy();
+
+        connection::port_t port() const { return port_.load(); }
+};
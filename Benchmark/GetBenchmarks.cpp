@@ -0,0 +1,164 @@
+#include "pch.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "Benchmarks.h"
+#include "DelayProxy.h"
+#include "Harness.h"
+#include "Pipeline.h"
+#include "Remote.h"
+
+using namespace std;
+using namespace connection;
+
+
+
+void bench_remote_get(const std::string& host, port_t port, const std::string& filename) {
+    const std::pair<const char*, uint16_t> modes[] = { { "inline", static_cast<uint16_t>(MAX_INLINE_PAYLOAD_LEN) }, { "data_channel", 0 } };
+
+    for (const auto& mode : modes) {
+        auto control = open_session(host, port, mode.second);
+
+        report(run_timed("remote_get", std::string(mode.first) + "_" + filename, [&]() -> uint64_t {
+            return remote_get(control, filename);
+        }));
+
+        close_session(control);
+    }
+}
+
+
+// v1 against v2 for mixes of small and large files. Inline responses are off, so every
+// GET goes through the data path being compared
+void bench_mux(const std::string& host, port_t port, const std::string& smallFile, const std::string& largeFile) {
+    const std::pair<const char*, std::vector<std::string>> mixes[] = {
+        { "small", std::vector<std::string>(32, smallFile) },
+        { "large", std::vector<std::string>(4, largeFile) },
+        { "mixed", [&]() { std::vector<std::string> mix(28, smallFile); mix.insert(mix.begin() + 7, 4, largeFile); return mix; }() }
+    };
+
+    for (const auto& mix : mixes) {
+        const auto& files = mix.second;
+        Multiplexer::Ptr mux;
+        auto v1 = open_session(host, port, 0);
+        auto v2 = open_session(host, port, 0, &mux);
+
+        report(run_timed("mux_get", std::string("v1_serial_") + mix.first, [&]() -> uint64_t {
+            uint64_t bytes = 0;
+
+            for (const auto& file : files)
+                bytes += remote_get(v1, file);
+
+            return bytes;
+        }));
+
+        report(run_timed("mux_get", std::string("v2_serial_") + mix.first, [&]() -> uint64_t {
+            uint64_t bytes = 0;
+
+            for (const auto& file : files)
+                bytes += remote_get(mux, file);
+
+            return bytes;
+        }));
+
+        report(run_timed("mux_get", std::string("v2_concurrent_") + mix.first, [&]() -> uint64_t {
+            std::atomic<uint64_t> bytes(0);
+            std::vector<std::thread> threads;
+
+            for (const auto& file : files)
+                threads.emplace_back([&, file]() { bytes += remote_get(mux, file); });
+
+            for (auto& thread : threads)
+                thread.join();
+
+            return bytes.load();
+        }));
+
+        close_session(v1);
+        close_session(v2, mux);
+    }
+}
+
+
+// the same batch of GETs one at a time and pipelined, over a link with rttMs of round trip
+void bench_pipeline(const std::string& host, port_t port, const std::string& filename, long rttMs) {
+    constexpr int GETS_PER_BATCH = 32;
+    DelayProxy proxy(host, port, rttMs);
+    const auto rtt = "_rtt" + std::to_string(rttMs) + "ms";
+
+    {
+        auto v1 = open_session("127.0.0.1", proxy.port(), 0);
+
+        report(run_timed("pipeline_get", "v1_serial" + rtt, [&]() -> uint64_t {
+            uint64_t bytes = 0;
+
+            for (int i = 0; i < GETS_PER_BATCH; ++i)
+                bytes += remote_get(v1, filename);
+
+            return bytes;
+        }, 1));
+
+        close_session(v1);
+    }
+
+    for (const size_t depth : { 1, 8, 32 }) {
+        Multiplexer::Ptr mux;
+        auto v2 = open_session("127.0.0.1", proxy.port(), 0, &mux);
+
+        report(run_timed("pipeline_get", "v2_depth" + std::to_string(depth) + rtt, [&]() -> uint64_t {
+            CommandPipeline pipeline(mux, depth, 10000);
+            uint64_t bytes = 0;
+
+            for (int i = 0; i < GETS_PER_BATCH; ++i) {
+                pipeline.submit(MAKE_MSG(MSGID::MESSAGE_GET, filename), [&](uint64_t, const Message& response, const Connection::Ptr& stream) {
+                    bytes += discard_get_data(stream, response, filename);
+                });
+            }
+
+            pipeline.drain();
+            return bytes;
+        }, 1));
+
+        close_session(v2, mux);
+    }
+}
+
+
+#ifndef WIN32
+// loopback TCP against the local socket, for latency (small file) and throughput (large file).
+// Inline responses are off throughout, so small files take the data path being compared too
+void bench_local(const std::string& host, port_t port, const std::string& path, const std::string& smallFile, const std::string& largeFile) {
+    for (const auto& file : { smallFile, largeFile }) {
+        Multiplexer::Ptr mux;
+        auto v1 = open_session(host, port, 0);
+        auto v2 = open_session(host, port, 0, &mux);
+        auto local = open_local_session(path);
+
+        report(run_timed("local_get", "tcp_v1_" + file, [&]() { return remote_get(v1, file); }));
+        report(run_timed("local_get", "tcp_v2_" + file, [&]() { return remote_get(mux, file); }));
+        report(run_timed("local_get", "fd_read_" + file, [&]() { return remote_get(local, file, false); }));
+        report(run_timed("local_get", "fd_mmap_" + file, [&]() { return remote_get(local, file, true); }));
+
+        close_session(v1);
+        close_session(v2, mux);
+        close_session(local);
+    }
+}
+#endif
+
+
+// the same contents out of an archive (a range of the archive file, sendfile on a v1 data channel)
+// and out of a file of their own
+void bench_archive(const std::string& host, port_t port, const std::string& member, const std::string& extracted) {
+    Multiplexer::Ptr mux;
+    auto v1 = open_session(host, port, 0);
+    auto v2 = open_session(host, port, 0, &mux);
+
+    report(run_timed("archive_get", "v1_member", [&]() { return remote_get(v1, member); }));
+    report(run_timed("archive_get", "v1_extracted", [&]() { return remote_get(v1, extracted); }));
+    report(run_timed("archive_get", "v2_member", [&]() { return remote_get(mux, member); }));
+    report(run_timed("archive_get", "v2_extracted", [&]() { return remote_get(mux, extracted); }));
+
+    close_session(v1);
+    close_session(v2, mux);
+}
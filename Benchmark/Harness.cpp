@@ -0,0 +1,72 @@
+#include "pch.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "Harness.h"
+#include "SyncStream.h"
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+
+// -------------------------------------------------------
+// allocation counting: every operator new in the process is
+// routed through here so we can report allocations per op.
+// Kept out of the files calling new and delete: inlined into
+// them, the compiler takes free() on what new returned for a
+// mismatched pair
+// -------------------------------------------------------
+static std::atomic<uint64_t> g_allocations(0);
+
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+
+uint64_t allocation_count() {
+    return g_allocations.load();
+}
+
+
+void report(const BenchResult& r) {
+    const double nsPerOp = r.iterations ? r.elapsedNs / r.iterations : 0.0;
+    const double opsPerSec = r.elapsedNs > 0 ? r.iterations * 1e9 / r.elapsedNs : 0.0;
+    const double mbPerSec = r.elapsedNs > 0 ? (r.bytes / (1024.0 * 1024.0)) * 1e9 / r.elapsedNs : 0.0;
+    const double allocsPerOp = r.iterations ? static_cast<double>(r.allocations) / r.iterations : 0.0;
+
+    std::ostringstream line;
+    line.setf(std::ios::fixed);
+    line.precision(2);
+
+    line << "bench=" << r.name << " param=" << (r.param.empty() ? "-" : r.param) << " iters=" << r.iterations
+         << " ns_per_op=" << nsPerOp << " ops_per_sec=" << opsPerSec << " mb_per_sec=" << mbPerSec
+         << " allocs_per_op=" << allocsPerOp;
+
+    sync_cout.print(line.str(), sync_endl);
+}
+
+
+long peak_rss_kb() {
+#ifndef WIN32
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss; // already KiB on Linux
+#endif
+    return -1;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+
+// What every benchmark reports through. A result is printed as a single line of space-separated
+// key=value pairs (see Benchmark.cpp), so runs can be diffed or parsed for regression comparison
+
+constexpr std::stringstream::openmode binary_stream = std::stringstream::in | std::stringstream::out | std::stringstream::binary;
+constexpr long BENCH_MIN_DURATION_MS = 500;             // each benchmark repeats until it has run at least this long
+
+
+// operator new calls made so far by the whole process
+uint64_t allocation_count();
+
+
+struct BenchResult {
+    std::string name;
+    std::string param;
+    uint64_t iterations;
+    double elapsedNs;
+    uint64_t bytes;
+    uint64_t allocations;
+};
+
+
+void report(const BenchResult& r);
+
+
+// runs op in batches, starting at batch and doubling, until at least BENCH_MIN_DURATION_MS has elapsed.
+// op returns number of bytes it processed
+template <class Op>
+BenchResult run_timed(const std::string& name, const std::string& param, Op op, uint64_t batch = 64) {
+    BenchResult result{ name, param, 0, 0.0, 0, 0 };
+
+    op(); // warm up: first call may allocate lazily-initialized state
+
+    while (true) {
+        const auto allocsBefore = allocation_count();
+        const auto start = std::chrono::high_resolution_clock::now();
+
+        for (uint64_t i = 0; i < batch; ++i)
+            result.bytes += op();
+
+        const auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+        result.allocations += allocation_count() - allocsBefore;
+        result.elapsedNs += static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        result.iterations += batch;
+
+        if (result.elapsedNs >= BENCH_MIN_DURATION_MS * 1e6)
+            break;
+
+        batch *= 2;
+    }
+
+    return result;
+}
+
+
+// peak resident set size of this process in KiB, or -1 where unavailable
+long peak_rss_kb();
@@ -0,0 +1,226 @@
+#include "pch.h"
+#include <atomic>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "Benchmarks.h"
+#include "Harness.h"
+#include "SyncStream.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+using namespace std;
+using namespace connection;
+
+constexpr uint64_t STREAM_BYTES_PER_RUN = 64ull * 1024 * 1024;
+
+
+// serialize message exactly the way Connection::send(const Message&) frames it
+static void encode_message(NetworkDataStream& ds, const Message& message) {
+    ds << message.msgid << message.length() << message.datalen << message.port;
+    ds.write_str(message.payload);
+}
+
+
+// inverse of encode_message, mirroring Connection::receive(Message*)
+static void decode_message(NetworkDataStream& ds, Message* pMsg) {
+    ds >> pMsg->msgid;
+    ds >> pMsg->msglen;
+    ds >> pMsg->datalen;
+    ds >> pMsg->port;
+    pMsg->payload = ds.read_str(pMsg->msglen - MESSAGE_BYTE_LEN);
+}
+
+
+void bench_message_codec(const std::vector<size_t>& payloadSizes) {
+    for (auto payloadLen : payloadSizes) {
+        const auto message = MAKE_MSG(MSGID::MESSAGE_GET, 12345, 4242, std::string(payloadLen, 'x'));
+        const auto param = "payload_" + std::to_string(payloadLen);
+
+        report(run_timed("message_encode", param, [&]() -> uint64_t {
+            std::stringstream buf(binary_stream);
+            NetworkDataStream ds(buf);
+
+            encode_message(ds, message);
+            return message.length();
+        }));
+
+        std::stringstream encoded(binary_stream);
+        {
+            NetworkDataStream ds(encoded);
+            encode_message(ds, message);
+        }
+        const auto wire = encoded.str();
+
+        report(run_timed("message_decode", param, [&]() -> uint64_t {
+            std::stringstream buf(wire, binary_stream);
+            NetworkDataStream ds(buf);
+            Message decoded;
+
+            decode_message(ds, &decoded);
+
+            if (decoded.msglen != message.length())
+                throw std::runtime_error("message_decode: round trip mismatch");
+
+            return decoded.msglen;
+        }));
+    }
+}
+
+
+void bench_strings(const std::vector<size_t>& sizes) {
+    for (auto len : sizes) {
+        const std::string str(len, 'y');
+        const auto param = "len_" + std::to_string(len);
+
+        std::stringstream wbuf(binary_stream);
+        NetworkDataStream wds(wbuf);
+
+        report(run_timed("write_str", param, [&]() -> uint64_t {
+            wbuf.seekp(0);
+            wds.write_str(str);
+            return len;
+        }));
+
+        std::stringstream rbuf(str, binary_stream);
+        NetworkDataStream rds(rbuf);
+
+        report(run_timed("read_str", param, [&]() -> uint64_t {
+            rbuf.seekg(0);
+            const auto result = rds.read_str(static_cast<uint16_t>(len));
+            return result.length();
+        }));
+    }
+}
+
+
+// ------------------------------------------------------------------
+// socket throughput: a connected pair of Connections with a sender
+// thread pushing STREAM_BYTES_PER_RUN through send(NetworkDataStream&)
+// in pieces of chunkSize, and this thread pulling them with receive()
+// ------------------------------------------------------------------
+static std::pair<Connection::Ptr, Connection::Ptr> make_tcp_pair() {
+    Connection::Ptr accepted;
+    port_t listenPort = Connection::PORT_ANY;
+    std::atomic_bool listening(false);
+
+    Connection::StopListeningQuery stop = []() { return false; };
+    Connection::SocketCreatedCallback onCreate = [&](const std::string&, port_t port) { listenPort = port; listening.store(true); };
+    Connection::ConnectionEstablishedCallback onConnection = [&](Connection::Ptr conn) { accepted = conn; };
+    Connection::ErrorCallback onError = [](const ConnectionException& ce) -> bool { throw ce; };
+
+    std::thread listener([&]() { Connection::welcome(Connection::PORT_ANY, stop, onCreate, onConnection, onError, true, 10000); });
+
+    while (!listening.load())
+        std::this_thread::yield();
+
+    auto connected = Connection::connect("127.0.0.1", listenPort);
+    listener.join();
+
+    return std::make_pair(connected, accepted);
+}
+
+
+// backend is one of "tcp" (loopback), "unix" (socketpair) or "shm" (shared memory ring)
+static std::pair<Connection::Ptr, Connection::Ptr> make_connection_pair(const std::string& backend) {
+#ifndef WIN32
+    if (backend == "unix") {
+        int sv[2];
+
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+            throw ConnectionException::create("socketpair failed");
+
+        return std::make_pair(std::make_shared<Connection>(Transport::Ptr(new SocketTransport(sv[0], "unix")), "socketpair", "socketpair", 0, 1),
+                              std::make_shared<Connection>(Transport::Ptr(new SocketTransport(sv[1], "unix")), "socketpair", "socketpair", 1, 0));
+    }
+
+    if (backend == "shm") {
+        auto transports = ShmTransport::create_pair();
+
+        return std::make_pair(std::make_shared<Connection>(std::move(transports.first), "shm", "shm", 0, 1),
+                              std::make_shared<Connection>(std::move(transports.second), "shm", "shm", 1, 0));
+    }
+#endif
+
+    // no socketpair or shared memory transport on Windows: everything falls back to a loopback TCP pair
+    return make_tcp_pair();
+}
+
+
+void bench_stream(const std::vector<int>& chunkSizes, const std::string& backend, const std::string& name) {
+    for (auto chunkSize : chunkSizes) {
+        auto pair = make_connection_pair(backend);
+        const uint64_t chunksPerRun = STREAM_BYTES_PER_RUN / chunkSize;
+        const std::string chunk(chunkSize, 'z');
+
+        std::thread sender([&]() {
+            for (uint64_t i = 0; i < chunksPerRun; ++i) {
+                std::stringstream buf(chunk, binary_stream);
+                NetworkDataStream ds(buf);
+
+                pair.first->send(ds);
+            }
+
+            pair.first->shutdown();
+        });
+
+        std::stringstream sink(binary_stream);
+        NetworkDataStream ds(sink);
+        uint64_t received = 0;
+
+        const auto allocsBefore = allocation_count();
+        const auto start = std::chrono::high_resolution_clock::now();
+
+        while (received < chunksPerRun * chunkSize) {
+            sink.seekp(0); // keep the sink from growing: we only care about throughput
+            received += pair.second->receive(ds, chunkSize);
+        }
+
+        const auto elapsed = std::chrono::high_resolution_clock::now() - start;
+        const auto allocs = allocation_count() - allocsBefore;
+
+        pair.second->shutdown();
+        sender.join();
+
+        report(BenchResult{ name, backend + "_chunk_" + std::to_string(chunkSize), chunksPerRun,
+            static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()), received, allocs });
+    }
+}
+
+
+void bench_message_roundtrip(const std::string& backend) {
+    auto pair = make_connection_pair(backend);
+    const auto request = MAKE_MSG(MSGID::MESSAGE_GET, "testfile_small.txt");
+    const auto reply = MAKE_MSG(MSGID::MESSAGE_OK, 568, 0, "");
+
+    // echo thread plays the part of the server
+    std::thread echo([&]() {
+        Message msg;
+
+        while (true) {
+            pair.second->receive(&msg);
+
+            if (msg.msgid == MSGID::MESSAGE_QUIT)
+                break;
+
+            pair.second->send(reply);
+        }
+
+        pair.second->shutdown();
+    });
+
+    report(run_timed("message_roundtrip", backend, [&]() -> uint64_t {
+        Message response;
+
+        pair.first->send(request);
+        pair.first->receive(&response);
+
+        return request.length() + response.length();
+    }));
+
+    pair.first->send(MAKE_MSG(MSGID::MESSAGE_QUIT));
+    pair.first->shutdown();
+    echo.join();
+}
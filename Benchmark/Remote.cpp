@@ -0,0 +1,290 @@
+#include "pch.h"
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "Harness.h"
+#include "ProtocolVer.h"
+#include "Remote.h"
+#include "SessionResume.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "BufferPool.h"
+#include "FdPassing.h"
+#endif
+
+using namespace std;
+using namespace connection;
+
+
+Connection::Ptr open_session(const std::string& host, port_t port, uint16_t inlineLimit, Multiplexer::Ptr* pMux, std::string* pToken) {
+    auto control = Connection::connect(host, port);
+    Message msg;
+
+    control->receive(&msg, 10000); // server greets first
+
+    if (msg.msgid != MSGID::MESSAGE_HELLO)
+        throw std::runtime_error("server sent unexpected greeting: " + msg.to_string());
+
+    const auto serverVersion = protocol_major(msg.payload);
+
+    if (pToken)
+        *pToken = hello_field(msg.payload, HELLO_SESSION);
+
+    // announcing no version keeps the server on v1
+    ZERO_MSG(&msg);
+    msg.msgid = MSGID::MESSAGE_HELLO;
+    msg.inlineLimit = inlineLimit;
+
+    if (pMux) {
+        msg.payload = MAKE_VERSION("Benchmark", "hello");
+
+        if (serverVersion < PROTOCOL_VERSION_MULTIPLEXED)
+            throw std::runtime_error("server does not speak protocol v" + std::to_string(PROTOCOL_VERSION_MULTIPLEXED));
+    }
+
+    control->send(msg);
+
+    if (pMux)
+        *pMux = Multiplexer::create(control, Multiplexer::CLIENT);
+
+    return control;
+}
+
+
+#ifndef WIN32
+Connection::Ptr open_local_session(const std::string& path) {
+    auto control = Connection::connect_local(path);
+    Message msg;
+
+    control->receive(&msg, 10000);
+
+    if (msg.msgid != MSGID::MESSAGE_HELLO)
+        throw std::runtime_error("server sent unexpected greeting: " + msg.to_string());
+
+    ZERO_MSG(&msg);
+    msg.msgid = MSGID::MESSAGE_HELLO;
+    msg.payload = MAKE_VERSION_AT("Benchmark", PROTOCOL_VERSION_DESCRIPTORS, "hello");
+
+    control->send(msg);
+    return control;
+}
+
+
+// collects the descriptor following a FLAG_DESCRIPTOR response and reads dataLen bytes of the
+// file through it: copied out with read() like a socket would, or mapped and summed in place
+static uint64_t read_passed_file(const Connection::Ptr& control, uint64_t dataLen, bool mapped) {
+    int fd = -1;
+    std::string payload;
+    uint64_t bytes = 0;
+
+    if (!receive_fd(control->transport().native_handle(), &fd, &payload) || fd < 0)
+        throw std::runtime_error("server did not pass a descriptor");
+
+    if (mapped && dataLen > 0) {
+        void* contents = mmap(nullptr, static_cast<size_t>(dataLen), PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+
+        if (contents != MAP_FAILED) {
+            volatile uint64_t sum = 0;
+            const auto words = static_cast<const uint64_t*>(contents);
+
+            for (size_t i = 0; i < dataLen / sizeof(uint64_t); ++i)
+                sum += words[i];
+
+            munmap(contents, static_cast<size_t>(dataLen));
+            bytes = dataLen;
+        }
+    } else {
+        auto lease = BufferPool::shared().acquire();
+
+        while (bytes < dataLen) {
+            const auto got = ::read(fd, lease.data(), static_cast<size_t>(std::min<uint64_t>(dataLen - bytes, lease.size())));
+
+            if (got <= 0)
+                break;
+
+            bytes += got;
+        }
+    }
+
+    ::close(fd);
+    return bytes;
+}
+#endif
+
+
+void close_session(const Connection::Ptr& control, const Multiplexer::Ptr& mux) {
+    if (mux) {
+        mux->open_stream()->send(MAKE_MSG(MSGID::MESSAGE_QUIT));
+        mux->close();
+    } else {
+        control->send(MAKE_MSG(MSGID::MESSAGE_QUIT));
+        control->shutdown();
+    }
+}
+
+
+uint64_t remote_get(const Connection::Ptr& control, const std::string& filename, bool mapPassed) {
+    auto command = MAKE_MSG(MSGID::MESSAGE_GET, filename);
+    Message response;
+    bool bListen = true;
+    uint64_t received = 0;
+
+    Connection::StopListeningQuery stopListening = [&bListen]() { return !bListen; };
+    Connection::ErrorCallback onError = [](const ConnectionException& ce) -> bool { throw ce; };
+
+    Connection::SocketCreatedCallback onListen = [&](const std::string&, port_t port) {
+        command.port = port;
+        control->send(command);
+        control->receive(&response, 10000);
+
+        if (response.msgid != MSGID::MESSAGE_OK)
+            throw std::runtime_error("GET " + filename + " failed: " + response.to_string());
+
+        if (response.flags & FLAG_INLINE) {
+            received = response.payload.size();
+            bListen = false;
+        }
+
+#ifndef WIN32
+        if (response.flags & FLAG_DESCRIPTOR) {
+            received = read_passed_file(control, response.datalen, mapPassed);
+            bListen = false;
+        }
+#endif
+    };
+
+    Connection::ConnectionEstablishedCallback onEstablished = [&](Connection::Ptr dataChannel) {
+        std::stringstream sink(binary_stream);
+        NetworkDataStream ds(sink);
+
+        while (received < response.datalen) {
+            sink.seekp(0);
+            received += dataChannel->receive(ds, static_cast<int>(std::min<uint64_t>(response.datalen - received, CHUNK_SIZE)));
+        }
+
+        dataChannel->shutdown();
+    };
+
+    Connection::welcome(Connection::PORT_ANY, stopListening, onListen, onEstablished, onError, true, 10000);
+
+    return received;
+}
+
+
+uint64_t discard_get_data(const Connection::Ptr& stream, const Message& response, const std::string& filename) {
+    uint64_t received = 0;
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("GET " + filename + " failed: " + response.to_string());
+
+    if (response.flags & FLAG_INLINE)
+        return response.payload.size();
+
+    std::stringstream sink(binary_stream);
+    NetworkDataStream ds(sink);
+
+    while (received < response.datalen) {
+        sink.seekp(0);
+        received += stream->receive(ds, static_cast<int>(std::min<uint64_t>(response.datalen - received, CHUNK_SIZE)));
+    }
+
+    return received;
+}
+
+
+uint64_t remote_get(const Multiplexer::Ptr& mux, const std::string& filename) {
+    auto stream = mux->open_stream();
+    Message response;
+
+    stream->send(MAKE_MSG(MSGID::MESSAGE_GET, filename));
+    stream->receive(&response, 10000);
+
+    const auto received = discard_get_data(stream, response, filename);
+
+    stream->shutdown();
+    return received;
+}
+
+
+std::string receive_exactly(Connection& channel, uint64_t len) {
+    std::string data(static_cast<size_t>(len), '\0');
+
+    for (size_t got = 0; got < data.size();) {
+        bool timedOut = false;
+        const auto received = channel.transport().receive(&data[got], static_cast<int>(data.size() - got), 10000, &timedOut);
+
+        if (received <= 0)
+            throw std::runtime_error("data cut short");
+
+        got += received;
+    }
+
+    return data;
+}
+
+
+#ifndef WIN32
+pid_t start_server(const std::string& executable, port_t port, const std::string& directory, const std::vector<std::string>& variables, const std::string& handoffPath) {
+    char resolved[PATH_MAX];
+
+    if (!::realpath(executable.c_str(), resolved))
+        throw std::runtime_error("can't find server " + executable);
+
+    // made ready before forking: the child only execs
+    const auto portArg = std::to_string(port);
+    std::vector<char*> environment;
+
+    for (char** variable = environ; *variable; ++variable)
+        environment.push_back(*variable);
+
+    for (const auto& variable : variables)
+        environment.push_back(const_cast<char*>(variable.c_str()));
+
+    environment.push_back(nullptr);
+
+    const pid_t pid = ::fork();
+
+    if (pid < 0)
+        throw std::runtime_error("can't start server " + executable);
+
+    if (pid == 0) {
+        const int null = ::open("/dev/null", O_WRONLY);
+        char* const args[] = { resolved, const_cast<char*>(portArg.c_str()), handoffPath.empty() ? nullptr : const_cast<char*>(handoffPath.c_str()), nullptr };
+
+        ::dup2(null, STDOUT_FILENO);
+
+        if (::chdir(directory.c_str()) == 0)
+            ::execve(resolved, args, environment.data());
+
+        ::_exit(127);
+    }
+
+    for (long waitedMs = 0;; waitedMs += 50) {
+        try {
+            close_session(open_session("127.0.0.1", port, 0));
+            return pid;
+        } catch (const std::exception&) {
+            if (waitedMs >= 10000) {
+                ::kill(pid, SIGKILL);
+                ::waitpid(pid, nullptr, 0);
+                throw std::runtime_error("server " + executable + " didn't start on port " + portArg);
+            }
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+}
+
+
+void stop_server(pid_t pid) {
+    ::kill(pid, SIGINT);
+    ::waitpid(pid, nullptr, 0);
+}
+#endif
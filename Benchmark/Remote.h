@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "Connection.h"
+#include "Message.h"
+#include "Multiplexer.h"
+
+#ifndef WIN32
+#include <sys/types.h>
+#endif
+
+// ------------------------------------------------------------------
+// talking to a running Server like Client does, for the benchmarks
+// that measure one
+// ------------------------------------------------------------------
+
+// mux is only set if asked for (pMux) and the server speaks protocol v2; otherwise the session is v1.
+// pToken, if given, gets the token the session can be resumed with
+connection::Connection::Ptr open_session(const std::string& host, connection::port_t port, uint16_t inlineLimit,
+    connection::Multiplexer::Ptr* pMux = nullptr, std::string* pToken = nullptr);
+
+#ifndef WIN32
+// v1 session over the server's Unix domain socket, announcing the version that has GET pass descriptors
+connection::Connection::Ptr open_local_session(const std::string& path);
+#endif
+
+void close_session(const connection::Connection::Ptr& control, const connection::Multiplexer::Ptr& mux = nullptr);
+
+// one GET, the same exchange as Client's handle_get but discarding the data. Returns bytes received.
+// mapPassed picks how a file passed as a descriptor is read: copied out with read() like a socket
+// would, or mapped and summed in place
+uint64_t remote_get(const connection::Connection::Ptr& control, const std::string& filename, bool mapPassed = false);
+
+// one GET over its own stream of a v2 session, discarding the data. Returns bytes received
+uint64_t remote_get(const connection::Multiplexer::Ptr& mux, const std::string& filename);
+
+// reads and discards the data following a GET's OK response on stream. Returns bytes received
+uint64_t discard_get_data(const connection::Connection::Ptr& stream, const connection::Message& response, const std::string& filename);
+
+// reads exactly len bytes from channel
+std::string receive_exactly(connection::Connection& channel, uint64_t len);
+
+#ifndef WIN32
+// a server of our own on port, serving directory with the variables given added to its environment
+// and its output discarded. Given a handoff path it takes over from (or will hand over to) a server
+// restarted on the same path (see HotRestart.h). Returns once the port greets
+pid_t start_server(const std::string& executable, connection::port_t port, const std::string& directory, const std::vector<std::string>& variables,
+    const std::string& handoffPath = "");
+
+// as ctrl+c would, waiting for it to exit
+void stop_server(pid_t pid);
+#endif
@@ -0,0 +1,254 @@
+#include "pch.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "Benchmarks.h"
+#include "DelayProxy.h"
+#include "ProtocolVer.h"
+#include "Remote.h"
+#include "SessionResume.h"
+#include "SyncStream.h"
+
+#ifndef WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace connection;
+
+
+
+// reconnects to a session dropped from the far end and resumes it under token, without waiting on
+// the server's greeting: the multiplexer picks that and the answer to the resumption up ahead of the
+// streams. token is replaced with the resumed session's own, and resumed says whether the server
+// still had the session, once the answer is in
+static Connection::Ptr resume_session(const std::string& host, port_t port, std::string* token, std::atomic_bool* resumed, Multiplexer::Ptr* pMux) {
+    auto control = Connection::connect(host, port);
+    Message msg;
+
+    ZERO_MSG(&msg);
+    msg.msgid = MSGID::MESSAGE_HELLO;
+    msg.payload = MAKE_VERSION("Benchmark", "hello") + std::string("\n") + HELLO_RESUME + " " + *token;
+
+    control->send(msg);
+
+    *pMux = Multiplexer::create(control, Multiplexer::CLIENT, [token, resumed](Connection& channel) {
+        Message hello;
+        Message answer;
+
+        channel.receive(&hello, 10000);
+        channel.receive(&answer, 10000);
+
+        *token = hello_field(hello.payload, HELLO_SESSION);
+        resumed->store(answer.msgid == MSGID::MESSAGE_OK);
+    });
+
+    return control;
+}
+
+
+// time from reconnecting after a drop to the first GET's data, through a proxy adding rttMs of round
+// trip: greeting a new session first, then resuming the old one with the GET sent straight behind
+// the HELLO. Reported as percentiles of that time, not throughput
+void bench_resume(const std::string& host, port_t port, const std::string& filename, long rttMs) {
+    constexpr int RECONNECTS = 50;
+    DelayProxy proxy(host, port, rttMs);
+    const auto rtt = "_rtt" + std::to_string(rttMs) + "ms";
+
+    // cut off under the multiplexer, as a failing network would. The server has to see the drop and
+    // park the session before it can be resumed
+    const auto drop = [rttMs](const Connection::Ptr& control, const Multiplexer::Ptr& mux) {
+        ::shutdown(control->transport().native_handle(), SHUT_RDWR);
+        mux->close();
+        std::this_thread::sleep_for(std::chrono::milliseconds(rttMs + 20));
+    };
+
+    for (const bool resuming : { false, true }) {
+        Multiplexer::Ptr mux;
+        std::string token;
+        std::atomic_bool resumed(false);
+        std::vector<double> latenciesUs;
+        int expired = 0;
+        auto control = open_session("127.0.0.1", proxy.port(), 0, &mux, &token);
+
+        for (int i = 0; i < RECONNECTS; ++i) {
+            drop(control, mux);
+
+            const auto began = std::chrono::steady_clock::now();
+
+            if (resuming)
+                control = resume_session("127.0.0.1", proxy.port(), &token, &resumed, &mux);
+            else control = open_session("127.0.0.1", proxy.port(), 0, &mux, &token);
+
+            remote_get(mux, filename);
+            latenciesUs.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - began).count());
+
+            // the answer was read before the GET's response, so it's in by now
+            if (resuming && !resumed.load())
+                ++expired;
+        }
+
+        close_session(control, mux);
+        std::sort(latenciesUs.begin(), latenciesUs.end());
+
+        const auto percentile = [&latenciesUs](double p) {
+            return latenciesUs[std::min(latenciesUs.size() - 1, static_cast<size_t>(p * latenciesUs.size()))];
+        };
+
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(1);
+
+        line << "bench=reconnect_latency param=" << (resuming ? "resume" : "new_session") << rtt << " p50_us=" << percentile(0.5)
+             << " p99_us=" << percentile(0.99) << " max_us=" << latenciesUs.back() << " expired=" << expired;
+
+        sync_cout.print(line.str(), sync_endl);
+    }
+}
+
+
+#ifndef WIN32
+constexpr int RESTART_BENCH_WORKERS = 4;                // threads opening a session, GETting a file and quitting, over and over
+constexpr int RESTART_BENCH_KEPT_SESSIONS = 4;          // sessions GETting the file every RESTART_BENCH_KEPT_GET_MS throughout
+constexpr long RESTART_BENCH_KEPT_GET_MS = 20;
+constexpr long RESTART_BENCH_SETTLE_MS = 1000;          // load before the first restart and between each
+constexpr long RESTART_BENCH_HANDOVER_LIMIT_MS = 10000; // a predecessor still running after this is killed and counted as stuck
+
+
+// restarts a server of its own on port, serving directory, again and again under load from short
+// sessions and long-lived ones, each new process taking over from the last through a handoff path.
+// Every connection refused, session broken or GET failed along the way is counted: a hot restart
+// should see none. Returns whether it didn't
+bool bench_hot_restart(const std::string& executable, port_t port, const std::string& serverDirectory, int restarts) {
+    const auto name = "restart_bench_" + std::to_string(::getpid());
+    const auto handoffPath = "/tmp/" + name + ".sock";
+    std::vector<char> contents(4096, 'r');
+
+    std::ofstream(serverDirectory + "/" + name, std::ios::binary).write(contents.data(), static_cast<std::streamsize>(contents.size()));
+
+    auto pid = start_server(executable, port, serverDirectory, {}, handoffPath);
+    std::atomic_bool stop(false);
+    std::atomic<uint64_t> sessions(0);
+    std::atomic<uint64_t> refused(0);                   // connecting or being greeted failed
+    std::atomic<uint64_t> broken(0);                    // a short session failed after its greeting
+    std::atomic<uint64_t> keptGets(0);
+    std::atomic<uint64_t> keptFailures(0);              // a long-lived session's GET failed, and it had to start over
+    std::vector<std::thread> threads;
+
+    for (int i = 0; i < RESTART_BENCH_WORKERS; ++i) {
+        threads.emplace_back([&]() {
+            while (!stop.load()) {
+                Connection::Ptr control;
+
+                ++sessions;
+
+                try {
+                    control = open_session("127.0.0.1", port, static_cast<uint16_t>(contents.size()));
+                } catch (const std::exception&) {
+                    ++refused;
+                    continue;
+                }
+
+                try {
+                    remote_get(control, name);
+                    close_session(control);
+                } catch (const std::exception&) {
+                    ++broken;
+                }
+            }
+        });
+    }
+
+    // half of them over protocol v1, half over v2: each moves across its own way
+    for (int i = 0; i < RESTART_BENCH_KEPT_SESSIONS; ++i) {
+        threads.emplace_back([&, i]() {
+            const bool multiplexed = i % 2 == 1;
+            Connection::Ptr control;
+            Multiplexer::Ptr mux;
+
+            while (!stop.load()) {
+                try {
+                    if (!control)
+                        control = open_session("127.0.0.1", port, static_cast<uint16_t>(contents.size()), multiplexed ? &mux : nullptr);
+
+                    if (mux)
+                        remote_get(mux, name);
+                    else remote_get(control, name);
+
+                    ++keptGets;
+                } catch (const std::exception&) {
+                    ++keptFailures;
+                    control.reset();
+                    mux.reset();
+                }
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(RESTART_BENCH_KEPT_GET_MS));
+            }
+
+            if (control) {
+                try {
+                    close_session(control, mux);
+                } catch (const std::exception&) {
+                    ++keptFailures;
+                }
+            }
+        });
+    }
+
+    std::vector<double> handoversMs;
+    int stuck = 0;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(RESTART_BENCH_SETTLE_MS));
+
+    for (int i = 0; i < restarts; ++i) {
+        const auto began = std::chrono::steady_clock::now();
+        const auto successor = start_server(executable, port, serverDirectory, {}, handoffPath);
+
+        // the predecessor exits by itself once its last session has been passed across
+        while (::waitpid(pid, nullptr, WNOHANG) == 0) {
+            if (std::chrono::steady_clock::now() - began > std::chrono::milliseconds(RESTART_BENCH_HANDOVER_LIMIT_MS)) {
+                ::kill(pid, SIGKILL);
+                ::waitpid(pid, nullptr, 0);
+                ++stuck;
+                break;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        handoversMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - began).count());
+        pid = successor;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(RESTART_BENCH_SETTLE_MS));
+    }
+
+    stop.store(true);
+
+    for (auto& thread : threads)
+        thread.join();
+
+    stop_server(pid);
+    ::unlink((serverDirectory + "/" + name).c_str());
+    std::sort(handoversMs.begin(), handoversMs.end());
+
+    std::ostringstream line;
+    line.setf(std::ios::fixed);
+    line.precision(1);
+
+    line << "bench=hot_restart param=restarts" << restarts << " sessions=" << sessions.load() << " refused=" << refused.load()
+         << " broken=" << broken.load() << " kept_gets=" << keptGets.load() << " kept_failures=" << keptFailures.load() << " stuck=" << stuck
+         << " handover_p50_ms=" << (handoversMs.empty() ? 0.0 : handoversMs[handoversMs.size() / 2])
+         << " handover_max_ms=" << (handoversMs.empty() ? 0.0 : handoversMs.back());
+
+    sync_cout.print(line.str(), sync_endl);
+
+    return refused.load() == 0 && broken.load() == 0 && keptFailures.load() == 0 && stuck == 0;
+}
+#endif
@@ -0,0 +1,315 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Benchmarks.h"
+#include "BufferPool.h"
+#include "Harness.h"
+#include "Remote.h"
+#include "SyncStream.h"
+
+using namespace std;
+using namespace connection;
+
+constexpr long PUT_BENCH_DURATION_MS = 2000;            // long enough for the tail of the latencies to mean something
+
+
+// GETs name over its own stream of a v2 session into the file at path. Returns bytes received
+static uint64_t fetch_to_file(const Multiplexer::Ptr& mux, const std::string& name, const std::string& path) {
+    auto stream = mux->open_stream();
+    Message response;
+    std::fstream output(path, std::fstream::binary | std::fstream::in | std::fstream::out | std::fstream::trunc);
+    NetworkDataStream ds(output);
+    uint64_t received = 0;
+
+    stream->send(MAKE_MSG(MSGID::MESSAGE_GET, name));
+    stream->receive(&response, 10000);
+
+    if (response.msgid != MSGID::MESSAGE_OK || (response.flags & FLAG_INLINE))
+        throw std::runtime_error("GET " + name + " failed: " + response.to_string());
+
+    while (received < response.datalen)
+        received += stream->receive(ds, static_cast<int>(std::min<uint64_t>(response.datalen - received, CHUNK_SIZE)));
+
+    stream->shutdown();
+    return received;
+}
+
+
+// PUTs the file at path as name over its own stream of a v2 session. Returns bytes sent
+static uint64_t put_from_file(const Multiplexer::Ptr& mux, const std::string& path, const std::string& name) {
+    auto stream = mux->open_stream();
+    std::fstream input(path, std::fstream::binary | std::fstream::in);
+    Message response;
+
+    input.seekg(0, input.end);
+
+    auto command = MAKE_MSG(MSGID::MESSAGE_PUT, name);
+    command.datalen = static_cast<uint64_t>(input.tellg());
+
+    input.seekg(0, input.beg);
+
+    stream->send(command);
+    stream->receive(&response, 10000);
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("PUT " + name + " failed: " + response.to_string());
+
+    NetworkDataStream ds(input);
+    const auto sent = static_cast<uint64_t>(stream->send(ds));
+
+    // confirmed once the server has stored it (as durably as it's been told to)
+    stream->receive(&response, 10000);
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("PUT " + name + " failed: " + response.to_string());
+
+    stream->shutdown();
+    return sent;
+}
+
+
+// COPY or MOVE over its own stream of a v2 session, waiting out any progress reports
+static void remote_copy(const Multiplexer::Ptr& mux, MSGID command, const std::string& from, const std::string& to) {
+    auto stream = mux->open_stream();
+    Message response;
+
+    stream->send(MAKE_MSG(command, from + "\n" + to));
+
+    do {
+        stream->receive(&response, 10000);
+    } while (response.msgid == MSGID::MESSAGE_OK && (response.flags & FLAG_PROGRESS));
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error(to_string(command) + " " + from + " failed: " + response.to_string());
+
+    stream->shutdown();
+}
+
+
+// a duplicate of file made the old way, through the client, against COPY on the server
+void bench_copy(const std::string& host, port_t port, const std::string& serverDirectory, const std::string& file) {
+    Multiplexer::Ptr mux;
+    auto v2 = open_session(host, port, 0, &mux);
+    const std::string duplicate = "copy_bench_" + std::to_string(::getpid()) + "_" + file;
+    const auto duplicatePath = serverDirectory + "/" + duplicate;
+    char scratch[] = "/tmp/copy_bench_XXXXXX";
+    const int scratchFd = mkstemp(scratch);
+
+    if (scratchFd < 0)
+        throw std::runtime_error("couldn't create a scratch file");
+
+    ::close(scratchFd);
+
+    const auto size_of = [](const std::string& path) -> int64_t {
+        struct stat st;
+        return ::stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+    };
+
+    report(run_timed("copy", "get_and_put_" + file, [&]() -> uint64_t {
+        const auto bytes = fetch_to_file(mux, file, scratch);
+
+        put_from_file(mux, scratch, duplicate);
+        ::unlink(duplicatePath.c_str());
+        return bytes;
+    }, 1));
+
+    ::unlink(scratch);
+
+    report(run_timed("copy", "server_copy_" + file, [&]() -> uint64_t {
+        remote_copy(mux, MSGID::MESSAGE_COPY, file, duplicate);
+
+        const auto bytes = size_of(duplicatePath);
+
+        ::unlink(duplicatePath.c_str());
+        return static_cast<uint64_t>(bytes);
+    }, 1));
+
+    close_session(v2, mux);
+}
+
+
+// sessions uploading small files all at once, each PUT timed from command to confirmation. The
+// durability mode is the server's, so this is run against a server started with each in turn
+void bench_put(const std::string& host, port_t port, const std::string& serverDirectory, size_t fileSize) {
+    char scratch[] = "/tmp/put_bench_XXXXXX";
+    const int scratchFd = mkstemp(scratch);
+
+    if (scratchFd < 0)
+        throw std::runtime_error("couldn't create a scratch file");
+
+    const std::string contents(fileSize, 'x');
+
+    if (::write(scratchFd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+        throw std::runtime_error("couldn't write the scratch file");
+
+    ::close(scratchFd);
+
+    for (const size_t sessions : { 1, 8, 32, 128 }) {
+        std::vector<Multiplexer::Ptr> muxes(sessions);
+        std::vector<Connection::Ptr> controls;
+
+        for (auto& mux : muxes)
+            controls.push_back(open_session(host, port, 0, &mux));
+
+        std::mutex mutex;
+        std::vector<double> latenciesUs;
+        std::vector<std::string> uploaded;
+        std::vector<std::thread> uploaders;
+        const auto start = std::chrono::steady_clock::now();
+        const auto stop = start + std::chrono::milliseconds(PUT_BENCH_DURATION_MS);
+
+        for (size_t i = 0; i < sessions; ++i) {
+            uploaders.emplace_back([&, i]() {
+                std::vector<double> mine;
+                std::vector<std::string> names;
+
+                while (std::chrono::steady_clock::now() < stop) {
+                    const auto name = "put_bench_" + std::to_string(::getpid()) + "_" + std::to_string(i) + "_" + std::to_string(names.size());
+                    const auto began = std::chrono::steady_clock::now();
+
+                    put_from_file(muxes[i], scratch, name);
+
+                    mine.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - began).count());
+                    names.push_back(name);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+
+                latenciesUs.insert(latenciesUs.end(), mine.begin(), mine.end());
+                uploaded.insert(uploaded.end(), names.begin(), names.end());
+            });
+        }
+
+        for (auto& uploader : uploaders)
+            uploader.join();
+
+        const auto elapsedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        const auto param = "sessions_" + std::to_string(sessions);
+
+        report(BenchResult{ "put", param, latenciesUs.size(), elapsedNs, latenciesUs.size() * fileSize, 0 });
+
+        std::sort(latenciesUs.begin(), latenciesUs.end());
+
+        const auto percentile = [&latenciesUs](double p) {
+            return latenciesUs.empty() ? 0.0 : latenciesUs[std::min(latenciesUs.size() - 1, static_cast<size_t>(p * latenciesUs.size()))];
+        };
+
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(1);
+
+        line << "bench=put_latency param=" << param << " p50_us=" << percentile(0.5) << " p99_us=" << percentile(0.99)
+             << " p999_us=" << percentile(0.999) << " max_us=" << (latenciesUs.empty() ? 0.0 : latenciesUs.back());
+
+        sync_cout.print(line.str(), sync_endl);
+
+        for (size_t i = 0; i < sessions; ++i)
+            close_session(controls[i], muxes[i]);
+
+        for (const auto& name : uploaded)
+            ::unlink((serverDirectory + "/" + name).c_str());
+    }
+
+    ::unlink(scratch);
+}
+
+
+// PUTs len bytes of the file at path from offset as one range of a parallel upload of name
+static void put_range_from_file(const Multiplexer::Ptr& mux, const std::string& path, const std::string& name, uint64_t offset, uint64_t len, uint64_t total) {
+    auto stream = mux->open_stream();
+    std::ifstream input(path, std::ios::binary);
+    auto command = MAKE_MSG(MSGID::MESSAGE_PUT, name + "\n" + std::to_string(offset) + " " + std::to_string(total));
+    Message response;
+
+    command.datalen = len;
+    input.seekg(static_cast<std::streamoff>(offset));
+
+    stream->send(command);
+    stream->receive(&response, 10000);
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("PUT " + name + " range failed: " + response.to_string());
+
+    auto lease = BufferPool::shared().acquire();
+
+    for (uint64_t left = len; left > 0;) {
+        const auto want = static_cast<size_t>(std::min<uint64_t>(left, lease.size()));
+
+        if (!input.read(lease.data(), want))
+            throw std::runtime_error("couldn't read " + path);
+
+        for (size_t sent = 0; sent < want;)
+            sent += stream->transport().send(lease.data() + sent, static_cast<int>(want - sent));
+
+        left -= want;
+    }
+
+    stream->receive(&response, 10000);
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("PUT " + name + " range failed: " + response.to_string());
+
+    stream->shutdown();
+}
+
+
+// one file uploaded as a single PUT, then split into ranges sent over several streams at once
+void bench_put_ranges(const std::string& host, port_t port, const std::string& serverDirectory, const std::string& path) {
+    Multiplexer::Ptr mux;
+    auto v2 = open_session(host, port, 0, &mux);
+    struct stat st;
+
+    if (::stat(path.c_str(), &st) != 0)
+        throw std::runtime_error("couldn't stat " + path);
+
+    const auto total = static_cast<uint64_t>(st.st_size);
+    const std::string name = "put_ranges_bench_" + std::to_string(::getpid());
+    const auto uploaded = serverDirectory + "/" + name;
+
+    for (const uint64_t streams : { 1, 2, 4, 8 }) {
+        report(run_timed("put_ranges", "streams_" + std::to_string(streams), [&]() -> uint64_t {
+            if (streams == 1) {
+                put_from_file(mux, path, name);
+            } else {
+                const uint64_t rangeLen = (total + streams - 1) / streams;
+                std::vector<std::thread> senders;
+                std::mutex mutex;
+                std::exception_ptr failure;
+
+                for (uint64_t offset = 0; offset < total; offset += rangeLen) {
+                    senders.emplace_back([&, offset]() {
+                        try {
+                            put_range_from_file(mux, path, name, offset, std::min(rangeLen, total - offset), total);
+                        } catch (...) {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            failure = std::current_exception();
+                        }
+                    });
+                }
+
+                for (auto& sender : senders)
+                    sender.join();
+
+                if (failure)
+                    std::rethrow_exception(failure);
+            }
+
+            ::unlink(uploaded.c_str());
+            return total;
+        }, 1));
+    }
+
+    close_session(v2, mux);
+}
+#endif
@@ -0,0 +1,371 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <unistd.h>
+#include "Benchmarks.h"
+#include "BufferPool.h"
+#include "Remote.h"
+#include "SyncStream.h"
+
+using namespace std;
+using namespace connection;
+
+constexpr long WATCH_BENCH_DURATION_MS = 10000;
+constexpr long WATCH_BENCH_POLL_MS = 2000;              // how often each poller lists the directory
+constexpr long WATCH_BENCH_CHANGE_MS = 1000;            // how often a file appears: uploads trickling in
+constexpr long FOLLOW_BENCH_DURATION_MS = 5000;
+constexpr long FOLLOW_BENCH_APPEND_MS = 10;             // how often the log being shipped grows by a line
+constexpr size_t FOLLOW_BENCH_LINE_LEN = 100;
+
+
+// the listing an LS sends back, inline or following the response
+static std::string remote_ls(const Multiplexer::Ptr& mux) {
+    auto stream = mux->open_stream();
+    Message response;
+
+    stream->send(MAKE_MSG(MSGID::MESSAGE_LS));
+    stream->receive(&response, 10000);
+
+    if (response.msgid != MSGID::MESSAGE_OK)
+        throw std::runtime_error("LS failed: " + response.to_string());
+
+    const auto listing = (response.flags & FLAG_INLINE) ? response.payload : receive_exactly(*stream, response.datalen);
+
+    stream->shutdown();
+    return listing;
+}
+
+
+// CPU time, user and system, a process on this host has used so far
+static double process_cpu_ms(pid_t pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+
+    if (!std::getline(stat, line))
+        throw std::runtime_error("no process " + std::to_string(pid));
+
+    // the fields after the command name, which is in parentheses and may hold anything, start at the 3rd
+    std::istringstream fields(line.substr(line.rfind(')') + 2));
+    std::string field;
+    unsigned long ticks = 0;
+
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+        if (i == 14 || i == 15)     // utime, stime
+            ticks += std::stoul(field);
+    }
+
+    return ticks * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+
+// sessions learning about new files on a server on this host (process pid, serving serverDirectory):
+// polling with LS, then subscribed with WATCH. A file appears every WATCH_BENCH_CHANGE_MS meanwhile.
+// Reports the server's CPU time per second of the run, and how long each file took to be noticed.
+// The same sessions left idle, with no files appearing, are the baseline both are paying on top of
+void bench_watch(const std::string& host, port_t port, pid_t pid, const std::string& serverDirectory, size_t sessions) {
+    enum Mode { IDLE, POLLING, WATCHING };
+
+    for (const auto mode : { IDLE, POLLING, WATCHING }) {
+        const bool watching = mode == WATCHING;
+
+        std::vector<Multiplexer::Ptr> muxes(sessions);
+        std::vector<Connection::Ptr> controls;
+        std::vector<Connection::Ptr> watches;
+        const auto prefix = "watch_bench_" + std::to_string(::getpid()) + "_";
+
+        for (auto& mux : muxes) {
+            controls.push_back(open_session(host, port, MAX_INLINE_PAYLOAD_LEN, &mux));
+
+            if (!watching)
+                continue;
+
+            Message response;
+
+            watches.push_back(mux->open_stream());
+            watches.back()->send(MAKE_MSG(MSGID::MESSAGE_WATCH));
+            watches.back()->receive(&response, 10000);
+
+            if (response.msgid != MSGID::MESSAGE_OK)
+                throw std::runtime_error("WATCH failed: " + response.to_string());
+        }
+
+        std::mutex mutex;
+        std::map<std::string, std::chrono::steady_clock::time_point> created;
+        std::vector<double> delaysMs;
+        std::atomic_bool stop(false);
+        std::vector<std::thread> observers;
+
+        const auto noticed = [&](const std::string& name, std::vector<double>* delays) {
+            std::lock_guard<std::mutex> lock(mutex);
+            const auto it = created.find(name);
+
+            if (it != created.end())
+                delays->push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - it->second).count());
+        };
+
+        for (size_t i = 0; i < sessions; ++i) {
+            observers.emplace_back([&, i]() {
+                std::vector<double> delays;
+
+                try {
+                    if (mode == IDLE) {
+                        while (!stop.load())
+                            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    } else if (watching) {
+                        Message event;
+
+                        while (watches[i]->receive(&event) > 0 && (event.flags & FLAG_EVENT)) {
+                            std::istringstream lines(event.payload);
+                            std::string line;
+
+                            while (std::getline(lines, line)) {
+                                if (line.compare(0, 8, "created ") == 0)
+                                    noticed(line.substr(8), &delays);
+                            }
+                        }
+                    } else {
+                        std::set<std::string> known;
+
+                        // spread out, as independent pollers would be
+                        std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_BENCH_POLL_MS * i / sessions));
+
+                        while (!stop.load()) {
+                            const auto listing = remote_ls(muxes[i]);
+                            std::vector<std::string> names;
+
+                            {
+                                std::lock_guard<std::mutex> lock(mutex);
+
+                                for (const auto& file : created) {
+                                    if (!known.count(file.first) && listing.find('"' + file.first + '"') != std::string::npos)
+                                        names.push_back(file.first);
+                                }
+                            }
+
+                            for (const auto& name : names) {
+                                known.insert(name);
+                                noticed(name, &delays);
+                            }
+
+                            std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_BENCH_POLL_MS));
+                        }
+                    }
+                } catch (const std::exception& e) {
+                    sync_cerr.print("session ", i, " failed: ", e.what(), sync_endl);
+                }
+
+                std::lock_guard<std::mutex> lock(mutex);
+                delaysMs.insert(delaysMs.end(), delays.begin(), delays.end());
+            });
+        }
+
+        const auto cpuBefore = process_cpu_ms(pid);
+        const auto start = std::chrono::steady_clock::now();
+
+        for (int n = 0; std::chrono::steady_clock::now() - start < std::chrono::milliseconds(WATCH_BENCH_DURATION_MS); ++n) {
+            const auto name = prefix + std::to_string(n);
+
+            if (mode == IDLE) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_BENCH_CHANGE_MS));
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                created[name] = std::chrono::steady_clock::now();
+            }
+
+            std::ofstream(serverDirectory + "/" + name) << n;
+            std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_BENCH_CHANGE_MS));
+        }
+
+        const auto elapsedS = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto cpuMs = process_cpu_ms(pid) - cpuBefore;
+
+        // a watch ends once the client finishes its side of the stream
+        stop.store(true);
+
+        for (const auto& watch : watches)
+            watch->transport().shutdown_send();
+
+        for (auto& observer : observers)
+            observer.join();
+
+        for (size_t i = 0; i < sessions; ++i)
+            close_session(controls[i], muxes[i]);
+
+        for (const auto& file : created)
+            ::unlink((serverDirectory + "/" + file.first).c_str());
+
+        std::sort(delaysMs.begin(), delaysMs.end());
+
+        const auto percentile = [&delaysMs](double p) {
+            return delaysMs.empty() ? 0.0 : delaysMs[std::min(delaysMs.size() - 1, static_cast<size_t>(p * delaysMs.size()))];
+        };
+
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(1);
+
+        line << "bench=change_detection param=" << (mode == IDLE ? "idle_" : watching ? "watchers_" : "pollers_") << sessions << " server_cpu_ms_per_s=" << cpuMs / elapsedS
+             << " noticed=" << delaysMs.size() << " p50_ms=" << percentile(0.5) << " p99_ms=" << percentile(0.99);
+
+        sync_cout.print(line.str(), sync_endl);
+    }
+}
+
+
+// a log on a server on this host growing by a line every FOLLOW_BENCH_APPEND_MS, shipped as it grows:
+// by GETting all of it again every so often, as shippers without follow mode do, then with one GET
+// following it. Reports how long lines took from being appended to arriving, and bytes transferred
+// per line appended
+void bench_follow(const std::string& host, port_t port, const std::string& serverDirectory) {
+    const auto name = "follow_bench_" + std::to_string(::getpid()) + ".log";
+    const auto path = serverDirectory + "/" + name;
+    const size_t lines = FOLLOW_BENCH_DURATION_MS / FOLLOW_BENCH_APPEND_MS;
+
+    for (const long pollMs : { 1000L, 100L, 0L }) {     // 0: following
+        Multiplexer::Ptr mux;
+        auto control = open_session(host, port, MAX_INLINE_PAYLOAD_LEN, &mux);
+        std::ofstream log(path, std::ios::binary | std::ios::trunc);
+
+        std::mutex mutex;
+        std::vector<std::chrono::steady_clock::time_point> appended(lines);
+        std::vector<double> latenciesUs;
+        std::string partial;
+        uint64_t transferred = 0;
+        std::atomic_bool stop(false);
+        Connection::Ptr following;
+
+        // every line completed by data has arrived: each starts with its number
+        const auto arrive = [&](const char* data, size_t len) {
+            const auto now = std::chrono::steady_clock::now();
+            std::lock_guard<std::mutex> lock(mutex);
+
+            partial.append(data, len);
+
+            size_t end;
+
+            while ((end = partial.find('\n')) != std::string::npos) {
+                const auto n = std::stoul(partial.substr(0, 8));
+
+                latenciesUs.push_back(std::chrono::duration<double, std::micro>(now - appended[n]).count());
+                partial.erase(0, end + 1);
+            }
+        };
+
+        if (pollMs == 0) {
+            Message response;
+
+            following = mux->open_stream();
+            following->send(MAKE_MSG(MSGID::MESSAGE_GET, name + "\nfollow 0 0"));
+            following->receive(&response, 10000);
+
+            if (response.msgid != MSGID::MESSAGE_OK || !(response.flags & FLAG_FOLLOW))
+                throw std::runtime_error("GET following " + name + " failed: " + response.to_string());
+        }
+
+        std::thread reader([&]() {
+            try {
+                if (following) {
+                    auto lease = BufferPool::shared().acquire();
+                    int got;
+
+                    while ((got = following->transport().receive(lease.data(), static_cast<int>(lease.size()), Connection::TIMEOUT_NEVER, nullptr)) > 0) {
+                        transferred += static_cast<uint64_t>(got);
+                        arrive(lease.data(), static_cast<size_t>(got));
+                    }
+
+                    return;
+                }
+
+                size_t seen = 0;
+
+                while (!stop.load()) {
+                    auto stream = mux->open_stream();
+                    Message response;
+
+                    stream->send(MAKE_MSG(MSGID::MESSAGE_GET, name));
+                    stream->receive(&response, 10000);
+
+                    if (response.msgid != MSGID::MESSAGE_OK)
+                        throw std::runtime_error("GET " + name + " failed: " + response.to_string());
+
+                    const auto contents = (response.flags & FLAG_INLINE) ? response.payload : receive_exactly(*stream, response.datalen);
+
+                    stream->shutdown();
+
+                    transferred += contents.size();
+                    arrive(contents.data() + seen, contents.size() - seen);
+                    seen = contents.size();
+
+                    std::this_thread::sleep_for(std::chrono::milliseconds(pollMs));
+                }
+            } catch (const std::exception& e) {
+                sync_cerr.print("shipping ", name, " failed: ", e.what(), sync_endl);
+            }
+        });
+
+        const auto start = std::chrono::steady_clock::now();
+
+        for (size_t n = 0; n < lines; ++n) {
+            char line[FOLLOW_BENCH_LINE_LEN + 1];
+
+            snprintf(line, sizeof(line), "%08zu %0*d\n", n, static_cast<int>(FOLLOW_BENCH_LINE_LEN - 10), 0);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                appended[n] = std::chrono::steady_clock::now();
+            }
+
+            log.write(line, FOLLOW_BENCH_LINE_LEN);
+            log.flush();
+
+            std::this_thread::sleep_until(start + std::chrono::milliseconds(FOLLOW_BENCH_APPEND_MS * static_cast<long>(n + 1)));
+        }
+
+        // long enough for the last lines to be fetched too
+        std::this_thread::sleep_for(std::chrono::milliseconds(pollMs + 100));
+        stop.store(true);
+
+        if (following)
+            following->transport().shutdown_send();
+
+        reader.join();
+
+        if (following)
+            following->shutdown();
+
+        close_session(control, mux);
+        log.close();
+        ::unlink(path.c_str());
+
+        std::sort(latenciesUs.begin(), latenciesUs.end());
+
+        const auto percentile = [&latenciesUs](double p) {
+            return latenciesUs.empty() ? 0.0 : latenciesUs[std::min(latenciesUs.size() - 1, static_cast<size_t>(p * latenciesUs.size()))];
+        };
+
+        std::ostringstream summary;
+        summary.setf(std::ios::fixed);
+        summary.precision(1);
+
+        summary << "bench=log_shipping param=" << (pollMs == 0 ? std::string("follow") : "reget_" + std::to_string(pollMs) + "ms") << " lines=" << lines
+               << " arrived=" << latenciesUs.size() << " p50_us=" << percentile(0.5) << " p99_us=" << percentile(0.99)
+               << " bytes_per_line=" << static_cast<double>(transferred) / lines;
+
+        sync_cout.print(summary.str(), sync_endl);
+    }
+}
+#endif
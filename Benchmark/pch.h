@@ -0,0 +1,9 @@
+#ifndef PCH_H
+#define PCH_H
+
+#include "Connection.h"
+#include "NetworkDataStream.h"
+#include "Message.h"
+#include "ProtocolVer.h"
+
+#endif //PCH_H
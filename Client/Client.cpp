@@ -19,8 +19,34 @@
 #include <limits>
 #include <map>
 #include <cctype>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <ctime>
+#include <iomanip>
 #include "Connection.h"
+#include "BufferPool.h"
+#include "FileBundle.h"
+#include "Glob.h"
+#include "TreeManifest.h"
+#include "StatBatch.h"
+#include "Multiplexer.h"
+#include "ProtocolVer.h"
+#include "SessionResume.h"
 #include "SyncStream.h"
+#include "Trace.h"
+#ifndef WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "FdPassing.h"
+#endif
 
 using namespace std;
 using namespace connection;
@@ -30,17 +56,45 @@ namespace fs = std::experimental::filesystem;
 constexpr long RESPONSE_TIMEOUT_MS = 10000; // how long to wait on a response from the server
 constexpr long CONNECTION_WAIT_TIMEOUT = 10000; // how long to wait for server to connect to our data channel
 constexpr int kTerminalLength = 79;
+constexpr int RGET_DEFAULT_WORKERS = 4;
+constexpr int RGET_MAX_WORKERS = 32;            // each busy worker holds a stream open, and the server allows Multiplexer::MAX_STREAMS
+constexpr int PUT_MAX_STREAMS = 32;             // same limit for the ranges of one parallel upload
+constexpr uint64_t PUT_MIN_RANGE = 1024 * 1024; // a file is only split into ranges at least this big
+constexpr long FOLLOW_IDLE_S = 30;              // 'get -f' stops once the file has gone this long without growing, unless told otherwise
+
 
+// called with the server's response to a command: returns true if data follows
+typedef std::function<bool(const Message&)> ResponseCallback;
 
 // function prototypes
-bool parse_arguments(int argc, const char** argv, string& address, port_t& port);
+bool parse_arguments(int argc, const char** argv, string& address, port_t& port, string& localPath);
 
 void run_client();
 bool parse_command(MSGID command);
+bool run_or_resume(MSGID command);
+void connect_to_server();
 bool exchange_greetings();
-void handle_ls();
+bool resume_session();
+void read_resume_answer(Connection& control);
+bool take_interrupted(const string& filename, uint64_t size, InterruptedUpload* upload);
+void run_command(Message command, ResponseCallback onResponse, Connection::ConnectionEstablishedCallback onData);
+bool check_response(const Message& response);
+bool receive_file(const string& filename, uint64_t dataLen, fstream& output);
+void handle_ls(const vector<string>& args);
 void handle_get(const string& filename);
-void handle_put(const string& filename);
+void handle_follow(const vector<string>& arguments);
+void handle_put(const vector<string>& arguments);
+bool put_range(const string& filename, uint64_t offset, uint64_t len, uint64_t total, string* failure);
+void handle_mget(const vector<string>& patterns);
+void handle_mput(const vector<string>& patterns);
+void handle_rget(const vector<string>& arguments);
+void handle_copy(MSGID command, const vector<string>& arguments);
+void handle_stat(const vector<string>& arguments);
+void handle_watch(const vector<string>& arguments);
+void stop_watch();
+void run_control_command(const Message& command, std::function<bool(const Message&)> onMessage);
+bool fetch_file(const string& path, uint64_t* bytes, string* failure);
+vector<string> read_arguments();
 void handle_quit();
 void make_header(const std::string& msg, uint64_t bytes);
 bool get_yesno();
@@ -62,6 +116,13 @@ const CommandLookupTable kCommands =
 {
     { "GET",    MSGID::MESSAGE_GET  },
     { "PUT",    MSGID::MESSAGE_PUT  },
+    { "MGET",   MSGID::MESSAGE_MGET },
+    { "MPUT",   MSGID::MESSAGE_MPUT },
+    { "RGET",   MSGID::MESSAGE_TREE },
+    { "COPY",   MSGID::MESSAGE_COPY },
+    { "MOVE",   MSGID::MESSAGE_MOVE },
+    { "STAT",   MSGID::MESSAGE_STAT },
+    { "WATCH",  MSGID::MESSAGE_WATCH },
     { "LS",     MSGID::MESSAGE_LS   },
     { "QUIT",   MSGID::MESSAGE_QUIT },
     { "Q",      MSGID::MESSAGE_QUIT },
@@ -69,19 +130,59 @@ const CommandLookupTable kCommands =
 };
 
 Connection::Ptr kControl;
+Multiplexer::Ptr kMux;          // protocol v2: each command opens a stream on kControl instead of a data channel
+bool kLocal = false;            // connected over a Unix domain socket: GET is answered with the file's descriptor
+int kVersion = 1;               // protocol version agreed in the greeting
+
+string kAddress;                // where to reconnect to if the connection drops
+port_t kPort = 0;
+string kLocalPath;
+string kSessionToken;           // given by the server's greeting: presented to resume the session after a drop
+
+// a watch running in the background, printing changes to the server's files as they arrive
+struct Watch {
+    Connection::Ptr stream;
+    std::mutex mutex;
+    std::condition_variable ended;
+    bool stopping = false;      // asked to stop from here
+    bool over = false;
+};
+
+std::shared_ptr<Watch> kWatch;
+
+// a resumption's answer arrives after the commands that follow it have been sent: uploads the
+// server still holds part of wait for it
+std::mutex kResumeMutex;
+std::condition_variable kResumeAnswered;
+bool kResumePending = false;
+map<string, InterruptedUpload> kInterrupted;
 
 int main(int argc, const char** argv)
 {
     string address;
-    port_t port;
+    port_t port = 0;
+    string localPath;
 
-    if (!parse_arguments(argc, argv, address, port))
+    if (!parse_arguments(argc, argv, address, port, localPath))
         return EXIT_FAILURE;
 
     Connection::initialize();
 
+    // where each command's time goes, phase by phase, as Chrome trace events (see Trace.h)
+    if (const char* tracePath = getenv("FTP_TRACE")) {
+        const char* flushMs = getenv("FTP_TRACE_FLUSH_MS");
+
+        if (trace::start(tracePath, "Client", flushMs ? atol(flushMs) : 0))
+            trace::name_thread("client");
+        else cerr << "Can't trace to " << tracePath << ": it can't be written to" << endl;
+    }
+
+    kAddress = address;
+    kPort = port;
+    kLocalPath = localPath;
+
     try {
-        kControl = Connection::connect(address, port);
+        connect_to_server();
     }
     catch (const ConnectionException& e) {
         cerr << "error connecting to server: " << e.what() << endl;
@@ -94,12 +195,25 @@ int main(int argc, const char** argv)
         cerr << "error: " << e.what() << "\nConnection closed." << endl;
     }
 
+    trace::finish();
     Connection::deinitialize();
 
     return 0;
 }
 
 
+void connect_to_server() {
+#ifndef WIN32
+    if (!kLocalPath.empty()) {
+        kControl = Connection::connect_local(kLocalPath);
+        kLocal = true;
+        return;
+    }
+#endif
+    kControl = Connection::connect(kAddress, kPort);
+}
+
+
 void run_client() {
     if (!exchange_greetings()) return;
 
@@ -125,34 +239,94 @@ void run_client() {
             continue;
         }
 
-    } while (it == kCommands.cend() /* no command chosen */ || parse_command(it->second));
+    } while (it == kCommands.cend() /* no command chosen */ || run_or_resume(it->second));
 
     cout << "Goodbye!" << endl;
 }
 
 
+// runs command, first getting the session back if the connection has dropped since the last one.
+// One that drops partway is left to the user to run again once the session has been resumed
+bool run_or_resume(MSGID command) {
+    try {
+        if (kMux && !kMux->is_open() && command != MSGID::MESSAGE_QUIT && !resume_session())
+            return false;
+
+        return parse_command(command);
+    }
+    catch (const ConnectionException& e) {
+        if (command == MSGID::MESSAGE_QUIT)
+            throw;
+
+        cerr << "error: " << e.what() << endl;
+
+        if (!resume_session())
+            throw;
+
+        cout << "The command was interrupted: run it again to carry on" << endl;
+        return true;
+    }
+}
+
+
 // return true if should continue running
 // avoids having a bunch of complexity in run_client: each command might need arguments user supplied
 bool parse_command(MSGID command) {
+    trace::Span span(command_name(command));
+
     switch (command) {
         case MSGID::MESSAGE_LS:
-            handle_ls();
+            // optionally a directory, which may be inside an archive the server serves
+            handle_ls(read_arguments());
             break;
 
         case MSGID::MESSAGE_GET:
-            // should be another argument: filename
+            // a file name, or -f and a file name to follow it as it grows
             {
-                string fname;
-                cin >> fname;
+                const auto arguments = read_arguments();
 
-                handle_get(fname);
+                if (!arguments.empty() && arguments[0] == "-f")
+                    handle_follow(arguments);
+                else if (arguments.size() == 1)
+                    handle_get(arguments[0]);
+                else cerr << "usage: get <filename>, or get -f <filename> [offset [idle seconds]]" << endl;
             }
             break;
 
 
         case MSGID::MESSAGE_PUT:
-        
-            cerr << "not implemented yet" << endl;
+            // a file name, then optionally how many streams to send it over at once
+            handle_put(read_arguments());
+            break;
+
+        case MSGID::MESSAGE_MGET:
+            // the rest of the line: file names or glob patterns
+            handle_mget(read_arguments());
+            break;
+
+        case MSGID::MESSAGE_MPUT:
+            handle_mput(read_arguments());
+            break;
+
+        case MSGID::MESSAGE_TREE:
+            // directory, then optionally how many files to fetch at once
+            handle_rget(read_arguments());
+            break;
+
+        case MSGID::MESSAGE_COPY:
+        case MSGID::MESSAGE_MOVE:
+            // source, then destination
+            handle_copy(command, read_arguments());
+            break;
+
+        case MSGID::MESSAGE_STAT:
+            // names, optionally preceded by -c for checksums
+            handle_stat(read_arguments());
+            break;
+
+        case MSGID::MESSAGE_WATCH:
+            // nothing to start watching, or "off" to stop
+            handle_watch(read_arguments());
             break;
 
         case MSGID::MESSAGE_QUIT:
@@ -175,6 +349,9 @@ bool exchange_greetings() {
     ZERO_MSG(&msg);
 
     msg.msgid = MSGID::MESSAGE_HELLO;
+    msg.inlineLimit = MAX_INLINE_PAYLOAD_LEN; // small files and listings can come back with the OK response
+    // descriptors can't be passed through the multiplexer, so a local client stays on v1
+    msg.payload = kLocal ? MAKE_VERSION_AT("Client", PROTOCOL_VERSION_DESCRIPTORS, "hello") : MAKE_VERSION("Client", "hello");
     kControl->send(msg);
 
     // expect greetings back
@@ -190,50 +367,231 @@ bool exchange_greetings() {
         return false;
     }
 
-    cout << "Established connection with " << msg.payload << endl;
+    kVersion = negotiate_version(msg.payload, static_cast<int>(kLocal ? PROTOCOL_VERSION_DESCRIPTORS : PROTOCOL_VERSION));
+    kSessionToken = hello_field(msg.payload, HELLO_SESSION);
+
+    if (kVersion >= PROTOCOL_VERSION_MULTIPLEXED)
+        kMux = Multiplexer::create(kControl, Multiplexer::CLIENT);
+
+    cout << "Established connection with " << hello_banner(msg.payload) << " (protocol v" << kVersion << ")" << endl;
+    return true;
+}
+
+
+// reconnects after the connection has dropped and resumes the session under its token. The
+// version and inline limit stay as they were agreed, so there's no greeting to wait for: under v2
+// commands go out at once, while the multiplexer picks up the server's answer ahead of their
+// responses. Returns false if the server can't be reached
+bool resume_session() {
+    if (kSessionToken.empty())
+        return false;
+
+    if (kMux)
+        kMux->close();
+
+    kMux = nullptr;
+
+    try {
+        connect_to_server();
+
+        Message hello; ZERO_MSG(&hello);
+        hello.msgid = MSGID::MESSAGE_HELLO;
+        hello.inlineLimit = MAX_INLINE_PAYLOAD_LEN;
+        hello.payload = (kLocal ? MAKE_VERSION_AT("Client", PROTOCOL_VERSION_DESCRIPTORS, "hello") : MAKE_VERSION("Client", "hello")) +
+            string("\n") + HELLO_RESUME + " " + kSessionToken;
+
+        {
+            std::lock_guard<std::mutex> lock(kResumeMutex);
+            kResumePending = true;
+            kInterrupted.clear();
+        }
+
+        kControl->send(hello);
+
+        if (kVersion >= PROTOCOL_VERSION_MULTIPLEXED)
+            kMux = Multiplexer::create(kControl, Multiplexer::CLIENT, read_resume_answer);
+        else read_resume_answer(*kControl);
+    }
+    catch (const ConnectionException& e) {
+        cerr << "error reconnecting to server: " << e.what() << endl;
+        return false;
+    }
+
+    cout << "Reconnected to " << kControl->identify_remote() << ": resuming the session" << endl;
+    return true;
+}
+
+
+// the server's greeting on a resumed connection, and its answer to the resumption
+void read_resume_answer(Connection& control) {
+    Message hello;
+    Message answer;
+
+    ZERO_MSG(&answer);
+
+    const auto finish = [&answer]() {
+        std::lock_guard<std::mutex> lock(kResumeMutex);
+
+        // an expired session carries on as a new one, with nothing to finish
+        if (answer.msgid == MSGID::MESSAGE_OK) {
+            for (auto& upload : decode_interrupted(answer.payload))
+                kInterrupted[upload.name] = std::move(upload);
+        }
+
+        kResumePending = false;
+        kResumeAnswered.notify_all();
+    };
+
+    try {
+        control.receive(&hello, RESPONSE_TIMEOUT_MS);
+
+        if (hello.msgid != MSGID::MESSAGE_HELLO)
+            throw ConnectionException("server sent incorrect greeting while resuming");
+
+        kSessionToken = hello_field(hello.payload, HELLO_SESSION);
+        control.receive(&answer, RESPONSE_TIMEOUT_MS);
+    }
+    catch (...) {
+        finish();
+        throw;
+    }
+
+    finish();
+}
+
+
+// the parts of filename's upload the server is still missing, if a resumed session left one of
+// size bytes unfinished. Waits for the server's answer to a resumption still on its way
+bool take_interrupted(const string& filename, uint64_t size, InterruptedUpload* upload) {
+    std::unique_lock<std::mutex> lock(kResumeMutex);
+
+    kResumeAnswered.wait(lock, []() { return !kResumePending; });
+
+    const auto it = kInterrupted.find(filename);
+
+    if (it == kInterrupted.end() || it->second.size != size)
+        return false;
+
+    *upload = std::move(it->second);
+    kInterrupted.erase(it);
+
     return true;
 }
 
 
-void handle_ls() {
-    auto msg = MAKE_MSG(MSGID::MESSAGE_LS);
+// sends command and hands the server's response to onResponse, which returns true if data
+// follows. Under v1 the data arrives over a connection the server makes back to us; under v2
+// the command runs on a stream of its own, which carries the response and then the data
+void run_command(Message command, ResponseCallback onResponse, Connection::ConnectionEstablishedCallback onData) {
     Message response; ZERO_MSG(&response);
-    bool bListen = true;
     bool timedOut = false;
 
-    Connection::StopListeningQuery stopListening = [&bListen]() { return !bListen; };
-    Connection::ErrorCallback onError = [](const ConnectionException& ce) { throw ce; return false; };
-    Connection::SocketCreatedCallback onListen = [&msg](const std::string& remoteHost, port_t port) {
-        // let the server know which port to connect to
-        msg.port = port;
-        kControl->send(msg);
+    // from sending the command to the server's answer, labelled with what it's about
+    const auto detail = trace::enabled() ? command.payload.substr(0, command.payload.find('\n')) : string();
+
+    if (kMux) {
+        auto stream = kMux->open_stream();
+        trace::Span responding("respond", detail);
+
+        stream->send(command);
+        stream->receive(&response, RESPONSE_TIMEOUT_MS, &timedOut);
+        responding.end();
+
+        if (timedOut)
+            throw ConnectionException("server response timed out");
+
+        if (onResponse(response))
+            onData(stream);
+
+        return;
+    }
+
+    bool bListen = true;
+
+    Connection::StopListeningQuery stopListening = [&bListen]() {
+        return !bListen;
+    };
+
+    Connection::ErrorCallback onError = [](const ConnectionException& ce) {
+        throw ce; return false;
     };
 
-    Connection::ConnectionEstablishedCallback onEstablished = [&](Connection::Ptr dataChannel) {
+    trace::Clock::time_point responded;
+
+    Connection::SocketCreatedCallback onListen = [&](const std::string& remoteHost, port_t port) {
+        trace::Span responding("respond", detail);
+
+        // once port is listening, we know which port server should connect to
+        command.port = port;
+        kControl->send(command);
+
         // expecting OK or ERROR from server
+        // ERROR would tell us server isn't going to be connecting at all
         kControl->receive(&response, RESPONSE_TIMEOUT_MS, &timedOut);
+        responding.end();
 
         if (timedOut)
             throw ConnectionException("server response timed out");
 
-        switch (response.msgid) {
-            case MSGID::MESSAGE_ERROR:
-                bListen = false;
-                cerr << "error: " << response.to_string() << endl;
-                return;
+        bListen = onResponse(response);
+        responded = trace::Clock::now();
+    };
 
-            case MSGID::MESSAGE_OK:
-                // all good to go
-                break;
+    // the wait for the server to connect back, from its answer on
+    Connection::ConnectionEstablishedCallback onAccepted = [&](Connection::Ptr dataChannel) {
+        trace::record("accept", responded, trace::Clock::now());
+        onData(dataChannel);
+    };
+
+    Connection::welcome(Connection::PORT_ANY, stopListening, onListen, trace::enabled() ? onAccepted : onData, onError, true, CONNECTION_WAIT_TIMEOUT);
+}
+
+
+// true for OK. Errors are reported to the user; anything else is a protocol failure
+bool check_response(const Message& response) {
+    switch (response.msgid) {
+        case MSGID::MESSAGE_ERROR:
+            cerr << "error: " << response.to_string() << endl;
+            return false;
+
+        case MSGID::MESSAGE_OK:
+            // all good to go
+            return true;
 
         default:
             throw ConnectionException(("unexpected server response: " + response.to_string()));
+    }
+}
+
+
+void handle_ls(const vector<string>& args) {
+    uint64_t dataLen = 0;
+
+    if (args.size() > 1) {
+        cerr << "usage: ls [directory]" << endl;
+        return;
+    }
+
+    ResponseCallback onResponse = [&](const Message& response) {
+        if (!check_response(response))
+            return false;
+
+        // short listings arrive with the response: no data to wait for
+        if (response.flags & FLAG_INLINE) {
+            make_header("Listing files on server", response.datalen);
+            cout << response.payload << endl << endl;
+            return false;
         }
 
+        dataLen = response.datalen;
+        return true;
+    };
+
+    Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
         std::stringstream buf;
         NetworkDataStream ds(buf);
 
-        auto bytesLeft = response.datalen;
+        auto bytesLeft = dataLen;
 
         while (bytesLeft > 0) {
             // return value of received is guaranteed to be int or smaller
@@ -241,22 +599,18 @@ void handle_ls() {
             bytesLeft -= received;
         }
 
-        make_header("Listing files on server", response.datalen);
+        make_header("Listing files on server", dataLen);
         cout << buf.str() << endl << endl;
 
         dataChannel->shutdown();
     };
 
-    Connection::welcome(Connection::PORT_ANY, stopListening, onListen, onEstablished, onError, true, CONNECTION_WAIT_TIMEOUT);
+    run_command(MAKE_MSG(MSGID::MESSAGE_LS, args.empty() ? "" : args[0]), onResponse, onData);
 }
 
 
-// note: refactor to remove common connection code
 void handle_get(const string& filename) {
-    auto command = MAKE_MSG(MSGID::MESSAGE_GET, filename);
-    Message response; ZERO_MSG(&response);
-    bool bListen = true;
-    bool timedOut = false;
+    uint64_t dataLen = 0;
     fstream output;
 
     if (fs::exists(filename)) {
@@ -269,41 +623,43 @@ void handle_get(const string& filename) {
     }
 
 
-    Connection::StopListeningQuery stopListening = [&bListen]() { 
-        return !bListen; 
-    };
-
-    Connection::ErrorCallback onError = [](const ConnectionException& ce) {
-        throw ce; return false;
-    };
+    ResponseCallback onResponse = [&](const Message& response) {
+        if (!check_response(response))
+            return false;
 
-    Connection::SocketCreatedCallback onListen = [&](const std::string& remoteHost, port_t port) {
-        command.port = port;
-        kControl->send(command);
+        dataLen = response.datalen;
 
-        // expecting OK or ERROR from server
-        kControl->receive(&response, RESPONSE_TIMEOUT_MS, &timedOut);
+        // the server handed us the file itself
+        if (response.flags & FLAG_DESCRIPTOR) {
+            if (receive_file(filename, dataLen, output))
+                cout << "Received " << filename << " successfully!\n\tCopied " << dataLen << " bytes from the server's file" << endl;
 
-        if (timedOut)
-            throw ConnectionException("server response timed out");
+            return false;
+        }
 
-        switch (response.msgid) {
-            case MSGID::MESSAGE_ERROR:
-                bListen = false;
-                cerr << "error: " << response.to_string() << endl;
-                return;
+        if (!(response.flags & FLAG_INLINE))
+            return true;
 
-            case MSGID::MESSAGE_OK:
-                // all good to go
-                break;
+        // small files arrive with the response: no data to wait for
+        output.open(filename.c_str(), output.binary | output.out | output.trunc);
 
-            default:
-                throw ConnectionException(("unexpected server response: " + response.to_string()));
+        if (!output.good()) {
+            cerr << "Couldn't open " << filename << " for writing" << endl;
+            return false;
         }
+
+        output.write(response.payload.data(), response.payload.size());
+        output.flush();
+
+        if (output.good() && response.payload.size() == response.datalen) {
+            cout << "Received " << filename << " successfully!\n\tTransferred " << response.datalen << " bytes" << endl;
+        } else cerr << "Failed to write " << filename << ": wrote " << response.payload.size() << " of " << response.datalen << " bytes" << endl;
+
+        return false;
     };
 
 
-    Connection::ConnectionEstablishedCallback onEstablished = [&](Connection::Ptr dataChannel) {
+    Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
         output.open(filename.c_str(), output.binary | output.in | output.out | output.trunc);
 
         if (!output.good()) {
@@ -312,9 +668,17 @@ void handle_get(const string& filename) {
         }
 
         NetworkDataStream ds(output);
-        auto bytesLeft = response.datalen;
+        auto bytesLeft = dataLen;
+        trace::Span receiving("receive");
+        trace::Span firstByte("first byte");   // the part of receiving spent waiting for the first of it
 
         try {
+            // received on its own, so the span ends as soon as anything arrives rather than a whole chunk
+            if (bytesLeft > 0)
+                bytesLeft -= static_cast<uint64_t>(dataChannel->receive(ds, 1));
+
+            firstByte.end();
+
             while (bytesLeft > 0) {
                 // return value of received is guaranteed to be int or smaller
                 auto received = static_cast<uint64_t>(dataChannel->receive(ds, bytesLeft > CHUNK_SIZE ? CHUNK_SIZE : static_cast<int>(bytesLeft)));
@@ -328,60 +692,212 @@ void handle_get(const string& filename) {
             cerr << "Error: " << ce.what() << endl;
         }
 
-        const auto bytesReceived = response.datalen - bytesLeft;
+        const auto bytesReceived = dataLen - bytesLeft;
 
         // confirm we got what we expected
         output.flush();
+        receiving.end();
+
+        trace::Span closing("shutdown");
+
         dataChannel->shutdown();
+        closing.end();
 
         if (bytesLeft == 0) {
             cout << "Received " << filename << " successfully!\n\tTransferred " << bytesReceived << " bytes" << endl;
-        } else cerr << "Failed to receive " << filename << ": received " << bytesReceived << " of " << response.datalen << " bytes" << endl;
+        } else cerr << "Failed to receive " << filename << ": received " << bytesReceived << " of " << dataLen << " bytes" << endl;
+    };
+
+
+    run_command(MAKE_MSG(MSGID::MESSAGE_GET, filename), onResponse, onData);
+}
+
+
+// like tail -f: fetches a file from offset, then keeps the channel open and adds what's appended to
+// the file to the local copy as it's written, until the file goes quiet for the idle time (never
+// for 0) or is renamed or removed. From offset 0 the local copy starts over; from further on, it's
+// carried on, so a copy that stopped can catch up again from its own size
+void handle_follow(const vector<string>& arguments) {
+    uint64_t offset = 0;
+    long idleS = FOLLOW_IDLE_S;
+
+    if (arguments.size() < 2 || arguments.size() > 4 ||
+        (arguments.size() > 2 && !(std::istringstream(arguments[2]) >> offset)) ||
+        (arguments.size() > 3 && (!(std::istringstream(arguments[3]) >> idleS) || idleS < 0))) {
+        cerr << "usage: get -f <filename> [offset [idle seconds]]" << endl;
+        return;
+    }
+
+    const auto& filename = arguments[1];
+
+    if (offset == 0 && fs::exists(filename)) {
+        cout << "WARNING: " << filename << " already exists. Overwrite? Y/N" << endl;
+
+        if (!get_yesno()) {
+            cout << "Command cancelled" << endl;
+            return;
+        }
+    }
+
+    ResponseCallback onResponse = [&](const Message& response) {
+        if (!check_response(response))
+            return false;
+
+        if (!(response.flags & FLAG_FOLLOW))
+            throw ConnectionException("server did not follow " + filename);
+
+        return true;
+    };
+
+    Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
+        fstream output(filename.c_str(), fstream::binary | fstream::out | (offset == 0 ? fstream::trunc : fstream::app));
+        uint64_t received = 0;
+
+        if (!output.good()) {
+            cerr << "Couldn't open " << filename << " for writing" << endl;
+            dataChannel->shutdown();
+            return;
+        }
+
+        cout << "Following " << filename << " from byte " << offset << ": " <<
+            (idleS > 0 ? "until it goes " + std::to_string(idleS) + " seconds without growing" : string("until it's renamed or removed")) << endl;
+
+        auto lease = BufferPool::shared().acquire();
+
+        try {
+            int got;
+
+            // the end of the data is the end of the follow
+            while ((got = dataChannel->transport().receive(lease.data(), static_cast<int>(lease.size()), Connection::TIMEOUT_NEVER, nullptr)) > 0) {
+                output.write(lease.data(), got);
+                output.flush();
+
+                received += static_cast<uint64_t>(got);
+            }
+        }
+        catch (const ConnectionException& ce) {
+            cerr << "Following " << filename << " failed: " << ce.what() << endl;
+        }
+
+        dataChannel->shutdown();
+
+        if (!output.good())
+            cerr << "Failed to write " << filename << endl;
+
+        cout << "Stopped following " << filename << "\n\tTransferred " << received << " bytes, up to byte " << offset + received << endl;
     };
 
+    run_command(MAKE_MSG(MSGID::MESSAGE_GET, filename + "\nfollow " + std::to_string(offset) + " " + std::to_string(idleS * 1000)), onResponse, onData);
+}
+
+
+// takes the descriptor the server passes after an OK with FLAG_DESCRIPTOR and copies dataLen bytes
+// of the file it refers to straight into filename
+bool receive_file(const string& filename, uint64_t dataLen, fstream& output) {
+#ifndef WIN32
+    int fd = -1;
+    string payload;
+
+    // the descriptor has to be collected whatever happens, or the control connection is out of step
+    if (!receive_fd(kControl->transport().native_handle(), &fd, &payload) || fd < 0)
+        throw ConnectionException("server did not pass a descriptor for " + filename);
+
+    output.open(filename.c_str(), output.binary | output.out | output.trunc);
+
+    if (!output.good()) {
+        cerr << "Couldn't open " << filename << " for writing" << endl;
+        ::close(fd);
+        return false;
+    }
+
+    bool ok = true;
+    uint64_t copied = 0;
+
+    // read rather than mapped: the file can be truncated under us by whoever else has it open, which
+    // reading sees as an early end but would fault a mapping
+    if (dataLen > 0) {
+        auto lease = BufferPool::shared().acquire();
+
+        posix_fadvise(fd, 0, static_cast<off_t>(dataLen), POSIX_FADV_SEQUENTIAL);
+
+        while (copied < dataLen) {
+            const auto got = ::pread(fd, lease.data(), static_cast<size_t>(std::min<uint64_t>(dataLen - copied, lease.size())), static_cast<off_t>(copied));
+
+            if (got < 0 && errno == EINTR)
+                continue;
 
-    Connection::welcome(Connection::PORT_ANY, stopListening, onListen, onEstablished, onError, true);
+            if (got <= 0) {
+                if (got < 0)
+                    cerr << "Failed to read " << filename << ": " << strerror(errno) << endl;
+                else cerr << "Failed to receive " << filename << ": the server's file shrank to " << copied << " of " << dataLen << " bytes" << endl;
+
+                ok = false;
+                break;
+            }
+
+            output.write(lease.data(), got);
+            copied += static_cast<uint64_t>(got);
+        }
+    }
+
+    ::close(fd);
+    output.flush();
+
+    if (ok && !output.good()) {
+        cerr << "Failed to write " << filename << endl;
+        ok = false;
+    }
+
+    return ok;
+#else
+    throw ConnectionException("server passed a descriptor, which this platform can't receive");
+#endif
 }
 
 
-void handle_put(const string& filename) {
-	Connection::Ptr dataChannel;
+void handle_put(const vector<string>& arguments) {
+	if (arguments.empty() || arguments.size() > 2) {
+        cerr << "usage: put <filename> [streams]" << endl;
+        return;
+	}
+
+	const string& filename = arguments[0];
 	auto command = MAKE_MSG(MSGID::MESSAGE_PUT, filename);
-	Message response; ZERO_MSG(&response);
 	fstream input;
 	fs::path filePath(filename);
 	std::streampos fileSize = 0;
-	bool bListen = true;
-	bool timedOut = false;
+	int streams = 1;
 
-	// first check for failure scenarios:
-	// did they actually specify a filename?
-	if (filename.empty()) {
-		response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
-        cerr << "error: filename required" << endl;
-        return;
+	if (arguments.size() == 2) {
+        try {
+            streams = std::max(1, std::min(PUT_MAX_STREAMS, std::stoi(arguments[1])));
+        } catch (...) {
+            cerr << "'" << arguments[1] << "' is not a number of streams" << endl;
+            return;
+        }
 	}
 
+	// first check for failure scenarios:
 	// did they try to use some kind of path (not allowed for now)
 	if (filename.find('/') != std::string::npos || filename.find('\\') != std::string::npos) {
-		cerr << "'" << filename << "' contains a path which is not permitted";
+		cerr << "'" << filename << "' contains a path which is not permitted" << endl;
 		return;
 	}
 
 	// does their filename exist?
 	if (!fs::exists(fs::path(filename))) {
-		cerr << "File '" << filename << "' not found";
+		cerr << "File '" << filename << "' not found" << endl;
 		return;
 	}
 
 	// did they specify something that isn't a file?
 	if (!fs::is_regular_file(filePath)) {
-		cerr << "'" << filename << "' is not a file - only files may be sent with this command";
+		cerr << "'" << filename << "' is not a file - only files may be sent with this command" << endl;
 		return;
 	}
 
 
-    input.open(filename.c_str(), input.binary | input.in | input.out );
+    input.open(filename.c_str(), input.binary | input.in);
 
 	if (!input.good() || !input.is_open()) {
         cerr << "Failed to open '" << filename << "'" << endl;
@@ -401,72 +917,836 @@ void handle_put(const string& filename) {
 		cerr << "Unable to determine length of '" << filename << "'" << endl;
         return;
 	}
-	
 
-    // file is open, all checks on client-side have passed: prepare to send the file
+    // v1 has one control connection, and it can only carry one command at a time
+    if (!kMux && streams > 1) {
+        cout << "Protocol v1 session: sending the file over one connection" << endl;
+        streams = 1;
+    }
 
-	Connection::StopListeningQuery stopListening = [&bListen]() { 
-        return !bListen; 
-    };
+    const auto total = static_cast<uint64_t>(fileSize);
+    vector<std::pair<uint64_t, uint64_t>> ranges;
+    InterruptedUpload interrupted;
 
-	Connection::ErrorCallback onError = [](const ConnectionException& ce) {
-		throw ce; return false;
-	};
+    // the server kept what arrived before the connection dropped: only the gaps need sending
+    if (kMux && take_interrupted(filename, total, &interrupted)) {
+        uint64_t left = 0;
 
-	Connection::SocketCreatedCallback onListen = [&](const std::string& remoteHost, port_t port) {
-        // once port is listening, we know which port server should connect to
-		command.port = port;
-        kControl->send(command);
+        for (const auto& gap : interrupted.missing)
+            left += gap.second;
 
-        // expecting OK or ERROR from server
-        // ERROR would tell us server isn't going to be connecting at all
-        kControl->receive(&response, RESPONSE_TIMEOUT_MS, &timedOut);
+        cout << "Resuming upload of '" << filename << "': " << left << " of " << total << " bytes left" << endl;
+        ranges = interrupted.missing;
+    } else {
+        streams = static_cast<int>(std::max<uint64_t>(1, std::min<uint64_t>(streams, total / PUT_MIN_RANGE)));
 
-        if (timedOut)
-            throw ConnectionException("server response timed out");
+        const uint64_t rangeLen = (total + streams - 1) / streams;
 
-        switch (response.msgid) {
-            case MSGID::MESSAGE_ERROR:
-                bListen = false;
-                cerr << response.to_string() << endl;
-                return;
+        for (int i = 0; streams > 1 && i < streams; ++i)
+            ranges.emplace_back(i * rangeLen, std::min(rangeLen, total - i * rangeLen));
+    }
 
-            case MSGID::MESSAGE_OK:
-                // all good to go
-                break;
+    // each range is a PUT on a stream of its own. The server writes them into one hidden file as
+    // they arrive, and puts it in place once the last is in
+    if (!ranges.empty()) {
+        input.close();
+
+        const auto start = std::chrono::steady_clock::now();
+        std::mutex failedMutex;
+        vector<string> failed;
+        vector<std::thread> threads;
+        uint64_t sending = 0;
+
+        for (const auto& range : ranges) {
+            sending += range.second;
+
+            threads.emplace_back([&, range]() {
+                string failure;
+
+                try {
+                    if (put_range(filename, range.first, range.second, total, &failure))
+                        return;
+                } catch (const std::exception& e) {
+                    failure = e.what();
+                }
+
+                std::lock_guard<std::mutex> lock(failedMutex);
+                failed.push_back("bytes " + std::to_string(range.first) + "+: " + failure);
+            });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+
+        for (const auto& failure : failed)
+            cerr << "error: " << failure << endl;
 
-            default:
-                throw ConnectionException(("unexpected server response: " + response.to_string()));
+        if (failed.empty()) {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            const double seconds = std::max<long long>(elapsed, 1) / 1000.0;
+
+            cout << "Successfully transferred '" << filename << "' to server: " << sending << " bytes over " << ranges.size() << " streams in "
+                 << elapsed << " ms (" << static_cast<uint64_t>(sending / (1024.0 * 1024.0) / seconds) << " MB/s)" << endl;
         }
+
+        return;
+    }
+
+    // file is open, all checks on client-side have passed: prepare to send the file
+
+	ResponseCallback onResponse = [](const Message& response) {
+        return check_response(response);
 	};
 
 
-	Connection::ConnectionEstablishedCallback onEstablished = [&](Connection::Ptr dataChannel) {
+	Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
 		// now actually stream the data over to the server. Connection handles splitting
 		// this in chunks for us
 		NetworkDataStream stream(input);
 
 		const auto bytesSent = dataChannel->send(stream);
 
-		dataChannel->shutdown();
-
-		// that's it, just make sure we sent everything and let the data connection close
 		if (bytesSent != fileSize) {
 			cout << "Transmission incomplete! Sent " << bytesSent << " bytes of " << fileSize << " bytes to " << dataChannel->identify_remote() << endl;
+			dataChannel->shutdown();
+			return;
+		}
+
+		// the file only appears on the server once it's all there: v2 says so on the stream, and a
+		// v1 data channel is closed from the far end
+		Message confirmation = MAKE_MSG(MSGID::MESSAGE_OK);
+
+		if (kMux) {
+			dataChannel->receive(&confirmation, RESPONSE_TIMEOUT_MS);
+		} else {
+			char eof;
+			dataChannel->transport().shutdown_send();
+			dataChannel->transport().receive(&eof, 1, RESPONSE_TIMEOUT_MS, nullptr);
 		}
-		else cout << "Successfully sent transferred '" << filename << "' to server: " << bytesSent << " bytes were sent" << endl;
+
+		dataChannel->shutdown();
+
+		if (confirmation.msgid != MSGID::MESSAGE_OK)
+			cerr << "error: " << confirmation.to_string() << endl;
+		else cout << "Successfully transferred '" << filename << "' to server: " << bytesSent << " bytes were sent" << endl;
 	};
 
     // callbacks are set up, now kick off actual operation
-	Connection::welcome(Connection::PORT_ANY, stopListening, onListen, onEstablished, onError, true, CONNECTION_WAIT_TIMEOUT);
+	run_command(command, onResponse, onData);
+}
+
+
+// PUTs len bytes of filename from offset, as one range of a parallel upload over its own stream.
+// Returns false, giving the reason, if the server didn't confirm it
+bool put_range(const string& filename, uint64_t offset, uint64_t len, uint64_t total, string* failure) {
+    auto stream = kMux->open_stream();
+    auto command = MAKE_MSG(MSGID::MESSAGE_PUT, filename + "\n" + std::to_string(offset) + " " + std::to_string(total));
+    Message response; ZERO_MSG(&response);
+    std::ifstream input(filename, std::ios::binary);
+
+    command.datalen = len;
+    input.seekg(static_cast<std::streamoff>(offset));
+
+    if (!input.good()) {
+        *failure = "failed to read '" + filename + "'";
+        return false;
+    }
+
+    stream->send(command);
+    stream->receive(&response, RESPONSE_TIMEOUT_MS);
+
+    if (response.msgid != MSGID::MESSAGE_OK) {
+        *failure = response.to_string();
+        return false;
+    }
+
+    auto lease = BufferPool::shared().acquire();
+
+    for (uint64_t left = len; left > 0;) {
+        const auto want = static_cast<size_t>(std::min<uint64_t>(left, lease.size()));
+
+        // shrunk since it was measured: ending the stream early tells the server to give up on the file
+        if (!input.read(lease.data(), want)) {
+            stream->shutdown();
+            *failure = "'" + filename + "' changed while it was being sent";
+            return false;
+        }
+
+        for (size_t sent = 0; sent < want;)
+            sent += stream->transport().send(lease.data() + sent, static_cast<int>(want - sent));
+
+        left -= want;
+    }
+
+    // confirmed once the range is written, or, for the range that completes the file, once it's in place
+    ZERO_MSG(&response);
+    stream->receive(&response, RESPONSE_TIMEOUT_MS);
+    stream->shutdown();
+
+    if (response.msgid != MSGID::MESSAGE_OK) {
+        *failure = response.to_string();
+        return false;
+    }
+
+    return true;
+}
+
+
+// fetches every file matching patterns over one data channel. Files that already exist here are
+// left alone, since there may be too many to ask about one by one
+void handle_mget(const vector<string>& patterns) {
+    if (patterns.empty()) {
+        cerr << "error: at least one file name or pattern required" << endl;
+        return;
+    }
+
+    string payload;
+
+    for (const auto& pattern : patterns)
+        payload += (payload.empty() ? "" : "\n") + pattern;
+
+    if (payload.length() > MAX_PAYLOAD_LEN) {
+        cerr << "error: too many names; use a pattern that matches them" << endl;
+        return;
+    }
+
+    string fileCount;
+
+    ResponseCallback onResponse = [&](const Message& response) {
+        if (!check_response(response))
+            return false;
+
+        fileCount = response.payload;
+        return true;
+    };
+
+    Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
+        BundleFilter accept = [](const BundleEntry& entry, std::string* reason) {
+            if (!fs::exists(entry.name))
+                return true;
+
+            *reason = "already exists here, skipped";
+            return false;
+        };
+
+        const auto result = receive_bundle(*dataChannel, "", accept, RESPONSE_TIMEOUT_MS);
+
+        dataChannel->shutdown();
+
+        make_header("Received " + std::to_string(result.files) + " of " + fileCount + " files", result.bytes);
+
+        for (const auto& failure : result.failed)
+            cerr << "\t" << failure << endl;
+    };
+
+    run_command(MAKE_MSG(MSGID::MESSAGE_MGET, payload), onResponse, onData);
+}
+
+
+// sends every local file matching patterns over one data channel
+void handle_mput(const vector<string>& patterns) {
+    vector<string> names;
+
+    for (const auto& pattern : patterns) {
+        if (pattern.find('/') != std::string::npos || pattern.find('\\') != std::string::npos) {
+            cerr << "'" << pattern << "' contains a path which is not permitted" << endl;
+            return;
+        }
+    }
+
+#if WIN32
+    for (const auto& item : fs::_Directory_iterator<true_type>(fs::current_path())) {
+#else
+    for (const auto& item : fs::directory_iterator(fs::current_path())) {
+#endif
+        if (!fs::is_regular_file(item))
+            continue;
+
+        const auto name = item.path().filename().string();
+
+        if (std::any_of(patterns.cbegin(), patterns.cend(), [&name](const string& pattern) { return glob_match(pattern.c_str(), name.c_str()); }))
+            names.push_back(name);
+    }
+
+    if (names.empty()) {
+        cerr << "No files match" << endl;
+        return;
+    }
+
+    std::sort(names.begin(), names.end());
+
+    string payload;
+    uint64_t dataLen = BUNDLE_HEADER_LEN;
+    std::error_code ec;
+
+    for (const auto& name : names) {
+        payload += (payload.empty() ? "" : "\n") + name;
+        dataLen += bundle_entry_len(name, fs::file_size(name, ec));
+    }
+
+    // the payload is only for the server's log, so it needn't name every file
+    if (payload.length() > MAX_PAYLOAD_LEN)
+        payload = std::to_string(names.size()) + " files";
+
+    auto command = MAKE_MSG(MSGID::MESSAGE_MPUT, payload);
+    command.datalen = dataLen;
+
+    ResponseCallback onResponse = [](const Message& response) {
+        return check_response(response);
+    };
+
+    Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
+        BundleWriter writer(*dataChannel);
+
+        for (const auto& name : names) {
+            if (!writer.add(name, name))
+                cerr << "\tCouldn't read " << name << ", skipped" << endl;
+        }
+
+        writer.finish();
+
+        // the server answers once everything it was sent has been written, naming what it couldn't write
+        Message summary; ZERO_MSG(&summary);
+        bool timedOut = false;
+
+        dataChannel->receive(&summary, RESPONSE_TIMEOUT_MS, &timedOut);
+        dataChannel->shutdown();
+
+        make_header("Sent " + std::to_string(writer.files()) + " of " + std::to_string(names.size()) + " files", writer.bytes());
+
+        if (timedOut || summary.msgid != MSGID::MESSAGE_OK) {
+            cerr << "error: " << (timedOut ? "the server didn't say which files it wrote" : summary.to_string()) << endl;
+            return;
+        }
+
+        if (summary.datalen < writer.files())
+            cerr << "The server wrote " << summary.datalen << " of them:" << endl;
+
+        std::stringstream failures(summary.payload);
+        string failure;
+
+        while (std::getline(failures, failure)) {
+            if (!failure.empty())
+                cerr << "\t" << failure << endl;
+        }
+    };
+
+    run_command(command, onResponse, onData);
+}
+
+
+// fetches a directory tree from the server: its manifest first, then every file in it, several at
+// a time over protocol v2, largest first so one big file left until last doesn't hold up the finish.
+// Files that already exist here are left alone
+void handle_rget(const vector<string>& arguments) {
+    if (arguments.empty() || arguments.size() > 2) {
+        cerr << "usage: rget <directory> [workers]    ('.' for everything on the server)" << endl;
+        return;
+    }
+
+    const string root = arguments[0] == "." ? "" : arguments[0];
+    int workers = RGET_DEFAULT_WORKERS;
+
+    if (arguments.size() == 2) {
+        try {
+            workers = std::max(1, std::min(RGET_MAX_WORKERS, std::stoi(arguments[1])));
+        } catch (...) {
+            cerr << "'" << arguments[1] << "' is not a number of workers" << endl;
+            return;
+        }
+    }
+
+    // v1 has one control connection, and it can only carry one command at a time
+    if (!kMux && workers > 1) {
+        cout << "Protocol v1 session: fetching one file at a time" << endl;
+        workers = 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    string manifest;
+    uint64_t dataLen = 0;
+    bool listed = false;
+
+    ResponseCallback onResponse = [&](const Message& response) {
+        if (!check_response(response))
+            return false;
+
+        listed = true;
+
+        if (response.flags & FLAG_INLINE) {
+            manifest = response.payload;
+            return false;
+        }
+
+        dataLen = response.datalen;
+        return true;
+    };
+
+    Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
+        std::stringstream buf(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+        NetworkDataStream ds(buf);
+        auto bytesLeft = dataLen;
+
+        while (bytesLeft > 0)
+            bytesLeft -= static_cast<uint64_t>(dataChannel->receive(ds, bytesLeft > CHUNK_SIZE ? CHUNK_SIZE : static_cast<int>(bytesLeft)));
+
+        manifest = buf.str();
+        dataChannel->shutdown();
+    };
+
+    run_command(MAKE_MSG(MSGID::MESSAGE_TREE, root), onResponse, onData);
+
+    if (!listed)
+        return;
+
+    vector<TreeEntry> entries;
+
+    try {
+        entries = decode_manifest(manifest);
+    } catch (const ConnectionException& e) {
+        cerr << "error: " << e.what() << endl;
+        return;
+    }
+
+    vector<TreeEntry> files;
+    uint64_t skipped = 0;
+    std::error_code ec;
+
+    for (const auto& entry : entries) {
+        if (entry.type == TreeEntry::DIRECTORY) {
+            fs::create_directories(entry.path, ec);
+        } else if (fs::exists(entry.path)) {
+            ++skipped;
+        } else files.push_back(entry);
+    }
+
+    std::stable_sort(files.begin(), files.end(), [](const TreeEntry& lhs, const TreeEntry& rhs) { return lhs.size > rhs.size; });
+
+    std::atomic<size_t> next(0);
+    std::atomic<uint64_t> received(0);
+    std::atomic<uint64_t> bytes(0);
+    std::mutex failedMutex;
+    vector<string> failed;
+    vector<std::thread> threads;
+
+    const auto work = [&]() {
+        for (size_t i = next++; i < files.size(); i = next++) {
+            uint64_t fileBytes = 0;
+            string failure;
+
+            try {
+                if (fetch_file(files[i].path, &fileBytes, &failure)) {
+                    ++received;
+                    bytes += fileBytes;
+                    continue;
+                }
+            } catch (const std::exception& e) {
+                failure = e.what();
+            }
+
+            std::lock_guard<std::mutex> lock(failedMutex);
+            failed.push_back(files[i].path + ": " + failure);
+        }
+    };
+
+    for (int i = 1; i < workers; ++i) {
+        threads.emplace_back([&]() {
+            trace::name_thread("rget worker");
+            work();
+        });
+    }
+
+    work();
+
+    for (auto& thread : threads)
+        thread.join();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    const double seconds = std::max<long long>(elapsed, 1) / 1000.0;
+
+    make_header("Received " + std::to_string(received.load()) + " of " + std::to_string(files.size()) + " files", bytes.load());
+    cout << "\tCompleted in " << elapsed << " ms with " << workers << (workers == 1 ? " worker: " : " workers: ")
+         << static_cast<uint64_t>(bytes.load() / (1024.0 * 1024.0) / seconds) << " MB/s, " << static_cast<uint64_t>(received.load() / seconds) << " files/s" << endl;
+
+    if (skipped > 0)
+        cout << "\t" << skipped << " files already here were skipped" << endl;
+
+    for (const auto& failure : failed)
+        cerr << "\t" << failure << endl;
+}
+
+
+// GETs path into the same path here without asking anything: rget's workers call this at once.
+// Returns false, giving the reason, if the file didn't arrive whole
+bool fetch_file(const string& path, uint64_t* bytes, string* failure) {
+    uint64_t dataLen = 0;
+    fstream output;
+
+    const auto open_output = [&]() {
+        output.open(path.c_str(), output.binary | output.out | output.trunc);
+
+        if (!output.good())
+            *failure = "couldn't open for writing";
+
+        return output.good();
+    };
+
+    ResponseCallback onResponse = [&](const Message& response) {
+        if (response.msgid != MSGID::MESSAGE_OK) {
+            *failure = response.to_string();
+            return false;
+        }
+
+        dataLen = response.datalen;
+
+        if (response.flags & FLAG_DESCRIPTOR) {
+            if (receive_file(path, dataLen, output))
+                *bytes = dataLen;
+            else *failure = "couldn't copy the server's file";
+
+            return false;
+        }
+
+        if (!(response.flags & FLAG_INLINE))
+            return true;
+
+        if (open_output()) {
+            output.write(response.payload.data(), response.payload.size());
+            output.flush();
+
+            if (output.good())
+                *bytes = response.payload.size();
+            else *failure = "failed to write";
+        }
+
+        return false;
+    };
+
+    Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
+        if (!open_output()) {
+            dataChannel->shutdown();
+            return;
+        }
+
+        NetworkDataStream ds(output);
+        auto bytesLeft = dataLen;
+        trace::Span receiving("receive");
+        trace::Span firstByte("first byte");   // the part of receiving spent waiting for the first of it
+
+        // as in handle_get: on its own, so the span ends as soon as anything arrives
+        if (bytesLeft > 0)
+            bytesLeft -= static_cast<uint64_t>(dataChannel->receive(ds, 1));
+
+        firstByte.end();
+
+        while (bytesLeft > 0)
+            bytesLeft -= static_cast<uint64_t>(dataChannel->receive(ds, bytesLeft > CHUNK_SIZE ? CHUNK_SIZE : static_cast<int>(bytesLeft)));
+
+        output.flush();
+        receiving.end();
+
+        trace::Span closing("shutdown");
+
+        dataChannel->shutdown();
+        closing.end();
+
+        if (output.good())
+            *bytes = dataLen;
+        else *failure = "failed to write";
+    };
+
+    run_command(MAKE_MSG(MSGID::MESSAGE_GET, path), onResponse, onData);
+
+    return failure->empty() && *bytes == dataLen;
+}
+
+
+// copies or moves a file on the server, without it coming here and going back
+void handle_copy(MSGID command, const vector<string>& arguments) {
+    if (arguments.size() != 2) {
+        cerr << "usage: " << (command == MSGID::MESSAGE_COPY ? "copy" : "move") << " <source> <destination>" << endl;
+        return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+
+    run_control_command(MAKE_MSG(command, arguments[0] + "\n" + arguments[1]), [&](const Message& response) {
+        if (!check_response(response))
+            return false;
+
+        if (response.flags & FLAG_PROGRESS) {
+            cout << "\t" << response.datalen / (1024 * 1024) << " of " << std::stoull(response.payload) / (1024 * 1024) << " MB done" << endl;
+            return true;
+        }
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+        cout << arguments[0] << " " << response.payload << " to " << arguments[1] << " (" << response.datalen << " bytes) in " << elapsed << " ms" << endl;
+        return false;
+    });
+}
+
+
+// size, modification time and type (and checksum, with -c) of each name, in one round trip
+void handle_stat(const vector<string>& arguments) {
+    const bool wantCrc = !arguments.empty() && arguments.front() == "-c";
+    const vector<string> names(arguments.begin() + (wantCrc ? 1 : 0), arguments.end());
+
+    if (names.empty()) {
+        cerr << "usage: stat [-c] <name> [name...]" << endl;
+        return;
+    }
+
+    const auto request = encode_stat_request(names, wantCrc ? STAT_WANT_CRC : 0);
+    auto command = MAKE_MSG(MSGID::MESSAGE_STAT);
+    string entries;
+    uint64_t dataLen = 0;
+    bool answered = false;
+
+    // a long list goes as data, which the server asks for with an OK of its own
+    if (request.length() <= MAX_PAYLOAD_LEN)
+        command.payload = request;
+    else command.datalen = request.length();
+
+    ResponseCallback onResponse = [&](const Message& response) {
+        if (!check_response(response))
+            return false;
+
+        if (response.flags & FLAG_INLINE) {
+            entries = response.payload;
+            answered = true;
+            return false;
+        }
+
+        dataLen = response.datalen;
+        return true;
+    };
+
+    Connection::ConnectionEstablishedCallback onData = [&](Connection::Ptr dataChannel) {
+        if (command.datalen > 0) {
+            for (size_t sent = 0; sent < request.length();)
+                sent += dataChannel->transport().send(request.data() + sent, static_cast<int>(request.length() - sent));
+
+            // the answer is announced where the command was sent
+            Message response;
+            bool timedOut = false;
+
+            (kMux ? dataChannel : kControl)->receive(&response, RESPONSE_TIMEOUT_MS, &timedOut);
+
+            if (timedOut)
+                throw ConnectionException("server response timed out");
+
+            if (!check_response(response)) {
+                dataChannel->shutdown();
+                return;
+            }
+
+            dataLen = response.datalen;
+        }
+
+        std::stringstream buf(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+        NetworkDataStream ds(buf);
+        auto bytesLeft = dataLen;
+
+        while (bytesLeft > 0)
+            bytesLeft -= static_cast<uint64_t>(dataChannel->receive(ds, bytesLeft > CHUNK_SIZE ? CHUNK_SIZE : static_cast<int>(bytesLeft)));
+
+        entries = buf.str();
+        answered = true;
+        dataChannel->shutdown();
+    };
+
+    run_command(command, onResponse, onData);
+
+    if (!answered)
+        return;
+
+    const auto stats = decode_stats(entries, names.size());
+    const char* types[] = { "missing", "file", "directory", "other" };
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        const auto& stat = stats[i];
+
+        cout << std::left << std::setw(10) << types[stat.type];
+
+        if (stat.type != STAT_MISSING) {
+            const auto seconds = static_cast<std::time_t>(stat.mtimeNs / 1000000000ull);
+            char when[32] = "";
+
+            std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", std::localtime(&seconds));
+            cout << std::right << std::setw(14) << stat.size << "  " << when;
+
+            if (stat.flags & STAT_HAS_CRC)
+                cout << "  " << std::hex << std::setw(8) << std::setfill('0') << stat.crc << std::dec << std::setfill(' ');
+        }
+
+        cout << "  " << names[i] << endl;
+    }
+}
+
+
+// sends a command that involves no data channel and hands every response to onMessage until it
+// returns false: some commands report progress before their final response
+void run_control_command(const Message& command, std::function<bool(const Message&)> onMessage) {
+    auto channel = kMux ? kMux->open_stream() : kControl;
+    Message response;
+    bool timedOut = false;
+
+    channel->send(command);
+
+    do {
+        channel->receive(&response, RESPONSE_TIMEOUT_MS, &timedOut);
+
+        if (timedOut)
+            throw ConnectionException("server response timed out");
+    } while (onMessage(response));
+
+    if (kMux)
+        channel->shutdown();
+}
+
+
+// the rest of the command line, split on whitespace
+vector<string> read_arguments() {
+    string line;
+    string word;
+    vector<string> words;
+
+    std::getline(cin, line);
+
+    std::istringstream input(line);
+
+    while (input >> word)
+        words.push_back(word);
+
+    return words;
+}
+
+
+// starts a watch on the server's directory, or with "off" stops it. Changes are printed as they
+// arrive, between commands or in the middle of one
+void handle_watch(const vector<string>& arguments) {
+    if (arguments.size() > 1 || (arguments.size() == 1 && arguments[0] != "off")) {
+        cerr << "usage: watch [off]" << endl;
+        return;
+    }
+
+    if (!arguments.empty()) {
+        if (!kWatch)
+            cout << "Not watching" << endl;
+
+        stop_watch();
+        return;
+    }
+
+    if (!kMux) {
+        cerr << "error: watching needs a protocol v2 session" << endl;
+        return;
+    }
+
+    if (kWatch) {
+        std::lock_guard<std::mutex> lock(kWatch->mutex);
+
+        if (!kWatch->over) {
+            cout << "Already watching" << endl;
+            return;
+        }
+    }
+
+    auto watch = std::make_shared<Watch>();
+    Message response; ZERO_MSG(&response);
+
+    watch->stream = kMux->open_stream();
+    watch->stream->send(MAKE_MSG(MSGID::MESSAGE_WATCH));
+    watch->stream->receive(&response, RESPONSE_TIMEOUT_MS);
+
+    if (response.msgid != MSGID::MESSAGE_OK) {
+        cerr << "error: " << response.to_string() << endl;
+        watch->stream->shutdown();
+        return;
+    }
+
+    kWatch = watch;
+    cout << "Watching the server's files: changes are shown as they happen ('watch off' to stop)" << endl;
+
+    std::thread([watch]() {
+        try {
+            while (true) {
+                Message event;
+
+                watch->stream->receive(&event);
+
+                // anything else is the watch over: stopped from here, or by the server
+                if (event.msgid != MSGID::MESSAGE_OK || !(event.flags & FLAG_EVENT)) {
+                    std::lock_guard<std::mutex> lock(watch->mutex);
+
+                    if (event.msgid != MSGID::MESSAGE_OK)
+                        sync_cerr.print("watch failed: ", event.to_string(), sync_endl);
+                    else if (!watch->stopping)
+                        sync_cout.print("[watch] ended by the server: run watch again to carry on", sync_endl);
+                    break;
+                }
+
+                std::istringstream lines(event.payload);
+                string line;
+
+                while (std::getline(lines, line)) {
+                    if (line == "overflow")
+                        sync_cout.print("[watch] too many changes to follow: list the files again", sync_endl);
+                    else sync_cout.print("[watch] ", line, sync_endl);
+                }
+            }
+        }
+        catch (const ConnectionException&) {
+            // the connection has gone, and the watch with it
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(watch->mutex);
+
+            watch->over = true;
+            watch->ended.notify_all();
+        }
+
+        // only once over is set: until then stop_watch may be finishing our side of the stream
+        watch->stream->shutdown();
+    }).detach();
+}
+
+
+// asks the server to end the watch, and waits for it to say it has
+void stop_watch() {
+    if (!kWatch)
+        return;
+
+    std::unique_lock<std::mutex> lock(kWatch->mutex);
+
+    if (!kWatch->over) {
+        kWatch->stopping = true;
+        kWatch->stream->transport().shutdown_send();
+
+        if (kWatch->ended.wait_for(lock, std::chrono::milliseconds(RESPONSE_TIMEOUT_MS), [&]() { return kWatch->over; }))
+            cout << "Stopped watching" << endl;
+    }
+
+    lock.unlock();
+    kWatch = nullptr;
 }
 
 
 void handle_quit() {
+    stop_watch();
+
     // let server know we're done
     const auto msg = MAKE_MSG(MSGID::MESSAGE_QUIT, "Goodbye!");
-    kControl->send(msg);
-    kControl->shutdown();
+
+    if (kMux) {
+        kMux->open_stream()->send(msg);
+        kMux->close();
+    } else {
+        kControl->send(msg);
+        kControl->shutdown();
+    }
 }
 
 
@@ -486,11 +1766,19 @@ inline string getExe(const char* str) {
 
 #undef max
 
-bool parse_arguments(int argc, const char** argv, string& address, port_t& port) {
+bool parse_arguments(int argc, const char** argv, string& address, port_t& port, string& localPath) {
     string serverAddress;
     string serverPort;
     auto iPort = std::stoi("0"); // decltype only available in C++17
 
+#ifndef WIN32
+    // a lone argument is the path of a server's local socket (FTP_LOCAL_SOCKET)
+    if (argc == 2) {
+        localPath = *(argv + 1);
+        return !localPath.empty();
+    }
+#endif
+
     if (argc != 3) goto print_usage;
 
     serverAddress = *(argv + 1);
@@ -521,6 +1809,9 @@ bool parse_arguments(int argc, const char** argv, string& address, port_t& port)
 
 print_usage:
     cerr << "Usage: " << getExe(*argv) << " <server machine> <server port>" << endl;
+#ifndef WIN32
+    cerr << "       " << getExe(*argv) << " <server local socket path>" << endl;
+#endif
     return false;
 }
 
@@ -0,0 +1,76 @@
+#pragma once
+#include <iostream>
+#include <streambuf>
+#include <stddef.h>
+
+namespace connection {
+
+    // streambuf over a caller-owned, fixed-size buffer. Reads see only what has been written
+    // (the first filled bytes count as written); writing past the end fails the stream rather
+    // than growing it
+    class ArrayStreamBuf : public std::streambuf {
+        public:
+            ArrayStreamBuf(char* data, size_t size, size_t filled = 0) {
+                setp(data, data + size);
+                setg(data, data, data);
+                pbump(static_cast<int>(filled));
+            }
+
+            size_t written() const { return static_cast<size_t>(pptr() - pbase()); }
+
+        protected:
+            int_type underflow() override {
+                if (gptr() < pptr()) {
+                    setg(eback(), gptr(), pptr());
+                    return traits_type::to_int_type(*gptr());
+                }
+
+                return traits_type::eof();
+            }
+
+            pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+                const bool in = (which & std::ios_base::in) != 0;
+                const bool out = (which & std::ios_base::out) != 0;
+                off_type base = 0;
+
+                if (in == out)
+                    return pos_type(off_type(-1)); // moving both at once is ambiguous, same as stringbuf
+
+                if (dir == std::ios_base::cur)
+                    base = out ? pptr() - pbase() : gptr() - eback();
+                else if (dir == std::ios_base::end)
+                    base = out ? epptr() - pbase() : pptr() - eback();
+
+                const off_type pos = base + off;
+
+                if (pos < 0 || pos > (out ? epptr() - pbase() : pptr() - eback()))
+                    return pos_type(off_type(-1));
+
+                if (out) {
+                    setp(pbase(), epptr());
+                    pbump(static_cast<int>(pos));
+                } else setg(eback(), eback() + pos, pptr());
+
+                return pos_type(pos);
+            }
+
+            pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+                return seekoff(off_type(pos), std::ios_base::beg, which);
+            }
+    };
+
+
+    // iostream over a fixed buffer, for NetworkDataStream to encode and decode
+    // messages without the heap allocations a stringstream makes
+    class ArrayStream : public std::iostream {
+        ArrayStreamBuf buf_;
+
+        public:
+            ArrayStream(char* data, size_t size, size_t filled = 0) : std::iostream(nullptr), buf_(data, size, filled) {
+                rdbuf(&buf_);
+            }
+
+            size_t written() const { return buf_.written(); }
+    };
+
+} // end connection namespace
@@ -0,0 +1,127 @@
+#include "stdafx.h"
+#include <stdlib.h>
+#include "BufferPool.h"
+#include "Metrics.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+
+namespace connection {
+    static_assert(BufferPool::BUFFER_SIZE % BufferPool::ALIGNMENT == 0, "buffers must tile arenas without breaking alignment");
+    static_assert(BufferPool::ARENA_SIZE % BufferPool::BUFFER_SIZE == 0, "arenas must hold a whole number of buffers");
+
+    static metrics::Counter& leased_metric() {
+        static auto& gauge = metrics::counter("bufferpool.leased");
+        return gauge;
+    }
+
+    static metrics::Counter& capacity_metric() {
+        static auto& gauge = metrics::counter("bufferpool.capacity");
+        return gauge;
+    }
+
+    static metrics::Counter& huge_arenas_metric() {
+        static auto& count = metrics::counter("bufferpool.huge_arenas");
+        return count;
+    }
+
+
+    // returns a fresh ARENA_SIZE block aligned to at least ALIGNMENT
+    static char* allocate_arena(bool hugePages) {
+#ifndef WIN32
+        void* arena = MAP_FAILED;
+
+        if (hugePages) {
+            arena = mmap(nullptr, BufferPool::ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+            if (arena != MAP_FAILED)
+                ++huge_arenas_metric();
+        }
+
+        // no reserved hugepages (the usual case): take a normal mapping and let the
+        // kernel back it with a transparent hugepage if it can
+        if (arena == MAP_FAILED) {
+            arena = mmap(nullptr, BufferPool::ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+            if (arena == MAP_FAILED)
+                throw std::bad_alloc();
+
+#ifdef MADV_HUGEPAGE
+            madvise(arena, BufferPool::ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+        }
+
+        return static_cast<char*>(arena);
+#else
+        auto arena = static_cast<char*>(_aligned_malloc(BufferPool::ARENA_SIZE, BufferPool::ALIGNMENT));
+
+        if (!arena)
+            throw std::bad_alloc();
+
+        return arena;
+#endif
+    }
+
+
+    BufferPool& BufferPool::shared() {
+        // never destroyed: leases may be released by detached threads during exit
+        static auto pool = new BufferPool();
+        return *pool;
+    }
+
+
+    BufferPool::Lease BufferPool::acquire() {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (free_.empty())
+            grow();
+
+        char* buffer = free_.back();
+        free_.pop_back();
+
+        ++leased_metric();
+        return Lease(this, buffer);
+    }
+
+
+    void BufferPool::release(char* buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        free_.push_back(buffer); // capacity reserved in grow(), so this never allocates
+        --leased_metric();
+    }
+
+
+    void BufferPool::grow() {
+        constexpr size_t buffersPerArena = ARENA_SIZE / BUFFER_SIZE;
+        char* arena = allocate_arena(hugePages_);
+
+        capacity_ += buffersPerArena;
+        free_.reserve(capacity_);
+
+        for (size_t i = 0; i < buffersPerArena; ++i)
+            free_.push_back(arena + i * BUFFER_SIZE);
+
+        capacity_metric() += buffersPerArena;
+    }
+
+
+    void BufferPool::use_huge_pages(bool enable) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        hugePages_ = enable;
+    }
+
+
+    size_t BufferPool::capacity() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return capacity_;
+    }
+
+
+    size_t BufferPool::leased() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return capacity_ - free_.size();
+    }
+
+} // end connection namespace
@@ -0,0 +1,62 @@
+#pragma once
+#include <mutex>
+#include <vector>
+#include <stddef.h>
+#include "Message.h"
+
+namespace connection {
+
+    // Server-wide pool of fixed-size transfer buffers. Buffers are carved out of large arenas
+    // (backed by hugepages where the platform allows), cache-line aligned, and recycled through
+    // a free list, so leasing one for a send or receive never touches malloc once the pool has
+    // warmed up. Arenas are never returned to the OS
+    class BufferPool {
+        public:
+            constexpr static size_t BUFFER_SIZE = CHUNK_SIZE;
+            constexpr static size_t ALIGNMENT = 64;
+            constexpr static size_t ARENA_SIZE = 2 * 1024 * 1024;   // one huge page on x86-64
+
+            // RAII handle on one buffer: returned to the pool when it goes out of scope
+            class Lease {
+                BufferPool* pool_;
+                char* data_;
+
+                public:
+                    Lease(BufferPool* pool, char* data) : pool_(pool), data_(data) {}
+                    Lease(Lease&& other) : pool_(other.pool_), data_(other.data_) { other.data_ = nullptr; }
+                    ~Lease() { if (data_) pool_->release(data_); }
+
+                    char* data() const { return data_; }
+                    constexpr static size_t size() { return BUFFER_SIZE; }
+
+                    Lease(const Lease& other) = delete;
+                    Lease& operator=(const Lease& other) = delete;
+                    Lease& operator=(Lease&& other) = delete;
+            };
+
+            static BufferPool& shared();
+
+            Lease acquire();
+
+            // ask for explicitly reserved hugepages (MAP_HUGETLB) for arenas allocated from now on.
+            // Without this, arenas are ordinary mappings with transparent hugepages requested
+            void use_huge_pages(bool enable);
+
+            size_t capacity() const;    // buffers allocated so far
+            size_t leased() const;      // buffers currently handed out
+
+        private:
+            mutable std::mutex mutex_;
+            std::vector<char*> free_;
+            size_t capacity_ = 0;
+            bool hugePages_ = false;
+
+            void release(char* buffer);
+            void grow();
+
+            BufferPool() = default;
+            BufferPool(const BufferPool& other) = delete;
+            BufferPool& operator=(const BufferPool& other) = delete;
+    };
+
+} // end connection namespace
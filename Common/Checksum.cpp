@@ -0,0 +1,46 @@
+#include "stdafx.h"
+#include "Checksum.h"
+
+namespace connection {
+
+    // one table per byte of a 32 bit word, so four input bytes are folded in per step ("slicing by 4")
+    struct Crc32Tables {
+        uint32_t table[4][256];
+
+        Crc32Tables() {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+
+                for (int bit = 0; bit < 8; ++bit)
+                    crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+
+                table[0][i] = crc;
+            }
+
+            for (uint32_t i = 0; i < 256; ++i) {
+                for (int t = 1; t < 4; ++t)
+                    table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+            }
+        }
+    };
+
+
+    uint32_t crc32(uint32_t crc, const void* data, size_t len) {
+        static const Crc32Tables tables;
+        const auto& t = tables.table;
+        auto p = static_cast<const unsigned char*>(data);
+
+        crc = ~crc;
+
+        for (; len >= 4; len -= 4, p += 4) {
+            crc ^= static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+            crc = t[3][crc & 0xff] ^ t[2][(crc >> 8) & 0xff] ^ t[1][(crc >> 16) & 0xff] ^ t[0][crc >> 24];
+        }
+
+        while (len-- > 0)
+            crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+
+        return ~crc;
+    }
+
+} // end connection namespace
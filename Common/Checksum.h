@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace connection {
+
+    // CRC-32 (the polynomial zlib and gzip use), for checking files arrived intact. Feed a file
+    // through in pieces by passing each call's result back in as crc; start from 0
+    uint32_t crc32(uint32_t crc, const void* data, size_t len);
+
+} // end connection namespace
@@ -4,53 +4,31 @@
 #include <algorithm>
 #include <numeric>
 #include <chrono>
+#include <vector>
 
 #ifndef WIN32
-#include <unistd.h>
-#include <sys/select.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <netdb.h>
-#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/un.h>
 #endif
 
 #include "Connection.h"
+#include "SocketCompat.h"
+#include "LingeringCloser.h"
+#include "BufferPool.h"
+#include "ArrayStream.h"
+#include "Probes.h"
 
 
-constexpr std::stringstream::openmode binary_stream = std::stringstream::in | std::stringstream::out | std::stringstream::binary;
-constexpr long SHUTDOWN_TIMEOUT_MS = 60000;
 
 
 using std::ostringstream;
 
-#ifndef WIN32
-
-constexpr int SOCKET_ERROR = -1;
-constexpr int INVALID_SOCKET = -1;
-constexpr int SD_SEND = SHUT_WR;
-
-typedef bool BOOL;
-constexpr BOOL TRUE = true;
-constexpr BOOL FALSE = false;
-
-typedef uint16_t DWORD;
-typedef fd_set FD_SET;
-
-typedef struct timeval TIMEVAL;
-typedef struct sockaddr SOCKADDR;
-
-#define ZeroMemory(buf, n) memset((buf), 0, (n))
-#define ADDR_ANY INADDR_ANY
-
-#else // is WIN32
-
-typedef int socklen_t;
-#define TEMP_FAILURE_RETRY(expr) (expr)
-
-#endif
-
-
 namespace connection {
+    // std::chrono takes its count by reference, so this one needs a definition of its own
+    const long Connection::CONNECT_ATTEMPT_DELAY_MS;
+
 #ifdef WIN32
     static bool g_winsockInit = false;
 
@@ -84,125 +62,120 @@ namespace connection {
         ::close(socket);
     }
 
-    ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-        if (len == 0) return 0;
-
-        return ::recv(sockfd, buf, len, flags);
-    }
-
 #endif
 
-    int recv_timeout(socket_t which, char* buf, int len, DWORD flags, long timeoutMs, bool* timedOut = nullptr) {
-        FD_SET rfd;
-        FD_SET efd;
-
-        FD_ZERO(&rfd);
-        FD_ZERO(&efd);
-
-        FD_SET(which, &rfd);
-        FD_SET(which, &efd);
-
-        timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = timeoutMs * 1000;
-
-        if (timedOut) *timedOut = false;
-
-        // why not setsockopt? so the caller can determine how long we should wait
-        int numReady = TEMP_FAILURE_RETRY(select(FD_SETSIZE, &rfd, nullptr, &efd, timeoutMs > 0 ? &timeout : nullptr));
-
-        if (numReady == SOCKET_ERROR)
-            throw ConnectionException::create("exception in select recv_timeout");
-
-        if (numReady == 0) { // timed out?
-            if (timedOut) *timedOut = true;
-            return 0;
-        }
-
-
-        if (FD_ISSET(which, &rfd) || FD_ISSET(which, &efd)) {
-            auto result = recv(which, buf, len, flags);
-
-            if (result == SOCKET_ERROR)
-                throw ConnectionException::create("failed to receive data");
-
-            return result;
-        }
-
-        // no data to read or errors to catch
-        return 0;
+    Connection::Connection(socket_t socket, const std::string& hostName, const std::string& remoteName, const port_t& hostPort, const port_t& remotePort)
+        : Connection(Transport::Ptr(new SocketTransport(socket)), hostName, remoteName, hostPort, remotePort) {
+        // empty body
     }
 
 
-    Connection::Connection(socket_t socket, const std::string& hostName, const std::string& remoteName, const port_t& hostPort, const port_t& remotePort)
-        : socket_(socket), hostName_(hostName), remoteName_(remoteName), hostPort_(hostPort), remotePort_(remotePort) {
+    Connection::Connection(Transport::Ptr transport, const std::string& hostName, const std::string& remoteName, const port_t& hostPort, const port_t& remotePort)
+        : transport_(std::move(transport)), hostName_(hostName), remoteName_(remoteName), hostPort_(hostPort), remotePort_(remotePort) {
         // empty body
     }
 
 
     Connection::~Connection() {
-        if (socket_ != INVALID_SOCKET) {
-            shutdown();
-            closesocket(socket_);
+        if (transport_ && transport_->is_open()) {
+            try {
+                shutdown();
+            }
+            catch (...) {
+                // destructors must not throw; the transport is closed regardless
+            }
         }
     }
 
 
     int Connection::send(NetworkDataStream& data) {
-        char buf[CHUNK_SIZE];
+        if (!transport_)
+            throw ConnectionException("cannot send: connection has been shut down");
+
+        auto lease = BufferPool::shared().acquire();
+        char* buf = lease.data();
         int bytesSent = 0;
         int totalBytesSent = 0;
+        const auto started = FTP_PROBE_ENABLED(send) ? probe_nanos() : 0;
 
         while (data.stream_.good()) {
-            data.stream_.read(buf, CHUNK_SIZE);
+            data.stream_.read(buf, lease.size());
             auto bytesLeft = data.stream_.gcount(); // tells us how many bytes were just read
 
             if (!data.stream_.good() && bytesLeft == 0) break;
 
+            const auto chunkLen = bytesLeft;
+
             // it's quite possible the entire chunk won't fit into a single send, so
             // call send multiple times if necessary
             while (bytesLeft > 0) {
-                if ((bytesSent = ::send(socket_, buf, static_cast<int>(bytesLeft), 0)) == SOCKET_ERROR)
-                    throw ConnectionException::create("error sending data stream (position " + std::to_string(data.stream_.tellg()) + ")");
+                try {
+                    bytesSent = transport_->send(buf + (chunkLen - bytesLeft), static_cast<int>(bytesLeft));
+                }
+                catch (const ConnectionException& ce) {
+                    throw ConnectionException(std::string(ce.what()) + " (data stream position " + std::to_string(data.stream_.tellg()) + ")");
+                }
 
                 bytesLeft -= bytesSent;
                 totalBytesSent += bytesSent;
             }
         }
 
-        if (data.stream_.eof()) return totalBytesSent;
+        if (data.stream_.eof()) {
+            if (FTP_PROBE_ENABLED(send))
+                FTP_PROBE(send, transport_->native_handle(), totalBytesSent, probe_nanos() - started);
+
+            return totalBytesSent;
+        }
 
         throw std::runtime_error("did not send all data!"); // todo: better exception?
     }
 
 
     int Connection::send(const connection::Message& message) {
-        std::stringstream buf(binary_stream);
-        NetworkDataStream ds(buf);
+        if (message.payload.length() > static_cast<size_t>(max_payload_len(message.msgid)))
+            throw std::invalid_argument(("maximum payload length exceeded: " + std::to_string(message.payload.length()) + " > " + (std::to_string(max_payload_len(message.msgid))).c_str()));
 
-        if (message.payload.length() > MAX_PAYLOAD_LEN)
-            throw std::invalid_argument(("maximum payload length exceeded: " + std::to_string(message.payload.length()) + " > " + (std::to_string(MAX_PAYLOAD_LEN)).c_str()));
+        // encode straight into a pooled buffer: the largest message fits comfortably in one
+        auto lease = BufferPool::shared().acquire();
+        ArrayStream buf(lease.data(), lease.size());
+        NetworkDataStream ds(buf);
 
         ds << message.msgid << message.length() << message.datalen << message.port;
 
         ds.write_str(message.payload);
 
-        return send(ds);
+        if (!buf.good())
+            throw std::runtime_error("failed to encode " + connection::to_string(message.msgid));
+
+        const auto started = FTP_PROBE_ENABLED(message_send) ? probe_nanos() : 0;
+        const auto bytesSent = send(ds);
+
+        if (FTP_PROBE_ENABLED(message_send))
+            FTP_PROBE(message_send, transport_->native_handle(), static_cast<int>(message.msgid), message.length(), message.datalen, probe_nanos() - started);
+
+        return bytesSent;
     }
 
 
     int Connection::receive(NetworkDataStream& data, int howMany, long timeoutMs, bool* timedOut) {
-        char buf[CHUNK_SIZE];
+        if (!transport_)
+            throw ConnectionException("cannot receive: connection has been shut down");
+
+        auto lease = BufferPool::shared().acquire();
+        char* buf = lease.data();
         int byteChunkReceived = 0;
         int totalBytes = 0;
         bool internalTimeout = false;
+        const auto started = FTP_PROBE_ENABLED(receive) ? probe_nanos() : 0;
 
         // even though we're allowing a max of one chunk, there's no guarantee
         // that we can get all that data in a single recv, so continue until we
         // have it all or something breaks
 
         while (howMany > 0 && data.stream_.good()) {
-            if ((byteChunkReceived = recv_timeout(socket_, buf, howMany, 0, timeoutMs, &internalTimeout)) == SOCKET_ERROR)
+            // never ask for more than fits in buf: a peer controls msglen, and therefore howMany
+            if ((byteChunkReceived = transport_->receive(buf, std::min(howMany, CHUNK_SIZE), timeoutMs, &internalTimeout)) == SOCKET_ERROR)
                 throw ConnectionException::create("error receiving data stream (received total of " + std::to_string(totalBytes) + " bytes so far)");
 
             if (byteChunkReceived > 0) {
@@ -215,16 +188,14 @@ namespace connection {
 
                 howMany -= byteChunkReceived;
                 totalBytes += byteChunkReceived;
-            } else if (totalBytes == 0) {
+            } else if (!internalTimeout) {
+                // if we got 0 bytes and didn't time out, the socket is no longer connected (or the
+                // stream has ended), whether or not part of what we were waiting for has arrived
+                throw ConnectionException::create("client has disconnected unexpectedly", false);
 
+            } else if (totalBytes == 0 && timeoutMs != TIMEOUT_NEVER) {
                 // if the caller has set a selectTimeout, it's not an error to fail to read any bytes
-                if (internalTimeout && timeoutMs != TIMEOUT_NEVER)
-                    break;
-
-                // if we got 0 bytes and didn't time out, the socket is no longer connected
-                if (!internalTimeout)
-                    throw ConnectionException::create("client has disconnected unexpectedly", false);
-
+                break;
             }
         }
 
@@ -233,6 +204,9 @@ namespace connection {
         if (!data.stream_.good())
             throw std::runtime_error("failed to receive data"); // todo: better exception?
 
+        if (FTP_PROBE_ENABLED(receive))
+            FTP_PROBE(receive, transport_->native_handle(), totalBytes, probe_nanos() - started, internalTimeout);
+
         return totalBytes;
     }
 
@@ -240,8 +214,10 @@ namespace connection {
     int Connection::receive(connection::Message* pMsg, long timeoutMs, bool* usertimedOut) {
         int bytesReceived = 0;
         bool timedOut = false;
-        std::stringstream buf(binary_stream);
+        auto lease = BufferPool::shared().acquire();
+        ArrayStream buf(lease.data(), lease.size());
         NetworkDataStream ds(buf);
+        const auto started = FTP_PROBE_ENABLED(message_receive) ? probe_nanos() : 0;
 
         ZERO_MSG(pMsg);
 
@@ -259,6 +235,13 @@ namespace connection {
         ds >> pMsg->msgid;
         ds >> pMsg->msglen;
 
+        // don't trust the peer's length: it decides how much we read and hold in memory
+        if (pMsg->msglen < MESSAGE_BYTE_LEN || pMsg->msglen - MESSAGE_BYTE_LEN > max_payload_len(pMsg->msgid)) {
+            const auto ex = std::runtime_error(("invalid message length " + std::to_string(pMsg->msglen) + " for " + connection::to_string(pMsg->msgid)).c_str());
+            ZERO_MSG(pMsg);
+            throw ex;
+        }
+
         // this message will tell us how many bytes are in the message (TOTAL)
         auto moreBytes = pMsg->msglen - bytesReceived;
 
@@ -277,6 +260,9 @@ namespace connection {
 
         pMsg->payload = ds.read_str(pMsg->msglen - MESSAGE_BYTE_LEN); // can infer size of payload by examining message length
 
+        if (FTP_PROBE_ENABLED(message_receive))
+            FTP_PROBE(message_receive, transport_->native_handle(), static_cast<int>(pMsg->msgid), pMsg->msglen, pMsg->datalen, probe_nanos() - started);
+
         return totalBytes;
     }
 
@@ -290,25 +276,104 @@ namespace connection {
         bool singleShot,                           
         long timeoutMs) {
 
-        socket_t welcomeSocket, acceptSocket;
-        sockaddr_in service;
-        FD_SET descriptors;
-        TIMEVAL selectTimeout;
-        struct sockaddr_in sin;
+        welcome_on(create_welcome_socket(port), stopListeningQuery, onCreate, onConnection, onAcceptFailure, singleShot, timeoutMs);
+    }
 
-        char buf[256] = { '\0' };
-        std::string hostName, remoteName;
-        port_t srcPort, destPort;
-        socklen_t len = sizeof(sin);
+
+    // text form of a socket address and its port. IPv4 peers of a dual-stack socket appear as
+    // IPv4-mapped IPv6 addresses (::ffff:a.b.c.d): those are reported as plain IPv4, so the name
+    // works for connecting back whichever kind of socket the other side listens on
+    static bool describe_address(const sockaddr_storage& addr, std::string* name, port_t* port) {
+        char buf[INET6_ADDRSTRLEN] = { '\0' };
+
+        if (addr.ss_family == AF_INET6) {
+            const auto& sin6 = reinterpret_cast<const sockaddr_in6&>(addr);
+            *port = ntohs(sin6.sin6_port);
+
+            if (IN6_IS_ADDR_V4MAPPED(&sin6.sin6_addr)) {
+                if (inet_ntop(AF_INET, &sin6.sin6_addr.s6_addr[12], buf, sizeof(buf)) == nullptr)
+                    return false;
+            } else if (inet_ntop(AF_INET6, (void*)&sin6.sin6_addr, buf, sizeof(buf)) == nullptr)
+                return false;
+        } else if (addr.ss_family == AF_INET) {
+            const auto& sin = reinterpret_cast<const sockaddr_in&>(addr);
+            *port = ntohs(sin.sin_port);
+
+            if (inet_ntop(AF_INET, (void*)&sin.sin_addr, buf, sizeof(buf)) == nullptr)
+                return false;
+        } else return false;
+
+        *name = std::string(buf);
+        return true;
+    }
+
+
+    static void set_nonblocking(socket_t socket, bool enable) {
+#ifdef WIN32
+        u_long mode = enable ? 1 : 0;
+        ioctlsocket(socket, FIONBIO, &mode);
+#else
+        const int flags = fcntl(socket, F_GETFL, 0);
+        fcntl(socket, F_SETFL, enable ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+#endif
+    }
+
+
+    static int last_socket_error() {
+#ifdef WIN32
+        return WSAGetLastError();
+#else
+        return errno;
+#endif
+    }
+
+
+    // so ConnectionException::create reports an error saved earlier
+    static void restore_socket_error(int err) {
+#ifdef WIN32
+        WSASetLastError(err);
+#else
+        errno = err;
+#endif
+    }
+
+
+    static bool connect_in_progress(int err) {
+#ifdef WIN32
+        return err == WSAEWOULDBLOCK;
+#else
+        return err == EINPROGRESS || err == EINTR; // interrupted non-blocking connects carry on regardless
+#endif
+    }
+
+
+    socket_t Connection::create_welcome_socket(port_t port) {
+        socket_t welcomeSocket;
+        int family = AF_INET6;
+        sockaddr_storage service;
+        socklen_t serviceLen;
 #ifdef WIN32
         BOOL optTrue = TRUE;
+        DWORD optFalse = 0;
 #else
         int optTrue = 1;
+        int optFalse = 0;
 #endif
 
 
-        // create a socket to listen for incoming requests
-        welcomeSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        // create a socket to listen for incoming requests: IPv6 that also accepts IPv4 if we can
+        welcomeSocket = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+
+        if (welcomeSocket != INVALID_SOCKET && setsockopt(welcomeSocket, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&optFalse, sizeof(optFalse)) == SOCKET_ERROR) {
+            closesocket(welcomeSocket);
+            welcomeSocket = INVALID_SOCKET;
+        }
+
+        // no IPv6 here, or it can't be shared with IPv4: IPv4 only
+        if (welcomeSocket == INVALID_SOCKET) {
+            family = AF_INET;
+            welcomeSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        }
 
         if (welcomeSocket == INVALID_SOCKET)
             throw ConnectionException::create("failed to create welcome socket");
@@ -322,20 +387,30 @@ namespace connection {
         ZeroMemory(&service, sizeof(service));
 
         // bind IP address and destPort to socket
-        // todo: IPv6 support?
-        service.sin_family = AF_INET;
-
-        service.sin_port = htons(port);
-        service.sin_addr.s_addr = htonl(ADDR_ANY);
+        if (family == AF_INET6) {
+            auto& sin6 = reinterpret_cast<sockaddr_in6&>(service);
+
+            sin6.sin6_family = AF_INET6;
+            sin6.sin6_port = htons(port);
+            sin6.sin6_addr = in6addr_any;
+            serviceLen = sizeof(sin6);
+        } else {
+            auto& sin = reinterpret_cast<sockaddr_in&>(service);
+
+            sin.sin_family = AF_INET;
+            sin.sin_port = htons(port);
+            sin.sin_addr.s_addr = htonl(ADDR_ANY);
+            serviceLen = sizeof(sin);
+        }
 
-        if (bind(welcomeSocket, (SOCKADDR *) &service, sizeof(service)) == SOCKET_ERROR) {
+        if (bind(welcomeSocket, (SOCKADDR *) &service, serviceLen) == SOCKET_ERROR) {
             const auto connerr = ConnectionException::create("welcome socket bind failed");
             closesocket(welcomeSocket);
 
             throw connerr;
         }
 
-        if (listen(welcomeSocket, 1) == SOCKET_ERROR) {
+        if (listen(welcomeSocket, SOMAXCONN) == SOCKET_ERROR) {
             const auto connerr = ConnectionException::create("welcome socket listen failed");
 
             closesocket(welcomeSocket);
@@ -343,6 +418,28 @@ namespace connection {
             throw connerr;
         }
 
+        return welcomeSocket;
+    }
+
+
+    void Connection::welcome_on(
+        socket_t welcomeSocket,
+        StopListeningQuery& stopListeningQuery,
+        SocketCreatedCallback& onCreate,
+        ConnectionEstablishedCallback& onConnection,
+        ErrorCallback& onAcceptFailure,
+        bool singleShot,
+        long timeoutMs) {
+
+        socket_t acceptSocket;
+        FD_SET descriptors;
+        TIMEVAL selectTimeout;
+        sockaddr_storage sin;
+
+        std::string hostName, remoteName;
+        port_t srcPort, destPort;
+        socklen_t len = sizeof(sin);
+
         // get port # of listening socket
         if (getsockname(welcomeSocket, (struct sockaddr *)&sin, &len) == SOCKET_ERROR) {
             const auto connerr = ConnectionException::create("getsockname failed");
@@ -353,16 +450,13 @@ namespace connection {
         }
 
         // find address of listening socket
-        if (inet_ntop(AF_INET, &sin.sin_addr, buf, sizeof(buf)) == nullptr) {
+        if (!describe_address(sin, &hostName, &srcPort)) {
             const auto connerr = ConnectionException::create("failed to convert address");
             closesocket(welcomeSocket);
 
             throw connerr;
         }
 
-        hostName = std::string(buf);
-        srcPort = ntohs(sin.sin_port);
-
         // socket is now actively listening. Use callback in case caller wants to do
         // something when this happens
         onCreate(hostName, srcPort);
@@ -370,12 +464,6 @@ namespace connection {
         // -------------------------------------------------------
         // begin accepting connections
         // -------------------------------------------------------
-        selectTimeout.tv_usec = 50 * 1000; // wait this long for select
-                                             // mainly this avoids a busy loop, yet allows the thread
-                                             // to react quickly if the callback tells us to stop listening
-                                             // for connections
-        selectTimeout.tv_sec = 0;
-
         const auto startTime = std::chrono::high_resolution_clock::now();
 
         while (!stopListeningQuery()) {
@@ -389,6 +477,12 @@ namespace connection {
             FD_ZERO(&descriptors);
             FD_SET(welcomeSocket, &descriptors);
 
+            // wait this long for select: mainly this avoids a busy loop, yet allows the thread to react
+            // quickly if the callback tells us to stop listening for connections. Set every time round,
+            // since Linux's select leaves it holding whatever time was left, which is none once it times out
+            selectTimeout.tv_sec = 0;
+            selectTimeout.tv_usec = 50 * 1000;
+
             // check for incoming connections
             auto readyCount = TEMP_FAILURE_RETRY (select(FD_SETSIZE, &descriptors, nullptr, nullptr, &selectTimeout));
 
@@ -407,6 +501,8 @@ namespace connection {
                 continue; // no connections ready to be accepted
 
             // accept this connection
+            const auto started = FTP_PROBE_ENABLED(accept) ? probe_nanos() : 0;
+
             acceptSocket = accept(welcomeSocket, NULL, NULL);
 
             if (acceptSocket == INVALID_SOCKET) {
@@ -421,7 +517,6 @@ namespace connection {
             // new client established: identify the port it's using and IP address
             len = sizeof(sin);
             ZeroMemory(&sin, len);
-            ZeroMemory(buf, sizeof(buf));
 
 
             if (getpeername(acceptSocket, (struct sockaddr *)&sin, &len) == SOCKET_ERROR) {
@@ -433,7 +528,7 @@ namespace connection {
 
             } else {
 
-                if (inet_ntop(AF_INET, &sin.sin_addr, buf, sizeof(buf)) == nullptr) {
+                if (!describe_address(sin, &remoteName, &destPort)) {
                     const auto connerr = ConnectionException::create("failed to convert address from binary to text");
                     closesocket(welcomeSocket);
                     closesocket(acceptSocket);
@@ -441,8 +536,8 @@ namespace connection {
                     throw connerr;
                 }
 
-                remoteName = std::string(buf);
-                destPort = ntohs(sin.sin_port);
+                if (FTP_PROBE_ENABLED(accept))
+                    FTP_PROBE(accept, welcomeSocket, acceptSocket, probe_nanos() - started);
 
                 onConnection(std::make_unique<Connection>(acceptSocket, hostName, remoteName, srcPort, destPort));
 
@@ -458,18 +553,19 @@ namespace connection {
     }
 
 
-    Connection::Ptr Connection::connect(const std::string& remoteName, port_t destPort) {
+    Connection::Ptr Connection::connect(const std::string& remoteName, port_t destPort, long timeoutMs) {
+        typedef std::chrono::steady_clock clock;
+
         int retVal;
-        addrinfo hints, *result, *ptr = nullptr;
+        addrinfo hints, *result;
         socket_t connectSocket = INVALID_SOCKET;
-        struct sockaddr_in sin;
+        sockaddr_storage sin;
         socklen_t len = sizeof(sin);
-        char buf[256] = { '\0' };
         std::string hostName;
         port_t srcPort;
 
         ZeroMemory(&hints, sizeof(hints));
-        hints.ai_family = AF_INET; // IPv4, TODO: IPv6
+        hints.ai_family = AF_UNSPEC;
         hints.ai_socktype = SOCK_STREAM;
         hints.ai_protocol = IPPROTO_TCP;
 
@@ -477,93 +573,304 @@ namespace connection {
         retVal = getaddrinfo(remoteName.c_str(), std::to_string(destPort).c_str(), &hints, &result);
 
         if (retVal != 0)
-            throw ConnectionException::create("getaddrinfo failed");
+            throw ConnectionException("getaddrinfo failed for " + remoteName + ": " + gai_strerror(retVal));
+
+        // take addresses in the resolver's order of preference, but alternate families so one
+        // unreachable family can only ever delay us by one attempt at a time
+        std::vector<const addrinfo*> addresses;
+
+        {
+            std::vector<const addrinfo*> preferred, other;
+
+            for (auto ptr = result; ptr != nullptr; ptr = ptr->ai_next) {
+                if (ptr->ai_family != AF_INET && ptr->ai_family != AF_INET6) continue;
+
+                (ptr->ai_family == result->ai_family ? preferred : other).push_back(ptr);
+            }
+
+            for (size_t i = 0; i < std::max(preferred.size(), other.size()); ++i) {
+                if (i < preferred.size()) addresses.push_back(preferred[i]);
+                if (i < other.size()) addresses.push_back(other[i]);
+            }
+        }
+
+        std::vector<socket_t> pending;
+        size_t next = 0;
+        int lastError = 0;
+        const auto deadline = clock::now() + std::chrono::milliseconds(timeoutMs);
+        auto nextStart = clock::now();
+
+        while (connectSocket == INVALID_SOCKET) {
+            auto now = clock::now();
 
+            if (now >= deadline)
+                break;
+
+            // start the next attempt once the last has had its head start, or straight away if
+            // nothing is in flight
+            if (next < addresses.size() && (now >= nextStart || pending.empty())) {
+                const auto ptr = addresses[next++];
+                socket_t attempt = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+
+                if (attempt == INVALID_SOCKET) {
+                    lastError = last_socket_error();
+                    continue; // e.g. IPv6 not available here
+                }
 
-        // Attempt to connect to the address(es) returned by
-        // the call to getaddrinfo
-        for (ptr = result; ptr != nullptr; ptr = ptr->ai_next) {
-            // todo: try to support ipv6 also?
-            if (ptr->ai_family != AF_INET) continue; // only ipv4 addresses for now
+                set_nonblocking(attempt, true);
 
-            // attempt to create a socket using provided details
-            connectSocket = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+                if (::connect(attempt, ptr->ai_addr, (int)ptr->ai_addrlen) == 0) {
+                    connectSocket = attempt;
+                    break;
+                }
+
+                const auto err = last_socket_error();
+
+                if (!connect_in_progress(err)) {
+                    lastError = err;
+                    closesocket(attempt);
+                    continue;
+                }
+
+                pending.push_back(attempt);
+                nextStart = now + std::chrono::milliseconds(CONNECT_ATTEMPT_DELAY_MS);
+            }
+
+            if (pending.empty()) {
+                if (next < addresses.size())
+                    continue;
+
+                break; // every address has failed
+            }
+
+            // wait for an attempt to finish, but no longer than until the next one is due
+            const auto wakeAt = next < addresses.size() ? std::min(nextStart, deadline) : deadline;
+            const auto waitUs = std::max<long long>(0, std::chrono::duration_cast<std::chrono::microseconds>(wakeAt - now).count());
+
+            FD_SET writable, failed;
+            TIMEVAL selectTimeout;
+
+            FD_ZERO(&writable);
+            FD_ZERO(&failed);
+
+            for (const auto attempt : pending) {
+                FD_SET(attempt, &writable);
+                FD_SET(attempt, &failed); // winsock reports failed connects here rather than as writable
+            }
+
+            selectTimeout.tv_sec = static_cast<long>(waitUs / 1000000);
+            selectTimeout.tv_usec = static_cast<long>(waitUs % 1000000);
+
+            if (TEMP_FAILURE_RETRY(select(FD_SETSIZE, nullptr, &writable, &failed, &selectTimeout)) == SOCKET_ERROR) {
+                const auto connerr = ConnectionException::create("select failed while connecting");
+
+                for (const auto attempt : pending)
+                    closesocket(attempt);
 
-            if (connectSocket == INVALID_SOCKET) {
-                const auto connerr = ConnectionException::create("error at socket()");
                 freeaddrinfo(result);
-                closesocket(connectSocket);
                 throw connerr;
             }
 
-            // attempt to connect to server using the provided address details
-            retVal = TEMP_FAILURE_RETRY(::connect(connectSocket, ptr->ai_addr, (int)ptr->ai_addrlen));
+            for (auto it = pending.begin(); it != pending.end();) {
+                if (!FD_ISSET(*it, &writable) && !FD_ISSET(*it, &failed)) {
+                    ++it;
+                    continue;
+                }
 
-            if (retVal == SOCKET_ERROR) {
-                closesocket(connectSocket);
+                int err = 0;
+                socklen_t errLen = sizeof(err);
 
-                connectSocket = INVALID_SOCKET;
-            } else {
-                // we have a connection!
+                if (getsockopt(*it, SOL_SOCKET, SO_ERROR, (char *)&err, &errLen) == SOCKET_ERROR)
+                    err = last_socket_error();
 
-                // grab source srcPort and our (host) name
-                if (getsockname(connectSocket, (struct sockaddr *)&sin, &len) == SOCKET_ERROR) {
-                    const auto connerr = ConnectionException::create("getsockname error");
-                    freeaddrinfo(result);
-                    closesocket(connectSocket);
-                    throw connerr;
+                if (err == 0 && connectSocket == INVALID_SOCKET) {
+                    // we have a connection!
+                    connectSocket = *it;
+                    it = pending.erase(it);
+                    continue;
                 }
 
-                srcPort = ntohs(sin.sin_port);
-                inet_ntop(AF_INET, &sin.sin_addr, buf, sizeof(buf));
-                hostName = std::string(buf);
-
-                break;
+                if (err != 0) {
+                    // a refused or unreachable address: let the next one go now rather than wait
+                    lastError = err;
+                    nextStart = clock::now();
+                    closesocket(*it);
+                    it = pending.erase(it);
+                } else ++it;
             }
         }
 
+        // the losers: closing one still connecting simply abandons it
+        for (const auto attempt : pending)
+            closesocket(attempt);
+
+        freeaddrinfo(result);
 
         if (connectSocket == INVALID_SOCKET) {
-            freeaddrinfo(result);
-            throw ConnectionException::create("unable to connect to server " + hostName + "!", false);
+            const auto what = "unable to connect to server " + remoteName + ":" + std::to_string(destPort);
+
+            if (lastError == 0)
+                throw ConnectionException(what + ": no address answered within " + std::to_string(timeoutMs) + " ms");
+
+            restore_socket_error(lastError);
+            throw ConnectionException::create(what);
         }
 
+        set_nonblocking(connectSocket, false);
 
-        Ptr pConnection = std::make_unique<Connection>(connectSocket, hostName, remoteName, srcPort, destPort);
-        freeaddrinfo(result);
+        // grab source srcPort and our (host) name
+        if (getsockname(connectSocket, (struct sockaddr *)&sin, &len) == SOCKET_ERROR || !describe_address(sin, &hostName, &srcPort)) {
+            const auto connerr = ConnectionException::create("getsockname error");
+            closesocket(connectSocket);
+            throw connerr;
+        }
 
-        return pConnection;
+        return std::make_unique<Connection>(connectSocket, hostName, remoteName, srcPort, destPort);
     }
 
 
-    void Connection::shutdown() {
-        char buf[1024];
-        int bytes = 0;
+#ifndef WIN32
+    static sockaddr_un make_local_address(const std::string& path) {
+        sockaddr_un addr;
 
-        if (socket_ == INVALID_SOCKET)
-		    return; // socket is already closed, no need to do anything
+        ZeroMemory(&addr, sizeof(addr));
+        addr.sun_family = AF_UNIX;
 
-        ::shutdown(socket_, SD_SEND);
+        if (path.empty() || path.length() >= sizeof(addr.sun_path))
+            throw ConnectionException("invalid local socket path '" + path + "'");
 
-        try {
-            while ((bytes = recv_timeout(socket_, buf, sizeof(buf), 0, SHUTDOWN_TIMEOUT_MS)) != SOCKET_ERROR && bytes > 0) {
-                // do nothing: we don't care what we receive, we're just waiting for this to return zero or time out
-                // to let us know the other side has been closed
-            }
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        return addr;
+    }
+
+
+    void Connection::welcome_local(
+        const std::string& path,
+        StopListeningQuery& stopListeningQuery,
+        ConnectionEstablishedCallback& onConnection,
+        ErrorCallback& onAcceptFailure,
+        bool singleShot,
+        long timeoutMs) {
+
+        const auto addr = make_local_address(path);
+        FD_SET descriptors;
+        TIMEVAL selectTimeout;
+
+        socket_t welcomeSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (welcomeSocket == INVALID_SOCKET)
+            throw ConnectionException::create("failed to create local welcome socket");
+
+        // a previous server that didn't exit cleanly leaves its socket file behind
+        ::unlink(path.c_str());
+
+        if (bind(welcomeSocket, (SOCKADDR *)&addr, sizeof(addr)) == SOCKET_ERROR) {
+            const auto connerr = ConnectionException::create("local welcome socket bind failed");
+            closesocket(welcomeSocket);
+
+            throw connerr;
         }
-        catch (const ConnectionException&) {
-            // swallow
+
+        if (listen(welcomeSocket, SOMAXCONN) == SOCKET_ERROR) {
+            const auto connerr = ConnectionException::create("local welcome socket listen failed");
+            closesocket(welcomeSocket);
+            ::unlink(path.c_str());
+
+            throw connerr;
+        }
+
+        const auto startTime = std::chrono::high_resolution_clock::now();
+
+        while (!stopListeningQuery()) {
+            const auto elapsed = std::chrono::high_resolution_clock::now() - startTime;
+
+            if (timeoutMs != TIMEOUT_NEVER && std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() > timeoutMs)
+                break;
+
+            FD_ZERO(&descriptors);
+            FD_SET(welcomeSocket, &descriptors);
+
+            selectTimeout.tv_sec = 0;
+            selectTimeout.tv_usec = 50 * 1000;
+
+            auto readyCount = TEMP_FAILURE_RETRY(select(FD_SETSIZE, &descriptors, nullptr, nullptr, &selectTimeout));
+
+            if (readyCount == SOCKET_ERROR) {
+                const auto connerr = ConnectionException::create("select failed");
+                closesocket(welcomeSocket);
+                ::unlink(path.c_str());
+
+                throw connerr;
+            }
+
+            if (readyCount == 0 || !FD_ISSET(welcomeSocket, &descriptors))
+                continue;
+
+            const auto started = FTP_PROBE_ENABLED(accept) ? probe_nanos() : 0;
+            socket_t acceptSocket = accept(welcomeSocket, NULL, NULL);
+
+            if (acceptSocket == INVALID_SOCKET) {
+                if (!onAcceptFailure(ConnectionException::create("accept failed")))
+                    break;
+
+                continue;
+            }
+
+            if (FTP_PROBE_ENABLED(accept))
+                FTP_PROBE(accept, welcomeSocket, acceptSocket, probe_nanos() - started);
+
+            onConnection(std::make_shared<Connection>(Transport::Ptr(new SocketTransport(acceptSocket, "unix")), path, "localhost", static_cast<port_t>(PORT_ANY), static_cast<port_t>(PORT_ANY)));
+
+            if (singleShot)
+                break;
         }
 
-        closesocket(socket_);
+        closesocket(welcomeSocket);
+        ::unlink(path.c_str());
+    }
+
 
-        socket_ = INVALID_SOCKET;
+    Connection::Ptr Connection::connect_local(const std::string& path) {
+        const auto addr = make_local_address(path);
+        socket_t connectSocket = socket(AF_UNIX, SOCK_STREAM, 0);
 
+        if (connectSocket == INVALID_SOCKET)
+            throw ConnectionException::create("error at socket()");
 
-        if (bytes == SOCKET_ERROR) {
-            // graceful shutdown not possible
-            throw ConnectionException("could not shutdown gracefully");
+        if (TEMP_FAILURE_RETRY(::connect(connectSocket, (SOCKADDR *)&addr, sizeof(addr))) == SOCKET_ERROR) {
+            const auto connerr = ConnectionException::create("unable to connect to local server " + path);
+            closesocket(connectSocket);
+            throw connerr;
         }
+
+        return std::make_shared<Connection>(Transport::Ptr(new SocketTransport(connectSocket, "unix")), "localhost", path, static_cast<port_t>(PORT_ANY), static_cast<port_t>(PORT_ANY));
+    }
+#endif
+
+
+    void Connection::shutdown() {
+        if (!transport_ || !transport_->is_open())
+            return; // socket is already closed, no need to do anything
+
+        const auto started = FTP_PROBE_ENABLED(shutdown) ? probe_nanos() : 0;
+        const auto handle = transport_->native_handle();
+
+        transport_->shutdown_send();
+
+        // the peer may take its time noticing and closing its end. Waiting on that is the
+        // closer's job, not this thread's
+        LingeringCloser::adopt(std::move(transport_));
+
+        if (FTP_PROBE_ENABLED(shutdown))
+            FTP_PROBE(shutdown, handle, probe_nanos() - started);
+    }
+
+
+    void Connection::release() {
+        if (transport_)
+            transport_->close();
+
+        transport_.reset();
     }
 
 
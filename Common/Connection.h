@@ -5,21 +5,13 @@
 #include <iostream>
 #include "Message.h"
 #include "NetworkDataStream.h"
-
-#ifdef WIN32
-#include <WinSock2.h>
-typedef SOCKET socket_t;
-#else
-#include <sys/socket.h>
-#include <sys/types.h>
-typedef int socket_t;
-#endif
+#include "Transport.h"
 
 namespace connection {
 
 
     class Connection {
-        socket_t socket_;
+        Transport::Ptr transport_;
         const std::string hostName_;
         const std::string remoteName_;
         const port_t hostPort_;
@@ -29,8 +21,11 @@ namespace connection {
     public:
         const static port_t PORT_ANY = 0;
         const static long TIMEOUT_NEVER = 0;
+        const static long CONNECT_TIMEOUT_MS = 10000;       // default deadline for connect() as a whole
+        const static long CONNECT_ATTEMPT_DELAY_MS = 250;   // head start each address gets before connect() also tries the next
 
         Connection(socket_t socket, const std::string& hostName, const std::string& remoteName, const port_t& hostPort, const port_t& remotePort);
+        Connection(Transport::Ptr transport, const std::string& hostName, const std::string& remoteName, const port_t& hostPort, const port_t& remotePort);
         ~Connection();
 
 
@@ -45,6 +40,7 @@ namespace connection {
         port_t remote_port() const { return remotePort_; }
         std::string host_name() const { return hostName_; }
         std::string remote_name() const { return remoteName_; }
+        Transport& transport() const { return *transport_; }   // only valid until shutdown()
 
         std::string identify_host() const {
             std::stringstream ss;
@@ -69,10 +65,15 @@ namespace connection {
         int receive(connection::Message* pMsg, long timeoutMs = TIMEOUT_NEVER, bool* timedOut = nullptr);
         int receive(NetworkDataStream& data, int numBytes, long timeoutMs = TIMEOUT_NEVER, bool* timedOut = nullptr);
 
-        // blocking: initiates a graceful shutdown. Any extra data being sent will be thrown out
+        // non-blocking: stops sending and hands the connection to LingeringCloser, which discards
+        // anything the peer still sends and closes once the peer does (or gives up waiting).
         // once shut down, a connection is permanently closed
         void shutdown();
 
+        // closes this process's handle without shutting the connection down. Used once the
+        // socket has been passed to another process, which carries on with the connection
+        void release();
+
         static void initialize();
         static void deinitialize();
 
@@ -85,7 +86,42 @@ namespace connection {
             bool singleShot = false,                            // close welcome socket after a single successful connection
             long timeoutMs = TIMEOUT_NEVER);
 
-        static Ptr connect(const std::string& remoteName, port_t port);
+        // the two halves of welcome: create_welcome_socket binds and listens, welcome_on accepts
+        // connections on a listening socket until told to stop, then closes it. Splitting them lets
+        // a caller hold on to the listening socket itself (e.g. to pass it to another process).
+        // The socket is dual-stack where the platform allows, accepting IPv6 and IPv4 alike
+        static socket_t create_welcome_socket(port_t port);
+
+        static void welcome_on(
+            socket_t welcomeSocket,
+            StopListeningQuery& stopListeningQuery,
+            SocketCreatedCallback& onCreate,
+            ConnectionEstablishedCallback& onConnection,
+            ErrorCallback& onAcceptFailure,
+            bool singleShot = false,
+            long timeoutMs = TIMEOUT_NEVER);
+
+        // resolves remoteName to its IPv6 and IPv4 addresses and races connection attempts to them
+        // ("happy eyeballs"): addresses are tried in turn, alternating between families, each one
+        // started CONNECT_ATTEMPT_DELAY_MS after the last or as soon as an earlier attempt fails.
+        // The first to connect wins and the rest are abandoned. Throws if none has connected
+        // within timeoutMs
+        static Ptr connect(const std::string& remoteName, port_t port, long timeoutMs = CONNECT_TIMEOUT_MS);
+
+#ifndef WIN32
+        // same as welcome/connect, but over a Unix domain socket bound to path. Connections
+        // report "localhost" as their remote name so data channels can still be opened back
+        // to the peer over TCP loopback
+        static void welcome_local(
+            const std::string& path,
+            StopListeningQuery& stopListeningQuery,
+            ConnectionEstablishedCallback& onConnection,
+            ErrorCallback& onAcceptFailure,
+            bool singleShot = false,
+            long timeoutMs = TIMEOUT_NEVER);
+
+        static Ptr connect_local(const std::string& path);
+#endif
 
 
 
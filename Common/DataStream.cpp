@@ -53,11 +53,12 @@ namespace connection {
         if (len == 0)
             return std::string();
 
-        auto buf = std::unique_ptr<char[]>(new char[len]);
+        std::string str(len, '\0');
 
-        stream_.read(buf.get(), len);
+        stream_.read(&str[0], len); // straight into the string: no intermediate buffer
 
-        return std::string(buf.get(), len);
+        str.resize(static_cast<size_t>(stream_.gcount()));
+        return str;
     }
 
 
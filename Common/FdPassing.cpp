@@ -0,0 +1,115 @@
+#include "stdafx.h"
+#ifndef WIN32
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "FdPassing.h"
+#include "SocketCompat.h"
+
+namespace connection {
+    // each message is a 2 byte length and the payload, with the descriptor riding along
+    // as ancillary data on the first byte
+
+    void send_fd(socket_t channel, int fd, const std::string& payload) {
+        if (payload.length() > MAX_FD_PAYLOAD_LEN)
+            throw std::invalid_argument("descriptor payload too long: " + std::to_string(payload.length()));
+
+        std::string frame(2, '\0');
+        frame[0] = static_cast<char>(payload.length() >> 8);
+        frame[1] = static_cast<char>(payload.length() & 0xff);
+        frame += payload;
+
+        iovec iov;
+        iov.iov_base = &frame[0];
+        iov.iov_len = frame.length();
+
+        char control[CMSG_SPACE(sizeof(int))];
+        ZeroMemory(control, sizeof(control));
+
+        msghdr msg;
+        ZeroMemory(&msg, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (fd >= 0) {
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        size_t sent = 0;
+
+        while (sent < frame.length()) {
+            const auto result = TEMP_FAILURE_RETRY(sendmsg(channel, &msg, MSG_NOSIGNAL));
+
+            if (result == SOCKET_ERROR)
+                throw ConnectionException::create("failed to pass descriptor");
+
+            // descriptor has gone with the first chunk; send the rest as plain data
+            sent += result;
+            iov.iov_base = &frame[sent];
+            iov.iov_len = frame.length() - sent;
+            msg.msg_control = nullptr;
+            msg.msg_controllen = 0;
+        }
+    }
+
+
+    bool receive_fd(socket_t channel, int* fd, std::string* payload) {
+        unsigned char header[2];
+        char control[CMSG_SPACE(sizeof(int))];
+
+        iovec iov;
+        iov.iov_base = header;
+        iov.iov_len = sizeof(header);
+
+        msghdr msg;
+        ZeroMemory(&msg, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        *fd = -1;
+
+        const auto result = TEMP_FAILURE_RETRY(recvmsg(channel, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC));
+
+        if (result == 0)
+            return false;
+
+        if (result != sizeof(header))
+            throw ConnectionException::create("failed to receive descriptor", result == SOCKET_ERROR);
+
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        const size_t length = (static_cast<size_t>(header[0]) << 8) | header[1];
+        payload->assign(length, '\0');
+
+        if (length > 0 && TEMP_FAILURE_RETRY(::recv(channel, &(*payload)[0], length, MSG_WAITALL)) != static_cast<ssize_t>(length)) {
+            if (*fd >= 0) ::close(*fd);
+            throw ConnectionException::create("failed to receive descriptor payload");
+        }
+
+        return true;
+    }
+
+
+    bool is_local_socket(socket_t s) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+
+        if (getsockname(s, reinterpret_cast<sockaddr*>(&addr), &len) == SOCKET_ERROR)
+            return false;
+
+        return addr.ss_family == AF_UNIX;
+    }
+}
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+#ifndef WIN32
+#include <string>
+#include "Transport.h"
+
+namespace connection {
+    constexpr int MAX_FD_PAYLOAD_LEN = 4096;
+
+    // Pass an open file descriptor to the process on the other end of a Unix domain
+    // socket (SCM_RIGHTS), along with a payload describing it. The receiver gets its own
+    // descriptor for the same open file or socket; the sender's copy is unaffected.
+    // fd may be -1 to send the payload alone
+    void send_fd(socket_t channel, int fd, const std::string& payload);
+
+    // Returns false if the peer closed the channel. *fd is -1 if the message carried none
+    bool receive_fd(socket_t channel, int* fd, std::string* payload);
+
+    // true if s is a Unix domain socket, the only kind descriptors can be passed over
+    bool is_local_socket(socket_t s);
+}
+#endif
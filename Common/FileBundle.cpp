@@ -0,0 +1,470 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "FileBundle.h"
+#include "ArrayStream.h"
+#include "Checksum.h"
+
+namespace connection {
+    static_assert(BUNDLE_HEADER_LEN + MAX_BUNDLE_NAME_LEN <= BufferPool::BUFFER_SIZE, "a whole header must fit in one pool buffer");
+
+    // size and permission bits of a regular file. False if path isn't one
+    static bool file_info(const std::string& path, uint64_t* size, uint32_t* mode) {
+#ifdef WIN32
+        struct _stat64 st;
+
+        if (_stat64(path.c_str(), &st) != 0 || !(st.st_mode & _S_IFREG))
+            return false;
+
+        *mode = (st.st_mode & _S_IWRITE) ? 0644 : 0444;
+#else
+        struct stat st;
+
+        if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            return false;
+
+        *mode = st.st_mode & 0777;
+#endif
+        *size = static_cast<uint64_t>(st.st_size);
+        return true;
+    }
+
+
+    static bool valid_name(const std::string& name) {
+        return !name.empty() && name != "." && name != ".." && name.find_first_of("/\\") == std::string::npos;
+    }
+
+
+    // writes the file straight to its own name, truncating whatever was there
+    class FileSink : public BundleSink {
+        std::string path_;
+        std::ofstream output_;
+        bool discard_;          // this opened the file, and it hasn't been committed
+
+        public:
+            explicit FileSink(const std::string& path) : path_(path), output_(path, std::ios::binary | std::ios::trunc) {
+                discard_ = output_.is_open();
+            }
+
+            ~FileSink() {
+                if (discard_) {
+                    output_.close();
+                    ::remove(path_.c_str());
+                }
+            }
+
+            bool is_open() const { return output_.is_open(); }
+
+            bool write(const char* data, size_t len) override {
+                output_.write(data, len);
+                return output_.good();
+            }
+
+            std::string commit(uint32_t mode) override {
+                output_.close();
+
+                if (!output_)
+                    return "failed to write";
+
+#ifndef WIN32
+                ::chmod(path_.c_str(), mode);
+#else
+                (void)mode;
+#endif
+                discard_ = false;
+                return std::string();
+            }
+    };
+
+
+    static BundleSink::Ptr open_file_sink(const BundleEntry&, const std::string& path, std::string* reason) {
+        auto* file = new FileSink(path);
+        BundleSink::Ptr sink(file);
+
+        if (!file->is_open()) {
+            *reason = "failed to open for writing";
+            return nullptr;
+        }
+
+        return sink;
+    }
+
+
+    // the sender's permissions, except that nothing arrives writable by anyone else
+    static uint32_t arriving_mode(const BundleEntry& entry) {
+        return entry.mode & 0755;
+    }
+
+
+    // returns why the file couldn't be written, or an empty string once it has been
+    static std::string write_file(const BundleOpener& open, const BundleEntry& entry, const std::string& path, const char* data, size_t len) {
+        std::string reason;
+        const auto sink = open(entry, path, &reason);
+
+        if (!sink)
+            return reason;
+
+        if (!sink->write(data, len))
+            return "failed to write";
+
+        return sink->commit(arriving_mode(entry));
+    }
+
+
+    // -------------------------------------------------------
+    // BundleWriter
+    // -------------------------------------------------------
+    BundleWriter::BundleWriter(Connection& channel)
+        : channel_(channel), lease_(BufferPool::shared().acquire()), used_(0), files_(0), bytes_(0) {}
+
+
+    bool BundleWriter::add(const std::string& name, const std::string& path) {
+        if (name.empty() || name.length() > MAX_BUNDLE_NAME_LEN)
+            throw std::invalid_argument("bundle entry name must be 1 to " + std::to_string(MAX_BUNDLE_NAME_LEN) + " bytes: '" + name + "'");
+
+        uint64_t size = 0;
+        uint32_t mode = 0;
+
+        if (!file_info(path, &size, &mode))
+            return false;
+
+        std::ifstream input(path, std::ios::binary);
+
+        if (!input.is_open())
+            return false;
+
+        const size_t headerLen = BUNDLE_HEADER_LEN + name.length();
+
+        // small file: read it straight into the buffer, behind room for its header, which is
+        // filled in once the contents (and so the checksum) are known
+        if (headerLen + size <= lease_.size()) {
+            if (used_ + headerLen + size > lease_.size())
+                flush();
+
+            char* contents = lease_.data() + used_ + headerLen;
+
+            input.read(contents, static_cast<std::streamsize>(size));
+
+            const auto got = static_cast<uint64_t>(input.gcount()); // less if the file has shrunk since
+            put_header(BundleEntry{ name, got, mode, crc32(0, contents, static_cast<size_t>(got)) });
+
+            used_ += static_cast<size_t>(got);
+            ++files_;
+            bytes_ += got;
+
+            return true;
+        }
+
+        // big file: one pass for the checksum (and the size as it is now), another to send it
+        uint32_t crc = 0;
+        uint64_t actual = 0;
+
+        {
+            auto scratch = BufferPool::shared().acquire();
+
+            while (input.read(scratch.data(), scratch.size()) || input.gcount() > 0) {
+                crc = crc32(crc, scratch.data(), static_cast<size_t>(input.gcount()));
+                actual += static_cast<uint64_t>(input.gcount());
+            }
+        }
+
+        input.clear();
+        input.seekg(0, input.beg);
+
+        if (used_ + headerLen > lease_.size())
+            flush();
+
+        put_header(BundleEntry{ name, actual, mode, crc });
+
+        for (uint64_t left = actual; left > 0;) {
+            if (used_ == lease_.size())
+                flush();
+
+            const auto want = static_cast<size_t>(std::min<uint64_t>(left, lease_.size() - used_));
+
+            input.read(lease_.data() + used_, want);
+
+            // shrunk since the first pass: keep the framing, and let the checksum give it away
+            const auto got = static_cast<size_t>(input.gcount());
+
+            if (got < want)
+                memset(lease_.data() + used_ + got, 0, want - got);
+
+            used_ += want;
+            left -= want;
+        }
+
+        ++files_;
+        bytes_ += actual;
+
+        return true;
+    }
+
+
+    void BundleWriter::finish() {
+        if (used_ + BUNDLE_HEADER_LEN > lease_.size())
+            flush();
+
+        put_header(BundleEntry{ "", 0, 0, 0 });
+        flush();
+    }
+
+
+    // writes entry's header at the end of the buffer, which must have room for it
+    void BundleWriter::put_header(const BundleEntry& entry) {
+        const size_t headerLen = BUNDLE_HEADER_LEN + entry.name.length();
+        ArrayStream buf(lease_.data() + used_, headerLen);
+        NetworkDataStream ds(buf);
+
+        ds << static_cast<uint16_t>(entry.name.length());
+        ds.write_str(entry.name);
+        ds << entry.size << entry.mode << entry.crc;
+
+        used_ += headerLen;
+    }
+
+
+    void BundleWriter::flush() {
+        for (size_t sent = 0; sent < used_;)
+            sent += channel_.transport().send(lease_.data() + sent, static_cast<int>(used_ - sent));
+
+        used_ = 0;
+    }
+
+
+    // -------------------------------------------------------
+    // BundleReader
+    // -------------------------------------------------------
+    BundleReader::BundleReader(Connection& channel, long timeoutMs)
+        : channel_(channel), timeoutMs_(timeoutMs), lease_(BufferPool::shared().acquire()), begin_(0), end_(0), remaining_(0) {}
+
+
+    bool BundleReader::next(BundleEntry* entry) {
+        if (remaining_ > 0)
+            read([](const char*, size_t) {});
+
+        fill(sizeof(uint16_t));
+
+        uint16_t nameLen = 0;
+
+        {
+            ArrayStream buf(lease_.data() + begin_, sizeof(nameLen), sizeof(nameLen));
+            NetworkDataStream ds(buf);
+
+            ds >> nameLen;
+        }
+
+        if (nameLen > MAX_BUNDLE_NAME_LEN)
+            throw ConnectionException("malformed bundle: " + std::to_string(nameLen) + " byte file name");
+
+        const size_t headerLen = BUNDLE_HEADER_LEN + nameLen;
+
+        fill(headerLen);
+
+        ArrayStream buf(lease_.data() + begin_, headerLen, headerLen);
+        NetworkDataStream ds(buf);
+
+        ds >> nameLen;
+        entry->name = ds.read_str(nameLen);
+        ds >> entry->size >> entry->mode >> entry->crc;
+
+        begin_ += headerLen;
+        remaining_ = nameLen > 0 ? entry->size : 0;
+
+        return nameLen > 0;
+    }
+
+
+    void BundleReader::read(const std::function<void(const char*, size_t)>& onData) {
+        while (remaining_ > 0) {
+            if (begin_ == end_) {
+                begin_ = end_ = 0;
+                fill(1);
+            }
+
+            const auto len = static_cast<size_t>(std::min<uint64_t>(remaining_, end_ - begin_));
+
+            onData(lease_.data() + begin_, len);
+
+            begin_ += len;
+            remaining_ -= len;
+        }
+    }
+
+
+    // makes sure at least atLeast bytes (no more than a buffer) are buffered from begin_ on
+    void BundleReader::fill(size_t atLeast) {
+        if (end_ - begin_ >= atLeast)
+            return;
+
+        if (begin_ > 0) {
+            memmove(lease_.data(), lease_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+
+        while (end_ < atLeast) {
+            bool timedOut = false;
+            const auto got = channel_.transport().receive(lease_.data() + end_, static_cast<int>(lease_.size() - end_), timeoutMs_, &timedOut);
+
+            if (got <= 0)
+                throw ConnectionException(timedOut ? "timed out waiting for the rest of the bundle" : "bundle ended early: peer closed the connection");
+
+            end_ += got;
+        }
+    }
+
+
+    // -------------------------------------------------------
+    // receive_bundle
+    // -------------------------------------------------------
+    BundleResult receive_bundle(Connection& channel, const std::string& directory, BundleFilter accept, long timeoutMs, BundleOpener open) {
+        struct Job {
+            BundleEntry entry;
+            std::vector<char> contents;
+        };
+
+        BundleResult result;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<Job> queue;
+        size_t queuedBytes = 0;
+        bool done = false;
+
+        if (!open)
+            open = open_file_sink;
+
+        const auto path_of = [&directory](const std::string& name) {
+            return directory.empty() ? name : directory + "/" + name;
+        };
+
+        const auto record = [&](const std::string& name, uint64_t bytes, const std::string& failure) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (failure.empty()) {
+                ++result.files;
+                result.bytes += bytes;
+            } else result.failed.push_back(name + ": " + failure);
+        };
+
+        std::vector<std::thread> writers;
+
+        for (size_t i = 0; i < BUNDLE_WRITERS; ++i) {
+            writers.emplace_back([&]() {
+                while (true) {
+                    Job job;
+
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        changed.wait(lock, [&]() { return !queue.empty() || done; });
+
+                        if (queue.empty())
+                            return;
+
+                        job = std::move(queue.front());
+                        queue.pop_front();
+                        queuedBytes -= job.contents.size();
+                    }
+
+                    changed.notify_all(); // room for the reader
+
+                    std::string failure;
+
+                    if (crc32(0, job.contents.data(), job.contents.size()) != job.entry.crc)
+                        failure = "checksum mismatch";
+                    else failure = write_file(open, job.entry, path_of(job.entry.name), job.contents.data(), job.contents.size());
+
+                    record(job.entry.name, job.contents.size(), failure);
+                }
+            });
+        }
+
+        const auto stop_writers = [&]() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done = true;
+            }
+
+            changed.notify_all();
+
+            for (auto& writer : writers)
+                writer.join();
+        };
+
+        try {
+            BundleReader reader(channel, timeoutMs);
+            BundleEntry entry;
+
+            while (reader.next(&entry)) {
+                std::string reason;
+
+                // anything skipped has its contents passed over by the next call to next()
+                if (!valid_name(entry.name)) {
+                    record(entry.name, 0, "file names may not contain a path");
+                    continue;
+                }
+
+                if (accept && !accept(entry, &reason)) {
+                    record(entry.name, 0, reason);
+                    continue;
+                }
+
+                // too big to hold in memory while it waits its turn: write it out as it arrives
+                if (entry.size > BUNDLE_MAX_QUEUED_FILE) {
+                    const auto sink = open(entry, path_of(entry.name), &reason);
+                    uint32_t crc = 0;
+                    bool written = true;
+
+                    if (!sink) {
+                        record(entry.name, 0, reason);
+                        continue;
+                    }
+
+                    reader.read([&](const char* data, size_t len) {
+                        crc = crc32(crc, data, len);
+                        written = written && sink->write(data, len);
+                    });
+
+                    // a sink not committed throws away what it was given
+                    const std::string failure = !written ? "failed to write" : crc != entry.crc ? "checksum mismatch" : sink->commit(arriving_mode(entry));
+
+                    record(entry.name, entry.size, failure);
+                    continue;
+                }
+
+                Job job{ entry, std::vector<char>(static_cast<size_t>(entry.size)) };
+                size_t at = 0;
+
+                reader.read([&](const char* data, size_t len) {
+                    memcpy(job.contents.data() + at, data, len);
+                    at += len;
+                });
+
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    changed.wait(lock, [&]() { return queue.empty() || queuedBytes + job.contents.size() <= BUNDLE_QUEUE_BYTES; });
+
+                    queuedBytes += job.contents.size();
+                    queue.push_back(std::move(job));
+                }
+
+                changed.notify_all();
+            }
+        }
+        catch (...) {
+            stop_writers();
+            throw;
+        }
+
+        stop_writers();
+        return result;
+    }
+
+} // end connection namespace
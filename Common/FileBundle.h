@@ -0,0 +1,133 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "BufferPool.h"
+#include "Connection.h"
+
+namespace connection {
+
+    // MGET and MPUT send many files back to back over one data channel, as a "bundle". Each file
+    // is a header followed by exactly size bytes of its contents:
+    //
+    //   name length (2) | name | size (8) | mode (4) | CRC-32 of contents (4)
+    //
+    // and a header with an empty name ends the bundle
+    struct BundleEntry {
+        std::string name;
+        uint64_t size;
+        uint32_t mode;          // permission bits (0777) on the sending side
+        uint32_t crc;
+    };
+
+    constexpr int BUNDLE_HEADER_LEN = 18;           // not counting the name
+    constexpr int MAX_BUNDLE_NAME_LEN = 1024;
+
+    // bytes a file takes up in a bundle, header included
+    inline uint64_t bundle_entry_len(const std::string& name, uint64_t size) {
+        return BUNDLE_HEADER_LEN + name.length() + size;
+    }
+
+
+    // Packs files into a bundle on channel. Small files are gathered into one buffer and go out
+    // together, so a bundle of many small files costs a send per buffer rather than per file
+    class BundleWriter {
+        public:
+            explicit BundleWriter(Connection& channel);
+
+            // sends the file at path under name. Returns false, having sent nothing, if it can't be read
+            bool add(const std::string& name, const std::string& path);
+
+            // ends the bundle and sends whatever is still buffered
+            void finish();
+
+            uint64_t files() const { return files_; }
+            uint64_t bytes() const { return bytes_; }
+
+        private:
+            Connection& channel_;
+            BufferPool::Lease lease_;
+            size_t used_;
+            uint64_t files_;
+            uint64_t bytes_;
+
+            void put_header(const BundleEntry& entry);
+            void flush();
+
+            BundleWriter(const BundleWriter& other) = delete;
+            BundleWriter& operator=(const BundleWriter& other) = delete;
+    };
+
+
+    // Unpacks a bundle arriving on channel
+    class BundleReader {
+        public:
+            BundleReader(Connection& channel, long timeoutMs);
+
+            // reads the next header. Returns false once the bundle has ended; throws if it's malformed.
+            // Anything left unread of the previous entry's contents is skipped
+            bool next(BundleEntry* entry);
+
+            // hands the current entry's contents to onData, a piece at a time
+            void read(const std::function<void(const char*, size_t)>& onData);
+
+        private:
+            Connection& channel_;
+            long timeoutMs_;
+            BufferPool::Lease lease_;
+            size_t begin_;
+            size_t end_;
+            uint64_t remaining_;        // contents of the current entry not yet read
+
+            void fill(size_t atLeast);
+
+            BundleReader(const BundleReader& other) = delete;
+            BundleReader& operator=(const BundleReader& other) = delete;
+    };
+
+
+    struct BundleResult {
+        uint64_t files = 0;                 // written and verified
+        uint64_t bytes = 0;
+        std::vector<std::string> failed;    // "name: reason" for each file not written
+    };
+
+    // return false to skip an entry, giving the reason
+    typedef std::function<bool(const BundleEntry& entry, std::string* reason)> BundleFilter;
+
+
+    // Where receive_bundle writes one file. By default that's straight into the file under its own
+    // name; the server stages each one instead (see StagedUpload), so nobody sees a file half written
+    class BundleSink {
+        public:
+            typedef std::unique_ptr<BundleSink> Ptr;
+
+            virtual ~BundleSink() {}    // gets rid of whatever was written, unless it was committed
+
+            // appends len bytes. False if they couldn't be written
+            virtual bool write(const char* data, size_t len) = 0;
+
+            // the whole file has arrived and its checksum matches: gives it permission bits mode and
+            // keeps it. Returns why it couldn't be kept, or an empty string
+            virtual std::string commit(uint32_t mode) = 0;
+    };
+
+    // opens a sink for entry, to be written at path. nullptr, giving the reason, if it can't be
+    typedef std::function<BundleSink::Ptr(const BundleEntry& entry, const std::string& path, std::string* reason)> BundleOpener;
+
+
+    // writes every file of the bundle on channel into directory, through sinks from open if given.
+    // Entries are read off the channel on this thread and handed to a small pool of writers, so slow
+    // disk writes overlap with the network and with each other; at most BUNDLE_QUEUE_BYTES of
+    // contents wait in memory. Files too big for that are written on this thread as they arrive.
+    // Names with a path in them are always refused, and a file whose checksum doesn't match is
+    // never kept
+    BundleResult receive_bundle(Connection& channel, const std::string& directory, BundleFilter accept, long timeoutMs, BundleOpener open = nullptr);
+
+    constexpr size_t BUNDLE_WRITERS = 4;
+    constexpr size_t BUNDLE_QUEUE_BYTES = 8 * 1024 * 1024;
+    constexpr uint64_t BUNDLE_MAX_QUEUED_FILE = 1024 * 1024;
+
+} // end connection namespace
@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+
+namespace connection {
+
+    // true if name matches pattern, where '*' stands for any run of characters and '?' for any
+    // one character. Everything else matches only itself
+    inline bool glob_match(const char* pattern, const char* name) {
+        const char* starPattern = nullptr;      // just past the last '*' seen, to backtrack to
+        const char* starName = nullptr;
+
+        while (*name) {
+            if (*pattern == '*') {
+                starPattern = ++pattern;
+                starName = name;
+            } else if (*pattern == '?' || *pattern == *name) {
+                ++pattern;
+                ++name;
+            } else if (starPattern) {
+                // let the last '*' swallow one more character and try again from there
+                pattern = starPattern;
+                name = ++starName;
+            } else return false;
+        }
+
+        while (*pattern == '*')
+            ++pattern;
+
+        return *pattern == '\0';
+    }
+
+    inline bool is_glob(const std::string& pattern) {
+        return pattern.find_first_of("*?") != std::string::npos;
+    }
+
+} // end connection namespace
@@ -0,0 +1,202 @@
+#include "stdafx.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "LingeringCloser.h"
+#include "Metrics.h"
+#include "SocketCompat.h"
+
+#ifdef WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+namespace connection {
+    constexpr int LINGER_POLL_MS = 50;  // how long the reaper blocks in poll before rechecking deadlines and new arrivals
+    constexpr size_t LINGER_DRAIN_LIMIT = 64 * 1024;    // most read from one transport before the reaper moves on to the others
+
+    typedef std::chrono::steady_clock Clock;
+
+    struct Lingering {
+        Transport::Ptr transport;
+        Clock::time_point deadline;
+    };
+
+    // shared with the reaper thread, which is detached and may outlive static destruction
+    // at exit: allocated once and never freed
+    struct ReaperState {
+        std::mutex mutex;
+        std::condition_variable arrived;
+        std::vector<Lingering> pending;         // handed over but not yet picked up by the reaper
+        bool running = false;
+        bool woken = false;                     // a transport without a socket may be readable
+    };
+
+    static ReaperState& state() {
+        static auto s = new ReaperState();
+        return *s;
+    }
+
+    static metrics::Counter& lingering_metric() {
+        static auto& gauge = metrics::counter("connection.lingering");
+        return gauge;
+    }
+
+    static metrics::Counter& expired_metric() {
+        static auto& count = metrics::counter("connection.linger_expired");
+        return count;
+    }
+
+
+    // reads whatever the peer still has to say, up to LINGER_DRAIN_LIMIT and no later than deadline,
+    // so a peer that keeps sending can't hold up the rest. Only what has arrived already is read:
+    // waiting for more would hold up the rest too. Returns true once the transport is finished
+    // with: the peer has closed its end, or the transport has failed
+    static bool drain(Transport& transport, Clock::time_point deadline) {
+        char buf[1024];
+        bool timedOut = false;
+        size_t drained = 0;
+
+        try {
+            while (drained < LINGER_DRAIN_LIMIT && Clock::now() < deadline && transport.readable()) {
+                const auto bytes = transport.receive(buf, sizeof(buf), 1, &timedOut);
+
+                if (timedOut)
+                    return false;
+
+                if (bytes == 0)
+                    return true;
+
+                drained += static_cast<size_t>(bytes);
+            }
+
+            return false;
+        }
+        catch (const ConnectionException&) {
+            return true;
+        }
+    }
+
+
+    static void reap() {
+        std::vector<Lingering> active;
+        std::vector<pollfd> fds;
+
+        while (true) {
+            {
+                auto& st = state();
+                std::unique_lock<std::mutex> lock(st.mutex);
+
+                if (active.empty())
+                    st.arrived.wait(lock, [&st]() { return !st.pending.empty(); });
+
+                for (auto& item : st.pending)
+                    active.push_back(std::move(item));
+
+                st.pending.clear();
+            }
+
+            fds.resize(active.size());
+
+            bool sockets = false;
+
+            for (size_t i = 0; i < active.size(); ++i) {
+                fds[i].fd = active[i].transport->native_handle();
+                fds[i].events = POLLIN;
+                fds[i].revents = 0;
+                sockets = sockets || fds[i].fd != INVALID_SOCKET;
+            }
+
+            // transports without a socket (fd of -1) are ignored by poll. With nothing else to
+            // wait on, wait to be woken for them instead
+            if (sockets) {
+                if (poll(fds.data(), static_cast<unsigned long>(fds.size()), LINGER_POLL_MS) == SOCKET_ERROR)
+                    std::this_thread::sleep_for(std::chrono::milliseconds(LINGER_POLL_MS));
+            } else {
+                auto& st = state();
+                std::unique_lock<std::mutex> lock(st.mutex);
+
+                st.arrived.wait_for(lock, std::chrono::milliseconds(LINGER_POLL_MS), [&st]() { return st.woken || !st.pending.empty(); });
+            }
+
+            // anything woken for from here on is looked at on the next pass
+            {
+                auto& st = state();
+                std::lock_guard<std::mutex> lock(st.mutex);
+
+                st.woken = false;
+            }
+
+            size_t kept = 0;
+
+            for (size_t i = 0; i < active.size(); ++i) {
+                bool finished = false;
+
+                if (fds[i].revents != 0 || (fds[i].fd == INVALID_SOCKET && active[i].transport->readable()))
+                    finished = drain(*active[i].transport, active[i].deadline);
+
+                if (!finished && Clock::now() >= active[i].deadline) {
+                    ++expired_metric();
+                    finished = true;
+                }
+
+                if (finished) {
+                    active[i].transport->close();
+                    --lingering_metric();
+                } else {
+                    if (kept != i)
+                        active[kept] = std::move(active[i]);
+                    ++kept;
+                }
+            }
+
+            active.resize(kept);
+        }
+    }
+
+
+    void LingeringCloser::adopt(Transport::Ptr transport) {
+        if (!transport || !transport->is_open())
+            return;
+
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+
+        if (static_cast<size_t>(lingering_metric().load()) >= MAX_LINGERING) {
+            ++expired_metric();
+            transport->close(); // over budget: the peer will see a reset instead of a clean close
+            return;
+        }
+
+        if (!st.running) {
+            std::thread(reap).detach();
+            st.running = true;
+        }
+
+        st.pending.push_back(Lingering{ std::move(transport), Clock::now() + std::chrono::milliseconds(LINGER_TIMEOUT_MS) });
+        ++lingering_metric();
+
+        st.arrived.notify_one();
+    }
+
+
+    size_t LingeringCloser::lingering() {
+        return static_cast<size_t>(lingering_metric().load());
+    }
+
+
+    void LingeringCloser::wake() {
+        auto& st = state();
+        std::lock_guard<std::mutex> lock(st.mutex);
+
+        if (!st.running || lingering_metric().load() == 0)
+            return;
+
+        st.woken = true;
+        st.arrived.notify_one();
+    }
+
+} // end connection namespace
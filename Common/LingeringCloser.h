@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+#include "Transport.h"
+
+namespace connection {
+
+    // Owns half-closed transports until the peer closes its end, so the thread that
+    // finished a transfer doesn't have to sit and wait for that. A single background
+    // thread drains and closes everything handed to it; a transport whose peer hasn't
+    // closed within LINGER_TIMEOUT_MS is closed anyway. Sockets are waited on with poll();
+    // a transport without one (a v2 stream) is only read once it's readable(), and should
+    // wake() the closer when it becomes so, or wait for its next look, LINGER_POLL_MS on
+    class LingeringCloser {
+        public:
+            constexpr static long LINGER_TIMEOUT_MS = 5000;
+            constexpr static size_t MAX_LINGERING = 4096;    // past this, new transports are closed immediately
+
+            // transport must already have had shutdown_send() called
+            static void adopt(Transport::Ptr transport);
+
+            // number of transports still waiting on their peer (also the connection.lingering metric)
+            static size_t lingering();
+
+            // a transport without a socket may have become readable: look at them all again. It only
+            // cuts the wait short while none of the transports held has a socket to poll
+            static void wake();
+    };
+
+} // end connection namespace
@@ -7,6 +7,7 @@
 namespace connection {
     constexpr int MESSAGE_BYTE_LEN = 13;            // note: NOT sizeof! platform and packing differences can result in different sizeof()
     constexpr int MAX_PAYLOAD_LEN = 1024;          // set a limit to max payload, else it would be possible craft messages that consume all of a server's memory 
+    constexpr int MAX_INLINE_PAYLOAD_LEN = 1024 * 16; // OK responses may carry small files and listings inline, up to this many bytes
     constexpr int CHUNK_SIZE = 1024 * 32;          // read up to this many bytes at a time from receive buffer
 
 
@@ -15,9 +16,17 @@ namespace connection {
 
     enum MSGID : uint8_t {
         MESSAGE_LS = 1,
-        MESSAGE_GET,
-        MESSAGE_PUT,
+        MESSAGE_GET,            // payload: the file name, then to follow it as it grows a line "follow <offset> <idle ms>" (see FLAG_FOLLOW)
+        MESSAGE_PUT,            // payload: the file name, then for one range of a parallel upload a line "<offset> <file size>". Data: datalen bytes
         MESSAGE_QUIT,
+        MESSAGE_MGET,           // payload: file names or glob patterns, one per line. Data: a bundle (FileBundle.h)
+        MESSAGE_MPUT,           // payload: what the client asked to send, for the record. Data: a bundle, answered on the data channel by
+                                //   an OK with the number of files written as datalen and a "name: reason" line for each that wasn't
+        MESSAGE_TREE,           // payload: a directory, empty for the server's own. Data: its manifest (TreeManifest.h)
+        MESSAGE_COPY,           // payload: source and destination, one per line. Done on the server: no data
+        MESSAGE_MOVE,           // same as COPY
+        MESSAGE_STAT,           // payload: a stat request (StatBatch.h), or empty and datalen bytes of one follow. Data: the entries
+        MESSAGE_WATCH,          // v2 only. No payload. Changes to the server's files follow on the stream until the client ends it (see FLAG_EVENT)
 
         MESSAGE_HELLO = 32,
 
@@ -25,6 +34,17 @@ namespace connection {
         MESSAGE_ERROR = 200
     };
 
+    // carried in the flags field of an OK response
+    enum MSGFLAG : uint16_t {
+        FLAG_NONE = 0,
+        FLAG_INLINE = 1,        // payload holds all datalen bytes: no data channel will be opened
+        FLAG_DESCRIPTOR = 2,    // the open file follows on the control socket (SCM_RIGHTS): read datalen bytes from it
+        FLAG_PROGRESS = 4,      // not the final response: datalen bytes of the payload's total are done so far
+        FLAG_EVENT = 8,         // not the final response: changes to files, "<created|modified|deleted> <name>" a line, or "overflow" if some were lost
+        FLAG_FOLLOW = 16        // datalen bytes are there now, and what's appended follows until the data ends: the file has gone quiet for
+                                // the idle time asked for (0: no limit), been renamed, removed or truncated, or either side has given up
+    };
+
     enum MSGECODE : uint16_t {
         ERR_UNKNOWN = 255,    
         ERR_FAILED_TO_OPEN = 1,
@@ -32,7 +52,8 @@ namespace connection {
         ERR_INVALID_FILENAME,
         ERR_NOT_A_FILE,
         ERR_ALREADY_EXISTS,
-        ERR_UNRECOGNIZED_COMMAND 
+        ERR_UNRECOGNIZED_COMMAND,
+        ERR_SESSION_EXPIRED         // answering a HELLO that asked to resume a session the server no longer has
     };
 
 
@@ -48,6 +69,7 @@ namespace connection {
             CASE_TO_STR(ERR_NOT_A_FILE);
             CASE_TO_STR(ERR_UNRECOGNIZED_COMMAND);
             CASE_TO_STR(ERR_ALREADY_EXISTS);
+            CASE_TO_STR(ERR_SESSION_EXPIRED);
         default:
             return "unknown error";
         }
@@ -61,6 +83,7 @@ namespace connection {
             CASE_TO_R_STR(ERR_NOT_A_FILE, "not a file");
             CASE_TO_R_STR(ERR_UNRECOGNIZED_COMMAND, "command not recognized");
             CASE_TO_R_STR(ERR_ALREADY_EXISTS, "file already exists");
+            CASE_TO_R_STR(ERR_SESSION_EXPIRED, "session expired");
 
             default:
                 return "no description";
@@ -74,6 +97,13 @@ namespace connection {
             CASE_TO_STR(MESSAGE_GET);
             CASE_TO_STR(MESSAGE_PUT);
             CASE_TO_STR(MESSAGE_QUIT);
+            CASE_TO_STR(MESSAGE_MGET);
+            CASE_TO_STR(MESSAGE_MPUT);
+            CASE_TO_STR(MESSAGE_TREE);
+            CASE_TO_STR(MESSAGE_COPY);
+            CASE_TO_STR(MESSAGE_MOVE);
+            CASE_TO_STR(MESSAGE_STAT);
+            CASE_TO_STR(MESSAGE_WATCH);
             CASE_TO_STR(MESSAGE_HELLO);
             CASE_TO_STR(MESSAGE_OK);
             CASE_TO_STR(MESSAGE_ERROR);
@@ -84,6 +114,28 @@ namespace connection {
     }
 
 
+    // the command as a user would type it: how it's labelled in traces (Trace.h)
+    inline const char* command_name(const MSGID msg) {
+        switch (msg) {
+            CASE_TO_R_STR(MESSAGE_LS, "LS");
+            CASE_TO_R_STR(MESSAGE_GET, "GET");
+            CASE_TO_R_STR(MESSAGE_PUT, "PUT");
+            CASE_TO_R_STR(MESSAGE_QUIT, "QUIT");
+            CASE_TO_R_STR(MESSAGE_MGET, "MGET");
+            CASE_TO_R_STR(MESSAGE_MPUT, "MPUT");
+            CASE_TO_R_STR(MESSAGE_TREE, "TREE");
+            CASE_TO_R_STR(MESSAGE_COPY, "COPY");
+            CASE_TO_R_STR(MESSAGE_MOVE, "MOVE");
+            CASE_TO_R_STR(MESSAGE_STAT, "STAT");
+            CASE_TO_R_STR(MESSAGE_WATCH, "WATCH");
+            CASE_TO_R_STR(MESSAGE_HELLO, "HELLO");
+
+            default:
+                return "unknown command";
+        }
+    }
+
+
 #undef CASE_TO_STR
 
     struct Message {
@@ -93,6 +145,8 @@ namespace connection {
         union {
             port_t port;
             MSGECODE ecode;
+            uint16_t flags;         // OK: MSGFLAG bits
+            uint16_t inlineLimit;   // HELLO from client: largest payload it accepts inline, 0 for none
         };
         std::string payload;
 
@@ -109,7 +163,7 @@ namespace connection {
             return !(*this == other);
         }
 
-        std::string to_string() {
+        std::string to_string() const {
             std::ostringstream buf;
 
             buf << "STATUS CODE " << +(static_cast<int>(msgid)) << " " << connection::to_string(msgid) << std::endl;
@@ -127,6 +181,12 @@ namespace connection {
 
 
 
+    // largest payload a message of this type may carry
+    inline int max_payload_len(MSGID msgid) {
+        return msgid == MSGID::MESSAGE_OK ? MAX_INLINE_PAYLOAD_LEN : MAX_PAYLOAD_LEN;
+    }
+
+
 #define ZERO_MSG(msg) (msg)->msgid = MESSAGE_ERROR; (msg)->msglen = 0; (msg)->datalen = 0; (msg)->port = 0; (msg)->payload = "";
 
     inline Message MAKE_MSG(MSGID msgid, uint32_t datalen, port_t portOrEcode, const std::string& payload) {
@@ -0,0 +1,41 @@
+#include "stdafx.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include "Metrics.h"
+
+namespace metrics {
+    static std::mutex g_mutex;
+
+    // unique_ptr so references handed out stay valid as the map grows. Deliberately never
+    // destroyed: detached threads may still be updating counters while the process exits
+    static std::map<std::string, std::unique_ptr<Counter>>& registry() {
+        static auto counters = new std::map<std::string, std::unique_ptr<Counter>>();
+        return *counters;
+    }
+
+
+    Counter& counter(const std::string& name) {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        auto& slot = registry()[name];
+
+        if (!slot)
+            slot.reset(new Counter(0));
+
+        return *slot;
+    }
+
+
+    std::string snapshot() {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        std::ostringstream stream;
+
+        for (const auto& kvp : registry()) {
+            if (stream.tellp() > 0) stream << " ";
+            stream << kvp.first << "=" << kvp.second->load();
+        }
+
+        return stream.str();
+    }
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+// Process-wide named counters and gauges. Counters are created on first use and live
+// for the rest of the process, so hot paths should look one up once and keep the
+// reference:
+//
+//     static auto& bytesSent = metrics::counter("connection.bytes_sent");
+//     bytesSent += n;
+namespace metrics {
+    typedef std::atomic<int64_t> Counter;
+
+    Counter& counter(const std::string& name);
+
+    // every counter as "name=value" pairs separated by spaces, sorted by name
+    std::string snapshot();
+}
@@ -0,0 +1,651 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <chrono>
+#include <string.h>
+#include <thread>
+#include <vector>
+#include "Multiplexer.h"
+#include "ArrayStream.h"
+#include "BufferPool.h"
+#include "LingeringCloser.h"
+#include "Metrics.h"
+#include "SocketCompat.h"
+
+#ifndef WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+namespace connection {
+    constexpr long MUX_POLL_MS = 100;   // the reader blocks this long at most between checks for being asked to stop (unless set otherwise)
+
+    static_assert(Multiplexer::FRAME_HEADER_LEN + Multiplexer::MAX_FRAME_DATA <= BufferPool::BUFFER_SIZE, "a whole frame must fit in one pool buffer");
+
+    enum FrameType : uint8_t {
+        FRAME_DATA = 1,         // stream bytes. The first DATA frame on a new id opens the stream
+        FRAME_WINDOW,           // payload: uint32 bytes the receiver has consumed and the sender may send again
+        FRAME_RESET             // sender has abandoned the stream
+    };
+
+    enum FrameFlag : uint8_t {
+        FRAME_FIN = 1           // DATA: sender has nothing more to send on this stream
+    };
+
+    struct Multiplexer::Stream {
+        const uint32_t id;
+        std::condition_variable changed;        // waited on by this stream's sender and receiver only
+        std::vector<char> received;
+        size_t readPos = 0;                     // received[readPos..] is still unread
+        uint32_t recvWindow = INITIAL_WINDOW;   // bytes the peer may still send us
+        uint32_t unacknowledged = 0;            // read but not yet credited back to the peer
+        uint32_t sendWindow = INITIAL_WINDOW;   // bytes we may still send the peer
+        bool finSent = false;
+        bool finReceived = false;
+        bool reset = false;
+        bool closed = false;
+
+        explicit Stream(uint32_t streamId) : id(streamId) {}
+    };
+
+
+    // what Connection sees of a stream
+    class MuxStream : public Transport {
+        Multiplexer::Ptr mux_;
+        std::shared_ptr<Multiplexer::Stream> stream_;
+
+        public:
+            MuxStream(Multiplexer::Ptr mux, std::shared_ptr<Multiplexer::Stream> stream) : mux_(std::move(mux)), stream_(std::move(stream)) {}
+            ~MuxStream() { close(); }
+
+            int send(const char* buf, int len) override { return mux_->stream_send(*stream_, buf, len); }
+            int receive(char* buf, int len, long timeoutMs, bool* timedOut) override { return mux_->stream_receive(*stream_, buf, len, timeoutMs, timedOut); }
+            void shutdown_send() override { mux_->stream_shutdown(*stream_); }
+            void close() override { mux_->stream_close(*stream_); }
+
+            bool is_open() const override {
+                std::lock_guard<std::mutex> lock(mux_->mutex_);
+                return !stream_->closed;
+            }
+
+            bool readable() const override {
+                std::lock_guard<std::mutex> lock(mux_->mutex_);
+                return stream_->readPos < stream_->received.size() || stream_->finReceived || stream_->reset || mux_->broken_;
+            }
+
+            socket_t native_handle() const override { return INVALID_SOCKET; }
+            const char* kind() const override { return "mux"; }
+    };
+
+
+    static metrics::Counter& streams_metric() {
+        static auto& gauge = metrics::counter("mux.streams");
+        return gauge;
+    }
+
+
+    Multiplexer::Multiplexer(Connection::Ptr connection, Role role)
+        : connection_(std::move(connection)), nextId_(role == CLIENT ? 1 : 2), lastPeerId_(0),
+          reading_(false), broken_(false), shutdownOnStop_(false), stopping_(false), pollMs_(MUX_POLL_MS), closed_(false) {
+        // empty body
+    }
+
+
+    Multiplexer::Ptr Multiplexer::create(Connection::Ptr connection, Role role, Preamble preamble) {
+        Ptr mux(new Multiplexer(std::move(connection), role));
+
+        mux->preamble_ = std::move(preamble);
+
+        // small frames (opens, window updates, FINs) routinely follow one another: left to Nagle,
+        // each would wait for the peer's delayed ack of the last
+        if (strcmp(mux->connection_->transport().kind(), "tcp") == 0) {
+            int optTrue = 1;
+            setsockopt(mux->connection_->transport().native_handle(), IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&optTrue), sizeof(optTrue));
+        }
+
+        mux->start_reader();
+        return mux;
+    }
+
+
+    Connection::Ptr Multiplexer::open_stream() {
+        std::shared_ptr<Stream> stream;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this]() { return streams_.size() < MAX_STREAMS || broken_; });
+
+            if (broken_)
+                throw ConnectionException("cannot open stream: multiplexed connection lost");
+        }
+
+        {
+            // the peer only treats increasing ids as new streams, so ids must go out in the order they're handed out
+            std::lock_guard<std::mutex> writeLock(writeMutex_);
+            uint32_t id;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                id = nextId_;
+                nextId_ += 2;
+
+                stream = std::make_shared<Stream>(id);
+                streams_[id] = stream;
+                ++streams_metric();
+            }
+
+            send_frame(FRAME_DATA, 0, id, nullptr, 0);
+        }
+
+        return wrap(std::move(stream));
+    }
+
+
+    Connection::Ptr Multiplexer::accept_stream(long timeoutMs, bool* timedOut) {
+        std::shared_ptr<Stream> stream;
+
+        if (timedOut) *timedOut = false;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            const auto ready = [this]() { return !accepted_.empty() || broken_; };
+
+            if (timeoutMs > 0) {
+                if (!changed_.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready)) {
+                    if (timedOut) *timedOut = true;
+                    return nullptr;
+                }
+            } else changed_.wait(lock, ready);
+
+            if (accepted_.empty())
+                return nullptr;
+
+            stream = accepted_.front();
+            accepted_.pop_front();
+        }
+
+        return wrap(std::move(stream));
+    }
+
+
+    size_t Multiplexer::active_streams() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return streams_.size();
+    }
+
+
+    bool Multiplexer::is_open() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return !broken_;
+    }
+
+
+    bool Multiplexer::detach() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (!streams_.empty() || broken_)
+                return false;
+        }
+
+        stop_reader();
+
+        {
+            std::lock_guard<std::mutex> writeLock(writeMutex_);
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (broken_)
+                return false;
+
+            if (streams_.empty()) {
+                closed_ = true;
+                broken_ = true;
+                changed_.notify_all();
+                return true;
+            }
+        }
+
+        // the peer opened a stream while we were stopping: carry on serving it
+        start_reader();
+        return false;
+    }
+
+
+    void Multiplexer::set_poll_interval(long ms) {
+        pollMs_.store(ms);
+    }
+
+
+    void Multiplexer::close() {
+        {
+            std::lock_guard<std::mutex> writeLock(writeMutex_);
+
+            if (closed_)
+                return; // already closed, or detached and no longer ours to shut down
+
+            closed_ = true;
+        }
+
+        bool reading;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            fail_all();
+
+            // the reader may be in the middle of a receive: rather than wait for it, leave
+            // shutting the connection down to it
+            reading = reading_;
+
+            if (reading) {
+                shutdownOnStop_ = true;
+                stopping_ = true;
+            }
+        }
+
+        // streams being drained there have nothing more coming
+        LingeringCloser::wake();
+
+        if (!reading)
+            connection_->shutdown();
+    }
+
+
+    void Multiplexer::start_reader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reading_ = true;
+        }
+
+        // the reader keeps the multiplexer alive until it stops
+        auto self = shared_from_this();
+
+        std::thread([self]() { self->read_frames(); }).detach();
+    }
+
+
+    void Multiplexer::stop_reader() {
+        stopping_ = true;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this]() { return !reading_; });
+        }
+
+        stopping_ = false;
+    }
+
+
+    // reader thread: demultiplexes frames into their streams' buffers until asked to stop, the
+    // connection fails or the peer breaks the protocol. It never writes, so it can't be held up
+    // by a peer that isn't reading. Reads take whatever has arrived, often several frames at once
+    void Multiplexer::read_frames() {
+        auto lease = BufferPool::shared().acquire();
+        char* const buf = lease.data();
+        size_t begin = 0;   // buf[begin, end) has been received but not yet handled
+        size_t end = 0;
+        bool failed = false;
+
+        try {
+            if (preamble_) {
+                preamble_(*connection_);
+                preamble_ = nullptr;
+            }
+
+            while (true) {
+                while (end - begin >= FRAME_HEADER_LEN) {
+                    ArrayStream header(buf + begin, FRAME_HEADER_LEN, FRAME_HEADER_LEN);
+                    NetworkDataStream ds(header);
+                    uint8_t type = 0;
+                    uint8_t flags = 0;
+                    uint32_t id = 0;
+                    uint32_t len = 0;
+
+                    ds >> type >> flags >> id >> len;
+
+                    if (len > MAX_FRAME_DATA)
+                        throw ConnectionException("protocol violation: " + std::to_string(len) + " byte frame");
+
+                    if (end - begin < FRAME_HEADER_LEN + len)
+                        break;
+
+                    handle_frame(type, flags, id, buf + begin + FRAME_HEADER_LEN, len);
+                    begin += FRAME_HEADER_LEN + len;
+                }
+
+                // move what's left of a partial frame to the front: a whole frame always fits
+                if (begin > 0) {
+                    memmove(buf, buf + begin, end - begin);
+                    end -= begin;
+                    begin = 0;
+                }
+
+                // only stop between frames, with nothing half read
+                if (!fill(buf, &end, lease.size(), end == 0))
+                    break;
+            }
+        }
+        catch (const ConnectionException&) {
+            failed = true;
+        }
+
+        bool shutdown = false;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            reading_ = false;
+            shutdown = shutdownOnStop_;
+
+            if (failed)
+                fail_all();
+            else changed_.notify_all();
+        }
+
+        // streams being drained there have nothing more coming
+        if (failed)
+            LingeringCloser::wake();
+
+        if (shutdown)
+            connection_->shutdown();
+    }
+
+
+    void Multiplexer::handle_frame(uint8_t type, uint8_t flags, uint32_t id, char* data, uint32_t len) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = streams_.find(id);
+        std::shared_ptr<Stream> stream = it != streams_.end() ? it->second : nullptr;
+
+        // the first DATA frame on a new, higher id of the peer's parity opens a stream
+        if (!stream && type == FRAME_DATA && id % 2 != nextId_ % 2 && id > lastPeerId_) {
+            if (streams_.size() >= 2 * MAX_STREAMS)
+                throw ConnectionException("protocol violation: peer opened more than " + std::to_string(2 * MAX_STREAMS) + " streams");
+
+            stream = std::make_shared<Stream>(id);
+            streams_[id] = stream;
+            lastPeerId_ = id;
+            accepted_.push_back(stream);
+            ++streams_metric();
+            changed_.notify_all();
+        }
+
+        // anything else is for a stream we've finished with already: nothing left to do with it
+        if (!stream)
+            return;
+
+        switch (type) {
+            case FRAME_DATA:
+                if (len > stream->recvWindow)
+                    throw ConnectionException("protocol violation: stream " + std::to_string(id) + " overran its window");
+
+                stream->recvWindow -= len;
+                stream->received.insert(stream->received.end(), data, data + len);
+
+                if (flags & FRAME_FIN) {
+                    stream->finReceived = true;
+
+                    if (stream->finSent)
+                        forget(*stream);
+                }
+                break;
+
+            case FRAME_WINDOW: {
+                ArrayStream buf(data, len, len);
+                NetworkDataStream ds(buf);
+                uint32_t credit = 0;
+
+                ds >> credit;
+
+                if (len != sizeof(credit) || credit > UINT32_MAX - stream->sendWindow)
+                    throw ConnectionException("protocol violation: bad window update for stream " + std::to_string(id));
+
+                stream->sendWindow += credit;
+                break;
+            }
+
+            case FRAME_RESET:
+                stream->reset = true;
+                forget(*stream);
+                break;
+
+            default:
+                throw ConnectionException("protocol violation: unknown frame type " + std::to_string(type));
+        }
+
+        stream->changed.notify_all();
+
+        // once shut down, a stream is LingeringCloser's to drain: it has no socket to poll for it
+        if (stream->finSent) {
+            lock.unlock();
+            LingeringCloser::wake();
+        }
+    }
+
+
+    // mutex_ must be held
+    void Multiplexer::forget(Stream& stream) {
+        auto it = streams_.find(stream.id);
+
+        if (it != streams_.end() && it->second.get() == &stream) {
+            streams_.erase(it);
+            --streams_metric();
+            changed_.notify_all(); // room for open_stream
+        }
+    }
+
+
+    // mutex_ must be held. Wakes everything waiting so it can see the connection has gone
+    void Multiplexer::fail_all() {
+        broken_ = true;
+
+        for (auto& entry : streams_)
+            entry.second->changed.notify_all();
+
+        changed_.notify_all();
+    }
+
+
+    // receives whatever has arrived into buf[*end, size), waiting for at least one byte. Returns
+    // false, having received nothing, if asked to stop while waiting (and canStop)
+    bool Multiplexer::fill(char* buf, size_t* end, size_t size, bool canStop) {
+        while (true) {
+            // asked while the last frames were being handled: nothing is half read, so stop before waiting again
+            if (canStop && stopping_)
+                return false;
+
+            bool timedOut = false;
+            const int bytes = connection_->transport().receive(buf + *end, static_cast<int>(size - *end), pollMs_.load(), &timedOut);
+
+            if (bytes > 0) {
+                *end += bytes;
+                return true;
+            }
+
+            if (!timedOut)
+                throw ConnectionException("multiplexed connection closed by peer");
+
+            if (canStop && stopping_)
+                return false;
+        }
+    }
+
+
+    void Multiplexer::write_frame(uint8_t type, uint8_t flags, uint32_t id, const char* data, uint32_t len) {
+        std::lock_guard<std::mutex> writeLock(writeMutex_);
+        send_frame(type, flags, id, data, len);
+    }
+
+
+    // writeMutex_ must be held. Header and payload go out in a single send so small
+    // frames don't sit behind Nagle waiting on an ack
+    void Multiplexer::send_frame(uint8_t type, uint8_t flags, uint32_t id, const char* data, uint32_t len) {
+        if (closed_)
+            throw ConnectionException("multiplexed connection is closed");
+
+        auto lease = BufferPool::shared().acquire();
+        ArrayStream buf(lease.data(), lease.size());
+        NetworkDataStream ds(buf);
+
+        ds << type << flags << id << len;
+
+        if (len > 0)
+            buf.write(data, len);
+
+        const char* frame = lease.data();
+        int bytesLeft = static_cast<int>(buf.written());
+
+        while (bytesLeft > 0) {
+            const int bytesSent = connection_->transport().send(frame, bytesLeft);
+
+            frame += bytesSent;
+            bytesLeft -= bytesSent;
+        }
+    }
+
+
+    Connection::Ptr Multiplexer::wrap(std::shared_ptr<Stream> stream) {
+        Transport::Ptr transport(new MuxStream(shared_from_this(), std::move(stream)));
+
+        return std::make_shared<Connection>(std::move(transport), connection_->host_name(), connection_->remote_name(), connection_->host_port(), connection_->remote_port());
+    }
+
+
+    int Multiplexer::stream_send(Stream& stream, const char* buf, int len) {
+        uint32_t bytes = 0;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            stream.changed.wait(lock, [&]() { return stream.sendWindow > 0 || stream.finSent || stream.reset || broken_; });
+
+            if (stream.finSent)
+                throw ConnectionException("cannot send: stream has been shut down");
+
+            if (stream.reset)
+                throw ConnectionException("stream reset by peer");
+
+            if (broken_)
+                throw ConnectionException("multiplexed connection lost");
+
+            bytes = std::min<uint32_t>({ static_cast<uint32_t>(len), stream.sendWindow, MAX_FRAME_DATA });
+            stream.sendWindow -= bytes;
+        }
+
+        write_frame(FRAME_DATA, 0, stream.id, buf, bytes);
+        return static_cast<int>(bytes);
+    }
+
+
+    int Multiplexer::stream_receive(Stream& stream, char* buf, int len, long timeoutMs, bool* timedOut) {
+        uint32_t credit = 0;
+        int bytes = 0;
+
+        if (timedOut) *timedOut = false;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            const auto ready = [&]() { return stream.readPos < stream.received.size() || stream.finReceived || stream.reset || broken_; };
+
+            if (timeoutMs > 0) {
+                if (!stream.changed.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready)) {
+                    if (timedOut) *timedOut = true;
+                    return 0;
+                }
+            } else stream.changed.wait(lock, ready);
+
+            if (stream.readPos < stream.received.size()) {
+                bytes = static_cast<int>(std::min<size_t>(len, stream.received.size() - stream.readPos));
+                memcpy(buf, stream.received.data() + stream.readPos, bytes);
+                stream.readPos += bytes;
+
+                if (stream.readPos == stream.received.size()) {
+                    stream.received.clear();
+                    stream.readPos = 0;
+                }
+
+                // hand the space back to the sender in large steps rather than a frame per read
+                if (!stream.finReceived && !stream.reset) {
+                    stream.unacknowledged += bytes;
+
+                    if (stream.unacknowledged >= INITIAL_WINDOW / 2) {
+                        credit = stream.unacknowledged;
+                        stream.recvWindow += credit;
+                        stream.unacknowledged = 0;
+                    }
+                }
+            } else if (stream.reset) {
+                throw ConnectionException("stream reset by peer");
+            } else if (!stream.finReceived) {
+                throw ConnectionException("multiplexed connection lost");
+            }
+            // else: end of stream
+        }
+
+        if (credit > 0) {
+            char raw[sizeof(credit)];
+            ArrayStream creditBuf(raw, sizeof(raw));
+            NetworkDataStream ds(creditBuf);
+
+            ds << credit;
+
+            try {
+                write_frame(FRAME_WINDOW, 0, stream.id, raw, sizeof(raw));
+            }
+            catch (const ConnectionException&) {
+                // the reader will find out the connection has gone; the bytes read are still good
+            }
+        }
+
+        return bytes;
+    }
+
+
+    void Multiplexer::stream_shutdown(Stream& stream) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (stream.finSent || stream.closed || stream.reset)
+                return;
+
+            stream.finSent = true;
+            stream.changed.notify_all(); // a sender waiting on the window can give up
+
+            if (stream.finReceived)
+                forget(stream);
+        }
+
+        try {
+            write_frame(FRAME_DATA, FRAME_FIN, stream.id, nullptr, 0);
+        }
+        catch (const ConnectionException&) {
+            // same as shutting down a socket whose connection has gone: nothing to tell the peer
+        }
+    }
+
+
+    void Multiplexer::stream_close(Stream& stream) {
+        bool sendReset = false;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if (stream.closed)
+                return;
+
+            stream.closed = true;
+
+            // unless both sides have finished cleanly, tell the peer to stop sending and waiting
+            sendReset = !(stream.finSent && stream.finReceived) && !stream.reset && !broken_;
+            forget(stream);
+        }
+
+        if (sendReset) {
+            try {
+                write_frame(FRAME_RESET, 0, stream.id, nullptr, 0);
+            }
+            catch (const ConnectionException&) {
+                // connection gone: the peer's end of the stream is failing anyway
+            }
+        }
+    }
+
+} // end connection namespace
@@ -0,0 +1,111 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include "Connection.h"
+
+namespace connection {
+
+    // Protocol v2 carries every command and its data over the control connection instead of
+    // opening a data connection per transfer. Each command runs on its own stream, and streams
+    // are interleaved on the wire in frames of at most MAX_FRAME_DATA bytes, so a large transfer
+    // can't hold up a small one queued behind it. Each direction of a stream has its own
+    // flow-control window: a sender never has more than INITIAL_WINDOW unread bytes outstanding,
+    // so one slow reader neither stalls the other streams nor makes the receiver buffer without limit.
+    //
+    // Streams are handed out as ordinary Connections, so Message framing and data streaming work
+    // on them unchanged. Shutting one down ends that stream, not the connection underneath.
+    //
+    // frame: type (1) | flags (1) | stream id (4) | length (4) | length bytes of payload
+    class Multiplexer : public std::enable_shared_from_this<Multiplexer> {
+        public:
+            typedef std::shared_ptr<Multiplexer> Ptr;
+
+            constexpr static int FRAME_HEADER_LEN = 10;
+            constexpr static uint32_t MAX_FRAME_DATA = 16 * 1024;
+            constexpr static uint32_t INITIAL_WINDOW = 256 * 1024;
+            // streams a side may have open at once. A peer is only cut off past twice this, since
+            // streams it has finished with may not have been closed on this side yet
+            constexpr static size_t MAX_STREAMS = 64;
+
+            enum Role { CLIENT, SERVER };                      // clients open odd-numbered streams, servers even
+
+            // reads whatever the peer sends ahead of the first frame, on the reader thread. Throwing
+            // a ConnectionException fails the multiplexer
+            typedef std::function<void(Connection&)> Preamble;
+
+            // connection must have finished its v1 exchange (greetings): from here on it only carries
+            // frames. Or nearly: with a preamble, streams can be opened and written to at once while
+            // the last of the exchange is still on its way in
+            static Ptr create(Connection::Ptr connection, Role role, Preamble preamble = nullptr);
+
+            Connection::Ptr open_stream();
+
+            // waits for the peer to open a stream. Returns nullptr on timeout (timedOut is set) or
+            // once the connection has failed or been closed
+            Connection::Ptr accept_stream(long timeoutMs, bool* timedOut);
+
+            size_t active_streams() const;
+            bool is_open() const;
+
+            // stops reading at a frame boundary and gives the connection up, e.g. to pass it to another
+            // process. Fails, and carries on as before, if any stream is open
+            bool detach();
+
+            // how long the reader waits on the peer at most between checks for being asked to stop. Shorter
+            // than the default lets detach() find a gap between the frames of a peer that is rarely quiet
+            void set_poll_interval(long ms);
+
+            // fails every open stream and shuts the connection down, without waiting for the reader to stop
+            void close();
+
+        private:
+            friend class MuxStream;
+            struct Stream;
+
+            Connection::Ptr connection_;
+            Preamble preamble_;
+
+            mutable std::mutex mutex_;
+            std::condition_variable changed_;                  // streams opened or forgotten, or the reader has stopped
+            std::map<uint32_t, std::shared_ptr<Stream>> streams_;
+            std::deque<std::shared_ptr<Stream>> accepted_;     // opened by the peer, waiting for accept_stream
+            uint32_t nextId_;
+            uint32_t lastPeerId_;
+            bool reading_;
+            bool broken_;
+            bool shutdownOnStop_;                               // close() left shutting the connection down to the reader
+            std::atomic_bool stopping_;
+            std::atomic<long> pollMs_;
+
+            std::mutex writeMutex_;                             // one frame on the wire at a time
+            bool closed_;
+
+            Multiplexer(Connection::Ptr connection, Role role);
+
+            void start_reader();
+            void stop_reader();
+            void read_frames();
+            void handle_frame(uint8_t type, uint8_t flags, uint32_t id, char* data, uint32_t len);
+            void forget(Stream& stream);
+            void fail_all();
+            bool fill(char* buf, size_t* end, size_t size, bool canStop);
+            void write_frame(uint8_t type, uint8_t flags, uint32_t id, const char* data, uint32_t len);
+            void send_frame(uint8_t type, uint8_t flags, uint32_t id, const char* data, uint32_t len);
+            Connection::Ptr wrap(std::shared_ptr<Stream> stream);
+
+            int stream_send(Stream& stream, const char* buf, int len);
+            int stream_receive(Stream& stream, char* buf, int len, long timeoutMs, bool* timedOut);
+            void stream_shutdown(Stream& stream);
+            void stream_close(Stream& stream);
+
+            Multiplexer(const Multiplexer& other) = delete;
+            Multiplexer& operator=(const Multiplexer& other) = delete;
+    };
+
+} // end connection namespace
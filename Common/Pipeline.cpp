@@ -0,0 +1,60 @@
+#include "stdafx.h"
+#include <algorithm>
+#include "Pipeline.h"
+
+namespace connection {
+
+    CommandPipeline::CommandPipeline(Multiplexer::Ptr mux, size_t depth, long responseTimeoutMs)
+        : mux_(std::move(mux)), depth_(std::max<size_t>(1, std::min(depth, Multiplexer::MAX_STREAMS))), responseTimeoutMs_(responseTimeoutMs), nextTag_(1) {}
+
+
+    CommandPipeline::~CommandPipeline() {
+        for (auto& pending : inFlight_) {
+            try {
+                pending.stream->shutdown();
+            }
+            catch (...) {
+                // destructors must not throw; the stream is reset by the multiplexer regardless
+            }
+        }
+    }
+
+
+    uint64_t CommandPipeline::submit(const Message& command, ResponseCallback onResponse) {
+        while (inFlight_.size() >= depth_)
+            complete_oldest();
+
+        auto stream = mux_->open_stream();
+        stream->send(command);
+
+        const auto tag = nextTag_++;
+        inFlight_.push_back(Pending{ tag, std::move(stream), std::move(onResponse) });
+
+        return tag;
+    }
+
+
+    void CommandPipeline::drain() {
+        while (!inFlight_.empty())
+            complete_oldest();
+    }
+
+
+    void CommandPipeline::complete_oldest() {
+        // off the queue before anything can throw, so a failed command isn't handled twice
+        auto pending = std::move(inFlight_.front());
+        inFlight_.pop_front();
+
+        Message response;
+        bool timedOut = false;
+
+        pending.stream->receive(&response, responseTimeoutMs_, &timedOut);
+
+        if (timedOut)
+            throw ConnectionException("server response timed out");
+
+        pending.onResponse(pending.tag, response, pending.stream);
+        pending.stream->shutdown();
+    }
+
+} // end connection namespace
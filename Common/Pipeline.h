@@ -0,0 +1,53 @@
+#pragma once
+#include <deque>
+#include <functional>
+#include <stdint.h>
+#include "Connection.h"
+#include "Multiplexer.h"
+
+namespace connection {
+
+    // Issues commands over a protocol v2 session without waiting for each response. Up to depth
+    // commands are in flight at once, each on its own stream, so a batch of commands costs about
+    // one round trip rather than one per command. The server may work on them in any order (it
+    // keeps commands that touch the same file in the order they were sent); here responses are
+    // handled in the order the commands were submitted, each identified by the tag submit returned
+    class CommandPipeline {
+        public:
+            // called with a command's response and its stream, on which any data follows. The
+            // stream is shut down once the callback returns
+            typedef std::function<void(uint64_t tag, const Message& response, const Connection::Ptr& stream)> ResponseCallback;
+
+            CommandPipeline(Multiplexer::Ptr mux, size_t depth, long responseTimeoutMs);
+
+            // abandons any commands still in flight: call drain() to see them through
+            ~CommandPipeline();
+
+            // sends command, first handling the oldest responses if depth commands are already in flight
+            uint64_t submit(const Message& command, ResponseCallback onResponse);
+
+            // handles the responses to every command still in flight
+            void drain();
+
+            size_t in_flight() const { return inFlight_.size(); }
+
+        private:
+            struct Pending {
+                uint64_t tag;
+                Connection::Ptr stream;
+                ResponseCallback onResponse;
+            };
+
+            Multiplexer::Ptr mux_;
+            size_t depth_;
+            long responseTimeoutMs_;
+            uint64_t nextTag_;
+            std::deque<Pending> inFlight_;
+
+            void complete_oldest();
+
+            CommandPipeline(const CommandPipeline& other) = delete;
+            CommandPipeline& operator=(const CommandPipeline& other) = delete;
+    };
+
+} // end connection namespace
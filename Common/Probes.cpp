@@ -0,0 +1,15 @@
+#include "stdafx.h"
+#include "Probes.h"
+
+#if defined(FTP_USDT) && !defined(WIN32)
+FTP_PROBE_SEMAPHORE(send) = 0;
+FTP_PROBE_SEMAPHORE(receive) = 0;
+FTP_PROBE_SEMAPHORE(send_file) = 0;
+FTP_PROBE_SEMAPHORE(message_send) = 0;
+FTP_PROBE_SEMAPHORE(message_receive) = 0;
+FTP_PROBE_SEMAPHORE(recv_wait) = 0;
+FTP_PROBE_SEMAPHORE(accept) = 0;
+FTP_PROBE_SEMAPHORE(shutdown) = 0;
+FTP_PROBE_SEMAPHORE(command_start) = 0;
+FTP_PROBE_SEMAPHORE(command_done) = 0;
+#endif
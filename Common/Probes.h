@@ -0,0 +1,60 @@
+#pragma once
+#include <chrono>
+#include <stdint.h>
+
+// USDT probes (provider "ftp") at the points where time goes on a connection, for bpftrace or perf to
+// attach to a running server or client. They're only compiled in when built with FTP_USDT defined,
+// which needs systemtap's <sys/sdt.h> (Linux); otherwise they're nothing at all. Compiled in, a probe
+// is a nop until a tracer attaches to it.
+//
+// Arguments that cost something to work out, durations above all, are only worked out while a
+// tracer is attached: each such probe has a semaphore the tracer raises (bpftrace does), checked with
+// FTP_PROBE_ENABLED first:
+//
+//     if (FTP_PROBE_ENABLED(send))
+//         FTP_PROBE(send, socket, bytes, probe_nanos() - started);
+//
+// Sockets are -1 for a stream of a multiplexed (v2) connection, and durations are in nanoseconds.
+//
+//  probe               arguments
+//  send                socket, bytes, duration
+//  receive             socket, bytes, duration, timed out
+//  send_file           socket, bytes, duration
+//  message_send        socket, message ID, message length, data length, duration
+//  message_receive     socket, message ID, message length, data length, duration (waiting included)
+//  recv_wait           socket, bytes, duration (select and recv), timed out
+//  accept              listening socket, accepted socket, duration (accept and looking up the peer)
+//  shutdown            socket, duration
+//  command_start       socket, message ID, payload (string)
+//  command_done        socket, message ID, duration
+#if defined(FTP_USDT) && !defined(WIN32)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define FTP_PROBE_SEMAPHORE(name) volatile unsigned short ftp_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+#define FTP_PROBE_ENABLED(name) __builtin_expect(ftp_##name##_semaphore != 0, 0)
+#define FTP_PROBE(name, ...) STAP_PROBEV(ftp, name, __VA_ARGS__)
+
+// defined in Probes.cpp. Every probe needs one, since <sys/sdt.h> notes one for every probe here
+extern FTP_PROBE_SEMAPHORE(send);
+extern FTP_PROBE_SEMAPHORE(receive);
+extern FTP_PROBE_SEMAPHORE(send_file);
+extern FTP_PROBE_SEMAPHORE(message_send);
+extern FTP_PROBE_SEMAPHORE(message_receive);
+extern FTP_PROBE_SEMAPHORE(recv_wait);
+extern FTP_PROBE_SEMAPHORE(accept);
+extern FTP_PROBE_SEMAPHORE(shutdown);
+extern FTP_PROBE_SEMAPHORE(command_start);
+extern FTP_PROBE_SEMAPHORE(command_done);
+#else
+// never evaluated: only so what a probe would have been given still counts as used
+template <class ...Args>
+inline void probe_unused(const Args&...) {}
+
+#define FTP_PROBE_ENABLED(name) false
+#define FTP_PROBE(name, ...) do { if (false) probe_unused(__VA_ARGS__); } while (0)
+#endif
+
+inline int64_t probe_nanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -1,6 +1,14 @@
 #pragma once
+#include <stdlib.h>
+#include <string>
+
+#define PROTOCOL_VERSION 2.0
+#define PROTOCOL_VERSION_MULTIPLEXED 2  // first major version that multiplexes commands and data over the control connection
+
+// newest version that can pass files as descriptors. The multiplexer reads the control connection
+// in bulk, which would swallow them, so clients that want them (local mode) announce this instead
+#define PROTOCOL_VERSION_DESCRIPTORS 1.0
 
-#define PROTOCOL_VERSION 1.0
 #ifdef WIN32
 #define PLATFORM "win32"
 #else 
@@ -9,4 +17,25 @@
 
 #define STRINGIZE(n) #n
 #define STR(s) STRINGIZE(s)
-#define MAKE_VERSION(name, msg) name "/" STR(PROTOCOL_VERSION) "/" PLATFORM ": " msg
+#define MAKE_VERSION_AT(name, version, msg) name "/" STR(version) "/" PLATFORM ": " msg
+#define MAKE_VERSION(name, msg) MAKE_VERSION_AT(name, PROTOCOL_VERSION, msg)
+
+// major protocol version announced in a HELLO payload made by MAKE_VERSION. Peers that
+// announce nothing (older clients send an empty HELLO) speak version 1
+inline int protocol_major(const std::string& hello) {
+    const auto slash = hello.find('/');
+
+    if (slash == std::string::npos)
+        return 1;
+
+    const int major = atoi(hello.c_str() + slash + 1);
+
+    return major > 0 ? major : 1;
+}
+
+// both sides announce the newest version they speak (ours, if we announced an older one) and use the older of the two
+inline int negotiate_version(const std::string& peerHello, int ours = static_cast<int>(PROTOCOL_VERSION)) {
+    const int theirs = protocol_major(peerHello);
+
+    return theirs < ours ? theirs : ours;
+}
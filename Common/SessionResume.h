@@ -0,0 +1,103 @@
+#pragma once
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+namespace connection {
+
+    // Session resumption. The server's HELLO gives each session a token, on a line of its own
+    // after the version ("session <token>"). A client whose connection drops reconnects and puts
+    // the token in its own HELLO ("resume <token>"): if the server still has the session, it
+    // carries on as it was (same protocol version and inline limit, and with any upload that was
+    // cut off still half there) without waiting on a new greeting. The client can send commands
+    // straight after its HELLO.
+    //
+    // The server's HELLO comes first as always, then one more message answering the resumption:
+    // OK with the interrupted uploads in the payload, one per line, or an error if the session has
+    // expired, in which case the connection carries on as a new session. Either way the HELLO
+    // gave the session a new token: each one is only good once
+    constexpr const char* HELLO_SESSION = "session";
+    constexpr const char* HELLO_RESUME = "resume";
+
+    // the value of the "key value" line in a HELLO payload, or "" if there isn't one
+    inline std::string hello_field(const std::string& hello, const std::string& key) {
+        std::istringstream lines(hello);
+        std::string line;
+
+        while (std::getline(lines, line)) {
+            if (line.compare(0, key.length() + 1, key + " ") == 0)
+                return line.substr(key.length() + 1);
+        }
+
+        return std::string();
+    }
+
+    // the version and greeting a HELLO opens with, without the fields after it
+    inline std::string hello_banner(const std::string& hello) {
+        return hello.substr(0, hello.find('\n'));
+    }
+
+
+    // an upload the server holds part of: the ranges it's missing can be sent with ranged PUTs
+    struct InterruptedUpload {
+        std::string name;
+        uint64_t size;
+        std::vector<std::pair<uint64_t, uint64_t>> missing;     // offset and length of each gap
+    };
+
+    // one line each: "<size> <offset>:<length>[,<offset>:<length>...] <name>"
+    inline std::string encode_interrupted(const std::vector<InterruptedUpload>& uploads) {
+        std::ostringstream out;
+
+        for (const auto& upload : uploads) {
+            out << upload.size << ' ';
+
+            for (size_t i = 0; i < upload.missing.size(); ++i)
+                out << (i > 0 ? "," : "") << upload.missing[i].first << ':' << upload.missing[i].second;
+
+            out << ' ' << upload.name << '\n';
+        }
+
+        return out.str();
+    }
+
+    // lines that don't parse are skipped: the worst that does is an upload sent again from the start
+    inline std::vector<InterruptedUpload> decode_interrupted(const std::string& payload) {
+        std::vector<InterruptedUpload> uploads;
+        std::istringstream lines(payload);
+        std::string line;
+
+        while (std::getline(lines, line)) {
+            std::istringstream fields(line);
+            std::string gaps;
+            InterruptedUpload upload;
+
+            if (!(fields >> upload.size >> gaps) || !std::getline(fields >> std::ws, upload.name) || upload.name.empty())
+                continue;
+
+            std::istringstream ranges(gaps);
+            std::string range;
+            bool valid = true;
+
+            while (valid && std::getline(ranges, range, ',')) {
+                std::istringstream numbers(range);
+                uint64_t offset = 0;
+                uint64_t len = 0;
+                char colon = 0;
+
+                valid = (numbers >> offset >> colon >> len) && colon == ':';
+
+                if (valid)
+                    upload.missing.emplace_back(offset, len);
+            }
+
+            if (valid && !upload.missing.empty())
+                uploads.push_back(std::move(upload));
+        }
+
+        return uploads;
+    }
+
+} // end connection namespace
@@ -0,0 +1,39 @@
+#pragma once
+// Shims that let the socket code be written once against the winsock names
+// and still compile on POSIX systems. Only include this from .cpp files
+
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netdb.h>
+#include <string.h>
+
+constexpr int SOCKET_ERROR = -1;
+constexpr int INVALID_SOCKET = -1;
+constexpr int SD_SEND = SHUT_WR;
+
+typedef bool BOOL;
+constexpr BOOL TRUE = true;
+constexpr BOOL FALSE = false;
+
+typedef uint16_t DWORD;
+typedef fd_set FD_SET;
+
+typedef struct timeval TIMEVAL;
+typedef struct sockaddr SOCKADDR;
+
+#define ZeroMemory(buf, n) memset((buf), 0, (n))
+#define ADDR_ANY INADDR_ANY
+
+#else // is WIN32
+
+typedef int socklen_t;
+#define TEMP_FAILURE_RETRY(expr) (expr)
+
+#endif
+
+namespace connection {
+    void closesocket(socket_t socket);
+}
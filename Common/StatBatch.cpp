@@ -0,0 +1,73 @@
+#include "stdafx.h"
+#include <sstream>
+#include "StatBatch.h"
+#include "Connection.h"
+#include "NetworkDataStream.h"
+
+namespace connection {
+
+    std::string encode_stat_request(const std::vector<std::string>& names, uint8_t options) {
+        std::string request(1, static_cast<char>(options));
+
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (i > 0)
+                request += '\n';
+
+            request += names[i];
+        }
+
+        return request;
+    }
+
+
+    bool decode_stat_request(const std::string& request, std::vector<std::string>* names, uint8_t* options) {
+        if (request.length() < 2)
+            return false; // options and at least one name
+
+        *options = static_cast<uint8_t>(request[0]);
+        names->clear();
+
+        for (size_t begin = 1; begin <= request.length();) {
+            auto end = request.find('\n', begin);
+
+            if (end == std::string::npos)
+                end = request.length();
+
+            names->push_back(request.substr(begin, end - begin));
+            begin = end + 1;
+        }
+
+        return true;
+    }
+
+
+    std::string encode_stats(const std::vector<FileStat>& stats) {
+        std::stringstream buf(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+        NetworkDataStream ds(buf);
+
+        for (const auto& stat : stats)
+            ds << static_cast<uint8_t>(stat.type) << stat.flags << stat.size << stat.mtimeNs << stat.crc;
+
+        return buf.str();
+    }
+
+
+    std::vector<FileStat> decode_stats(const std::string& stats, size_t count) {
+        if (stats.length() != count * STAT_ENTRY_LEN)
+            throw ConnectionException("expected " + std::to_string(count) + " stat entries, got " + std::to_string(stats.length()) + " bytes");
+
+        std::stringstream buf(stats, std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+        NetworkDataStream ds(buf);
+        std::vector<FileStat> entries(count);
+
+        for (auto& entry : entries) {
+            uint8_t type = 0;
+
+            ds >> type >> entry.flags >> entry.size >> entry.mtimeNs >> entry.crc;
+            entry.type = type <= STAT_OTHER ? static_cast<StatType>(type) : STAT_OTHER;
+        }
+
+        return entries;
+    }
+
+} // end connection namespace
@@ -0,0 +1,49 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace connection {
+
+    // STAT asks about many files at once. The request is an options byte followed by the names,
+    // one per line: in the payload when it fits, otherwise as data the server asks for. The answer
+    // is one fixed-size entry per name, in the order asked, so names aren't sent back:
+    //
+    //   type (1) | flags (1) | size (8) | mtime (8, ns since the epoch) | CRC-32 (4)
+    enum StatType : uint8_t {
+        STAT_MISSING = 0,       // no such file, or a name that isn't allowed
+        STAT_FILE,
+        STAT_DIRECTORY,
+        STAT_OTHER
+    };
+
+    enum StatFlags : uint8_t {
+        STAT_HAS_CRC = 1        // crc is the CRC-32 of the file's contents
+    };
+
+    enum StatOptions : uint8_t {
+        STAT_WANT_CRC = 1       // checksum regular files too (served from cache while they're unchanged)
+    };
+
+    struct FileStat {
+        StatType type;
+        uint8_t flags;
+        uint64_t size;
+        uint64_t mtimeNs;
+        uint32_t crc;
+    };
+
+    constexpr int STAT_ENTRY_LEN = 22;
+    constexpr uint64_t STAT_MAX_REQUEST_LEN = 4 * 1024 * 1024;     // larger requests are refused
+
+    std::string encode_stat_request(const std::vector<std::string>& names, uint8_t options);
+
+    // false if request is malformed
+    bool decode_stat_request(const std::string& request, std::vector<std::string>* names, uint8_t* options);
+
+    std::string encode_stats(const std::vector<FileStat>& stats);
+
+    // throws ConnectionException unless stats holds exactly count entries
+    std::vector<FileStat> decode_stats(const std::string& stats, size_t count);
+
+} // end connection namespace
@@ -0,0 +1,249 @@
+#include "stdafx.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+#include "Trace.h"
+
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+namespace trace {
+    std::atomic<bool> g_enabled(false);
+
+    struct SpanRecord {
+        const char* name;
+        Clock::time_point begin;
+        Clock::time_point end;
+        std::string detail;
+    };
+
+    // one thread's spans, for the flushing thread to take away. The mutex is only ever contended
+    // while a flush is taking them
+    struct ThreadSpans {
+        std::mutex mutex;
+        std::vector<SpanRecord> spans;
+        uint32_t tid;
+        std::string name;
+        bool nameWritten = false;
+    };
+
+    // deliberately never destroyed: the flushing thread, and sessions' threads recording spans,
+    // may still be at it as the process exits
+    struct State {
+        std::mutex registryMutex;
+        std::vector<std::shared_ptr<ThreadSpans>> threads;   // including those that have exited with spans still to write
+        uint32_t nextTid = 0;
+
+        std::mutex outputMutex;
+        std::ofstream output;
+        std::string process;
+        int pid = 0;
+        bool finished = false;
+    };
+
+    static State& state() {
+        static auto state = new State();
+        return *state;
+    }
+
+
+    // held by the thread for as long as it runs, and by the registry until its spans have been written
+    static ThreadSpans& this_thread() {
+        thread_local std::shared_ptr<ThreadSpans> spans;
+
+        if (!spans) {
+            auto& s = state();
+            spans = std::make_shared<ThreadSpans>();
+
+            std::lock_guard<std::mutex> lock(s.registryMutex);
+
+            spans->tid = ++s.nextTid;
+            s.threads.push_back(spans);
+        }
+
+        return *spans;
+    }
+
+
+    static void write_string(std::ostream& output, const std::string& value) {
+        output << '"';
+
+        for (const char c : value) {
+            if (c == '"' || c == '\\')
+                output << '\\' << c;
+            else if (static_cast<unsigned char>(c) < 0x20)
+                output << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec << std::setfill(' ');
+            else output << c;
+        }
+
+        output << '"';
+    }
+
+
+    // in microseconds, which is what Chrome expects: the steady clock's own epoch, so the spans of a
+    // client and a server on the same host line up
+    static double micros(Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count() / 1000.0;
+    }
+
+
+    bool start(const std::string& path, const std::string& process, long flushMs) {
+        auto& s = state();
+
+        {
+            std::lock_guard<std::mutex> lock(s.outputMutex);
+
+            s.output.open(path, std::ios::trunc);
+
+            if (!s.output.is_open())
+                return false;
+
+            s.process = process;
+            s.pid = static_cast<int>(getpid());
+
+            // the array's first element, so every span after it can begin with a comma
+            s.output << "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << s.pid << ",\"args\":{\"name\":";
+            write_string(s.output, process);
+            s.output << "}}";
+            s.output << std::fixed << std::setprecision(3);
+            s.output.flush();
+        }
+
+        g_enabled.store(true);
+
+        if (flushMs > 0) {
+            std::thread([flushMs]() {
+                while (true) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(flushMs));
+                    flush();
+                }
+            }).detach();
+        }
+
+        return true;
+    }
+
+
+    void flush() {
+        static auto& written = metrics::counter("trace.spans");
+        auto& s = state();
+        std::lock_guard<std::mutex> outputLock(s.outputMutex);
+
+        if (!s.output.is_open() || s.finished)
+            return;
+
+        std::vector<std::shared_ptr<ThreadSpans>> threads;
+
+        {
+            std::lock_guard<std::mutex> lock(s.registryMutex);
+            threads = s.threads;
+        }
+
+        for (const auto& thread : threads) {
+            std::vector<SpanRecord> spans;
+            std::string name;
+
+            {
+                std::lock_guard<std::mutex> lock(thread->mutex);
+
+                spans.swap(thread->spans);
+
+                if (!thread->nameWritten && !thread->name.empty()) {
+                    name = thread->name;
+                    thread->nameWritten = true;
+                }
+            }
+
+            written += static_cast<int64_t>(spans.size());
+
+            if (!name.empty()) {
+                s.output << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << s.pid << ",\"tid\":" << thread->tid << ",\"args\":{\"name\":";
+                write_string(s.output, name);
+                s.output << "}}";
+            }
+
+            for (const auto& span : spans) {
+                s.output << ",\n{\"name\":\"" << span.name << "\",\"cat\":";
+                write_string(s.output, s.process);
+                s.output << ",\"ph\":\"X\",\"ts\":" << micros(span.begin.time_since_epoch()) << ",\"dur\":" << micros(span.end - span.begin) <<
+                    ",\"pid\":" << s.pid << ",\"tid\":" << thread->tid;
+
+                if (!span.detail.empty()) {
+                    s.output << ",\"args\":{\"detail\":";
+                    write_string(s.output, span.detail);
+                    s.output << "}";
+                }
+
+                s.output << "}";
+            }
+        }
+
+        s.output.flush();
+        threads.clear();
+
+        // threads that have exited, now that everything they recorded is written
+        std::lock_guard<std::mutex> lock(s.registryMutex);
+
+        s.threads.erase(std::remove_if(s.threads.begin(), s.threads.end(), [](const std::shared_ptr<ThreadSpans>& thread) {
+            std::lock_guard<std::mutex> threadLock(thread->mutex);
+            return thread.use_count() == 1 && thread->spans.empty();
+        }), s.threads.end());
+    }
+
+
+    void finish() {
+        auto& s = state();
+
+        flush();
+        g_enabled.store(false);
+
+        std::lock_guard<std::mutex> lock(s.outputMutex);
+
+        if (!s.output.is_open() || s.finished)
+            return;
+
+        s.output << "\n]\n";
+        s.output.close();
+        s.finished = true;
+    }
+
+
+    void name_thread(const std::string& name) {
+        if (!enabled())
+            return;
+
+        auto& spans = this_thread();
+        std::lock_guard<std::mutex> lock(spans.mutex);
+
+        spans.name = name;
+        spans.nameWritten = false;
+    }
+
+
+    void record(const char* name, Clock::time_point begin, Clock::time_point end, const std::string& detail) {
+        static auto& dropped = metrics::counter("trace.dropped");
+
+        if (!enabled())
+            return;
+
+        auto& spans = this_thread();
+        std::lock_guard<std::mutex> lock(spans.mutex);
+
+        // nobody is flushing, or not often enough to keep up
+        if (spans.spans.size() >= TRACE_THREAD_LIMIT) {
+            ++dropped;
+            return;
+        }
+
+        spans.spans.push_back(SpanRecord{ name, begin, end, detail });
+    }
+}
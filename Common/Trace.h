@@ -0,0 +1,78 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <stdint.h>
+
+// Spans of time spent in each phase of a command, for finding out where a slow one's time went.
+// Each thread keeps the spans it finishes to itself until they're written out, so recording one
+// takes no lock another thread is waiting on. They're written as Chrome trace events (load the file
+// in chrome://tracing or ui.perfetto.dev), a row for each thread, with spans that happen within
+// another one nested under it:
+//
+//     trace::Span span("connect");         // from here to the end of the scope, or span.end()
+//
+// Nothing is recorded until trace::start is called, and until then a span costs a look at a flag
+namespace trace {
+    constexpr size_t TRACE_THREAD_LIMIT = 16 * 1024;    // spans a thread keeps between flushes: any more are dropped
+
+    typedef std::chrono::steady_clock Clock;
+
+    extern std::atomic<bool> g_enabled;
+
+    inline bool enabled() {
+        return g_enabled.load(std::memory_order_relaxed);
+    }
+
+    // starts recording, for process (how its spans are labelled) and to path, which is started over.
+    // Spans are written there as flush() is called, and every flushMs as well unless that's 0. False,
+    // recording nothing, if path can't be written to
+    bool start(const std::string& path, const std::string& process, long flushMs);
+
+    // writes out every span finished so far. The file can be loaded as it is at any time: the end of
+    // its array is left off until finish(), which Chrome's format allows
+    void flush();
+
+    // flushes for the last time and ends the array
+    void finish();
+
+    // what this thread's row is called
+    void name_thread(const std::string& name);
+
+    // a span from begin to end on this thread's row; detail, if any, is shown with it
+    void record(const char* name, Clock::time_point begin, Clock::time_point end, const std::string& detail = "");
+
+    class Span {
+        public:
+            explicit Span(const char* name) : name_(name), open_(enabled()) {
+                if (open_)
+                    begin_ = Clock::now();
+            }
+
+            Span(const char* name, const std::string& detail) : name_(name), open_(enabled()) {
+                if (open_) {
+                    detail_ = detail;
+                    begin_ = Clock::now();
+                }
+            }
+
+            ~Span() { end(); }
+
+            // finished before the end of its scope, so the next phase can begin
+            void end() {
+                if (open_) {
+                    open_ = false;
+                    record(name_, begin_, Clock::now(), detail_);
+                }
+            }
+
+        private:
+            const char* name_;
+            bool open_;
+            Clock::time_point begin_;
+            std::string detail_;
+
+            Span(const Span& other) = delete;
+            Span& operator=(const Span& other) = delete;
+    };
+}
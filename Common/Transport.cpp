@@ -0,0 +1,462 @@
+#include "stdafx.h"
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include "Transport.h"
+#include "SocketCompat.h"
+#include "Probes.h"
+
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include "BufferPool.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#endif
+
+
+namespace connection {
+
+#ifndef WIN32
+    uint64_t Transport::send_file(int fd, uint64_t offset, uint64_t len) {
+        auto lease = BufferPool::shared().acquire();
+        uint64_t sent = 0;
+        const auto started = FTP_PROBE_ENABLED(send_file) ? probe_nanos() : 0;
+
+        while (sent < len) {
+            const auto got = ::pread(fd, lease.data(), static_cast<size_t>(std::min<uint64_t>(len - sent, lease.size())), static_cast<off_t>(offset + sent));
+
+            if (got < 0 && errno == EINTR)
+                continue;
+
+            if (got < 0)
+                throw ConnectionException::create("failed to read file to send");
+
+            if (got == 0)
+                break;
+
+            for (ssize_t done = 0; done < got;)
+                done += send(lease.data() + done, static_cast<int>(got - done));
+
+            sent += static_cast<uint64_t>(got);
+        }
+
+        if (FTP_PROBE_ENABLED(send_file))
+            FTP_PROBE(send_file, native_handle(), sent, probe_nanos() - started);
+
+        return sent;
+    }
+#endif
+
+
+    // -------------------------------------------------------
+    // SocketTransport
+    // -------------------------------------------------------
+
+    int recv_timeout(socket_t which, char* buf, int len, DWORD flags, long timeoutMs, bool* timedOut = nullptr) {
+        FD_SET rfd;
+        FD_SET efd;
+
+        FD_ZERO(&rfd);
+        FD_ZERO(&efd);
+
+        FD_SET(which, &rfd);
+        FD_SET(which, &efd);
+
+        timeval timeout;
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+
+        if (timedOut) *timedOut = false;
+
+        const auto started = FTP_PROBE_ENABLED(recv_wait) ? probe_nanos() : 0;
+
+        // why not setsockopt? so the caller can determine how long we should wait
+        int numReady = TEMP_FAILURE_RETRY(select(FD_SETSIZE, &rfd, nullptr, &efd, timeoutMs > 0 ? &timeout : nullptr));
+
+        if (numReady == SOCKET_ERROR)
+            throw ConnectionException::create("exception in select recv_timeout");
+
+        if (numReady == 0) { // timed out?
+            if (timedOut) *timedOut = true;
+
+            if (FTP_PROBE_ENABLED(recv_wait))
+                FTP_PROBE(recv_wait, which, 0, probe_nanos() - started, true);
+
+            return 0;
+        }
+
+
+        if (FD_ISSET(which, &rfd) || FD_ISSET(which, &efd)) {
+            if (len == 0) return 0;
+
+            auto result = ::recv(which, buf, len, flags);
+
+            if (result == SOCKET_ERROR)
+                throw ConnectionException::create("failed to receive data");
+
+            if (FTP_PROBE_ENABLED(recv_wait))
+                FTP_PROBE(recv_wait, which, static_cast<int>(result), probe_nanos() - started, false);
+
+            return static_cast<int>(result);
+        }
+
+        // no data to read or errors to catch
+        return 0;
+    }
+
+
+    SocketTransport::SocketTransport(socket_t socket, const char* kind) : socket_(socket), kind_(kind) {}
+
+
+    SocketTransport::~SocketTransport() {
+        close();
+    }
+
+
+    int SocketTransport::send(const char* buf, int len) {
+        const auto bytesSent = ::send(socket_, buf, len, 0);
+
+        if (bytesSent == SOCKET_ERROR)
+            throw ConnectionException::create("error sending data");
+
+        return static_cast<int>(bytesSent);
+    }
+
+
+#ifndef WIN32
+    uint64_t SocketTransport::send_file(int fd, uint64_t offset, uint64_t len) {
+        off_t position = static_cast<off_t>(offset);
+        uint64_t sent = 0;
+        const auto started = FTP_PROBE_ENABLED(send_file) ? probe_nanos() : 0;
+
+        while (sent < len) {
+            // sendfile moves at most a little under 2 GiB per call
+            const auto result = ::sendfile(socket_, fd, &position, static_cast<size_t>(std::min<uint64_t>(len - sent, 1u << 30)));
+
+            if (result < 0 && errno == EINTR)
+                continue;
+
+            if (result < 0)
+                throw ConnectionException::create("error sending file");
+
+            if (result == 0)
+                break;
+
+            sent += static_cast<uint64_t>(result);
+        }
+
+        if (FTP_PROBE_ENABLED(send_file))
+            FTP_PROBE(send_file, socket_, sent, probe_nanos() - started);
+
+        return sent;
+    }
+#endif
+
+
+    int SocketTransport::receive(char* buf, int len, long timeoutMs, bool* timedOut) {
+        return recv_timeout(socket_, buf, len, 0, timeoutMs, timedOut);
+    }
+
+
+    void SocketTransport::shutdown_send() {
+        if (socket_ != INVALID_SOCKET)
+            ::shutdown(socket_, SD_SEND);
+    }
+
+
+    void SocketTransport::close() {
+        if (socket_ != INVALID_SOCKET) {
+            closesocket(socket_);
+            socket_ = INVALID_SOCKET;
+        }
+    }
+
+
+    bool SocketTransport::is_open() const {
+        return socket_ != INVALID_SOCKET;
+    }
+
+
+    bool SocketTransport::readable() const {
+        FD_SET rfd;
+        timeval now = { 0, 0 };
+
+        FD_ZERO(&rfd);
+        FD_SET(socket_, &rfd);
+
+        // a failed select is left for receive to report
+        return select(FD_SETSIZE, &rfd, nullptr, nullptr, &now) != 0;
+    }
+
+
+#ifndef WIN32
+    // -------------------------------------------------------
+    // ShmTransport
+    // -------------------------------------------------------
+
+    constexpr uint32_t SHM_MAGIC = 0x46545052; // "FTPR"
+    constexpr int SHM_SPIN_COUNT = 256;         // polls before falling back to a futex wait
+    constexpr long SHM_WAIT_SLICE_MS = 1000;    // blocking waits wake up this often to recheck state
+
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words must be plain 32 bit integers");
+
+    // one direction of the transport. head and tail count total bytes ever written/read,
+    // so head - tail is the number of bytes waiting and neither needs wrapping
+    struct ShmRing {
+        std::atomic<uint64_t> head;
+        std::atomic<uint64_t> tail;
+        std::atomic<uint32_t> dataSeq;          // bumped by writer; reader futex-waits on it
+        std::atomic<uint32_t> spaceSeq;         // bumped by reader; writer futex-waits on it
+        std::atomic<uint32_t> readerWaiting;
+        std::atomic<uint32_t> writerWaiting;
+        std::atomic<uint32_t> writerClosed;
+        std::atomic<uint32_t> readerClosed;
+    };
+
+    struct ShmHeader {
+        uint32_t magic;
+        uint32_t capacity;
+        ShmRing rings[2];
+    };
+
+
+    struct ShmSegment {
+        void* base;
+        size_t length;
+
+        ShmHeader* header() const { return static_cast<ShmHeader*>(base); }
+        char* data(int ring) const { return static_cast<char*>(base) + sizeof(ShmHeader) + ring * header()->capacity; }
+
+        ShmSegment(void* b, size_t len) : base(b), length(len) {}
+
+        ~ShmSegment() {
+            munmap(base, length);
+        }
+    };
+
+
+    static void futex_wait(std::atomic<uint32_t>& word, uint32_t expected, long timeoutMs) {
+        timespec ts;
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+
+        // not FUTEX_PRIVATE: the word may be shared with another process
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+    }
+
+
+    static void futex_wake(std::atomic<uint32_t>& word) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+    }
+
+
+    static void init_header(void* base, uint32_t capacity) {
+        auto header = new (base) ShmHeader;
+
+        header->magic = SHM_MAGIC;
+        header->capacity = capacity;
+
+        for (auto& ring : header->rings) {
+            ring.head = 0;
+            ring.tail = 0;
+            ring.dataSeq = 0;
+            ring.spaceSeq = 0;
+            ring.readerWaiting = 0;
+            ring.writerWaiting = 0;
+            ring.writerClosed = 0;
+            ring.readerClosed = 0;
+        }
+    }
+
+
+    ShmTransport::ShmTransport(std::shared_ptr<ShmSegment> segment, int side) : segment_(segment), side_(side), open_(true), sendShutdown_(false) {}
+
+
+    ShmTransport::~ShmTransport() {
+        close();
+    }
+
+
+    int ShmTransport::send(const char* buf, int len) {
+        if (!open_ || sendShutdown_)
+            throw ConnectionException("error sending data: transport is shut down");
+
+        auto& ring = segment_->header()->rings[side_];
+        const uint64_t capacity = segment_->header()->capacity;
+        char* data = segment_->data(side_);
+        int spins = 0;
+
+        while (true) {
+            if (ring.readerClosed.load())
+                throw ConnectionException("error sending data: peer has closed the connection");
+
+            const auto head = ring.head.load(std::memory_order_relaxed);
+            const auto space = capacity - (head - ring.tail.load(std::memory_order_acquire));
+
+            if (space > 0) {
+                const auto n = std::min<uint64_t>(space, static_cast<uint64_t>(len));
+                const auto offset = head % capacity;
+                const auto firstPart = std::min<uint64_t>(n, capacity - offset);
+
+                memcpy(data + offset, buf, firstPart);
+                memcpy(data, buf + firstPart, n - firstPart);
+
+                ring.head.store(head + n, std::memory_order_release);
+                ring.dataSeq.fetch_add(1);
+
+                if (ring.readerWaiting.load())
+                    futex_wake(ring.dataSeq);
+
+                return static_cast<int>(n);
+            }
+
+            if (++spins < SHM_SPIN_COUNT)
+                continue;
+
+            // ring is full: sleep until the reader frees some space
+            ring.writerWaiting.store(1);
+            const auto seq = ring.spaceSeq.load();
+
+            if (capacity - (ring.head.load() - ring.tail.load()) == 0 && !ring.readerClosed.load())
+                futex_wait(ring.spaceSeq, seq, SHM_WAIT_SLICE_MS);
+
+            ring.writerWaiting.store(0);
+        }
+    }
+
+
+    int ShmTransport::receive(char* buf, int len, long timeoutMs, bool* timedOut) {
+        if (timedOut) *timedOut = false;
+
+        if (!open_)
+            throw ConnectionException("failed to receive data: transport is closed");
+
+        auto& ring = segment_->header()->rings[1 - side_];
+        const uint64_t capacity = segment_->header()->capacity;
+        const char* data = segment_->data(1 - side_);
+        const auto start = std::chrono::steady_clock::now();
+        int spins = 0;
+
+        while (true) {
+            const auto tail = ring.tail.load(std::memory_order_relaxed);
+            const auto available = ring.head.load(std::memory_order_acquire) - tail;
+
+            if (available > 0) {
+                const auto n = std::min<uint64_t>(available, static_cast<uint64_t>(len));
+                const auto offset = tail % capacity;
+                const auto firstPart = std::min<uint64_t>(n, capacity - offset);
+
+                memcpy(buf, data + offset, firstPart);
+                memcpy(buf + firstPart, data, n - firstPart);
+
+                ring.tail.store(tail + n, std::memory_order_release);
+                ring.spaceSeq.fetch_add(1);
+
+                if (ring.writerWaiting.load())
+                    futex_wake(ring.spaceSeq);
+
+                return static_cast<int>(n);
+            }
+
+            if (len == 0)
+                return 0;
+
+            // the writer may have put its last bytes in after head was read above, and closed since:
+            // it's only the end of the stream if the ring is still empty now that it has closed
+            if (ring.writerClosed.load()) {
+                if (ring.head.load(std::memory_order_acquire) != ring.tail.load(std::memory_order_relaxed))
+                    continue;
+
+                return 0; // end of stream
+            }
+
+            long waitMs = SHM_WAIT_SLICE_MS;
+
+            if (timeoutMs > 0) {
+                const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+                if (elapsed >= timeoutMs) {
+                    if (timedOut) *timedOut = true;
+                    return 0;
+                }
+
+                waitMs = std::min(waitMs, static_cast<long>(timeoutMs - elapsed));
+            }
+
+            if (++spins < SHM_SPIN_COUNT)
+                continue;
+
+            ring.readerWaiting.store(1);
+            const auto seq = ring.dataSeq.load();
+
+            if (ring.head.load() == ring.tail.load() && !ring.writerClosed.load())
+                futex_wait(ring.dataSeq, seq, waitMs);
+
+            ring.readerWaiting.store(0);
+        }
+    }
+
+
+    bool ShmTransport::readable() const {
+        if (!open_)
+            return true;
+
+        const auto& ring = segment_->header()->rings[1 - side_];
+
+        return ring.head.load(std::memory_order_acquire) != ring.tail.load(std::memory_order_relaxed) || ring.writerClosed.load();
+    }
+
+
+    void ShmTransport::shutdown_send() {
+        if (!open_ || sendShutdown_)
+            return;
+
+        auto& ring = segment_->header()->rings[side_];
+
+        ring.writerClosed.store(1);
+        ring.dataSeq.fetch_add(1);
+        futex_wake(ring.dataSeq);
+
+        sendShutdown_ = true;
+    }
+
+
+    void ShmTransport::close() {
+        if (!open_)
+            return;
+
+        shutdown_send();
+
+        // let a blocked writer on the other side know nobody is listening anymore
+        auto& ring = segment_->header()->rings[1 - side_];
+
+        ring.readerClosed.store(1);
+        ring.spaceSeq.fetch_add(1);
+        futex_wake(ring.spaceSeq);
+
+        open_ = false;
+        segment_.reset();
+    }
+
+
+    std::pair<Transport::Ptr, Transport::Ptr> ShmTransport::create_pair(size_t capacity) {
+        const auto length = sizeof(ShmHeader) + 2 * capacity;
+        void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+        if (base == MAP_FAILED)
+            throw ConnectionException::create("failed to map shared memory transport");
+
+        init_header(base, static_cast<uint32_t>(capacity));
+
+        auto segment = std::make_shared<ShmSegment>(base, length);
+
+        return std::make_pair(Ptr(new ShmTransport(segment, 0)), Ptr(new ShmTransport(segment, 1)));
+    }
+#endif
+
+} // end connection namespace
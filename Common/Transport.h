@@ -0,0 +1,117 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <utility>
+#include <stdint.h>
+
+#ifdef WIN32
+#include <WinSock2.h>
+typedef SOCKET socket_t;
+#else
+#include <sys/socket.h>
+#include <sys/types.h>
+typedef int socket_t;
+#endif
+
+namespace connection {
+
+    // A Transport moves raw bytes between two endpoints. Connection does all of the
+    // message framing and stream chunking on top of one, so the protocol code is the
+    // same whether the bytes travel over TCP, a Unix domain socket or shared memory
+    class Transport {
+        public:
+            typedef std::unique_ptr<Transport> Ptr;
+
+            virtual ~Transport() {}
+
+            // Returns number of bytes sent, which may be less than len. Throws ConnectionException on failure
+            virtual int send(const char* buf, int len) = 0;
+
+            // Returns number of bytes received. Zero means either the peer has closed its end
+            // or the timeout expired; timedOut tells the two apart
+            virtual int receive(char* buf, int len, long timeoutMs, bool* timedOut) = 0;
+
+#ifndef WIN32
+            // sends len bytes of the open file fd starting at offset: all of them, unless the file ends
+            // first. Returns bytes sent. This copies through a pooled buffer; backends that can leave
+            // the copy to the kernel do so instead
+            virtual uint64_t send_file(int fd, uint64_t offset, uint64_t len);
+#endif
+
+            // stop sending: the peer will see end of stream once it has drained what was sent
+            virtual void shutdown_send() = 0;
+            virtual void close() = 0;
+            virtual bool is_open() const = 0;
+
+            // whether receive would return at once: with data, the end of the stream or a failure.
+            // LingeringCloser asks before reading more, rather than waiting in receive to find out
+            virtual bool readable() const { return true; }
+
+            // underlying socket, for the backends that have one
+            virtual socket_t native_handle() const = 0;
+
+            virtual const char* kind() const = 0;
+
+            Transport() = default;
+            Transport(const Transport& other) = delete;
+            Transport& operator=(const Transport& other) = delete;
+    };
+
+
+    // TCP and Unix domain sockets: anything select() and recv() work on
+    class SocketTransport : public Transport {
+        socket_t socket_;
+        const char* kind_;
+
+        public:
+            SocketTransport(socket_t socket, const char* kind = "tcp");
+            ~SocketTransport();
+
+            int send(const char* buf, int len) override;
+            int receive(char* buf, int len, long timeoutMs, bool* timedOut) override;
+#ifndef WIN32
+            uint64_t send_file(int fd, uint64_t offset, uint64_t len) override;     // sendfile(2): no copy through user space
+#endif
+            void shutdown_send() override;
+            void close() override;
+            bool is_open() const override;
+            bool readable() const override;
+            socket_t native_handle() const override { return socket_; }
+            const char* kind() const override { return kind_; }
+    };
+
+
+#ifndef WIN32
+    struct ShmSegment;
+
+    // A pair of single-producer/single-consumer ring buffers in a shared mapping, one per
+    // direction. Blocking waits use futexes; both endpoints live in one process (create_pair),
+    // which is what the transport benchmarks use. There is no kernel notion of the peer
+    // going away: an endpoint dropped without calling shutdown_send() is only noticed by timeouts
+    class ShmTransport : public Transport {
+        std::shared_ptr<ShmSegment> segment_;
+        int side_;
+        bool open_;
+        bool sendShutdown_;
+
+        public:
+            constexpr static size_t DEFAULT_CAPACITY = 1024 * 1024;
+
+            ShmTransport(std::shared_ptr<ShmSegment> segment, int side);
+            ~ShmTransport();
+
+            int send(const char* buf, int len) override;
+            int receive(char* buf, int len, long timeoutMs, bool* timedOut) override;
+            void shutdown_send() override;
+            void close() override;
+            bool is_open() const override { return open_; }
+            bool readable() const override;
+            socket_t native_handle() const override { return -1; }
+            const char* kind() const override { return "shm"; }
+
+            // both endpoints in this process
+            static std::pair<Ptr, Ptr> create_pair(size_t capacity = DEFAULT_CAPACITY);
+    };
+#endif
+
+} // end connection namespace
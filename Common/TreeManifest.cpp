@@ -0,0 +1,87 @@
+#include "stdafx.h"
+#include <sstream>
+#include "TreeManifest.h"
+#include "Connection.h"
+#include "NetworkDataStream.h"
+
+namespace connection {
+
+    std::string encode_manifest(const std::vector<TreeEntry>& entries) {
+        std::stringstream buf(std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+        NetworkDataStream ds(buf);
+
+        for (const auto& entry : entries) {
+            ds << static_cast<uint8_t>(entry.type) << static_cast<uint16_t>(entry.path.length());
+            ds.write_str(entry.path);
+            ds << entry.size << entry.mode;
+        }
+
+        return buf.str();
+    }
+
+
+    std::vector<TreeEntry> decode_manifest(const std::string& manifest) {
+        std::stringstream buf(manifest, std::stringstream::in | std::stringstream::out | std::stringstream::binary);
+        NetworkDataStream ds(buf);
+        std::vector<TreeEntry> entries;
+        size_t offset = 0;
+
+        while (offset < manifest.length()) {
+            TreeEntry entry;
+            uint8_t type = 0;
+            uint16_t pathLen = 0;
+
+            if (manifest.length() - offset < TREE_ENTRY_HEADER_LEN)
+                throw ConnectionException("malformed manifest: truncated entry");
+
+            ds >> type >> pathLen;
+
+            if (type != TreeEntry::FILE && type != TreeEntry::DIRECTORY)
+                throw ConnectionException("malformed manifest: unknown entry type " + std::to_string(type));
+
+            if (pathLen > MAX_TREE_PATH_LEN || manifest.length() - offset < TREE_ENTRY_HEADER_LEN + static_cast<size_t>(pathLen))
+                throw ConnectionException("malformed manifest: bad path length");
+
+            entry.type = static_cast<TreeEntry::Type>(type);
+            entry.path = ds.read_str(pathLen);
+            ds >> entry.size >> entry.mode;
+
+            // a manifest says where files will be written: never anywhere outside the destination
+            if (!is_safe_relative_path(entry.path))
+                throw ConnectionException("manifest names an unsafe path: '" + entry.path + "'");
+
+            offset += TREE_ENTRY_HEADER_LEN + pathLen;
+            entries.push_back(std::move(entry));
+        }
+
+        return entries;
+    }
+
+
+    bool is_safe_relative_path(const std::string& path) {
+        if (path.empty() || path.length() > MAX_TREE_PATH_LEN || path.front() == '/')
+            return false;
+
+        if (path.find_first_of("\\:") != std::string::npos || path.find('\0') != std::string::npos)
+            return false;
+
+        size_t begin = 0;
+
+        while (begin <= path.length()) {
+            auto end = path.find('/', begin);
+
+            if (end == std::string::npos)
+                end = path.length();
+
+            const auto component = path.substr(begin, end - begin);
+
+            if (component.empty() || component == "." || component == "..")
+                return false;
+
+            begin = end + 1;
+        }
+
+        return true;
+    }
+
+} // end connection namespace
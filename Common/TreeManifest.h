@@ -0,0 +1,35 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace connection {
+
+    // TREE answers with a manifest of everything under a directory, which the client then fetches
+    // with ordinary GETs. Entries are listed parents first:
+    //
+    //   type (1) | path length (2) | path | size (8) | mode (4)
+    //
+    // where paths are relative to the server's directory and use '/' between components
+    struct TreeEntry {
+        enum Type : uint8_t { FILE = 1, DIRECTORY = 2 };
+
+        Type type;
+        std::string path;
+        uint64_t size;          // 0 for directories
+        uint32_t mode;          // permission bits (0777) on the server
+    };
+
+    constexpr int TREE_ENTRY_HEADER_LEN = 15;      // not counting the path
+    constexpr int MAX_TREE_PATH_LEN = 1024;
+
+    std::string encode_manifest(const std::vector<TreeEntry>& entries);
+
+    // throws ConnectionException if manifest is malformed or names an unsafe path
+    std::vector<TreeEntry> decode_manifest(const std::string& manifest);
+
+    // true for a relative path that stays beneath the directory it's relative to: no leading
+    // separator, no empty, "." or ".." components, no backslashes or drive letters
+    bool is_safe_relative_path(const std::string& path);
+
+} // end connection namespace
@@ -0,0 +1,850 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ArchiveFs.h"
+#include "SyncStream.h"
+#include "TreeManifest.h"
+
+using namespace connection;
+
+static const char INDEX_MAGIC[8] = { 'F', 'T', 'P', 'A', 'I', 'D', 'X', '1' };
+
+struct Archive::IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t format;
+    uint64_t archiveSize;       // the archive as it was when indexed: if either has changed, so might the members
+    int64_t archiveMtimeNs;
+    uint64_t count;
+    uint64_t namesOffset;       // from the start of the index file
+    uint64_t namesLen;
+    uint64_t reserved;
+};
+
+struct Archive::IndexEntry {
+    uint64_t nameOffset;        // from the start of the names
+    uint32_t nameLen;
+    uint32_t mode;
+    uint64_t offset;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+enum : uint32_t { ENTRY_DIRECTORY = 1, ENTRY_COMPRESSED = 2 };
+
+constexpr uint64_t TAR_BLOCK = 512;
+constexpr uint64_t MAX_TAR_METADATA_LEN = 1024 * 1024;   // a long name or pax header bigger than this is taken to be corruption
+
+
+static std::string describe_errno(const std::string& what) {
+    return what + ": " + strerror(errno);
+}
+
+
+static bool ends_with(const std::string& s, const std::string& suffix) {
+    return s.length() >= suffix.length() && s.compare(s.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
+
+// true if len bytes at offset all lie within the first total bytes. Offsets and lengths come from the
+// archive itself, so their sum can't be trusted not to wrap around
+static bool within(uint64_t offset, uint64_t len, uint64_t total) {
+    return offset <= total && len <= total - offset;
+}
+
+
+// reads exactly len bytes at offset, or fails
+static bool read_at(int fd, void* buf, size_t len, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < len) {
+        const auto got = ::pread(fd, static_cast<char*>(buf) + done, len - done, static_cast<off_t>(offset + done));
+
+        if (got < 0 && errno == EINTR)
+            continue;
+
+        if (got <= 0)
+            return false;
+
+        done += static_cast<size_t>(got);
+    }
+
+    return true;
+}
+
+
+// archives name members "./a/b" and directories "a/": both are kept as they'd be asked for
+static std::string normalize_member_path(std::string path) {
+    while (path.compare(0, 2, "./") == 0)
+        path.erase(0, 2);
+
+    while (!path.empty() && path.back() == '/')
+        path.pop_back();
+
+    return path;
+}
+
+
+// -------------------------------------------------------
+// tar
+// -------------------------------------------------------
+static uint64_t tar_number(const char* field, size_t len) {
+    // GNU tar stores numbers too big for octal in base 256, marked by the top bit of the first byte
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        uint64_t value = static_cast<unsigned char>(field[0]) & 0x7f;
+
+        for (size_t i = 1; i < len; ++i)
+            value = (value << 8) | static_cast<unsigned char>(field[i]);
+
+        return value;
+    }
+
+    uint64_t value = 0;
+    size_t i = 0;
+
+    while (i < len && field[i] == ' ')
+        ++i;
+
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+        value = value * 8 + static_cast<uint64_t>(field[i] - '0');
+
+    return value;
+}
+
+
+static std::string tar_string(const char* field, size_t len) {
+    return std::string(field, strnlen(field, len));
+}
+
+
+// the header's checksum is the sum of its bytes, counting the checksum field itself as spaces
+static bool tar_checksum_ok(const char* header) {
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < TAR_BLOCK; ++i)
+        sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+
+    return sum == tar_number(header + 148, 8);
+}
+
+
+// pax extended header: records of "length key=value\n", the length counting the whole record
+static void parse_pax(const std::string& data, std::string* path, uint64_t* size, bool* hasSize) {
+    size_t at = 0;
+
+    while (at < data.length()) {
+        uint64_t len = 0;
+        size_t i = at;
+
+        for (; i < data.length() && data[i] >= '0' && data[i] <= '9'; ++i)
+            len = len * 10 + static_cast<uint64_t>(data[i] - '0');
+
+        if (i >= data.length() || data[i] != ' ' || len <= i + 1 - at || at + len > data.length())
+            return;
+
+        const auto record = data.substr(i + 1, at + len - i - 2);   // without the newline
+        const auto equals = record.find('=');
+
+        if (equals != std::string::npos) {
+            const auto key = record.substr(0, equals);
+
+            if (key == "path")
+                *path = record.substr(equals + 1);
+            else if (key == "size") {
+                *size = strtoull(record.c_str() + equals + 1, nullptr, 10);
+                *hasSize = true;
+            }
+        }
+
+        at += len;
+    }
+}
+
+
+// one header per member, each followed by the member's contents padded to whole blocks, so indexing
+// costs one small read per member however big the members are
+static bool parse_tar(int fd, uint64_t archiveSize, std::vector<ArchiveMember>* members, uint64_t* headerBytes, std::string* error) {
+    char header[TAR_BLOCK];
+    std::string longName, paxPath;
+    uint64_t paxSize = 0;
+    bool hasPaxSize = false;
+    uint64_t at = 0;
+
+    while (at + TAR_BLOCK <= archiveSize) {
+        if (!read_at(fd, header, TAR_BLOCK, at)) {
+            *error = describe_errno("failed to read tar header");
+            return false;
+        }
+
+        *headerBytes += TAR_BLOCK;
+
+        // the archive ends with zero blocks
+        if (std::all_of(header, header + TAR_BLOCK, [](char c) { return c == 0; }))
+            return true;
+
+        if (!tar_checksum_ok(header)) {
+            *error = "bad tar header at offset " + std::to_string(at);
+            return false;
+        }
+
+        const char type = header[156];
+        uint64_t size = tar_number(header + 124, 12);
+        const uint64_t dataAt = at + TAR_BLOCK;
+
+        // GNU long name, or pax extended header: both describe the member after them
+        if (type == 'L' || type == 'x') {
+            if (size > MAX_TAR_METADATA_LEN || !within(dataAt, size, archiveSize)) {
+                *error = "bad tar extended header at offset " + std::to_string(at);
+                return false;
+            }
+
+            std::string data(static_cast<size_t>(size), '\0');
+
+            if (!read_at(fd, &data[0], data.size(), dataAt)) {
+                *error = describe_errno("failed to read tar extended header");
+                return false;
+            }
+
+            *headerBytes += size;
+
+            if (type == 'L')
+                longName = tar_string(data.data(), data.size());
+            else parse_pax(data, &paxPath, &paxSize, &hasPaxSize);
+
+            at = dataAt + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+            continue;
+        }
+
+        std::string name;
+
+        if (!paxPath.empty())
+            name = paxPath;
+        else if (!longName.empty())
+            name = longName;
+        else {
+            name = tar_string(header, 100);
+
+            // ustar splits long names in two
+            if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != '\0')
+                name = tar_string(header + 345, 155) + "/" + name;
+        }
+
+        if (hasPaxSize)
+            size = paxSize;
+
+        longName.clear();
+        paxPath.clear();
+        hasPaxSize = false;
+
+        const bool file = type == '0' || type == '\0' || type == '7';
+        const bool directory = type == '5';
+
+        // whatever the type, the contents are skipped over to reach the next header
+        if (!within(dataAt, size, archiveSize)) {
+            *error = "tar archive ends partway through '" + name + "'";
+            return false;
+        }
+
+        name = normalize_member_path(name);
+
+        // links, devices and the like aren't served; neither is anything that would lead out of the archive
+        if ((file || directory) && is_safe_relative_path(name)) {
+            members->push_back(ArchiveMember{ name, dataAt, directory ? 0 : size, static_cast<uint32_t>(tar_number(header + 100, 8) & 0777),
+                static_cast<int64_t>(tar_number(header + 136, 12)), directory, false });
+        }
+
+        at = dataAt + (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+
+    return true;
+}
+
+
+// -------------------------------------------------------
+// zip
+// -------------------------------------------------------
+static uint16_t le16(const unsigned char* p) {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+
+static uint32_t le32(const unsigned char* p) {
+    return static_cast<uint32_t>(le16(p)) | (static_cast<uint32_t>(le16(p + 2)) << 16);
+}
+
+
+static uint64_t le64(const unsigned char* p) {
+    return static_cast<uint64_t>(le32(p)) | (static_cast<uint64_t>(le32(p + 4)) << 32);
+}
+
+
+static int64_t dos_time(uint16_t time, uint16_t date) {
+    struct tm t = {};
+
+    t.tm_year = ((date >> 9) & 0x7f) + 80;
+    t.tm_mon = ((date >> 5) & 0xf) - 1;
+    t.tm_mday = date & 0x1f;
+    t.tm_hour = time >> 11;
+    t.tm_min = (time >> 5) & 0x3f;
+    t.tm_sec = (time & 0x1f) * 2;
+
+    return static_cast<int64_t>(timegm(&t));
+}
+
+
+constexpr uint32_t ZIP_LOCAL_HEADER_SIG = 0x04034b50;
+constexpr uint32_t ZIP_CENTRAL_HEADER_SIG = 0x02014b50;
+constexpr uint32_t ZIP_END_SIG = 0x06054b50;
+constexpr uint32_t ZIP64_END_SIG = 0x06064b50;
+constexpr uint32_t ZIP64_LOCATOR_SIG = 0x07064b50;
+constexpr size_t ZIP_LOCAL_HEADER_LEN = 30;
+constexpr size_t ZIP_CENTRAL_HEADER_LEN = 46;
+constexpr size_t ZIP_END_LEN = 22;
+constexpr size_t ZIP64_END_LEN = 56;
+constexpr size_t ZIP64_LOCATOR_LEN = 20;
+
+
+// every member is listed in the central directory at the end of the file, so indexing reads that,
+// plus the local header of each member that will be served, since only it says where the contents begin
+static bool parse_zip(int fd, uint64_t archiveSize, std::vector<ArchiveMember>* members, uint64_t* headerBytes, std::string* error) {
+    // the end of central directory record is last, followed only by a comment of at most 64 KiB
+    const auto tailLen = static_cast<size_t>(std::min<uint64_t>(archiveSize, ZIP_END_LEN + 0xffff));
+    std::vector<unsigned char> tail(tailLen);
+
+    if (tailLen < ZIP_END_LEN || !read_at(fd, tail.data(), tailLen, archiveSize - tailLen)) {
+        *error = "not a zip file: too short";
+        return false;
+    }
+
+    *headerBytes += tailLen;
+
+    int64_t end = static_cast<int64_t>(tailLen - ZIP_END_LEN);
+
+    while (end >= 0 && le32(&tail[static_cast<size_t>(end)]) != ZIP_END_SIG)
+        --end;
+
+    if (end < 0) {
+        *error = "not a zip file: no end of central directory";
+        return false;
+    }
+
+    const unsigned char* eocd = &tail[static_cast<size_t>(end)];
+    uint64_t count = le16(eocd + 10);
+    uint64_t directoryLen = le32(eocd + 12);
+    uint64_t directoryAt = le32(eocd + 16);
+
+    // zip64: the real values are in another record, which a locator just before this one points to
+    if (count == 0xffff || directoryLen == 0xffffffff || directoryAt == 0xffffffff) {
+        const uint64_t eocdAt = archiveSize - tailLen + static_cast<uint64_t>(end);
+        unsigned char locator[ZIP64_LOCATOR_LEN];
+        unsigned char record[ZIP64_END_LEN];
+
+        if (eocdAt < ZIP64_LOCATOR_LEN || !read_at(fd, locator, sizeof(locator), eocdAt - ZIP64_LOCATOR_LEN) || le32(locator) != ZIP64_LOCATOR_SIG ||
+            !read_at(fd, record, sizeof(record), le64(locator + 8)) || le32(record) != ZIP64_END_SIG) {
+            *error = "bad zip64 end of central directory";
+            return false;
+        }
+
+        *headerBytes += sizeof(locator) + sizeof(record);
+
+        count = le64(record + 32);
+        directoryLen = le64(record + 40);
+        directoryAt = le64(record + 48);
+    }
+
+    if (!within(directoryAt, directoryLen, archiveSize)) {
+        *error = "bad zip central directory: extends past the end of the file";
+        return false;
+    }
+
+    std::vector<unsigned char> directory(static_cast<size_t>(directoryLen));
+
+    if (!read_at(fd, directory.data(), directory.size(), directoryAt)) {
+        *error = describe_errno("failed to read zip central directory");
+        return false;
+    }
+
+    *headerBytes += directoryLen;
+
+    size_t at = 0;
+
+    for (uint64_t i = 0; i < count; ++i) {
+        if (at + ZIP_CENTRAL_HEADER_LEN > directory.size() || le32(&directory[at]) != ZIP_CENTRAL_HEADER_SIG) {
+            *error = "bad zip central directory entry " + std::to_string(i);
+            return false;
+        }
+
+        const unsigned char* p = &directory[at];
+        const uint16_t madeBy = le16(p + 4);
+        const uint16_t flags = le16(p + 8);
+        const uint16_t method = le16(p + 10);
+        uint64_t size = le32(p + 24);
+        const size_t nameLen = le16(p + 28);
+        const size_t extraLen = le16(p + 30);
+        const size_t commentLen = le16(p + 32);
+        uint64_t localAt = le32(p + 42);
+
+        if (at + ZIP_CENTRAL_HEADER_LEN + nameLen + extraLen + commentLen > directory.size()) {
+            *error = "bad zip central directory entry " + std::to_string(i);
+            return false;
+        }
+
+        const std::string rawName(reinterpret_cast<const char*>(p + ZIP_CENTRAL_HEADER_LEN), nameLen);
+
+        // zip64 extra field: 64-bit values for whichever of the fields above overflowed, in that order
+        const unsigned char* extra = p + ZIP_CENTRAL_HEADER_LEN + nameLen;
+
+        for (size_t e = 0; e + 4 <= extraLen;) {
+            const uint16_t id = le16(extra + e);
+            const size_t len = le16(extra + e + 2);
+            const unsigned char* field = extra + e + 4;
+            const unsigned char* fieldEnd = field + std::min(len, extraLen - e - 4);
+
+            if (id == 0x0001) {
+                if (size == 0xffffffff && field + 8 <= fieldEnd) {
+                    size = le64(field);
+                    field += 8;
+                }
+
+                if (le32(p + 20) == 0xffffffff && field + 8 <= fieldEnd)
+                    field += 8;
+
+                if (localAt == 0xffffffff && field + 8 <= fieldEnd)
+                    localAt = le64(field);
+            }
+
+            e += 4 + len;
+        }
+
+        at += ZIP_CENTRAL_HEADER_LEN + nameLen + extraLen + commentLen;
+
+        const bool isDirectory = !rawName.empty() && rawName.back() == '/';
+        const bool compressed = method != 0 || (flags & 1) != 0;     // deflated, or encrypted
+        const auto name = normalize_member_path(rawName);
+
+        if (!is_safe_relative_path(name))
+            continue;
+
+        // made on Unix: permission bits are in the top of the external attributes
+        uint32_t mode = (madeBy >> 8) == 3 ? (le32(p + 38) >> 16) & 0777 : 0;
+
+        if (mode == 0)
+            mode = isDirectory ? 0755 : 0644;
+
+        ArchiveMember member{ name, 0, isDirectory ? 0 : size, mode, dos_time(le16(p + 12), le16(p + 14)), isDirectory, compressed };
+
+        // the local header repeats the name and has an extra field of its own, possibly a different length
+        if (!isDirectory && !compressed) {
+            unsigned char local[ZIP_LOCAL_HEADER_LEN];
+
+            if (!read_at(fd, local, sizeof(local), localAt) || le32(local) != ZIP_LOCAL_HEADER_SIG) {
+                *error = "bad zip local header for '" + name + "'";
+                return false;
+            }
+
+            *headerBytes += sizeof(local);
+            member.offset = localAt + ZIP_LOCAL_HEADER_LEN + le16(local + 26) + le16(local + 28);
+
+            if (!within(member.offset, size, archiveSize)) {
+                *error = "zip archive ends partway through '" + name + "'";
+                return false;
+            }
+        }
+
+        members->push_back(member);
+    }
+
+    return true;
+}
+
+
+// -------------------------------------------------------
+// Archive
+// -------------------------------------------------------
+Archive::Archive(int fd, void* map, size_t mapLen) : fd_(fd), map_(map), mapLen_(mapLen) {
+    header_ = static_cast<const IndexHeader*>(map);
+    entries_ = reinterpret_cast<const IndexEntry*>(static_cast<const char*>(map) + sizeof(IndexHeader));
+    names_ = static_cast<const char*>(map) + header_->namesOffset;
+}
+
+
+Archive::~Archive() {
+    ::munmap(map_, mapLen_);
+    ::close(fd_);
+}
+
+
+Archive::Ptr Archive::open(const std::string& archivePath, const std::string& indexPath, IndexStats* stats, std::string* error) {
+    static_assert(sizeof(IndexHeader) == 64 && sizeof(IndexEntry) == 48, "index layout must not depend on padding");
+
+    Format format;
+
+    if (ends_with(archivePath, ".tar"))
+        format = TAR;
+    else if (ends_with(archivePath, ".zip"))
+        format = ZIP;
+    else {
+        *error = "not a .tar or .zip file";
+        return nullptr;
+    }
+
+    const int fd = ::open(archivePath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0 || ::fstat(fd, &st) != 0) {
+        *error = describe_errno("failed to open archive");
+
+        if (fd >= 0)
+            ::close(fd);
+
+        return nullptr;
+    }
+
+    const auto archiveSize = static_cast<uint64_t>(st.st_size);
+    const auto archiveMtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+
+    // maps the index, as long as it describes the archive as it is now
+    const auto map_index = [&]() -> Ptr {
+        const int indexFd = ::open(indexPath.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat indexSt;
+
+        if (indexFd < 0)
+            return nullptr;
+
+        if (::fstat(indexFd, &indexSt) != 0 || static_cast<size_t>(indexSt.st_size) < sizeof(IndexHeader)) {
+            ::close(indexFd);
+            return nullptr;
+        }
+
+        const auto len = static_cast<size_t>(indexSt.st_size);
+        void* map = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, indexFd, 0);
+
+        ::close(indexFd);
+
+        if (map == MAP_FAILED)
+            return nullptr;
+
+        const auto header = static_cast<const IndexHeader*>(map);
+
+        if (memcmp(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0 || header->version != ARCHIVE_INDEX_VERSION || header->format != format ||
+            header->archiveSize != archiveSize || header->archiveMtimeNs != archiveMtimeNs ||
+            header->count > (len - sizeof(IndexHeader)) / sizeof(IndexEntry) ||
+            header->namesOffset != sizeof(IndexHeader) + header->count * sizeof(IndexEntry) || header->namesLen != len - header->namesOffset) {
+            ::munmap(map, len);
+            return nullptr;
+        }
+
+        // lookups use every entry's name, and GETs its range, without checking: a damaged index is rebuilt
+        // instead. Compressed members aren't sent as ranges, and their size is what they expand to
+        const auto entries = reinterpret_cast<const IndexEntry*>(static_cast<const char*>(map) + sizeof(IndexHeader));
+
+        for (uint64_t i = 0; i < header->count; ++i) {
+            const auto& entry = entries[i];
+
+            if (!within(entry.nameOffset, entry.nameLen, header->namesLen) ||
+                ((entry.flags & ENTRY_COMPRESSED) == 0 && !within(entry.offset, entry.size, archiveSize))) {
+                ::munmap(map, len);
+                return nullptr;
+            }
+        }
+
+        return Ptr(new Archive(fd, map, len));
+    };
+
+    *stats = IndexStats{ 0, 0, false };
+
+    auto archive = map_index();
+
+    if (!archive) {
+        if (!build_index(fd, indexPath, format, archiveSize, archiveMtimeNs, stats, error) || !(archive = map_index())) {
+            if (error->empty())
+                *error = "index written but unreadable: " + indexPath;
+
+            ::close(fd);
+            return nullptr;
+        }
+
+        stats->rebuilt = true;
+    }
+
+    stats->members = archive->members();
+    return archive;
+}
+
+
+bool Archive::build_index(int fd, const std::string& indexPath, Format format, uint64_t archiveSize, int64_t archiveMtimeNs, IndexStats* stats, std::string* error) {
+    std::vector<ArchiveMember> members;
+
+    if (!(format == TAR ? parse_tar(fd, archiveSize, &members, &stats->headerBytes, error) : parse_zip(fd, archiveSize, &members, &stats->headerBytes, error)))
+        return false;
+
+    // sorted by path for binary search. A path can appear more than once (a tar appended to), and
+    // as when extracting, the last one wins
+    std::stable_sort(members.begin(), members.end(), [](const ArchiveMember& a, const ArchiveMember& b) { return a.path < b.path; });
+
+    std::vector<IndexEntry> entries;
+    std::string names;
+
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (i + 1 < members.size() && members[i + 1].path == members[i].path)
+            continue;
+
+        const auto& member = members[i];
+
+        entries.push_back(IndexEntry{ names.length(), static_cast<uint32_t>(member.path.length()), member.mode, member.offset, member.size, member.mtime,
+            (member.directory ? ENTRY_DIRECTORY : 0u) | (member.compressed ? ENTRY_COMPRESSED : 0u), 0 });
+        names += member.path;
+    }
+
+    IndexHeader header;
+
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = ARCHIVE_INDEX_VERSION;
+    header.format = format;
+    header.archiveSize = archiveSize;
+    header.archiveMtimeNs = archiveMtimeNs;
+    header.count = entries.size();
+    header.namesOffset = sizeof(IndexHeader) + entries.size() * sizeof(IndexEntry);
+    header.namesLen = names.length();
+    header.reserved = 0;
+
+    // written aside and renamed into place, so a server never maps half an index
+    const auto tempPath = indexPath + ".tmp";
+    std::ofstream output(tempPath, std::ios::binary | std::ios::trunc);
+
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(reinterpret_cast<const char*>(entries.data()), static_cast<std::streamsize>(entries.size() * sizeof(IndexEntry)));
+    output.write(names.data(), static_cast<std::streamsize>(names.length()));
+    output.close();
+
+    if (!output || ::rename(tempPath.c_str(), indexPath.c_str()) != 0) {
+        *error = "failed to write index " + indexPath;
+        ::remove(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+uint64_t Archive::members() const {
+    return header_->count;
+}
+
+
+std::string Archive::name_of(size_t index) const {
+    return std::string(names_ + entries_[index].nameOffset, entries_[index].nameLen);
+}
+
+
+ArchiveMember Archive::member_at(size_t index) const {
+    const auto& entry = entries_[index];
+
+    return ArchiveMember{ name_of(index), entry.offset, entry.size, entry.mode, entry.mtime, (entry.flags & ENTRY_DIRECTORY) != 0, (entry.flags & ENTRY_COMPRESSED) != 0 };
+}
+
+
+// index of the first entry whose path isn't less than path, comparing bytes as the index was sorted
+size_t Archive::lower_bound(const std::string& path) const {
+    size_t low = 0, high = static_cast<size_t>(header_->count);
+
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        const auto& entry = entries_[middle];
+        const int order = memcmp(names_ + entry.nameOffset, path.data(), std::min<size_t>(entry.nameLen, path.length()));
+
+        if (order < 0 || (order == 0 && entry.nameLen < path.length()))
+            low = middle + 1;
+        else high = middle;
+    }
+
+    return low;
+}
+
+
+bool Archive::find(const std::string& path, ArchiveMember* member) const {
+    if (path.empty()) {
+        *member = ArchiveMember{ "", 0, 0, 0755, 0, true, false };
+        return true;
+    }
+
+    const auto index = lower_bound(path);
+
+    if (index < header_->count && name_of(index) == path) {
+        *member = member_at(index);
+        return true;
+    }
+
+    // archives needn't have entries for the directories their members are in
+    const auto prefix = path + "/";
+    const auto child = lower_bound(prefix);
+
+    if (child < header_->count && name_of(child).compare(0, prefix.length(), prefix) == 0) {
+        *member = ArchiveMember{ path, 0, 0, 0755, 0, true, false };
+        return true;
+    }
+
+    return false;
+}
+
+
+bool Archive::list(const std::string& directory, std::vector<std::string>* names) const {
+    ArchiveMember found;
+
+    if (!find(directory, &found) || !found.directory)
+        return false;
+
+    const auto prefix = directory.empty() ? directory : directory + "/";
+    std::vector<std::string> directories;
+
+    for (auto index = lower_bound(prefix); index < header_->count;) {
+        const auto name = name_of(index);
+
+        if (name.compare(0, prefix.length(), prefix) != 0)
+            break;
+
+        const auto rest = name.substr(prefix.length());
+        const auto slash = rest.find('/');
+
+        if (slash == std::string::npos) {
+            if (entries_[index].flags & ENTRY_DIRECTORY)
+                directories.push_back(rest);
+            else names->push_back(rest);
+
+            ++index;
+            continue;
+        }
+
+        // a member further down: note its directory and skip the rest of what's in it. '0' follows
+        // '/', so nothing else lies between the two
+        const auto child = rest.substr(0, slash);
+
+        directories.push_back(child);
+        index = lower_bound(prefix + child + "0");
+    }
+
+    std::sort(directories.begin(), directories.end());
+    directories.erase(std::unique(directories.begin(), directories.end()), directories.end());
+
+    for (const auto& name : directories)
+        names->push_back(name + "/");
+
+    std::sort(names->begin(), names->end());
+    return true;
+}
+
+
+// -------------------------------------------------------
+// ArchiveFs
+// -------------------------------------------------------
+ArchiveFs& ArchiveFs::shared() {
+    static ArchiveFs fs;
+    return fs;
+}
+
+
+void ArchiveFs::mount_all(const std::string& indexDir) {
+    if (::mkdir(indexDir.c_str(), 0755) != 0 && errno != EEXIST) {
+        sync_cerr.print(describe_errno("Not serving archives: can't create index directory " + indexDir), sync_endl);
+        return;
+    }
+
+    std::vector<std::string> names;
+    DIR* dir = ::opendir(".");
+
+    if (dir == nullptr) {
+        sync_cerr.print(describe_errno("Not serving archives: can't list the server's directory"), sync_endl);
+        return;
+    }
+
+    while (const auto* item = ::readdir(dir)) {
+        const std::string name = item->d_name;
+        struct stat st;
+
+        // not through symbolic links, any more than GET follows them
+        if ((ends_with(name, ".tar") || ends_with(name, ".zip")) && ::lstat(name.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            names.push_back(name);
+    }
+
+    ::closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (const auto& name : names)
+            archives_[name] = nullptr;
+    }
+
+    if (!names.empty())
+        std::thread(&ArchiveFs::open_all, this, indexDir, names).detach();
+}
+
+
+// indexing thread: archives are opened in name order, each served as soon as it's open
+void ArchiveFs::open_all(const std::string& indexDir, const std::vector<std::string>& names) {
+    for (const auto& name : names) {
+        const auto started = std::chrono::steady_clock::now();
+        Archive::IndexStats stats;
+        std::string error;
+        auto archive = Archive::open(name, indexDir + "/" + name + ".idx", &stats, &error);
+
+        if (!archive) {
+            sync_cerr.print("Not serving archive ", name, ": ", error, sync_endl);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            archives_.erase(name);
+            continue;
+        }
+
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+
+        if (stats.rebuilt)
+            sync_cout.print("Serving archive ", name, ": indexed ", stats.members, " members in ", ms, " ms, reading ", stats.headerBytes, " bytes of headers", sync_endl);
+        else sync_cout.print("Serving archive ", name, ": ", stats.members, " members, index up to date", sync_endl);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        archives_[name] = archive;
+    }
+}
+
+
+bool ArchiveFs::enabled() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !archives_.empty();
+}
+
+
+Archive::Ptr ArchiveFs::resolve(const std::string& path, std::string* member, bool* indexing) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    *indexing = false;
+
+    if (archives_.empty() || !is_safe_relative_path(path))
+        return nullptr;
+
+    const auto slash = path.find('/');
+    const auto it = archives_.find(path.substr(0, slash));
+
+    if (it == archives_.end())
+        return nullptr;
+
+    *member = slash == std::string::npos ? "" : path.substr(slash + 1);
+    *indexing = !it->second;
+    return it->second;
+}
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+#ifndef WIN32
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Datasets published as one big tar or zip file are served straight out of the archive, without
+// extracting them first: "dataset.tar/a/b.csv" names member a/b.csv of dataset.tar in the
+// server's directory. Each archive is indexed once, by reading its headers (or zip central
+// directory) rather than its contents, and the index is kept in a file of its own which is
+// memory-mapped and searched in place. A GET for a member is then a range of the archive file
+// which the kernel can send as it is, as long as the member is stored rather than compressed.
+//
+// index file: header, then fixed-size entries sorted by member path, then the paths themselves.
+// It lives on the server's host only, so it is in host byte order
+struct ArchiveMember {
+    std::string path;           // within the archive, '/' between components, no trailing '/'
+    uint64_t offset;            // of the contents, within the archive file
+    uint64_t size;
+    uint32_t mode;              // permission bits (0777)
+    int64_t mtime;              // seconds since the epoch
+    bool directory;
+    bool compressed;            // zip member that isn't stored: listed, but can't be sent as a range
+};
+
+
+class Archive {
+    public:
+        typedef std::shared_ptr<Archive> Ptr;
+
+        enum Format : uint32_t { TAR = 1, ZIP = 2 };
+
+        struct IndexStats {
+            uint64_t members;
+            uint64_t headerBytes;       // read from the archive to build the index: 0 if it was up to date
+            bool rebuilt;
+        };
+
+        // opens the archive at archivePath along with its index at indexPath, (re)building the
+        // index if it's missing or the archive has changed since. Returns nullptr, with error set,
+        // if the archive can't be read or isn't a tar or zip file
+        static Ptr open(const std::string& archivePath, const std::string& indexPath, IndexStats* stats, std::string* error);
+
+        ~Archive();
+
+        // looks up a member by path. A directory the archive has no entry for but which members
+        // are in is found too
+        bool find(const std::string& path, ArchiveMember* member) const;
+
+        // names of the immediate children of directory ("" for the top), directories ending in '/'.
+        // Returns false if there is no such directory
+        bool list(const std::string& directory, std::vector<std::string>* names) const;
+
+        int fd() const { return fd_; }
+        uint64_t members() const;
+
+    private:
+        struct IndexHeader;
+        struct IndexEntry;
+
+        int fd_;
+        void* map_;
+        size_t mapLen_;
+        const IndexHeader* header_;
+        const IndexEntry* entries_;
+        const char* names_;
+
+        Archive(int fd, void* map, size_t mapLen);
+
+        size_t lower_bound(const std::string& path) const;
+        std::string name_of(size_t index) const;
+        ArchiveMember member_at(size_t index) const;
+
+        static bool build_index(int fd, const std::string& indexPath, Format format, uint64_t archiveSize, int64_t archiveMtimeNs, IndexStats* stats, std::string* error);
+
+        Archive(const Archive& other) = delete;
+        Archive& operator=(const Archive& other) = delete;
+};
+
+
+// the archives being served, by file name. Found once at startup, and each served from when its
+// index is ready
+class ArchiveFs {
+    public:
+        static ArchiveFs& shared();
+
+        // finds every .tar and .zip file in the server's directory, then opens them one by one in the
+        // background, keeping their indexes in indexDir and reporting on each as it goes: a large
+        // archive with no index yet mustn't hold up the server starting
+        void mount_all(const std::string& indexDir);
+
+        bool enabled() const;
+
+        // the archive path leads into, with member set to the rest of the path ("" for the archive
+        // itself). nullptr if path isn't in a mounted archive, with indexing set if it's in one that
+        // is still being indexed
+        Archive::Ptr resolve(const std::string& path, std::string* member, bool* indexing) const;
+
+    private:
+        mutable std::mutex mutex_;
+        std::map<std::string, Archive::Ptr> archives_;     // nullptr until indexed
+
+        ArchiveFs() {}
+
+        void open_all(const std::string& indexDir, const std::vector<std::string>& names);
+
+        ArchiveFs(const ArchiveFs& other) = delete;
+        ArchiveFs& operator=(const ArchiveFs& other) = delete;
+};
+
+constexpr uint32_t ARCHIVE_INDEX_VERSION = 1;
+#endif
@@ -1,6 +1,10 @@
 #include "pch.h"
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <thread>
 #ifdef WIN32
 #include <filesystem>
 #else
@@ -9,6 +13,32 @@
 #include "ClientSession.h"
 #include "Message.h"
 #include "SyncStream.h"
+#include "HotRestart.h"
+#include "ProtocolVer.h"
+#include "FileBundle.h"
+#include "Glob.h"
+#include "TreeManifest.h"
+#include "FileCopy.h"
+#include "StatBatch.h"
+#include "StatCache.h"
+#include "StagedUpload.h"
+#include "SessionTable.h"
+#include "SessionResume.h"
+#include "Trace.h"
+#include "Probes.h"
+#include "Metrics.h"
+#ifndef WIN32
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "FdPassing.h"
+#include "ArchiveFs.h"
+#include "DirectoryWatch.h"
+#include "FileCache.h"
+#include "FileWatch.h"
+#include "HotSet.h"
+#include "Readahead.h"
+#endif
 
 using namespace connection;
 using namespace std;
@@ -17,57 +47,466 @@ namespace fs = std::experimental::filesystem;
 constexpr long TIMEOUT_HELLO_MS = 10000;                // client has this many milliseconds to respond to a greeting message or we close the connection
 constexpr long TIMEOUT_CLIENT_COMMAND_RESPONSE = 10000;
 constexpr long TIMEOUT_IDLE = 60000;
-
-ClientSession::ClientSession(ConnectionPtr conn) : control_(conn) {}
+constexpr long TIMEOUT_IDLE_SLICE = 250;                // idle waits are broken up so a hot restart can take over idle sessions promptly
+constexpr long TIMEOUT_HANDOFF_SLICE = 10;              // and during one, v2 sessions look this often for a gap between their streams
+constexpr long COPY_PROGRESS_INTERVAL_MS = 500;         // COPY and MOVE report progress no more often than this
+constexpr uint64_t GET_FIRST_BYTES = 64 * 1024;         // sent on their own, so the time a GET takes to start sending can be measured
+
+ClientSession::ClientSession(ConnectionPtr conn) : control_(conn), inlineLimit_(0), version_(1), greeted_(false), resumable_(false), passFiles_(false), runningStreams_(0), nextStreamSeq_(0), nextToOrder_(0) {}
+ClientSession::ClientSession(ConnectionPtr conn, const HotRestart::SessionState& state) : control_(conn), inlineLimit_(state.inlineLimit), version_(state.version), greeted_(true), token_(state.token), resumable_(!state.token.empty()), passFiles_(false), runningStreams_(0), nextStreamSeq_(0), nextToOrder_(0) {
+    uploads_ = adopt_uploads(state.uploads);
+}
 
 
 void ClientSession::serve() {
-    if (!greeting())
+    if (!greeted_ && !greeting())
         return; // client failed to greet us correctly or at all, we're done serving them
 
-    // todo: serve client
+#ifndef WIN32
+    // checked on the socket itself, since a session handed over by hot restart has forgotten how it was accepted
+    passFiles_ = version_ < PROTOCOL_VERSION_MULTIPLEXED && is_local_socket(control_->transport().native_handle());
+#endif
+
+    if (version_ >= PROTOCOL_VERSION_MULTIPLEXED)
+        serve_multiplexed();
+    else serve_commands();
+
+    // the connection dropped (or went idle) rather than the client quitting: it may be back, here or,
+    // once a hot restart has begun, to the process taking over
+    if (resumable_ && !token_.empty()) {
+        HotRestart::SessionState state{ inlineLimit_, version_, token_, describe_uploads(uploads_) };
+
+        if (HotRestart::in_progress() && HotRestart::hand_off_parked(&state))
+            disown_uploads(uploads_, state.uploads);
+        else SessionTable::shared().park(token_, ParkedSession{ std::move(uploads_) });
+    }
+}
+
+
+// moves the session, with its unfinished uploads, to the process a hot restart is handing over to.
+// False if it has to carry on here
+bool ClientSession::hand_off() {
+    std::lock_guard<std::mutex> lock(uploadsMutex_);
+
+    const auto remote = control_->identify_remote();
+    HotRestart::SessionState state{ inlineLimit_, version_, token_, describe_uploads(uploads_) };
+
+    if (!HotRestart::hand_off_session(*control_, &state))
+        return false;
+
+    // any that didn't fit in the handoff go when this session does
+    disown_uploads(uploads_, state.uploads);
+
+    sync_cout.print(remote, " handed off to new server process", sync_endl);
+    resumable_ = false;
+    return true;
+}
+
+
+// protocol v1: one command at a time on the control connection, data on a connection of its own
+void ClientSession::serve_commands() {
     Message msg;
     bool timedOut = false;
+    long idleMs = 0;
+
     while (true) {
         // guaranteed to get a message back, or else 0 bytes AND timedOut set
-        control_->receive(&msg, TIMEOUT_IDLE, &timedOut);
+        control_->receive(&msg, TIMEOUT_IDLE_SLICE, &timedOut);
+
+        if (!timedOut) {
+            idleMs = 0;
+
+            if (!dispatch(control_, msg))
+                return;
+        }
 
-        // check for timeout
-        if (timedOut) {
-            sync_cerr.print(control_->identify_remote(), " timed out, closing connection", sync_endl);
+        // between commands is the one moment a session can move to a new server process. Nothing of
+        // the next command has been read yet, so one that never lets a whole slice go by between its
+        // commands moves straight after one
+        if (HotRestart::in_progress() && hand_off())
             return;
+
+        if (!timedOut)
+            continue;
+
+        if ((idleMs += TIMEOUT_IDLE_SLICE) < TIMEOUT_IDLE)
+            continue;
+
+        sync_cerr.print(control_->identify_remote(), " timed out, closing connection", sync_endl);
+        return;
+    }
+}
+
+
+// protocol v2: commands arrive on streams of the control connection and are served concurrently,
+// each on its own thread, with the data going back on the command's stream
+void ClientSession::serve_multiplexed() {
+    mux_ = Multiplexer::create(control_, Multiplexer::SERVER);
+    long idleMs = 0;
+
+    while (true) {
+        bool timedOut = false;
+        long slice = TIMEOUT_IDLE_SLICE;
+
+        // while handing over, a short gap between streams is enough to move in: a client that is never
+        // idle for a whole slice, or that keeps the reader from waiting out a whole poll, still moves
+        if (HotRestart::in_progress()) {
+            slice = TIMEOUT_HANDOFF_SLICE;
+            mux_->set_poll_interval(TIMEOUT_HANDOFF_SLICE);
         }
 
-        // decode sent message
-        switch (msg.msgid) {
-            case MSGID::MESSAGE_LS:
-                handle_ls(msg);
-                break;
+        auto stream = mux_->accept_stream(slice, &timedOut);
 
-            case MSGID::MESSAGE_GET:
-                handle_get(msg);
-                break;
+        if (stream) {
+            {
+                std::lock_guard<std::mutex> lock(streamsMutex_);
+                ++runningStreams_;
+            }
 
-            case MSGID::MESSAGE_PUT:
-                handle_put(msg);
-                break;
+            std::thread(&ClientSession::serve_stream, this, stream, nextStreamSeq_++).detach();
+            idleMs = 0;
+            continue;
+        }
 
-            case MSGID::MESSAGE_QUIT:
-                handle_quit(msg);
-                return;
+        if (!timedOut)
+            break; // client quit, or the connection has gone
+
+        bool busy;
+
+        {
+            std::lock_guard<std::mutex> lock(streamsMutex_);
+            busy = runningStreams_ > 0 || mux_->active_streams() > 0;
+        }
+
+        // a session with transfers in progress isn't idle
+        if (busy) {
+            idleMs = 0;
+            continue;
+        }
 
-            default:
-                sync_cerr.print(control_->identify_remote(), " sent unexpected message: ", msg, "\nclosing connection to", control_->identify_remote(), sync_endl);
+        // no streams and no stream threads: the connection can be handed over between frames
+        if (HotRestart::in_progress() && mux_->detach()) {
+            if (hand_off())
                 return;
+
+            mux_ = Multiplexer::create(control_, Multiplexer::SERVER); // carry on here
+        }
+
+        if ((idleMs += slice) < TIMEOUT_IDLE)
+            continue;
+
+        sync_cerr.print(control_->identify_remote(), " timed out, closing connection", sync_endl);
+        break;
+    }
+
+    // stream threads refer to this session: they must be done before it goes away
+    mux_->close();
+
+    std::unique_lock<std::mutex> lock(streamsMutex_);
+    streamsDone_.wait(lock, [this]() { return runningStreams_ == 0; });
+}
+
+
+void ClientSession::serve_stream(ConnectionPtr stream, uint64_t seq) {
+    bool ordered = false;
+
+    if (trace::enabled())
+        trace::name_thread(control_->identify_remote() + " stream " + std::to_string(seq));
+
+    try {
+        Message msg;
+        bool timedOut = false;
+
+        stream->receive(&msg, TIMEOUT_CLIENT_COMMAND_RESPONSE, &timedOut);
+
+        if (timedOut)
+            sync_cerr.print(control_->identify_remote(), " opened a stream but sent no command", sync_endl);
+
+        // waiting behind an earlier command on the same file is time the client sees too
+        trace::Span waiting("order");
+
+        order_command(seq, timedOut ? nullptr : &msg);
+        ordered = true;
+        waiting.end();
+
+        if (!timedOut && !dispatch(stream, msg))
+            mux_->close(); // ends the session
+    }
+    catch (const std::exception& e) {
+        sync_cerr.print(control_->identify_remote(), " : stream failed - ", e.what(), sync_endl);
+    }
+
+    // streams opened after this one are waiting for it to take its place in the order
+    if (!ordered)
+        order_command(seq, nullptr);
+
+    {
+        std::lock_guard<std::mutex> lock(streamsMutex_);
+
+        ordered_.erase(seq);
+        --runningStreams_;
+    }
+
+    orderChanged_.notify_all();
+    streamsDone_.notify_all();
+}
+
+
+static bool writes_files(const Message& command) {
+    return command.msgid == MSGID::MESSAGE_PUT || command.msgid == MSGID::MESSAGE_MPUT ||
+        command.msgid == MSGID::MESSAGE_COPY || command.msgid == MSGID::MESSAGE_MOVE;
+}
+
+
+// true for commands whose payload doesn't simply name the one file they touch
+static bool touches_many(const Message& command) {
+    return command.msgid == MSGID::MESSAGE_LS || command.msgid == MSGID::MESSAGE_MGET || command.msgid == MSGID::MESSAGE_MPUT ||
+        command.msgid == MSGID::MESSAGE_TREE || command.msgid == MSGID::MESSAGE_COPY || command.msgid == MSGID::MESSAGE_MOVE ||
+        command.msgid == MSGID::MESSAGE_STAT;
+}
+
+
+// where one range of a parallel upload goes
+struct PutRange {
+    uint64_t offset;
+    uint64_t total;             // size of the whole file
+};
+
+
+// a PUT's payload is the file name, followed for one range of a parallel upload by a line
+// "<offset> <file size>". Returns true for a range, which is left with a total of 0 if malformed
+static bool parse_put(const Message& command, std::string* fileName, PutRange* range) {
+    const auto split = command.payload.find('\n');
+
+    *fileName = command.payload.substr(0, split);
+
+    if (split == std::string::npos)
+        return false;
+
+    std::istringstream line(command.payload.substr(split + 1));
+
+    if (!(line >> range->offset >> range->total))
+        range->total = 0;
+
+    return true;
+}
+
+
+// how a GET follows its file as it grows
+struct GetFollow {
+    uint64_t offset;            // where to start
+    long idleMs;                // how long the file may go without growing before the GET ends: 0 for no limit
+};
+
+
+// a GET's payload is the file name, followed to follow the file by a line "follow <offset> <idle ms>".
+// Returns true to follow, leaving idleMs negative if the line is malformed
+static bool parse_get(const Message& command, std::string* fileName, GetFollow* follow) {
+    const auto split = command.payload.find('\n');
+
+    *fileName = command.payload.substr(0, split);
+
+    if (split == std::string::npos)
+        return false;
+
+    std::istringstream line(command.payload.substr(split + 1));
+    std::string keyword;
+
+    if (!(line >> keyword >> follow->offset >> follow->idleMs) || keyword != "follow")
+        follow->idleMs = -1;
+
+    return true;
+}
+
+
+// the one file a command's payload names
+static std::string target_of(const Message& command) {
+    std::string fileName = command.payload;
+    PutRange range;
+    GetFollow follow;
+
+    if (command.msgid == MSGID::MESSAGE_PUT)
+        parse_put(command, &fileName, &range);
+    else if (command.msgid == MSGID::MESSAGE_GET)
+        parse_get(command, &fileName, &follow);
+
+    return fileName;
+}
+
+
+// true if later, sent after earlier on the same session, has to wait for earlier to finish.
+// Only writes conflict: a PUT or MPUT with anything that reads or writes the same file, or with
+// a command that lists or matches files. Ranges of one parallel upload are disjoint, so they don't
+static bool must_follow(const Message& earlier, const Message& later) {
+    // a watch lasts until the client ends it, and touches nothing meanwhile
+    if (earlier.msgid == MSGID::MESSAGE_WATCH || later.msgid == MSGID::MESSAGE_WATCH)
+        return false;
+
+    // nor does a GET following its file: what it sends is whatever is written meanwhile anyway
+    if (earlier.msgid == MSGID::MESSAGE_GET && earlier.payload.find('\n') != std::string::npos)
+        return false;
+
+    if (earlier.msgid == MSGID::MESSAGE_QUIT || later.msgid == MSGID::MESSAGE_QUIT)
+        return true;
+
+    if (!writes_files(earlier) && !writes_files(later))
+        return false;
+
+    if (touches_many(earlier) || touches_many(later))
+        return true;
+
+    const auto is_range = [](const Message& command) {
+        return command.msgid == MSGID::MESSAGE_PUT && command.payload.find('\n') != std::string::npos;
+    };
+
+    if (is_range(earlier) && is_range(later))
+        return false;
+
+    return target_of(earlier) == target_of(later);
+}
+
+
+// enters stream seq's command (none if it never sent one) after those of every earlier stream, then
+// waits until no unfinished earlier command must come before it
+void ClientSession::order_command(uint64_t seq, const Message* command) {
+    std::unique_lock<std::mutex> lock(streamsMutex_);
+
+    orderChanged_.wait(lock, [this, seq]() { return nextToOrder_ == seq; });
+
+    ++nextToOrder_;
+
+    if (command)
+        ordered_[seq] = *command;
+
+    orderChanged_.notify_all();
+
+    if (!command)
+        return;
+
+    orderChanged_.wait(lock, [this, seq, command]() {
+        for (auto it = ordered_.begin(); it != ordered_.end() && it->first < seq; ++it) {
+            if (must_follow(it->second, *command))
+                return false;
         }
+
+        return true;
+    });
+}
+
+
+// true if a nested path passes through a symbolic link anywhere, which could lead out of the
+// server's directory. A plain file name is taken as it is, as it always has been
+static bool crosses_symlink(const std::string& path) {
+    if (path.find('/') == std::string::npos)
+        return false;
+
+    std::error_code ec;
+    fs::path prefix;
+
+    for (const auto& component : fs::path(path)) {
+        prefix /= component;
+
+        if (fs::is_symlink(fs::symlink_status(prefix, ec)))
+            return true;
+    }
+
+    return false;
+}
+
+
+// the server has just written to path: what's cached of it, or of anything beneath it, is out of date
+static void invalidate_caches(const std::string& path) {
+    StatCache::shared().invalidate(path);
+#ifndef WIN32
+    FileCache::shared().invalidate(path);
+#endif
+}
+
+
+static void clear_caches() {
+    StatCache::shared().clear();
+#ifndef WIN32
+    FileCache::shared().clear();
+#endif
+}
+
+
+// returns false once the session should end
+bool ClientSession::dispatch(const ConnectionPtr& control, const Message& clientCommand) {
+    trace::Span span(command_name(clientCommand.msgid), trace::enabled() ? target_of(clientCommand) : std::string());
+    const auto started = FTP_PROBE_ENABLED(command_done) ? probe_nanos() : 0;
+
+    // found out first: QUIT shuts the connection down. On v2 it's the command's stream that's asked,
+    // since the session's connection may be closed under it once the client has gone
+    const auto handle = control->transport().native_handle();
+
+    FTP_PROBE(command_start, handle, static_cast<int>(clientCommand.msgid), clientCommand.payload.c_str());
+
+    const bool carryOn = run_command(control, clientCommand);
+
+    if (FTP_PROBE_ENABLED(command_done))
+        FTP_PROBE(command_done, handle, static_cast<int>(clientCommand.msgid), probe_nanos() - started);
+
+    return carryOn;
+}
+
+
+bool ClientSession::run_command(const ConnectionPtr& control, const Message& clientCommand) {
+    switch (clientCommand.msgid) {
+        case MSGID::MESSAGE_LS:
+            handle_ls(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_GET:
+            handle_get(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_PUT:
+            handle_put(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_MGET:
+            handle_mget(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_MPUT:
+            handle_mput(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_TREE:
+            handle_tree(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_COPY:
+        case MSGID::MESSAGE_MOVE:
+            handle_copy(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_STAT:
+            handle_stat(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_WATCH:
+            handle_watch(control, clientCommand);
+            return true;
+
+        case MSGID::MESSAGE_QUIT:
+            handle_quit(control, clientCommand);
+            return false;
+
+        default:
+            sync_cerr.print(control_->identify_remote(), " sent unexpected message: ", clientCommand, "\nclosing connection to", control_->identify_remote(), sync_endl);
+            return false;
     }
 }
 
 
 // exchange greetings according to protocol
 bool ClientSession::greeting() {
-    // send hello to client
-    auto hello = MAKE_MSG(MSGID::MESSAGE_HELLO, MAKE_VERSION("Server", "welcome"));
+    token_ = SessionTable::new_token();
+
+    // send hello to client, along with the token that lets it resume this session
+    auto hello = MAKE_MSG(MSGID::MESSAGE_HELLO, MAKE_VERSION("Server", "welcome") "\n" + std::string(HELLO_SESSION) + " " + token_);
 
     if (control_->send(hello) != hello.length()) {
         sync_cerr.print("failed to send greeting message to ", control_->identify_remote(), sync_endl);
@@ -89,11 +528,61 @@ bool ClientSession::greeting() {
         return false;
     }
 
+    // older clients leave this zero and always get a data channel
+    inlineLimit_ = static_cast<uint16_t>(std::min<int>(response.inlineLimit, MAX_INLINE_PAYLOAD_LEN));
+
+    // and announce no version, so stay on v1
+    version_ = negotiate_version(response.payload);
+    greeted_ = true;
+    resumable_ = true;
+
+    // a client back after its connection dropped
+    const auto resumeToken = hello_field(response.payload, HELLO_RESUME);
+
+    if (!resumeToken.empty())
+        resume(resumeToken);
+
     return true;
 }
 
 
-void ClientSession::handle_ls(const Message& clientCommand) {
+// takes back the session parked under token, telling the client which of its uploads are still
+// only partly here. If it has expired, this carries on as the new session it has been so far
+void ClientSession::resume(const std::string& token) {
+    ParkedSession parked;
+
+    if (!SessionTable::shared().resume(token, &parked)) {
+        auto response = MAKE_EMSG(MSGECODE::ERR_SESSION_EXPIRED);
+        response.payload = "no session to resume: starting a new one";
+
+        sync_cerr.print(control_->identify_remote(), " tried to resume an expired session", sync_endl);
+        control_->send(response);
+        return;
+    }
+
+    // the version and inline limit stay as this greeting negotiated them: they're what the client
+    // speaks now, even if it spoke something else before its connection dropped
+    uploads_ = std::move(parked.uploads);
+
+    std::vector<InterruptedUpload> interrupted;
+
+    for (const auto& upload : uploads_)
+        interrupted.push_back(InterruptedUpload{ upload.first, upload.second->size(), upload.second->missing() });
+
+    auto response = MAKE_MSG(MSGID::MESSAGE_OK, encode_interrupted(interrupted));
+
+    // uploads that don't fit are still kept, but the client will have to send them again from the start
+    while (response.payload.length() > MAX_INLINE_PAYLOAD_LEN) {
+        interrupted.pop_back();
+        response.payload = encode_interrupted(interrupted);
+    }
+
+    sync_cout.print(control_->identify_remote(), " resumed its session, ", uploads_.size(), " interrupted uploads", sync_endl);
+    control_->send(response);
+}
+
+
+void ClientSession::handle_ls(const ConnectionPtr& control, const Message& clientCommand) {
     // client is listening for our contact and won't begin reading data
     // until we send OK message
 
@@ -101,22 +590,62 @@ void ClientSession::handle_ls(const Message& clientCommand) {
         Connection::Ptr dataChannel;
         Message response; ZERO_MSG(&response);
 
-        // establish that connection now
-        dataChannel = Connection::connect(control_->remote_name(), clientCommand.port);
-
         std::stringstream lsData;
         fs::path p = fs::current_path();
+        std::string directory = clientCommand.payload;
+
+        // "ls dir/" is "ls dir"
+        while (directory.length() > 1 && directory.back() == '/')
+            directory.pop_back();
+
+        bool listed = false;
+
+        if (!directory.empty()) {
+            response = MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
+            response.payload = "'" + directory + "' is not a directory";
+
+#ifndef WIN32
+            // the inside of an archive being served
+            listed = list_archive(directory, lsData, &response);
+#endif
+
+            if (!listed) {
+                if (!is_safe_relative_path(directory) || crosses_symlink(directory) || !fs::is_directory(directory)) {
+                    print_command_result(clientCommand, false, response.payload);
+                    control->send(response);
+                    return;
+                }
 
+                p = directory;
+            }
+        }
+
+        if (!listed) {
 #if WIN32
-        for (const auto& item : fs::_Directory_iterator<true_type>(p)) {
+            for (const auto& item : fs::_Directory_iterator<true_type>(p)) {
 #else
-        for (const auto& item : fs::directory_iterator(p)) {
+            for (const auto& item : fs::directory_iterator(p)) {
 #endif
-            if (fs::is_regular_file(item)) {
-                lsData << item.path().filename() << endl;
+                // uploads still arriving aren't there yet as far as the client is concerned
+                if (is_staging_name(item.path().filename().string())) {
+                    continue;
+                } else if (fs::is_regular_file(item)) {
+                    lsData << item.path().filename() << endl;
+
+                // subdirectories are only listed when asked about a directory, where TREE and GET can reach them
+                } else if (!directory.empty() && fs::is_directory(fs::symlink_status(item.path()))) {
+                    lsData << (item.path().filename() / "") << endl;
+                }
             }
         }
 
+        // short listings go straight back on the control channel
+        if (send_inline(control, clientCommand, lsData.str()))
+            return;
+
+        // establish that connection now
+        dataChannel = open_data_channel(control, clientCommand);
+
         NetworkDataStream data(lsData);
 
         lsData.seekg(0, lsData.end);
@@ -127,7 +656,7 @@ void ClientSession::handle_ls(const Message& clientCommand) {
         // let client know we're going to send data
         response = MAKE_MSG(MSGID::MESSAGE_OK, static_cast<uint32_t>(dataLen), 0, "");
 
-        control_->send(response);
+        control->send(response);
 
         // now send actual data
         if (dataChannel->send(data) != dataLen)
@@ -145,36 +674,125 @@ void ClientSession::handle_ls(const Message& clientCommand) {
 }
 
 
-void ClientSession::handle_get(const Message& clientCommand) {
+#ifndef WIN32
+// how long GETs take from arriving to sending their first bytes, totalled separately for files
+// readahead warmed and those it didn't, with how many of each: a mean per kind for the metrics
+// dump, and what readahead is for
+static void record_first_byte(bool warmed, std::chrono::steady_clock::time_point started) {
+    static auto& warmedUs = metrics::counter("readahead.first_byte_us_warmed");
+    static auto& warmedGets = metrics::counter("readahead.gets_warmed");
+    static auto& coldUs = metrics::counter("readahead.first_byte_us_cold");
+    static auto& coldGets = metrics::counter("readahead.gets_cold");
+    const auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+
+    (warmed ? warmedUs : coldUs) += us;
+    ++(warmed ? warmedGets : coldGets);
+}
+#endif
+
+
+void ClientSession::handle_get(const ConnectionPtr& control, const Message& clientCommand) {
+#ifndef WIN32
+    const auto started = std::chrono::steady_clock::now();
+    bool warmed = false;
+#endif
+
     try {
         Connection::Ptr dataChannel;
         Message response; MAKE_EMSG(MSGECODE::ERR_UNKNOWN);
+        std::string fileName;
+        GetFollow follow;
+        const bool following = parse_get(clientCommand, &fileName, &follow);
+        uint64_t fileSize = 0;
+#ifndef WIN32
+        CachedFile::Ptr file;
+        int error = 0;
+#else
         fstream input;
-        fs::path filePath(clientCommand.payload);
-        std::streampos fileSize = 0;
+        fs::path filePath(fileName);
+#endif
+        // until the file is found and open, or it's known why it can't be
+        trace::Span phase("validate");
+
+#ifndef WIN32
+        // a member of an archive being served, rather than a file of its own
+        std::string member;
+        bool indexing = false;
+        const auto archive = ArchiveFs::shared().resolve(fileName, &member, &indexing);
+
+        if (indexing && !member.empty()) {
+            response = MAKE_EMSG(MSGECODE::ERR_FAILED_TO_OPEN);
+            response.payload = "the archive '" + fileName.substr(0, fileName.find('/')) + "' is still being indexed: try again shortly";
+
+            print_command_result(clientCommand, false, response.payload);
+            control->send(response);
+            return;
+        }
+
+        if (archive && !member.empty()) {
+            if (following) {
+                response = MAKE_EMSG(MSGECODE::ERR_NOT_A_FILE);
+                response.payload = "'" + fileName + "' is in an archive, which never grows: get it without following";
+
+                print_command_result(clientCommand, false, response.payload);
+                control->send(response);
+                return;
+            }
+
+            phase.end();
+            send_archive_member(control, clientCommand, *archive, member);
+            return;
+        }
+#endif
 
         // the client is waiting on an OK or ERROR message and has a socket ready for us
 
         // first check for failure scenarios:
         {
             // did they actually specify a filename?
-            if (clientCommand.payload.empty()) {
+            if (fileName.empty()) {
                 response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
 
-            // did they try to use some kind of path (not allowed for now)
-            } else if (clientCommand.payload.find('/') != std::string::npos || clientCommand.payload.find('\\') != std::string::npos) {
+            } else if (following && follow.idleMs < 0) {
+                response = MAKE_EMSG(MSGECODE::ERR_UNRECOGNIZED_COMMAND);
+                response.payload = "malformed GET of " + fileName + ": expected 'follow <offset> <idle ms>'";
+
+#ifndef WIN32
+            // found a component at a time beneath the server's directory, if it isn't open already
+            } else if (!(file = FileCache::shared().open(fileName, &fileSize, &error))) {
+                std::stringstream stream;
+
+                if (error == EPERM) {
+                    response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
+                    stream << "'" << fileName << "' is not a path beneath the server's directory";
+                } else if (error == ENOENT) {
+                    response = MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
+                    stream << "File '" << fileName << "' not found on server";
+                } else if (error == EISDIR) {
+                    response = MAKE_EMSG(MSGECODE::ERR_NOT_A_FILE);
+                    stream << "'" << fileName << "' is not a file";
+                } else {
+                    response = MAKE_EMSG(MSGECODE::ERR_FAILED_TO_OPEN);
+                    stream << "can't open '" << fileName << "': " << strerror(error);
+                }
+
+                response.payload = stream.str();
+            }
+#else
+            // paths may only lead down into the server's directory (TREE lists files that way)
+            } else if (!is_safe_relative_path(fileName) || crosses_symlink(fileName)) {
                 response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
                 std::stringstream stream;
 
-                stream << "'" << clientCommand.payload << "' contains a path which is not permitted";
+                stream << "'" << fileName << "' is not a path beneath the server's directory";
                 response.payload = stream.str();
                 
             // does their filename exist?
-            } else if (!fs::exists(fs::path(clientCommand.payload))) {
+            } else if (!fs::exists(fs::path(fileName))) {
                 response = MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
                 std::stringstream stream;
 
-                stream << "File '" << clientCommand.payload << "' not found on server";
+                stream << "File '" << fileName << "' not found on server";
                 response.payload = stream.str();
 
             // did they specify something that isn't a file?
@@ -183,7 +801,7 @@ void ClientSession::handle_get(const Message& clientCommand) {
 
                 std::stringstream stream;
 
-                stream << "'" << clientCommand.payload << "' is not a file";
+                stream << "'" << fileName << "' is not a file";
                 response.payload = stream.str();
             }
 
@@ -195,7 +813,7 @@ void ClientSession::handle_get(const Message& clientCommand) {
 
                 // find out number of bytes in the file
                 input.seekg(0, input.end);
-                fileSize = input.tellg();
+                fileSize = static_cast<uint64_t>(input.tellg());
                 input.seekg(0, input.beg);
 
                 // it's possible seek failed for some reason, and if we can't tell the size
@@ -205,33 +823,110 @@ void ClientSession::handle_get(const Message& clientCommand) {
                     response.payload = "could not determine length of file";
                 }
             }
+#endif
         }
 
 
         // if we have a failure response, we're done, command has failed
         if (response.msgid == MSGID::MESSAGE_ERROR) {
             print_command_result(clientCommand, false, response.payload);
-            control_->send(response);
+            control->send(response);
             return;
         }
 
+        phase.end();
 
-        // everything looks good, connect to the client and let them know how much data
-        // is coming
-        dataChannel = Connection::connect(control_->remote_name(), clientCommand.port);
 
-        response = MAKE_MSG(MSGID::MESSAGE_OK);
-        response.datalen = fileSize;
+#ifndef WIN32
+        // with every file it's asked for, readahead learns the order files are fetched in, and the
+        // hot set which are fetched most
+        if (!following) {
+            std::string previous;
 
-        control_->send(response);
+            {
+                std::lock_guard<std::mutex> lock(getsMutex_);
 
-        // now actually stream the data over to the client. Connection handles splitting
-        // this in chunks for us
-        NetworkDataStream stream(input);
+                previous = lastGet_;
+                lastGet_ = fileName;
+            }
 
-        const auto bytesSent = dataChannel->send(stream);
+            warmed = Readahead::shared().on_get(previous, fileName);
+            HotSet::shared().record(fileName);
+        }
+#endif
 
-        dataChannel->shutdown();
+        if (following) {
+            follow_file(control, clientCommand, fileName, follow.offset, follow.idleMs);
+            return;
+        }
+
+        // small enough to skip the data channel entirely?
+        if (inlineLimit_ > 0 && fileSize <= inlineLimit_) {
+            trace::Span sending("inline");
+            std::string contents(static_cast<size_t>(fileSize), '\0');
+
+#ifndef WIN32
+            const bool read = contents.empty() || ::pread(file->fd(), &contents[0], contents.size(), 0) == static_cast<ssize_t>(contents.size());
+
+            if (read && send_inline(control, clientCommand, contents)) {
+                record_first_byte(warmed, started);
+                return;
+            }
+#else
+            if (!contents.empty())
+                input.read(&contents[0], contents.size());
+
+            if (static_cast<uint64_t>(input.gcount()) == fileSize && send_inline(control, clientCommand, contents))
+                return;
+
+            input.clear();
+            input.seekg(0, input.beg);
+#endif
+        }
+
+#ifndef WIN32
+        // a client on this host can read the file itself: no bytes need to go through us at all
+        if (passFiles_ && send_descriptor(control, clientCommand, file->fd(), fileSize))
+            return;
+#endif
+
+        // everything looks good, connect to the client and let them know how much data
+        // is coming
+        dataChannel = open_data_channel(control, clientCommand);
+
+        response = MAKE_MSG(MSGID::MESSAGE_OK);
+        response.datalen = fileSize;
+
+        trace::Span responding("respond");
+
+        control->send(response);
+        responding.end();
+
+        trace::Span streaming("stream");
+
+#ifndef WIN32
+        // straight from the page cache to the socket on a data channel (see Transport::send_file). The
+        // first bytes are where a file readahead didn't warm waits on the disk
+        auto bytesSent = dataChannel->transport().send_file(file->fd(), 0, std::min(fileSize, GET_FIRST_BYTES));
+
+        record_first_byte(warmed, started);
+
+        if (bytesSent < fileSize)
+            bytesSent += dataChannel->transport().send_file(file->fd(), bytesSent, fileSize - bytesSent);
+#else
+        // now actually stream the data over to the client. Connection handles splitting
+        // this in chunks for us
+        NetworkDataStream stream(input);
+
+        const auto bytesSent = static_cast<uint64_t>(dataChannel->send(stream));
+#endif
+
+        streaming.end();
+
+        trace::Span closing("shutdown");
+
+        dataChannel->shutdown();
+        closing.end();
 
         // that's it, just make sure we sent everything and let the data connection close
         if (bytesSent != fileSize) {
@@ -245,90 +940,849 @@ void ClientSession::handle_get(const Message& clientCommand) {
 }
 
 
-void ClientSession::handle_put(const Message& clientCommand) {
-	Connection::Ptr dataChannel;
-	Message response; MAKE_EMSG(MSGECODE::ERR_UNKNOWN);
-	fstream output;
-	fs::path filePath(clientCommand.payload);
-	std::streampos fileSize = 0;
+// sends fileName from offset as far as it goes, then what's appended to it as it's written, until it
+// has gone without growing for idleMs (for good if 0), is renamed, removed or truncated, or the
+// client finishes its side of the data channel. Waiting is left to inotify (FileWatch), so a
+// follower costs nothing while its file is quiet
+void ClientSession::follow_file(const ConnectionPtr& control, const Message& clientCommand, const std::string& fileName, uint64_t offset, long idleMs) {
+#ifdef WIN32
+    auto response = MAKE_EMSG(MSGECODE::ERR_UNRECOGNIZED_COMMAND);
+    response.payload = "this server can't follow files";
+
+    print_command_result(clientCommand, false, response.payload);
+    control->send(response);
+#else
+    FollowedFile::Ptr file;
+    Message response = MAKE_MSG(MSGID::MESSAGE_OK, 0, FLAG_FOLLOW, "");
+
+    if (HotRestart::in_progress()) {
+        response = MAKE_EMSG(MSGECODE::ERR_FAILED_TO_OPEN);
+        response.payload = "the server is restarting: follow " + fileName + " again shortly";
+    } else if (!(file = FileWatch::shared().follow(fileName))) {
+        response = MAKE_EMSG(MSGECODE::ERR_FAILED_TO_OPEN);
+        response.payload = fileName + " can't be followed";
+    } else if (offset > file->size()) {
+        response = MAKE_EMSG(MSGECODE::ERR_UNKNOWN);
+        response.payload = "offset " + std::to_string(offset) + " is past the end of " + fileName + " (" + std::to_string(file->size()) + " bytes)";
+    }
+
+    if (response.msgid == MSGID::MESSAGE_ERROR) {
+        if (file)
+            FileWatch::shared().unfollow(file);
+
+        print_command_result(clientCommand, false, response.payload);
+        control->send(response);
+        return;
+    }
+
+    auto dataChannel = open_data_channel(control, clientCommand);
+
+    response.datalen = file->size() - offset;
+    control->send(response);
 
+    // the file goes out from a thread of its own, so this one can wait for the client to finish
+    std::thread sender([&dataChannel, &file, offset, idleMs]() {
+        uint64_t at = offset;
+        auto lastGrowth = std::chrono::steady_clock::now();
 
-    // check for existence of file first: don't let client effectively delete stuff without
-    // an explicit command (if it were to be implemented)
-    if (fs::exists(filePath)) {
-        response = MAKE_EMSG(MSGECODE::ERR_ALREADY_EXISTS);
-    } 
+        try {
+            while (true) {
+                const auto size = file->size();
+
+                // what was sent no longer matches what's there
+                if (size < at)
+                    break;
+
+                if (size > at) {
+                    const auto sent = dataChannel->transport().send_file(file->fd(), at, size - at);
+
+                    // cut short under us
+                    if (sent < size - at)
+                        break;
+
+                    at = size;
+                    lastGrowth = std::chrono::steady_clock::now();
+                }
+
+                // all that was appended before it went has been sent
+                if (file->gone())
+                    break;
+
+                long waitMs = 0;
+
+                if (idleMs > 0) {
+                    const auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - lastGrowth).count();
+
+                    if (idle >= idleMs)
+                        break;
+
+                    waitMs = idleMs - static_cast<long>(idle);
+                }
+
+                if (!file->wait(waitMs))
+                    break;
+            }
+
+            dataChannel->transport().shutdown_send();
+        }
+        catch (const ConnectionException&) {
+            // the channel has failed: its reader below is finding out too
+        }
+    });
+
+    // the client finishes its side once it has seen the end of the data, or to stop following early
+    try {
+        char ignored;
+
+        while (dataChannel->transport().receive(&ignored, 1, Connection::TIMEOUT_NEVER, nullptr) > 0) {}
+    }
+    catch (const ConnectionException&) {
+        // same as the client finishing
+    }
+
+    file->cancel();
+    sender.join();
+
+    FileWatch::shared().unfollow(file);
+    dataChannel->shutdown();
+
+    print_command_result(clientCommand, true);
+#endif
+}
+
+
+void ClientSession::handle_put(const ConnectionPtr& control, const Message& clientCommand) {
+    Message response = MAKE_MSG(MSGID::MESSAGE_OK);
+    std::string fileName;
+    PutRange range;
+    StagedUpload::Ptr upload;
+    const bool ranged = parse_put(clientCommand, &fileName, &range);
 
     // don't allow invalid filenames:
     //  - empty
     //  - containing any kind of path separator (client could do bad things if we allowed this)
-    else if (clientCommand.payload.empty() || clientCommand.payload.find('/') != string::npos || clientCommand.payload.find('\\') != string::npos) {
+    //  - the hidden names uploads are staged under
+    if (fileName.empty() || fileName.find('/') != string::npos || fileName.find('\\') != string::npos || is_staging_name(fileName)) {
+        response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
+    }
+    else if (ranged && range.total == 0) {
         response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
+        response.payload = "malformed range for " + fileName + ": expected '<offset> <file size>'";
     }
     else {
-        // now try to actually open the file
-        output.open(filePath, output.binary | output.in | output.out | output.trunc);
-
-        if (!output.is_open())
-            response = MAKE_EMSG(MSGECODE::ERR_FAILED_TO_OPEN);
-        else response = MAKE_MSG(MSGID::MESSAGE_OK); // all checks passed
+        MSGECODE code = MSGECODE::ERR_UNKNOWN;
+
+        // check for existence of file first (and again when the upload is put in place): don't let
+        // client effectively delete stuff without an explicit command (if it were to be implemented)
+        upload = ranged ? join_upload(fileName, range.total, false, &code) : join_upload(fileName, clientCommand.datalen, true, &code);
+
+        if (!upload)
+            response = MAKE_EMSG(code);
+        else if (!upload->claim(ranged ? range.offset : 0, clientCommand.datalen)) {
+            response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
+            response.payload = "range " + std::to_string(range.offset) + "+" + std::to_string(clientCommand.datalen) + " of " + fileName +
+                " overlaps another or runs past its " + std::to_string(range.total) + " bytes";
+        }
     }
 
     // if there was some kind of error, report it to the client (we won't attempt
     // to establish a connection in this case)
     if (response.msgid != MSGID::MESSAGE_OK) {
-        print_command_result(clientCommand, false, connection::strecode(response.ecode));
-        
-        control_->send(response);
+        print_command_result(clientCommand, false, response.payload.empty() ? connection::strecode(response.ecode) : response.payload);
+
+        control->send(response);
         return;
-    } 
+    }
 
     // no errors, everything is ready. Let the client know we're going to connect
-    control_->send(response);
-	dataChannel = Connection::connect(control_->remote_name(), clientCommand.port);
+    control->send(response);
+
+    try {
+        const auto dataChannel = open_data_channel(control, clientCommand);
+
+        // written where it belongs in the hidden file as it arrives, however ranges interleave
+        const auto bytesReceived = upload->receive(*dataChannel, ranged ? range.offset : 0, clientCommand.datalen);
+        std::string failure;
+        bool completed = false;
 
-	//connection is created. receive data
-	NetworkDataStream ds(output);
+        if (bytesReceived != clientCommand.datalen) {
+            failure = "Failed to receive " + fileName + ": only received " + std::to_string(bytesReceived) + " of " + std::to_string(clientCommand.datalen) + " bytes";
 
-	auto bytesLeft = clientCommand.datalen;
+            // what's missing can be sent again, by this session or, if the connection has dropped,
+            // by the client resuming it
+            upload->release(ranged ? range.offset : 0, bytesReceived);
+            upload->arrived(bytesReceived);
+        }
 
-	try {
-		while (bytesLeft > 0) {
-			// return value of received is guaranteed to be int or smaller
-            // don't want to hold a bunch of data in memory at a time, so receive it a chunk at a time
-            // and write out
-			auto received = static_cast<uint64_t>(dataChannel->receive(ds, bytesLeft > CHUNK_SIZE ? CHUNK_SIZE : static_cast<int>(bytesLeft)));
-			bytesLeft -= received;
-    
-            output.flush();
+        // whichever range completes the file puts it in place
+        else if (upload->arrived(bytesReceived)) {
+            completed = true;
+            failure = upload->commit();
+            invalidate_caches(fileName);
         }
 
+        if (completed)
+            forget_upload(upload);
 
-        output.flush();
+        // protocol v2 confirms the upload on its stream, once it's in place and as safe as the server
+        // keeps uploads: for a range, once it's written, or in place if it was the last. A v1 data
+        // channel stays open until then
+        if (mux_) {
+            Message confirmation = MAKE_MSG(MSGID::MESSAGE_OK);
+            confirmation.datalen = bytesReceived;
 
-        // confirm we got what we expected
-        const auto bytesReceived = clientCommand.datalen - bytesLeft;
+            if (!failure.empty()) {
+                confirmation = MAKE_EMSG(MSGECODE::ERR_UNKNOWN);
+                confirmation.payload = failure;
+            }
+
+            control->send(confirmation);
+        }
 
         dataChannel->shutdown();
 
-        if (bytesLeft == 0) {
+        if (failure.empty()) {
             print_command_result(clientCommand, true);
         }
-        else print_command_result(clientCommand, false, "Failed to receive " + clientCommand.payload + ": only received " + std::to_string(bytesReceived) + " of " + std::to_string(response.datalen) + " bytes");
-		
-	}
-	catch (const ConnectionException& ce) { 
-		print_command_result(clientCommand, false, ce.what());
-	}
+        else print_command_result(clientCommand, false, failure);
+    }
+    catch (const ConnectionException& ce) {
+        print_command_result(clientCommand, false, ce.what());
+    }
+}
+
+
+// the upload under way in this session that a range of fileName belongs to, starting one if this
+// is the first range to arrive (or if fresh: a whole file, sent in one go). nullptr, with code set,
+// if it can't be started
+StagedUpload::Ptr ClientSession::join_upload(const std::string& fileName, uint64_t total, bool fresh, MSGECODE* code) {
+    std::lock_guard<std::mutex> lock(uploadsMutex_);
+
+    auto& upload = uploads_[fileName];
+
+    // one of a different size is left to whoever still holds it, and a new one begun
+    if (fresh || !upload || upload->size() != total)
+        upload = StagedUpload::create(fileName, total, code);
+
+    if (!upload)
+        uploads_.erase(fileName);
+
+    return upload;
+}
+
+
+void ClientSession::forget_upload(const StagedUpload::Ptr& upload) {
+    std::lock_guard<std::mutex> lock(uploadsMutex_);
+
+    const auto it = uploads_.find(upload->name());
+
+    if (it != uploads_.end() && it->second == upload)
+        uploads_.erase(it);
+}
+
+
+// sends every file matching the command's names and patterns over one data channel, as a bundle
+void ClientSession::handle_mget(const ConnectionPtr& control, const Message& clientCommand) {
+    try {
+        auto response = MAKE_MSG(MSGID::MESSAGE_OK);
+        std::vector<std::string> patterns;
+        std::vector<std::string> names;
+        std::stringstream lines(clientCommand.payload);
+        std::string line;
+
+        while (std::getline(lines, line)) {
+            if (!line.empty())
+                patterns.push_back(line);
+        }
+
+        for (const auto& pattern : patterns) {
+            // no paths, same as GET: patterns only ever match in the current directory
+            if (pattern.find('/') != std::string::npos || pattern.find('\\') != std::string::npos) {
+                response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
+                response.payload = "'" + pattern + "' contains a path which is not permitted";
+                break;
+            }
+
+            if (!is_glob(pattern) && !fs::is_regular_file(fs::path(pattern))) {
+                response = MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
+                response.payload = "File '" + pattern + "' not found on server";
+                break;
+            }
+        }
+
+        if (patterns.empty())
+            response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
+
+        if (response.msgid != MSGID::MESSAGE_ERROR) {
+#if WIN32
+            for (const auto& item : fs::_Directory_iterator<true_type>(fs::current_path())) {
+#else
+            for (const auto& item : fs::directory_iterator(fs::current_path())) {
+#endif
+                if (!fs::is_regular_file(item))
+                    continue;
+
+                const auto name = item.path().filename().string();
+
+                if (is_staging_name(name))
+                    continue;
+
+                if (std::any_of(patterns.cbegin(), patterns.cend(), [&name](const std::string& pattern) { return glob_match(pattern.c_str(), name.c_str()); }))
+                    names.push_back(name);
+            }
+
+            std::sort(names.begin(), names.end());
+
+            if (names.empty()) {
+                response = MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
+                response.payload = "no files on server match";
+            }
+        }
+
+        if (response.msgid == MSGID::MESSAGE_ERROR) {
+            print_command_result(clientCommand, false, response.payload.empty() ? connection::strecode(response.ecode) : response.payload);
+            control->send(response);
+            return;
+        }
+
+        // what the bundle should come to, though files changing meanwhile can make it differ:
+        // the bundle's own framing is what the client goes by
+        uint64_t dataLen = BUNDLE_HEADER_LEN;
+        std::error_code ec;
+
+        for (const auto& name : names)
+            dataLen += bundle_entry_len(name, fs::file_size(fs::path(name), ec));
+
+        auto dataChannel = open_data_channel(control, clientCommand);
+
+        response = MAKE_MSG(MSGID::MESSAGE_OK, std::to_string(names.size()));
+        response.datalen = dataLen;
+
+        control->send(response);
+
+        BundleWriter writer(*dataChannel);
+        std::vector<std::string> skipped;
+
+        for (const auto& name : names) {
+            if (!writer.add(name, name))
+                skipped.push_back(name);
+        }
+
+        writer.finish();
+        dataChannel->shutdown();
+
+        if (skipped.empty()) {
+            print_command_result(clientCommand, true);
+        } else print_command_result(clientCommand, false, "sent " + std::to_string(writer.files()) + " of " + std::to_string(names.size()) + " files; couldn't read '" + skipped.front() + "'" +
+            (skipped.size() > 1 ? " and " + std::to_string(skipped.size() - 1) + " more" : ""));
+    }
+    catch (const ConnectionException& ce) {
+        print_command_result(clientCommand, false, ce.what());
+    }
+}
+
+
+// receives a bundle of files over one data channel. Each is staged and put in place like a PUT, so
+// nothing that already exists is replaced and no file is seen half written
+void ClientSession::handle_mput(const ConnectionPtr& control, const Message& clientCommand) {
+    try {
+        control->send(MAKE_MSG(MSGID::MESSAGE_OK));
+
+        auto dataChannel = open_data_channel(control, clientCommand);
+
+        const auto result = receive_bundle(*dataChannel, "", nullptr, TIMEOUT_CLIENT_COMMAND_RESPONSE, stage_bundle_entry);
+
+        clear_caches(); // which names were written isn't kept track of
+
+        // the bundle ends itself, so the channel is still open the other way: tell the client which
+        // files didn't make it, as many as fit
+        auto summary = MAKE_MSG(MSGID::MESSAGE_OK);
+        summary.datalen = result.files;
+
+        for (size_t i = 0; i < result.failed.size(); ++i) {
+            const auto rest = "and " + std::to_string(result.failed.size() - i) + " more";
+
+            if (summary.payload.length() + result.failed[i].length() + 1 + rest.length() > MAX_PAYLOAD_LEN) {
+                summary.payload += rest;
+                break;
+            }
+
+            summary.payload += result.failed[i] + "\n";
+        }
+
+        dataChannel->send(summary);
+        dataChannel->shutdown();
+
+        if (result.failed.empty()) {
+            print_command_result(clientCommand, true);
+        } else print_command_result(clientCommand, false, "wrote " + std::to_string(result.files) + " files; " + std::to_string(result.failed.size()) + " failed, first " + result.failed.front());
+    }
+    catch (const ConnectionException& ce) {
+        print_command_result(clientCommand, false, ce.what());
+    }
+}
+
+
+// lists every directory and regular file beneath the one named, for the client to GET one by one.
+// Symbolic links are left out, so the walk never leaves the directory it started in
+void ClientSession::handle_tree(const ConnectionPtr& control, const Message& clientCommand) {
+    try {
+        const auto& root = clientCommand.payload;
+        std::error_code ec;
+
+        if (!root.empty() && (!is_safe_relative_path(root) || crosses_symlink(root) || fs::is_symlink(fs::symlink_status(root, ec)) || !fs::is_directory(fs::path(root), ec))) {
+            auto response = MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
+
+            response.payload = "'" + root + "' is not a directory beneath the server's directory";
+            print_command_result(clientCommand, false, response.payload);
+            control->send(response);
+            return;
+        }
+
+        std::vector<TreeEntry> entries;
+        const fs::path start(root.empty() ? "." : root);
+
+        for (fs::recursive_directory_iterator it(start, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end; it.increment(ec)) {
+            const auto status = it->symlink_status(ec);
+
+            if (ec || fs::is_symlink(status))
+                continue;
+
+            auto path = it->path().generic_string();
+
+            if (root.empty())
+                path.erase(0, 2); // "./"
+
+            // a name this side can't express safely in a path (a backslash, say) is left out, as
+            // are uploads still arriving
+            if (!is_safe_relative_path(path) || is_staging_name(it->path().filename().string())) {
+                if (fs::is_directory(status))
+                    it.disable_recursion_pending();
+                continue;
+            }
+
+            const auto mode = static_cast<uint32_t>(status.permissions()) & 0777;
+
+            if (fs::is_directory(status))
+                entries.push_back(TreeEntry{ TreeEntry::DIRECTORY, path, 0, mode });
+            else if (fs::is_regular_file(status))
+                entries.push_back(TreeEntry{ TreeEntry::FILE, path, fs::file_size(it->path(), ec), mode });
+        }
+
+        const auto manifest = encode_manifest(entries);
+
+        if (send_inline(control, clientCommand, manifest))
+            return;
+
+        auto dataChannel = open_data_channel(control, clientCommand);
+        auto response = MAKE_MSG(MSGID::MESSAGE_OK);
+
+        response.datalen = manifest.length();
+        control->send(response);
+
+        for (size_t sent = 0; sent < manifest.length();)
+            sent += dataChannel->transport().send(manifest.data() + sent, static_cast<int>(manifest.length() - sent));
+
+        dataChannel->shutdown();
+        print_command_result(clientCommand, true);
+    }
+    catch (const ConnectionException& ce) {
+        print_command_result(clientCommand, false, ce.what());
+    }
+}
+
+
+// COPY and MOVE: the file never leaves the server. Long copies report progress as they go
+void ClientSession::handle_copy(const ConnectionPtr& control, const Message& clientCommand) {
+    try {
+        const auto split = clientCommand.payload.find('\n');
+        const auto from = clientCommand.payload.substr(0, split);
+        const auto to = split == std::string::npos ? std::string() : clientCommand.payload.substr(split + 1);
+        auto response = MAKE_MSG(MSGID::MESSAGE_OK);
+        std::error_code ec;
+
+        if (!is_safe_relative_path(from) || !is_safe_relative_path(to) || crosses_symlink(from) || crosses_symlink(to)) {
+            response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
+            response.payload = "source and destination must both be paths beneath the server's directory";
+        } else if (!fs::exists(fs::path(from), ec)) {
+            response = MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
+            response.payload = "File '" + from + "' not found on server";
+        } else if (!fs::is_regular_file(fs::path(from), ec)) {
+            response = MAKE_EMSG(MSGECODE::ERR_NOT_A_FILE);
+            response.payload = "'" + from + "' is not a file";
+        } else if (fs::exists(fs::symlink_status(fs::path(to), ec))) {
+            // same as PUT: nothing is replaced without a command that says so
+            response = MAKE_EMSG(MSGECODE::ERR_ALREADY_EXISTS);
+            response.payload = "'" + to + "' already exists";
+        }
+
+        if (response.msgid == MSGID::MESSAGE_ERROR) {
+            print_command_result(clientCommand, false, response.payload);
+            control->send(response);
+            return;
+        }
+
+        auto lastReport = std::chrono::steady_clock::now();
+
+        CopyProgress onProgress = [&](uint64_t done, uint64_t total) {
+            const auto now = std::chrono::steady_clock::now();
+
+            if (done >= total || now - lastReport < std::chrono::milliseconds(COPY_PROGRESS_INTERVAL_MS))
+                return;
+
+            auto progress = MAKE_MSG(MSGID::MESSAGE_OK, 0, FLAG_PROGRESS, std::to_string(total));
+            progress.datalen = done;
+
+            control->send(progress);
+            lastReport = now;
+        };
+
+        CopyMethod method;
+        uint64_t bytes = 0;
+        std::string error;
+
+        const bool moved = clientCommand.msgid == MSGID::MESSAGE_MOVE;
+        const bool ok = moved ? move_file(from, to, onProgress, &method, &bytes, &error) : copy_file(from, to, onProgress, &method, &bytes, &error);
+
+        invalidate_caches(from);
+        invalidate_caches(to);
+
+        if (!ok) {
+            response = MAKE_EMSG(MSGECODE::ERR_FAILED_TO_OPEN);
+            response.payload = error;
+
+            print_command_result(clientCommand, false, error);
+            control->send(response);
+            return;
+        }
+
+        response.payload = std::string(moved ? "moved" : "copied") + " by " + to_string(method);
+        response.datalen = bytes;
+
+        control->send(response);
+        print_command_result(clientCommand, true);
+    }
+    catch (const ConnectionException& ce) {
+        print_command_result(clientCommand, false, ce.what());
+    }
+}
+
+
+// size, modification time, type and optionally checksum of every name asked about, in one response.
+// A request too long for the payload is sent as data, once we've said OK to it
+void ClientSession::handle_stat(const ConnectionPtr& control, const Message& clientCommand) {
+    try {
+        Connection::Ptr dataChannel;
+        std::string request = clientCommand.payload;
+
+        if (clientCommand.datalen > STAT_MAX_REQUEST_LEN) {
+            auto response = MAKE_EMSG(MSGECODE::ERR_UNKNOWN);
+
+            response.payload = "stat request of " + std::to_string(clientCommand.datalen) + " bytes is too long";
+            print_command_result(clientCommand, false, response.payload);
+            control->send(response);
+            return;
+        }
+
+        if (clientCommand.datalen > 0) {
+            control->send(MAKE_MSG(MSGID::MESSAGE_OK));
+            dataChannel = open_data_channel(control, clientCommand);
+
+            request.assign(static_cast<size_t>(clientCommand.datalen), '\0');
+
+            for (size_t got = 0; got < request.length();) {
+                bool timedOut = false;
+                const auto received = dataChannel->transport().receive(&request[got], static_cast<int>(request.length() - got), TIMEOUT_CLIENT_COMMAND_RESPONSE, &timedOut);
+
+                if (received <= 0)
+                    throw ConnectionException(timedOut ? "timed out waiting for stat request" : "stat request cut short");
+
+                got += received;
+            }
+        }
+
+        std::vector<std::string> names;
+        uint8_t options = 0;
+
+        if (!decode_stat_request(request, &names, &options)) {
+            auto response = MAKE_EMSG(MSGECODE::ERR_INVALID_FILENAME);
+
+            print_command_result(clientCommand, false, "empty stat request");
+            control->send(response);
+
+            if (dataChannel)
+                dataChannel->shutdown();
+            return;
+        }
+
+        std::vector<FileStat> stats;
+
+        // anything not beneath the server's directory might as well not exist
+        const auto allowed = [](const std::string& name) { return !crosses_symlink(name); };
+
+        stats.reserve(names.size());
+
+        for (const auto& name : names) {
+            if (!is_safe_relative_path(name))
+                stats.push_back(FileStat{ STAT_MISSING, 0, 0, 0, 0 });
+            else stats.push_back(StatCache::shared().lookup(name, (options & STAT_WANT_CRC) != 0, allowed));
+        }
+
+        const auto entries = encode_stats(stats);
+
+        if (!dataChannel && send_inline(control, clientCommand, entries))
+            return;
+
+        if (!dataChannel)
+            dataChannel = open_data_channel(control, clientCommand);
+
+        auto response = MAKE_MSG(MSGID::MESSAGE_OK);
+
+        response.datalen = entries.length();
+        control->send(response);
+
+        for (size_t sent = 0; sent < entries.length();)
+            sent += dataChannel->transport().send(entries.data() + sent, static_cast<int>(entries.length() - sent));
+
+        dataChannel->shutdown();
+        print_command_result(clientCommand, true);
+    }
+    catch (const ConnectionException& ce) {
+        print_command_result(clientCommand, false, ce.what());
+    }
 }
 
 
-void ClientSession::handle_quit(const Message& clientCommand) {
-    control_->shutdown();
+// reports changes to the server's files on the command's stream as they happen, until the client
+// ends its side of the stream. v2 only: over v1 it would hold the control connection for good
+void ClientSession::handle_watch(const ConnectionPtr& control, const Message& clientCommand) {
+#ifdef WIN32
+    auto response = MAKE_EMSG(MSGECODE::ERR_UNRECOGNIZED_COMMAND);
+    response.payload = "this server can't watch its directory";
+
+    print_command_result(clientCommand, false, response.payload);
+    control->send(response);
+#else
+    try {
+        WatchSubscription::Ptr subscription;
+
+        if (!mux_ || HotRestart::in_progress() || !(subscription = DirectoryWatch::shared().subscribe())) {
+            auto response = MAKE_EMSG(mux_ ? MSGECODE::ERR_FAILED_TO_OPEN : MSGECODE::ERR_UNRECOGNIZED_COMMAND);
+            response.payload = !mux_ ? "WATCH needs protocol v2" :
+                HotRestart::in_progress() ? "the server is restarting: watch again shortly" : "the server's directory can't be watched";
+
+            print_command_result(clientCommand, false, response.payload);
+            control->send(response);
+            return;
+        }
+
+        control->send(MAKE_MSG(MSGID::MESSAGE_OK));
+
+        // changes go out from a thread of their own, so this one can wait for the client to finish
+        std::thread sender([&control, &subscription]() {
+            try {
+                std::vector<WatchSubscription::Event> events;
+                bool overflowed = false;
+
+                while (subscription->next(&events, &overflowed)) {
+                    std::string lines = overflowed ? "overflow\n" : "";
+
+                    for (const auto& event : events) {
+                        auto line = std::string(to_string(event.change)) + " " + event.name + "\n";
+
+                        if (lines.length() + line.length() > MAX_INLINE_PAYLOAD_LEN) {
+                            control->send(MAKE_MSG(MSGID::MESSAGE_OK, 0, FLAG_EVENT, lines));
+                            lines.clear();
+                        }
+
+                        lines += line;
+                    }
+
+                    if (!lines.empty())
+                        control->send(MAKE_MSG(MSGID::MESSAGE_OK, 0, FLAG_EVENT, lines));
+
+                    events.clear();
+                }
+
+                control->send(MAKE_MSG(MSGID::MESSAGE_OK, "watch ended"));
+            }
+            catch (const ConnectionException&) {
+                // the stream has failed: its reader below is finding out too
+            }
+        });
+
+        // the client ends the watch by finishing its side of the stream; the connection failing ends it too
+        try {
+            char ignored;
+
+            while (control->transport().receive(&ignored, 1, Connection::TIMEOUT_NEVER, nullptr) > 0) {}
+        }
+        catch (const ConnectionException&) {
+            // same as the client finishing
+        }
+
+        subscription->cancel();
+        sender.join();
+
+        DirectoryWatch::shared().unsubscribe(subscription);
+        print_command_result(clientCommand, true);
+    }
+    catch (const ConnectionException& ce) {
+        print_command_result(clientCommand, false, ce.what());
+    }
+#endif
+}
+
+
+void ClientSession::handle_quit(const ConnectionPtr& control, const Message& clientCommand) {
+    resumable_ = false;
+
+    // under v2 QUIT came on a stream and the multiplexer shuts the connection down once its reader
+    // has let go of it; under v1 it came on the control connection itself
+    if (mux_)
+        mux_->close();
+    else control->shutdown();
+    print_command_result(clientCommand, true);
+}
+
+
+// v1: the client is listening on the port named in its command, so connect to it. v2: the data
+// follows the response on the command's own stream
+ConnectionPtr ClientSession::open_data_channel(const ConnectionPtr& control, const Message& clientCommand) {
+    if (mux_)
+        return control;
+
+    trace::Span connecting("connect");
+
+    return Connection::connect(control_->remote_name(), clientCommand.port);
+}
+
+
+// returns true if data was small enough to be sent inline with the OK response
+bool ClientSession::send_inline(const ConnectionPtr& control, const Message& clientCommand, const std::string& data) {
+    if (inlineLimit_ == 0 || data.length() > inlineLimit_)
+        return false;
+
+    auto response = MAKE_MSG(MSGID::MESSAGE_OK, static_cast<uint32_t>(data.length()), FLAG_INLINE, data);
+
+    control->send(response);
     print_command_result(clientCommand, true);
+
+    return true;
 }
 
 
+#ifndef WIN32
+// passes the client a duplicate of the read-only descriptor GET opened, rather than opening the file
+// again by a name that may lead somewhere else by now. It shares its file position with the cached
+// one, which nothing uses: both sides read at offsets of their own. Returns false, leaving the client
+// waiting on its response, if it couldn't be duplicated
+bool ClientSession::send_descriptor(const ConnectionPtr& control, const Message& clientCommand, int file, uint64_t fileSize) {
+    trace::Span passing("descriptor");
+    const int fd = ::fcntl(file, F_DUPFD_CLOEXEC, 0);
+
+    if (fd < 0)
+        return false;
+
+    auto response = MAKE_MSG(MSGID::MESSAGE_OK, 0, FLAG_DESCRIPTOR, "");
+    response.datalen = fileSize;
+
+    try {
+        control->send(response);
+        send_fd(control->transport().native_handle(), fd, "");
+    }
+    catch (...) {
+        ::close(fd);
+        throw;
+    }
+
+    ::close(fd);
+    print_command_result(clientCommand, true);
+
+    return true;
+}
+
+
+// answers a GET for a member of archive. Stored members are a range of the archive file, which goes
+// out through Transport::send_file: straight from the page cache to the socket on a data channel
+void ClientSession::send_archive_member(const ConnectionPtr& control, const Message& clientCommand, const Archive& archive, const std::string& member) {
+    ArchiveMember found;
+    Message response = MAKE_MSG(MSGID::MESSAGE_OK);
+
+    if (!archive.find(member, &found)) {
+        response = MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
+        response.payload = "File '" + clientCommand.payload + "' not found on server";
+    } else if (found.directory) {
+        response = MAKE_EMSG(MSGECODE::ERR_NOT_A_FILE);
+        response.payload = "'" + clientCommand.payload + "' is not a file";
+    } else if (found.compressed) {
+        response = MAKE_EMSG(MSGECODE::ERR_FAILED_TO_OPEN);
+        response.payload = "'" + clientCommand.payload + "' is compressed in its archive: only stored members can be served";
+    }
+
+    if (response.msgid == MSGID::MESSAGE_ERROR) {
+        print_command_result(clientCommand, false, response.payload);
+        control->send(response);
+        return;
+    }
+
+    if (inlineLimit_ > 0 && found.size <= inlineLimit_) {
+        std::string contents(static_cast<size_t>(found.size), '\0');
+
+        if (contents.empty() || ::pread(archive.fd(), &contents[0], contents.size(), static_cast<off_t>(found.offset)) == static_cast<ssize_t>(contents.size())) {
+            if (send_inline(control, clientCommand, contents))
+                return;
+        }
+    }
+
+    auto dataChannel = open_data_channel(control, clientCommand);
+
+    response.datalen = found.size;
+    control->send(response);
+
+    const auto bytesSent = dataChannel->transport().send_file(archive.fd(), found.offset, found.size);
+
+    dataChannel->shutdown();
+
+    if (bytesSent != found.size)
+        print_command_result(clientCommand, false, "did not send all bytes; " + std::to_string(bytesSent) + " of " + std::to_string(found.size) + " sent");
+    else print_command_result(clientCommand, true);
+}
+
+
+// lists path if it is an archive being served or a directory in one. Returns false, leaving
+// failure alone unless path is in an archive, otherwise
+bool ClientSession::list_archive(const std::string& path, std::ostream& listing, Message* failure) {
+    std::string member;
+    bool indexing = false;
+    const auto archive = ArchiveFs::shared().resolve(path, &member, &indexing);
+    std::vector<std::string> names;
+
+    if (indexing) {
+        *failure = MAKE_EMSG(MSGECODE::ERR_FAILED_TO_OPEN);
+        failure->payload = "the archive '" + path.substr(0, path.find('/')) + "' is still being indexed: try again shortly";
+        return false;
+    }
+
+    if (!archive)
+        return false;
+
+    if (!archive->list(member, &names)) {
+        ArchiveMember found;
+
+        *failure = archive->find(member, &found) ? MAKE_EMSG(MSGECODE::ERR_NOT_A_FILE) : MAKE_EMSG(MSGECODE::ERR_DOES_NOT_EXIST);
+        failure->payload = "'" + path + "' is not a directory";
+        return false;
+    }
+
+    for (const auto& name : names)
+        listing << fs::path(name) << endl;
+
+    return true;
+}
+#endif
+
+
 void ClientSession::print_command_result(const Message& command, bool successful, const std::string& failureReason) {
     sync_cout.print(control_->identify_remote(), " : ", connection::to_string(command.msgid), successful ? " successful" : " FAILED - ", successful ? std::string() :
         (failureReason.size() > 0 ? failureReason : std::string("unknown reason")), sync_endl);
@@ -1,23 +1,91 @@
 #pragma once
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
 #include "Connection.h"
+#include "HotRestart.h"
 #include "Message.h"
+#include "Multiplexer.h"
 
 typedef connection::Connection::Ptr ConnectionPtr;
 
+class Archive;
+class StagedUpload;
+
 class ClientSession {
     ConnectionPtr control_;
+    uint16_t inlineLimit_;          // client accepts responses up to this size inline on the control channel
+    int version_;                   // protocol version agreed in the greeting
+    bool greeted_;
+    std::string token_;             // presented by the client to resume the session if its connection drops
+    bool resumable_;                // the session can be parked for resumption when it ends: not once the client has quit
+    connection::Multiplexer::Ptr mux_;  // protocol v2: every command arrives on its own stream of the control connection
+    bool passFiles_;                // client is on this host (Unix domain socket, v1): GET hands it the open file instead of its bytes
+
+    std::mutex streamsMutex_;
+    std::condition_variable streamsDone_;
+    int runningStreams_;            // threads still serving a stream of this session
+
+    // pipelined commands run concurrently, except that one touching the same file as an earlier
+    // one (or listing files, or quitting) waits for it. Streams are numbered in the order the
+    // client opened them, and each enters its command in order before checking what it must follow
+    std::condition_variable orderChanged_;
+    uint64_t nextStreamSeq_;
+    uint64_t nextToOrder_;
+    std::map<uint64_t, connection::Message> ordered_;   // commands entered and not yet finished, by stream number
+
+    // uploads this session has begun and not finished, by file name: parallel ones with ranges
+    // still to come, and any cut off partway. If the connection drops they're kept for the client
+    // to finish when it resumes the session; otherwise they're thrown away when it ends
+    std::mutex uploadsMutex_;
+    std::map<std::string, std::shared_ptr<StagedUpload>> uploads_;
+
+    std::mutex getsMutex_;
+    std::string lastGet_;           // the file this session last started to GET, for readahead to spot a pattern
 
     bool greeting();
+    void resume(const std::string& token);
+    bool hand_off();
 
-    void handle_ls(const connection::Message& clientCommand);
-    void handle_get(const connection::Message& clientCommand);
-    void handle_put(const connection::Message& clientCommand);
-    void handle_quit(const connection::Message& clientCommand);
+    void serve_commands();
+    void serve_multiplexed();
+    void serve_stream(ConnectionPtr stream, uint64_t seq);
+    void order_command(uint64_t seq, const connection::Message* command);
+    bool dispatch(const ConnectionPtr& control, const connection::Message& clientCommand);
+    bool run_command(const ConnectionPtr& control, const connection::Message& clientCommand);
+
+    void handle_ls(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void handle_get(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void follow_file(const ConnectionPtr& control, const connection::Message& clientCommand, const std::string& fileName, uint64_t offset, long idleMs);
+    void handle_put(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void handle_mget(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void handle_mput(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void handle_tree(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void handle_copy(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void handle_stat(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void handle_watch(const ConnectionPtr& control, const connection::Message& clientCommand);
+    void handle_quit(const ConnectionPtr& control, const connection::Message& clientCommand);
+
+    std::shared_ptr<StagedUpload> join_upload(const std::string& fileName, uint64_t total, bool fresh, connection::MSGECODE* code);
+    void forget_upload(const std::shared_ptr<StagedUpload>& upload);
+
+    ConnectionPtr open_data_channel(const ConnectionPtr& control, const connection::Message& clientCommand);
+    bool send_inline(const ConnectionPtr& control, const connection::Message& clientCommand, const std::string& data);
+#ifndef WIN32
+    bool send_descriptor(const ConnectionPtr& control, const connection::Message& clientCommand, int file, uint64_t fileSize);
+    void send_archive_member(const ConnectionPtr& control, const connection::Message& clientCommand, const Archive& archive, const std::string& member);
+    bool list_archive(const std::string& path, std::ostream& listing, connection::Message* failure);
+#endif
 
     void print_command_result(const connection::Message& command, bool successful, const std::string& failureReason = "");
 
     public:
         ClientSession(ConnectionPtr controlConnection);
 
+        // carry on a session another server process started (hot restart): greetings are long done
+        ClientSession(ConnectionPtr controlConnection, const HotRestart::SessionState& state);
+
         void serve();
-};
\ No newline at end of file
+};
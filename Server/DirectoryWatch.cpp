@@ -0,0 +1,231 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <thread>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include "DirectoryWatch.h"
+#include "StagedUpload.h"
+#include "Metrics.h"
+
+using namespace connection;
+
+
+const char* to_string(WatchChange change) {
+    switch (change) {
+        case WatchChange::CREATED: return "created";
+        case WatchChange::MODIFIED: return "modified";
+        case WatchChange::DELETED: return "deleted";
+        default: return "unknown";
+    }
+}
+
+
+bool WatchSubscription::next(std::vector<Event>* events, bool* overflowed) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    changed_.wait(lock, [this]() { return !order_.empty() || overflowed_ || cancelled_; });
+
+    *overflowed = overflowed_;
+    overflowed_ = false;
+
+    for (const auto& name : order_)
+        events->push_back(Event{ pending_[name], name });
+
+    order_.clear();
+    pending_.clear();
+
+    return !events->empty() || *overflowed || !cancelled_;
+}
+
+
+void WatchSubscription::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    cancelled_ = true;
+    changed_.notify_all();
+}
+
+
+void WatchSubscription::post(const std::vector<Event>& changes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // the subscriber only needs waking for the first changes it hasn't collected
+    const bool wake = order_.empty();
+
+    for (const auto& change : changes) {
+        // the subscriber will be listing everything again anyway
+        if (overflowed_)
+            return;
+
+        const auto it = pending_.find(change.name);
+
+        if (it == pending_.end()) {
+            if (order_.size() >= WATCH_QUEUE_LIMIT) {
+                static auto& overflows = metrics::counter("watch.overflows");
+
+                order_.clear();
+                pending_.clear();
+                overflowed_ = true;
+                ++overflows;
+
+                changed_.notify_all();
+            } else {
+                order_.push_back(change.name);
+                pending_[change.name] = change.change;
+            }
+        } else if (it->second == WatchChange::CREATED) {
+            // still new to the subscriber, however much it has been written since; gone again, it never was
+            if (change.change == WatchChange::DELETED) {
+                order_.erase(std::find(order_.begin(), order_.end(), change.name));
+                pending_.erase(it);
+            }
+        } else if (it->second == WatchChange::DELETED && change.change == WatchChange::CREATED) {
+            it->second = WatchChange::MODIFIED;     // replaced
+        } else {
+            it->second = change.change;
+        }
+    }
+
+    if (wake && !order_.empty())
+        changed_.notify_all();
+}
+
+
+void WatchSubscription::overflow() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    order_.clear();
+    pending_.clear();
+    overflowed_ = true;
+
+    changed_.notify_all();
+}
+
+
+static metrics::Counter& subscribers_metric() {
+    static auto& gauge = metrics::counter("watch.subscribers");
+    return gauge;
+}
+
+
+DirectoryWatch& DirectoryWatch::shared() {
+    static DirectoryWatch watch;
+    return watch;
+}
+
+
+WatchSubscription::Ptr DirectoryWatch::subscribe() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (fd_ < 0 && !start())
+        return nullptr;
+
+    WatchSubscription::Ptr subscription(new WatchSubscription());
+
+    subscribers_.insert(subscription);
+    ++subscribers_metric();
+
+    return subscription;
+}
+
+
+void DirectoryWatch::unsubscribe(const WatchSubscription::Ptr& subscription) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (subscribers_.erase(subscription) > 0)
+        --subscribers_metric();
+}
+
+
+void DirectoryWatch::cancel_all() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (const auto& subscription : subscribers_)
+        subscription->cancel();
+}
+
+
+// called with mutex_ held. The watch, and the thread reading it, last as long as the process:
+// with nobody subscribed, changes are read and dropped
+bool DirectoryWatch::start() {
+    const int fd = ::inotify_init1(IN_CLOEXEC);
+
+    if (fd < 0)
+        return false;
+
+    // only once a file is complete is it worth telling anyone: one event per write would swamp subscribers
+    if (::inotify_add_watch(fd, ".", IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+        ::close(fd);
+        return false;
+    }
+
+    fd_ = fd;
+    std::thread(&DirectoryWatch::run_reader, this).detach();
+
+    return true;
+}
+
+
+void DirectoryWatch::run_reader() {
+    // room for plenty of events at once, each at least the header and up to a maximal name
+    alignas(struct inotify_event) char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+
+    while (true) {
+        const auto got = ::read(fd_, buf, sizeof(buf));
+
+        if (got < 0 && errno == EINTR)
+            continue;
+
+        if (got <= 0)
+            return;
+
+        // everything one read brings in (often a file's creation and its close, together) goes to
+        // each subscriber at once, waking it no more than once
+        std::vector<WatchSubscription::Event> changes;
+
+        for (char* at = buf; at < buf + got;) {
+            const auto event = reinterpret_cast<const struct inotify_event*>(at);
+
+            at += sizeof(struct inotify_event) + event->len;
+
+            // the kernel dropped events: nobody can know what changed any more
+            if (event->mask & IN_Q_OVERFLOW) {
+                std::lock_guard<std::mutex> lock(mutex_);
+
+                for (const auto& subscription : subscribers_)
+                    subscription->overflow();
+
+                continue;
+            }
+
+            // uploads in progress are nobody's business until they're put in place under their own name
+            if (event->len == 0 || is_staging_name(event->name))
+                continue;
+
+            if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                changes.push_back(WatchSubscription::Event{ WatchChange::CREATED, event->name });
+            else if (event->mask & IN_CLOSE_WRITE)
+                changes.push_back(WatchSubscription::Event{ WatchChange::MODIFIED, event->name });
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                changes.push_back(WatchSubscription::Event{ WatchChange::DELETED, event->name });
+        }
+
+        if (!changes.empty())
+            publish(changes);
+    }
+}
+
+
+void DirectoryWatch::publish(const std::vector<WatchSubscription::Event>& changes) {
+    static auto& published = metrics::counter("watch.changes");
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (const auto& subscription : subscribers_)
+        subscription->post(changes);
+
+    published += changes.size();
+}
+#endif
@@ -0,0 +1,90 @@
+#pragma once
+#ifndef WIN32
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+// Changes to the files in the server's directory, as WATCH reports them: created (or renamed into
+// place, as every upload is), modified (written and closed), or deleted (or renamed away)
+enum class WatchChange { CREATED, MODIFIED, DELETED };
+
+const char* to_string(WatchChange change);
+
+
+// One session's view of the changes. Changes to the same file since the session last collected
+// them are merged into one (a file created then written is just created, one created then deleted
+// is nothing at all), and a session that falls behind by more than WATCH_QUEUE_LIMIT files loses
+// the lot and is told it overflowed, so it can list the directory again instead. Neither a slow
+// subscriber nor a busy directory can make the server hold more than that for anyone
+class WatchSubscription {
+    public:
+        typedef std::shared_ptr<WatchSubscription> Ptr;
+
+        struct Event {
+            WatchChange change;
+            std::string name;
+        };
+
+        // waits for changes, and takes them in the order their files first changed. False once the
+        // subscription has been cancelled, with nothing more to take
+        bool next(std::vector<Event>* events, bool* overflowed);
+
+        // wakes next, for good
+        void cancel();
+
+    private:
+        friend class DirectoryWatch;
+
+        std::mutex mutex_;
+        std::condition_variable changed_;
+        std::deque<std::string> order_;                 // names in pending_, by first change
+        std::map<std::string, WatchChange> pending_;
+        bool overflowed_;
+        bool cancelled_;
+
+        WatchSubscription() : overflowed_(false), cancelled_(false) {}
+
+        void post(const std::vector<Event>& changes);
+        void overflow();
+
+        WatchSubscription(const WatchSubscription& other) = delete;
+        WatchSubscription& operator=(const WatchSubscription& other) = delete;
+};
+
+
+// One inotify watch on the server's directory, shared by every subscribed session, and one thread
+// reading it and handing each change to every subscriber. Nothing runs until the first session
+// subscribes, and sessions waiting for changes cost nothing until one comes
+class DirectoryWatch {
+    public:
+        static DirectoryWatch& shared();
+
+        // nullptr if the directory can't be watched
+        WatchSubscription::Ptr subscribe();
+        void unsubscribe(const WatchSubscription::Ptr& subscription);
+
+        // ends every subscription, e.g. so sessions can be handed to a new server process
+        void cancel_all();
+
+    private:
+        std::mutex mutex_;
+        std::set<WatchSubscription::Ptr> subscribers_;
+        int fd_;
+
+        DirectoryWatch() : fd_(-1) {}
+
+        bool start();
+        void run_reader();
+        void publish(const std::vector<WatchSubscription::Event>& changes);
+
+        DirectoryWatch(const DirectoryWatch& other) = delete;
+        DirectoryWatch& operator=(const DirectoryWatch& other) = delete;
+};
+
+constexpr size_t WATCH_QUEUE_LIMIT = 1024;              // files with changes a subscriber may have waiting before it overflows
+#endif
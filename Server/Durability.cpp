@@ -0,0 +1,228 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Durability.h"
+#include "Metrics.h"
+
+using namespace connection;
+
+
+static metrics::Counter& rounds_metric() {
+    static auto& count = metrics::counter("durability.sync_rounds");
+    return count;
+}
+
+
+static metrics::Counter& files_metric() {
+    static auto& count = metrics::counter("durability.files_synced");
+    return count;
+}
+
+
+const char* to_string(DurabilityMode mode) {
+    switch (mode) {
+        case DurabilityMode::NONE: return "none";
+        case DurabilityMode::ON_CLOSE: return "close";
+        case DurabilityMode::GROUP: return "group";
+        default: return "unknown";
+    }
+}
+
+
+bool parse_durability(const std::string& text, DurabilityMode* mode) {
+    for (const auto candidate : { DurabilityMode::NONE, DurabilityMode::ON_CLOSE, DurabilityMode::GROUP }) {
+        if (text == to_string(candidate)) {
+            *mode = candidate;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+Durability& Durability::shared() {
+    // never destroyed: its thread is still waiting for work as the process exits
+    static auto durability = new Durability();
+    return *durability;
+}
+
+
+void Durability::configure(DurabilityMode mode, long windowUs) {
+    mode_ = mode;
+    windowUs_ = windowUs;
+
+    // lives as long as the process: there is never a moment uploads may not need it
+    if (mode == DurabilityMode::GROUP)
+        std::thread(&Durability::run_committer, this).detach();
+}
+
+
+bool Durability::commit(int fd, const std::string& directory, std::string* error, const std::function<std::string()>& between) {
+    if (mode_ == DurabilityMode::NONE) {
+        *error = between ? between() : std::string();
+        return error->empty();
+    }
+
+    Request request{ fd, directory, between, std::string(), false };
+
+    if (mode_ == DurabilityMode::ON_CLOSE) {
+        sync_one(request);
+    } else {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        pending_.push_back(&request);
+        queued_.notify_one();
+        committed_.wait(lock, [&request]() { return request.done; });
+    }
+
+    *error = request.error;
+    return error->empty();
+}
+
+
+void Durability::run_committer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true) {
+        queued_.wait(lock, [this]() { return !pending_.empty(); });
+
+        if (windowUs_ > 0)
+            queued_.wait_for(lock, std::chrono::microseconds(windowUs_), [this]() { return pending_.size() >= GROUP_COMMIT_MAX_ROUND; });
+
+        // never more than a round's worth: the rest stay queued, ahead of anything newer, for the next
+        const auto take = static_cast<std::ptrdiff_t>(std::min(pending_.size(), GROUP_COMMIT_MAX_ROUND));
+        std::deque<Request*> round(pending_.begin(), pending_.begin() + take);
+
+        pending_.erase(pending_.begin(), pending_.begin() + take);
+
+        // uploads finishing from here on queue up for the next round
+        lock.unlock();
+        sync_round(round);
+        lock.lock();
+
+        for (auto* request : round)
+            request->done = true;
+
+        committed_.notify_all();
+    }
+}
+
+
+// ON_CLOSE: the file's contents, then its directory, each synced on their own
+void Durability::sync_one(Request& request) {
+    if (request.fd >= 0) {
+        if (::fdatasync(request.fd) != 0)
+            request.error = std::string("failed to sync file: ") + strerror(errno);
+
+        ++files_metric();
+    }
+
+    if (request.error.empty() && request.between)
+        request.error = request.between();
+
+    // a new name is only durable once its directory is
+    if (request.error.empty() && !request.directory.empty()) {
+        const int fd = ::open(request.directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd < 0 || ::fsync(fd) != 0)
+            request.error = "failed to sync directory " + request.directory + ": " + strerror(errno);
+
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    ++rounds_metric();
+}
+
+
+// GROUP: syncfs once for each filesystem the round touches. That writes back and commits
+// everything on it, files and directories alike, with one journal commit and one flush of the
+// disk's cache however many uploads are waiting, where syncing them one by one costs each of
+// those per file. It also writes back anything else dirty on the filesystem, which only makes
+// the round longer. Requests with something to do in between (renames, mostly) have it done
+// after that, and their filesystems synced once more for the directory entries it changed
+void Durability::sync_round(const std::deque<Request*>& round) {
+    std::vector<Request*> contents;
+    std::vector<Request*> renamed;
+
+    // a rename with no file of its own (a MOVE) has nothing to write back before it
+    for (auto* request : round) {
+        if (request->fd >= 0 || !request->between)
+            contents.push_back(request);
+    }
+
+    sync_filesystems(contents, true);
+
+    for (auto* request : round) {
+        if (!request->error.empty() || !request->between)
+            continue;
+
+        request->error = request->between();
+
+        if (request->error.empty() && !request->directory.empty())
+            renamed.push_back(request);
+    }
+
+    if (!renamed.empty())
+        sync_filesystems(renamed, false);
+
+    ++rounds_metric();
+}
+
+
+void Durability::sync_filesystems(const std::vector<Request*>& requests, bool countFiles) {
+    std::map<dev_t, std::vector<Request*>> byFilesystem;
+    std::map<dev_t, int> handles;
+
+    for (auto* request : requests) {
+        struct stat st;
+        int fd = request->fd;
+
+        if (fd < 0)
+            fd = ::open(request->directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd < 0 || ::fstat(fd, &st) != 0) {
+            request->error = "failed to sync " + request->directory + ": " + strerror(errno);
+        } else {
+            byFilesystem[st.st_dev].push_back(request);
+
+            // any descriptor on the filesystem will do for syncfs
+            if (handles.count(st.st_dev) == 0) {
+                handles[st.st_dev] = fd == request->fd ? ::dup(fd) : fd;
+                fd = -1;
+            }
+        }
+
+        if (fd >= 0 && fd != request->fd)
+            ::close(fd);
+    }
+
+    for (const auto& filesystem : byFilesystem) {
+        const int fd = handles[filesystem.first];
+        const bool synced = fd >= 0 && ::syncfs(fd) == 0;
+        const std::string error = synced ? "" : std::string("failed to sync filesystem: ") + strerror(errno);
+
+        for (auto* request : filesystem.second) {
+            request->error = error;
+
+            if (countFiles && request->fd >= 0)
+                ++files_metric();
+        }
+    }
+
+    for (const auto& handle : handles) {
+        if (handle.second >= 0)
+            ::close(handle.second);
+    }
+}
+#endif
@@ -0,0 +1,77 @@
+#pragma once
+#ifndef WIN32
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// How hard the server works to keep what it has confirmed. Uploads are written through the page
+// cache, so until that is written back a crash or power cut can lose a file whose PUT succeeded.
+// The same goes for each file of an MPUT, a COPY's new file and where a MOVE put one, and the
+// modes cover those too:
+//
+//   NONE       the kernel writes files back in its own time, as it always has
+//   ON_CLOSE   each upload is synced, contents and directory entry, before it is confirmed
+//   GROUP      as ON_CLOSE, except that uploads finishing at about the same time, from any
+//              session, share one round of syncing. A committer thread takes what queued up while
+//              it was busy with the last round (or within the window, if there is one), up to
+//              GROUP_COMMIT_MAX_ROUND of them, syncs the lot at once, and only then lets each of
+//              them be confirmed
+enum class DurabilityMode { NONE, ON_CLOSE, GROUP };
+
+const char* to_string(DurabilityMode mode);
+
+// "none", "close" or "group". False for anything else
+bool parse_durability(const std::string& text, DurabilityMode* mode);
+
+
+class Durability {
+    public:
+        static Durability& shared();
+
+        // windowUs: how long, in GROUP mode, the committer waits for more uploads to join a round
+        // once the first has arrived. 0 still batches whatever arrives during a round
+        void configure(DurabilityMode mode, long windowUs);
+
+        DurabilityMode mode() const { return mode_; }
+
+        // returns once the contents of fd (if not -1) and the entries of directory (if not empty)
+        // are on stable storage, as far as the mode asks for. False, with error set, if they couldn't be synced.
+        //
+        // between, if given, runs once the contents are safe and before the directory is synced, in
+        // whatever mode: that's where a file is renamed into place. It returns why it failed, or an
+        // empty string, and the directory isn't synced if it fails
+        bool commit(int fd, const std::string& directory, std::string* error, const std::function<std::string()>& between = nullptr);
+
+    private:
+        struct Request {
+            int fd;
+            std::string directory;
+            const std::function<std::string()>& between;
+            std::string error;
+            bool done;
+        };
+
+        DurabilityMode mode_;
+        long windowUs_;
+
+        std::mutex mutex_;
+        std::condition_variable queued_;
+        std::condition_variable committed_;
+        std::deque<Request*> pending_;
+
+        Durability() : mode_(DurabilityMode::NONE), windowUs_(0) {}
+
+        void run_committer();
+        static void sync_one(Request& request);
+        static void sync_round(const std::deque<Request*>& round);
+        static void sync_filesystems(const std::vector<Request*>& requests, bool countFiles);
+
+        Durability(const Durability& other) = delete;
+        Durability& operator=(const Durability& other) = delete;
+};
+
+constexpr size_t GROUP_COMMIT_MAX_ROUND = 256;      // a round takes at most this many, and stops waiting out its window once they've queued
+#endif
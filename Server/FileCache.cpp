@@ -0,0 +1,260 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "FileCache.h"
+#include "Metrics.h"
+#include "TreeManifest.h"
+
+using namespace connection;
+
+
+CachedFile::~CachedFile() {
+    ::close(fd_);
+}
+
+
+static metrics::Counter& hits_metric() {
+    static auto& count = metrics::counter("fdcache.hits");
+    return count;
+}
+
+
+static metrics::Counter& misses_metric() {
+    static auto& count = metrics::counter("fdcache.misses");
+    return count;
+}
+
+
+static metrics::Counter& open_metric() {
+    static auto& gauge = metrics::counter("fdcache.open");
+    return gauge;
+}
+
+
+FileCache& FileCache::shared() {
+    static FileCache cache;
+    return cache;
+}
+
+
+// the server's directory is wherever it was started, and stays so: held open, it's where every
+// path starts from even if it's renamed meanwhile
+FileCache::FileCache() : capacity_(FILE_CACHE_FDS), generation_(0), directory_(::open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) {
+    set_capacity(FILE_CACHE_FDS);
+}
+
+
+void FileCache::set_capacity(size_t fds) {
+    struct rlimit limit;
+
+    // the rest of the descriptors the process may have are for sockets, uploads and everything else
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+        fds = std::min(fds, static_cast<size_t>(limit.rlim_cur / 4));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    capacity_ = fds;
+
+    while (entries_.size() > capacity_)
+        evict(entries_.find(byUse_.back()));
+}
+
+
+CachedFile::Ptr FileCache::open(const std::string& name, uint64_t* size, int* error) {
+    // the same rule TREE, LS and the archives go by, on every platform: no backslashes or drive
+    // letters, which are only ordinary characters here, from a client that may not see them so
+    if (!is_safe_relative_path(name)) {
+        *error = EPERM;
+        return nullptr;
+    }
+
+    if (auto file = lookup(name, size)) {
+        ++hits_metric();
+        return file;
+    }
+
+    ++misses_metric();
+
+    uint64_t generation;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation = generation_;
+    }
+
+    const int fd = resolve(name, error);
+    struct stat st;
+
+    if (fd < 0)
+        return nullptr;
+
+    if (::fstat(fd, &st) != 0) {
+        *error = errno;
+        ::close(fd);
+        return nullptr;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        *error = EISDIR;
+        ::close(fd);
+        return nullptr;
+    }
+
+    auto file = std::make_shared<CachedFile>(fd);
+
+    *size = static_cast<uint64_t>(st.st_size);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // written to while it was being opened: what was opened may already be out of date, so it's
+    // good for this GET but not for keeping
+    if (capacity_ == 0 || generation != generation_)
+        return file;
+
+    const auto existing = entries_.find(name);
+
+    if (existing != entries_.end())
+        evict(existing);
+
+    byUse_.push_front(name);
+    entries_[name] = Entry{ file, st.st_dev, st.st_ino, Clock::now(), byUse_.begin() };
+
+    while (entries_.size() > capacity_)
+        evict(entries_.find(byUse_.back()));
+
+    open_metric() = static_cast<int64_t>(entries_.size());
+    return file;
+}
+
+
+// the descriptor kept for name, if it's still the file of that name. Its path is only looked at
+// again once FILE_CACHE_TTL_MS have passed since it last was
+CachedFile::Ptr FileCache::lookup(const std::string& name, uint64_t* size) {
+    CachedFile::Ptr file;
+    bool verify;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto it = entries_.find(name);
+
+        if (it == entries_.end())
+            return nullptr;
+
+        byUse_.splice(byUse_.begin(), byUse_, it->second.use);
+        file = it->second.file;
+        verify = Clock::now() - it->second.verified >= std::chrono::milliseconds(FILE_CACHE_TTL_MS);
+    }
+
+    struct stat st;
+    struct stat current;
+
+    // removed, or replaced by a file of its own
+    const bool stale = ::fstat(file->fd(), &st) != 0 || st.st_nlink == 0 || (verify &&
+        (::fstatat(directory_, name.c_str(), &current, name.find('/') == std::string::npos ? 0 : AT_SYMLINK_NOFOLLOW) != 0 ||
+         current.st_dev != st.st_dev || current.st_ino != st.st_ino));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = entries_.find(name);
+
+    // invalidated meanwhile: whoever did so knows better
+    if (it == entries_.end() || it->second.file != file)
+        return nullptr;
+
+    if (stale) {
+        evict(it);
+        open_metric() = static_cast<int64_t>(entries_.size());
+        return nullptr;
+    }
+
+    if (verify)
+        it->second.verified = Clock::now();
+
+    *size = static_cast<uint64_t>(st.st_size);
+    return file;
+}
+
+
+// opens name, already found safe, a component at a time from the server's directory. In a nested
+// path no component may be a symbolic link, which could lead anywhere; a plain file name is taken
+// as it is, as it always has been
+int FileCache::resolve(const std::string& name, int* error) const {
+    const bool nested = name.find('/') != std::string::npos;
+    int at = directory_;
+    size_t begin = 0;
+
+    if (directory_ < 0) {
+        *error = EBADF;
+        return -1;
+    }
+
+    while (true) {
+        const auto end = name.find('/', begin);
+        const bool last = end == std::string::npos;
+        const auto component = name.substr(begin, (last ? name.length() : end) - begin);
+
+        // O_NONBLOCK: a FIFO mustn't keep us waiting for a writer before it's found not to be a file
+        const int flags = O_RDONLY | O_CLOEXEC | (last ? O_NONBLOCK : O_DIRECTORY) | (nested ? O_NOFOLLOW : 0);
+        const int fd = ::openat(at, component.c_str(), flags);
+        int opened = errno;
+        struct stat st;
+
+        // a symbolic link refused on the way to the file looks like any other component that isn't a directory
+        if (fd < 0 && opened == ENOTDIR && ::fstatat(at, component.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode))
+            opened = ELOOP;
+
+        if (at != directory_)
+            ::close(at);
+
+        if (fd < 0) {
+            *error = opened == ELOOP ? EPERM : opened == ENOTDIR ? ENOENT : opened;
+            return -1;
+        }
+
+        if (last)
+            return fd;
+
+        at = fd;
+        begin = end + 1;
+    }
+}
+
+
+void FileCache::invalidate(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto prefix = path + "/";
+
+    ++generation_;
+
+    const auto exact = entries_.find(path);
+
+    if (exact != entries_.end())
+        evict(exact);
+
+    for (auto it = entries_.lower_bound(prefix); it != entries_.end() && it->first.compare(0, prefix.length(), prefix) == 0;)
+        evict(it++);
+
+    open_metric() = static_cast<int64_t>(entries_.size());
+}
+
+
+void FileCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    ++generation_;
+    entries_.clear();
+    byUse_.clear();
+    open_metric() = 0;
+}
+
+
+// called with mutex_ held
+void FileCache::evict(std::map<std::string, Entry>::iterator it) {
+    byUse_.erase(it->second.use);
+    entries_.erase(it);
+}
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+#ifndef WIN32
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A file opened for reading by GET. It stays open for as long as any GET is sending it, even once
+// the cache has let it go
+class CachedFile {
+    public:
+        typedef std::shared_ptr<CachedFile> Ptr;
+
+        explicit CachedFile(int fd) : fd_(fd) {}
+        ~CachedFile();
+
+        int fd() const { return fd_; }
+
+    private:
+        const int fd_;
+
+        CachedFile(const CachedFile& other) = delete;
+        CachedFile& operator=(const CachedFile& other) = delete;
+};
+
+
+// Descriptors of the files GET served recently, kept open so serving one again costs an fstat()
+// rather than walking its path, checking every component for symbolic links and opening it again.
+// Paths must pass is_safe_relative_path, and are resolved a component at a time with openat() from
+// the server's directory, held open, so no component can be "..", or a symbolic link in a nested
+// path, and lead out of it. The server's own writes invalidate the paths they touch; a file
+// replaced behind its back is noticed within FILE_CACHE_TTL_MS, when its path is looked at again.
+// At most FILE_CACHE_FDS descriptors are kept (FTP_FD_CACHE changes how many, 0 for none), the
+// least recently used closed first
+class FileCache {
+    public:
+        static FileCache& shared();
+
+        // name, relative to the server's directory, open for reading, with its size as it is now.
+        // nullptr if it can't be, with error set: ENOENT if there's no such file, EPERM if the path
+        // isn't beneath the server's directory, EISDIR if it isn't a regular file, or why it
+        // couldn't be opened
+        CachedFile::Ptr open(const std::string& name, uint64_t* size, int* error);
+
+        // path, and anything beneath it if it's a directory
+        void invalidate(const std::string& path);
+        void clear();
+
+        void set_capacity(size_t fds);
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Entry {
+            CachedFile::Ptr file;
+            dev_t device;
+            ino_t inode;
+            Clock::time_point verified;                 // when its path last led to it
+            std::list<std::string>::iterator use;       // place in byUse_
+        };
+
+        std::mutex mutex_;
+        std::map<std::string, Entry> entries_;
+        std::list<std::string> byUse_;                  // names, most recently used first
+        size_t capacity_;
+        uint64_t generation_;                           // bumped by every invalidation
+        const int directory_;
+
+        FileCache();
+
+        CachedFile::Ptr lookup(const std::string& name, uint64_t* size);
+        int resolve(const std::string& name, int* error) const;
+        void evict(std::map<std::string, Entry>::iterator it);
+
+        FileCache(const FileCache& other) = delete;
+        FileCache& operator=(const FileCache& other) = delete;
+};
+
+constexpr size_t FILE_CACHE_FDS = 256;
+constexpr long FILE_CACHE_TTL_MS = 1000;
+#endif
@@ -0,0 +1,237 @@
+#include "pch.h"
+#include <algorithm>
+#include "FileCopy.h"
+#include "BufferPool.h"
+#include "StagedUpload.h"
+
+#ifdef WIN32
+#include <filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "Durability.h"
+#endif
+
+using namespace connection;
+
+
+const char* to_string(CopyMethod method) {
+    switch (method) {
+        case CopyMethod::CLONE: return "reflink";
+        case CopyMethod::KERNEL: return "copy_file_range";
+        case CopyMethod::USERSPACE: return "read/write";
+        case CopyMethod::RENAME: return "rename";
+        default: return "unknown";
+    }
+}
+
+
+#ifndef WIN32
+static std::string describe_errno(const std::string& what) {
+    return what + ": " + strerror(errno);
+}
+
+
+// copy_file_range can't be used here at all, as opposed to having failed partway
+static bool copy_range_unsupported(int error) {
+    return error == EXDEV || error == ENOSYS || error == EOPNOTSUPP || error == EINVAL;
+}
+
+
+// copies from the start of fromFd to toFd through a pooled buffer
+static bool copy_userspace(int fromFd, int toFd, uint64_t total, CopyProgress& onProgress, uint64_t* done, std::string* error) {
+    auto lease = BufferPool::shared().acquire();
+
+    while (true) {
+        const auto got = ::read(fromFd, lease.data(), lease.size());
+
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+
+            *error = describe_errno("read failed");
+            return false;
+        }
+
+        if (got == 0)
+            return true;
+
+        for (ssize_t written = 0; written < got;) {
+            const auto put = ::write(toFd, lease.data() + written, static_cast<size_t>(got - written));
+
+            if (put < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                *error = describe_errno("write failed");
+                return false;
+            }
+
+            written += put;
+        }
+
+        *done += static_cast<uint64_t>(got);
+
+        // a report per buffer would be far too often: only at the boundaries of COPY_CHUNK
+        if (onProgress && (*done / COPY_CHUNK) != ((*done - got) / COPY_CHUNK))
+            onProgress(*done, total);
+    }
+}
+#endif
+
+
+bool copy_file(const std::string& from, const std::string& to, CopyProgress onProgress, CopyMethod* method, uint64_t* bytes, std::string* error) {
+    *bytes = 0;
+
+#ifdef WIN32
+    std::error_code ec;
+
+    *method = CopyMethod::USERSPACE;
+
+    if (!fs::copy_file(from, to, fs::copy_options::none, ec)) {
+        *error = ec.message();
+        return false;
+    }
+
+    *bytes = fs::file_size(to, ec);
+    return true;
+#else
+    const int fromFd = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fromFd < 0) {
+        *error = describe_errno("failed to open " + from);
+        return false;
+    }
+
+    if (::fstat(fromFd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        *error = from + " is not a file";
+        ::close(fromFd);
+        return false;
+    }
+
+    // filled under a hidden name beside to, and renamed there only once it's complete: nothing sees
+    // half a copy, and a file that turns up at to in the meantime isn't replaced
+    MSGECODE code = MSGECODE::ERR_UNKNOWN;
+    const auto staged = StagedUpload::create(to, 0, &code);
+
+    if (!staged) {
+        *error = "failed to create " + to + ": " + strecode(code);
+        ::close(fromFd);
+        return false;
+    }
+
+    const int toFd = staged->fd();
+    const auto total = static_cast<uint64_t>(st.st_size);
+    bool ok = true;
+
+    if (::ioctl(toFd, FICLONE, fromFd) == 0) {
+        *method = CopyMethod::CLONE;
+        *bytes = total;
+    } else {
+        *method = CopyMethod::KERNEL;
+
+        while (true) {
+            const auto copied = ::copy_file_range(fromFd, nullptr, toFd, nullptr, static_cast<size_t>(COPY_CHUNK), 0);
+
+            if (copied < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                // nothing written yet, and the kernel won't do it: do it ourselves
+                if (*bytes == 0 && copy_range_unsupported(errno)) {
+                    *method = CopyMethod::USERSPACE;
+                    ok = copy_userspace(fromFd, toFd, total, onProgress, bytes, error);
+                } else {
+                    *error = describe_errno("copy failed");
+                    ok = false;
+                }
+
+                break;
+            }
+
+            if (copied == 0)
+                break; // end of file (which may have moved since we looked)
+
+            *bytes += static_cast<uint64_t>(copied);
+
+            if (onProgress)
+                onProgress(*bytes, std::max(total, *bytes));
+        }
+    }
+
+    ::close(fromFd);
+
+    // not put in place, the hidden file goes when staged does
+    if (ok) {
+        staged->set_mode(st.st_mode & 0777);
+        *error = staged->commit();
+        ok = error->empty();
+    }
+
+    return ok;
+#endif
+}
+
+
+bool move_file(const std::string& from, const std::string& to, CopyProgress onProgress, CopyMethod* method, uint64_t* bytes, std::string* error) {
+    *bytes = 0;
+    *method = CopyMethod::RENAME;
+
+#ifdef WIN32
+    std::error_code ec;
+
+    *bytes = fs::file_size(from, ec);
+    fs::rename(from, to, ec);
+
+    if (ec) {
+        *error = ec.message();
+        return false;
+    }
+
+    return true;
+#else
+    struct stat st;
+
+    if (::stat(from.c_str(), &st) == 0)
+        *bytes = static_cast<uint64_t>(st.st_size);
+
+    const auto slash = to.rfind('/');
+    const auto directory = slash == std::string::npos ? std::string(".") : to.substr(0, slash);
+    int renameError = 0;
+
+    // plain rename() would silently replace to if it appeared in the meantime. The directory it
+    // lands in is synced after, as for an upload, if the server keeps those durable
+    const bool moved = Durability::shared().commit(-1, directory, error, [&]() {
+        if (::renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_NOREPLACE) == 0)
+            return std::string();
+
+        renameError = errno;
+        return describe_errno("failed to move " + from);
+    });
+
+    if (moved)
+        return true;
+
+    if (renameError != EXDEV)
+        return false;
+
+    // another filesystem: the data has to be copied after all
+    if (!copy_file(from, to, onProgress, method, bytes, error))
+        return false;
+
+    if (::unlink(from.c_str()) != 0) {
+        *error = describe_errno("copied, but failed to remove " + from);
+        return false;
+    }
+
+    return true;
+#endif
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <stdint.h>
+
+// COPY and MOVE run entirely on the server, so no byte of the file crosses the network. A copy
+// is a reflink where the filesystem can share the data (FICLONE: btrfs, XFS), and otherwise is
+// done by the kernel with copy_file_range, falling back to read/write only where that's refused
+// (across filesystems on older kernels, say). A move is a rename, or a copy and unlink when the
+// two paths are on different filesystems
+
+enum class CopyMethod {
+    CLONE,          // the new file shares the old one's blocks
+    KERNEL,         // copy_file_range: in the kernel, or offloaded to the storage where it can
+    USERSPACE,      // read and written through a buffer here
+    RENAME
+};
+
+const char* to_string(CopyMethod method);
+
+// called after each piece of a copy with the bytes done so far
+typedef std::function<void(uint64_t done, uint64_t total)> CopyProgress;
+
+// copies the regular file from to to, which must not exist yet, keeping its permission bits.
+// Returns false (with the reason in error) on failure, leaving no partial copy behind
+bool copy_file(const std::string& from, const std::string& to, CopyProgress onProgress, CopyMethod* method, uint64_t* bytes, std::string* error);
+
+// renames from to to, which must not exist yet, copying (then removing from) if it has to
+bool move_file(const std::string& from, const std::string& to, CopyProgress onProgress, CopyMethod* method, uint64_t* bytes, std::string* error);
+
+constexpr uint64_t COPY_CHUNK = 64 * 1024 * 1024;      // copied per call, so progress can be reported in between
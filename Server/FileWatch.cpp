@@ -0,0 +1,208 @@
+#include "pch.h"
+#ifndef WIN32
+#include <chrono>
+#include <thread>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "FileCache.h"
+#include "FileWatch.h"
+#include "Metrics.h"
+
+using namespace connection;
+
+
+FollowedFile::~FollowedFile() {
+    ::close(fd_);
+}
+
+
+uint64_t FollowedFile::size() const {
+    struct stat st;
+
+    return ::fstat(fd_, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+}
+
+
+// renamed, or its last name removed: whatever writes to it from now on, if anything, isn't writing to
+// the file of that name any more
+bool FollowedFile::gone() const {
+    struct stat st;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (moved_)
+            return true;
+    }
+
+    return ::fstat(fd_, &st) != 0 || st.st_nlink == 0;
+}
+
+
+bool FollowedFile::wait(long timeoutMs) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const auto ready = [this]() { return touched_ || cancelled_; };
+
+    if (timeoutMs > 0)
+        changed_.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready);
+    else changed_.wait(lock, ready);
+
+    touched_ = false;
+    return !cancelled_;
+}
+
+
+void FollowedFile::cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    cancelled_ = true;
+    changed_.notify_all();
+}
+
+
+void FollowedFile::touch(bool moved) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // a follower busy sending what was there already will look again before it waits: no need to wake it
+    const bool wake = !touched_;
+
+    touched_ = true;
+    moved_ = moved_ || moved;
+
+    if (wake)
+        changed_.notify_all();
+}
+
+
+static metrics::Counter& followed_metric() {
+    static auto& gauge = metrics::counter("follow.files");
+    return gauge;
+}
+
+
+FileWatch& FileWatch::shared() {
+    static FileWatch watch;
+    return watch;
+}
+
+
+FollowedFile::Ptr FileWatch::follow(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (fd_ < 0 && !start())
+        return nullptr;
+
+    // opened the way GET opens it, so a follow can't reach anything GET can't. Its descriptor is
+    // the follower's own: the cache may close its copy whenever it likes
+    uint64_t size;
+    int error;
+    const auto cached = FileCache::shared().open(name, &size, &error);
+    const int fd = cached ? ::dup(cached->fd()) : -1;
+
+    if (fd < 0)
+        return nullptr;
+
+    FollowedFile::Ptr file(new FollowedFile(fd));
+
+    // renaming and removing are watched on the file itself, not its directory, so they're seen
+    // whatever it's called by then. Removing a name changes the file's link count (IN_ATTRIB).
+    // Watched through the descriptor, not the name, which may already lead somewhere else
+    const auto opened = "/proc/self/fd/" + std::to_string(fd);
+
+    file->watch_ = ::inotify_add_watch(fd_, opened.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+
+    if (file->watch_ < 0)
+        return nullptr;
+
+    followers_[file->watch_].insert(file);
+    ++followed_metric();
+
+    return file;
+}
+
+
+void FileWatch::unfollow(const FollowedFile::Ptr& file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = followers_.find(file->watch_);
+
+    if (it == followers_.end() || it->second.erase(file) == 0)
+        return;
+
+    --followed_metric();
+
+    if (it->second.empty()) {
+        ::inotify_rm_watch(fd_, it->first);
+        followers_.erase(it);
+    }
+}
+
+
+void FileWatch::cancel_all() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (const auto& watched : followers_) {
+        for (const auto& file : watched.second)
+            file->cancel();
+    }
+}
+
+
+// called with mutex_ held. The instance, and the thread reading it, last as long as the process
+bool FileWatch::start() {
+    const int fd = ::inotify_init1(IN_CLOEXEC);
+
+    if (fd < 0)
+        return false;
+
+    fd_ = fd;
+    std::thread(&FileWatch::run_reader, this).detach();
+
+    return true;
+}
+
+
+void FileWatch::run_reader() {
+    // followed files have no names in their events: room for plenty of them at once
+    alignas(struct inotify_event) char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+
+    while (true) {
+        const auto got = ::read(fd_, buf, sizeof(buf));
+
+        if (got < 0 && errno == EINTR)
+            continue;
+
+        if (got <= 0)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (char* at = buf; at < buf + got;) {
+            const auto event = reinterpret_cast<const struct inotify_event*>(at);
+            const bool moved = (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED | IN_UNMOUNT)) != 0;
+
+            at += sizeof(struct inotify_event) + event->len;
+
+            // the kernel dropped events: every follower has to look for itself
+            if (event->mask & IN_Q_OVERFLOW) {
+                for (const auto& watched : followers_) {
+                    for (const auto& file : watched.second)
+                        file->touch(false);
+                }
+
+                continue;
+            }
+
+            const auto it = followers_.find(event->wd);
+
+            if (it == followers_.end())
+                continue;
+
+            for (const auto& file : it->second)
+                file->touch(moved);
+        }
+    }
+}
+#endif
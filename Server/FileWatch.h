@@ -0,0 +1,79 @@
+#pragma once
+#ifndef WIN32
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <stdint.h>
+
+// A file GET is following as it grows (see FLAG_FOLLOW). The file stays open for as long as it's
+// followed, so what has been appended can still be sent after it's been renamed or removed
+class FollowedFile {
+    public:
+        typedef std::shared_ptr<FollowedFile> Ptr;
+
+        ~FollowedFile();
+
+        int fd() const { return fd_; }
+
+        // the file's size, and whether it still has a name: as they are now
+        uint64_t size() const;
+        bool gone() const;
+
+        // waits up to timeoutMs (forever for 0) for the file to be written to, renamed or removed,
+        // returning at once if it has been since the last wait. False once the file has been
+        // cancelled: the follower should give up
+        bool wait(long timeoutMs);
+
+        // wakes wait, for good
+        void cancel();
+
+    private:
+        friend class FileWatch;
+
+        const int fd_;
+        int watch_;                 // inotify watch descriptor, shared by every follower of the same file
+        mutable std::mutex mutex_;
+        std::condition_variable changed_;
+        bool touched_;
+        bool moved_;
+        bool cancelled_;
+
+        FollowedFile(int fd) : fd_(fd), watch_(-1), touched_(false), moved_(false), cancelled_(false) {}
+
+        void touch(bool moved);
+
+        FollowedFile(const FollowedFile& other) = delete;
+        FollowedFile& operator=(const FollowedFile& other) = delete;
+};
+
+
+// One inotify instance for every file being followed, and one thread reading it and waking their
+// followers. However many files are followed, a quiet one costs nothing until it's written to
+class FileWatch {
+    public:
+        static FileWatch& shared();
+
+        // nullptr if name can't be opened or watched
+        FollowedFile::Ptr follow(const std::string& name);
+        void unfollow(const FollowedFile::Ptr& file);
+
+        // gives up every file, e.g. so sessions can be handed to a new server process
+        void cancel_all();
+
+    private:
+        std::mutex mutex_;
+        std::map<int, std::set<FollowedFile::Ptr>> followers_;     // by watch descriptor
+        int fd_;
+
+        FileWatch() : fd_(-1) {}
+
+        bool start();
+        void run_reader();
+
+        FileWatch(const FileWatch& other) = delete;
+        FileWatch& operator=(const FileWatch& other) = delete;
+};
+#endif
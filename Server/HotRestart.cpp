@@ -0,0 +1,293 @@
+#include "pch.h"
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include "HotRestart.h"
+#include "SyncStream.h"
+#include "SocketCompat.h"
+
+#ifndef WIN32
+#include <unistd.h>
+#include "FdPassing.h"
+#endif
+
+using namespace connection;
+
+constexpr std::stringstream::openmode binary_stream = std::stringstream::in | std::stringstream::out | std::stringstream::binary;
+
+// first byte of every handoff message
+enum HandoffKind : uint8_t {
+    HANDOFF_LISTENER = 1,
+    HANDOFF_SESSION,
+    HANDOFF_PARKED          // a session with no connection, so no descriptor
+};
+
+static std::atomic_bool g_inProgress(false);
+static std::mutex g_successorMutex;
+static Connection::Ptr g_successor;     // old process: channel to the new one
+
+
+#ifndef WIN32
+
+static void write_name(NetworkDataStream& ds, const std::string& name) {
+    ds << static_cast<uint16_t>(name.length());
+    ds.write_str(name);
+}
+
+
+static std::string read_name(NetworkDataStream& ds) {
+    uint16_t len = 0;
+    ds >> len;
+    return ds.read_str(len);
+}
+
+
+static std::string encode_upload(const HotRestart::UploadState& upload) {
+    std::stringstream buf(binary_stream);
+    NetworkDataStream ds(buf);
+
+    write_name(ds, upload.name);
+    write_name(ds, upload.stagingName);
+    ds << upload.size << static_cast<uint16_t>(upload.written.size());
+
+    for (const auto& range : upload.written)
+        ds << range.first << range.second;
+
+    return buf.str();
+}
+
+
+// appends the token and as many uploads as fit in what's left of a handoff message already
+// holding used bytes. The rest are dropped from state
+static void write_resume_state(NetworkDataStream& ds, size_t used, HotRestart::SessionState* state) {
+    std::string uploads;
+    size_t count = 0;
+
+    used += sizeof(uint16_t) + state->token.length() + sizeof(uint16_t);
+
+    for (; count < state->uploads.size() && count < UINT16_MAX; ++count) {
+        const auto upload = encode_upload(state->uploads[count]);
+
+        if (used + uploads.length() + upload.length() > MAX_FD_PAYLOAD_LEN)
+            break;
+
+        uploads += upload;
+    }
+
+    state->uploads.resize(count);
+
+    write_name(ds, state->token);
+    ds << static_cast<uint16_t>(count);
+    ds.write_str(uploads);
+}
+
+
+static void read_resume_state(std::stringstream& buf, NetworkDataStream& ds, HotRestart::SessionState* state) {
+    uint16_t count = 0;
+
+    // a server from before sessions could be resumed sends nothing more
+    if (buf.peek() == std::char_traits<char>::eof())
+        return;
+
+    state->token = read_name(ds);
+    ds >> count;
+
+    for (uint16_t i = 0; i < count; ++i) {
+        HotRestart::UploadState upload;
+        uint16_t ranges = 0;
+
+        upload.name = read_name(ds);
+        upload.stagingName = read_name(ds);
+        ds >> upload.size >> ranges;
+
+        for (uint16_t r = 0; r < ranges; ++r) {
+            uint64_t offset = 0, len = 0;
+
+            ds >> offset >> len;
+            upload.written.emplace_back(offset, len);
+        }
+
+        state->uploads.push_back(std::move(upload));
+    }
+}
+
+
+socket_t HotRestart::take_over(const std::string& path, SessionCallback onSession, ParkedCallback onParked, DrainedCallback onDrained) {
+    Connection::Ptr channel;
+
+    try {
+        channel = Connection::connect_local(path);
+    }
+    catch (const ConnectionException&) {
+        return INVALID_SOCKET; // nobody serving handoff: start fresh
+    }
+
+    int listenSocket = -1;
+    std::string payload;
+
+    if (!receive_fd(channel->transport().native_handle(), &listenSocket, &payload) || payload.empty() || payload[0] != HANDOFF_LISTENER || listenSocket < 0)
+        throw ConnectionException("previous server sent an unexpected handoff message");
+
+    std::thread([channel, listenSocket, onSession, onParked, onDrained]() {
+        const auto handle = channel->transport().native_handle();
+        int fd = -1;
+        std::string message;
+
+        try {
+            while (receive_fd(handle, &fd, &message)) {
+                std::stringstream buf(message, binary_stream);
+                NetworkDataStream ds(buf);
+                uint8_t kind = 0;
+                SessionState state{ 0, 1, std::string(), {} };
+                uint16_t hostPort = 0, remotePort = 0;
+
+                ds >> kind;
+
+                if (kind == HANDOFF_PARKED && fd < 0) {
+                    read_resume_state(buf, ds, &state);
+                    onParked(state);
+                    continue;
+                }
+
+                if (kind != HANDOFF_SESSION || fd < 0) {
+                    if (fd >= 0) ::close(fd);
+                    continue;
+                }
+
+                uint8_t version = 1;
+
+                ds >> state.inlineLimit >> hostPort >> remotePort;
+                const auto hostName = read_name(ds);
+                const auto remoteName = read_name(ds);
+                ds >> version;
+
+                state.version = version;
+                read_resume_state(buf, ds, &state);
+
+                onSession(std::make_shared<Connection>(fd, hostName, remoteName, hostPort, remotePort), state);
+            }
+        }
+        catch (const std::exception& e) {
+            sync_cerr.print("hot restart: lost contact with previous server: ", e.what(), sync_endl);
+        }
+
+        channel->release();
+        onDrained(listenSocket);
+    }).detach();
+
+    return listenSocket;
+}
+
+
+void HotRestart::serve_handoff(const std::string& path, socket_t listenSocket, std::function<void()> onHandedOff) {
+    std::thread([path, listenSocket, onHandedOff]() {
+        Connection::StopListeningQuery stop = []() { return false; };
+        Connection::ErrorCallback onError = [](const ConnectionException& ce) {
+            sync_cerr.print("hot restart: successor failed to connect: ", ce.what(), sync_endl);
+            return true;
+        };
+
+        Connection::ConnectionEstablishedCallback onSuccessor = [&](Connection::Ptr successor) {
+            std::stringstream buf(binary_stream);
+            NetworkDataStream ds(buf);
+
+            ds << static_cast<uint8_t>(HANDOFF_LISTENER);
+            send_fd(successor->transport().native_handle(), listenSocket, buf.str());
+
+            {
+                std::lock_guard<std::mutex> lock(g_successorMutex);
+                g_successor = successor;
+            }
+
+            g_inProgress.store(true);
+            onHandedOff();
+        };
+
+        try {
+            Connection::welcome_local(path, stop, onSuccessor, onError, true);
+        }
+        catch (const ConnectionException& ce) {
+            sync_cerr.print("hot restart: unable to serve handoff on ", path, ": ", ce.what(), sync_endl);
+        }
+    }).detach();
+}
+
+
+bool HotRestart::hand_off_session(Connection& control, SessionState* state) {
+    std::lock_guard<std::mutex> lock(g_successorMutex);
+
+    if (!g_successor)
+        return false;
+
+    std::stringstream buf(binary_stream);
+    NetworkDataStream ds(buf);
+
+    ds << static_cast<uint8_t>(HANDOFF_SESSION) << state->inlineLimit << control.host_port() << control.remote_port();
+    write_name(ds, control.host_name());
+    write_name(ds, control.remote_name());
+    ds << static_cast<uint8_t>(state->version);
+    write_resume_state(ds, buf.str().length(), state);
+
+    try {
+        send_fd(g_successor->transport().native_handle(), control.transport().native_handle(), buf.str());
+    }
+    catch (const ConnectionException& ce) {
+        sync_cerr.print("hot restart: failed to hand off ", control.identify_remote(), ": ", ce.what(), sync_endl);
+        return false;
+    }
+
+    // the successor has its own handle now; ours must close without shutting anything down
+    control.release();
+    return true;
+}
+
+
+bool HotRestart::hand_off_parked(SessionState* state) {
+    std::lock_guard<std::mutex> lock(g_successorMutex);
+
+    if (!g_successor)
+        return false;
+
+    std::stringstream buf(binary_stream);
+    NetworkDataStream ds(buf);
+
+    ds << static_cast<uint8_t>(HANDOFF_PARKED);
+    write_resume_state(ds, buf.str().length(), state);
+
+    try {
+        send_fd(g_successor->transport().native_handle(), -1, buf.str());
+    }
+    catch (const ConnectionException& ce) {
+        sync_cerr.print("hot restart: failed to hand off a parked session: ", ce.what(), sync_endl);
+        return false;
+    }
+
+    return true;
+}
+
+#else // WIN32: no descriptor passing, so restarts always start fresh
+
+socket_t HotRestart::take_over(const std::string&, SessionCallback, ParkedCallback, DrainedCallback) {
+    return INVALID_SOCKET;
+}
+
+
+void HotRestart::serve_handoff(const std::string&, socket_t, std::function<void()>) {}
+
+
+bool HotRestart::hand_off_session(Connection&, SessionState*) {
+    return false;
+}
+
+
+bool HotRestart::hand_off_parked(SessionState*) {
+    return false;
+}
+
+#endif
+
+
+bool HotRestart::in_progress() {
+    return g_inProgress.load();
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Connection.h"
+
+// Zero-downtime restarts (Linux only; elsewhere take_over always starts fresh).
+//
+// Every server started with a handoff path offers its listening socket to a successor on
+// that Unix socket path. Starting a new server with the same path connects to the old one,
+// which passes the listening socket over (SCM_RIGHTS) and stops accepting: connections
+// queued during the switch are accepted by the new process instead of refused. The old
+// process lets in-flight commands finish, passes each control connection across along with
+// its session state as soon as it is idle, and exits once it has no sessions left. Sessions
+// whose connection has dropped, waiting for their client to resume them, go across too
+class HotRestart {
+    public:
+        // an upload a session began and hasn't finished. The new process carries on writing the
+        // hidden file it is staged in
+        struct UploadState {
+            std::string name;
+            std::string stagingName;
+            uint64_t size;
+            std::vector<std::pair<uint64_t, uint64_t>> written;    // offset and length of each part
+        };
+
+        // what a session needs to carry on in another process
+        struct SessionState {
+            uint16_t inlineLimit;
+            int version;            // negotiated protocol version
+            std::string token;      // the client resumes the session with this if its connection drops
+            std::vector<UploadState> uploads;
+        };
+
+        typedef std::function<void(connection::Connection::Ptr, const SessionState&)> SessionCallback;
+        typedef std::function<void(const SessionState&)> ParkedCallback;
+        typedef std::function<void(socket_t)> DrainedCallback;
+
+        // new process: take over from the server serving handoff on path. Returns the inherited
+        // listening socket, or INVALID_SOCKET if there was nobody to take over from. Sessions
+        // passed across afterwards are delivered to onSession, and those waiting for their client
+        // to onParked, from a background thread; onDrained is called once the old process has exited
+        static socket_t take_over(const std::string& path, SessionCallback onSession, ParkedCallback onParked, DrainedCallback onDrained);
+
+        // old process: waits (in the background) for a successor to connect to path, then
+        // passes listenSocket to it and calls onHandedOff
+        static void serve_handoff(const std::string& path, socket_t listenSocket, std::function<void()> onHandedOff);
+
+        // true once the listening socket has been handed off: sessions should hand_off_session when next
+        // idle. Until they have, they refuse anything that would keep them from ever being idle, such as
+        // a WATCH or FOLLOW; those already running are ended as the handoff begins
+        static bool in_progress();
+
+        // passes control's socket and session state to the successor. On success control has been
+        // released and the session is over for this process; on failure the session should carry on.
+        // Uploads that don't fit in one handoff message are left out of state, and stay this process's
+        static bool hand_off_session(connection::Connection& control, SessionState* state);
+
+        // passes a session whose connection has dropped to the successor, to wait there for its client
+        // instead. Only the token and uploads are used, and uploads are left out as for hand_off_session
+        static bool hand_off_parked(SessionState* state);
+};
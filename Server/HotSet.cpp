@@ -0,0 +1,221 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "HotSet.h"
+#include "Metrics.h"
+#include "SyncStream.h"
+
+using namespace connection;
+
+// from linux/ioprio.h, which not every system's headers have
+constexpr int IOPRIO_WHO_THREAD = 1;
+constexpr int IOPRIO_IDLE = 3 << 13;                // class idle: the disk serves it only when nothing else wants it
+
+constexpr double HOTSET_FORGOTTEN = 0.1;            // a count decayed below this is dropped: not served since many saves ago
+
+
+HotSet& HotSet::shared() {
+    // never destroyed: its thread may be saving as the process exits
+    static auto hotSet = new HotSet();
+    return *hotSet;
+}
+
+
+void HotSet::start(const std::string& path, uint64_t budgetBytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        path_ = path;
+        budgetBytes_ = budgetBytes;
+    }
+
+    // loading the summary and warming up happen there too: nothing here may keep clients waiting
+    std::thread(&HotSet::run, this).detach();
+}
+
+
+void HotSet::record(const std::string& fileName) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // a name that would split its line in the summary isn't worth the trouble
+    if (path_.empty() || fileName.find('\n') != std::string::npos)
+        return;
+
+    counts_[fileName] += 1;
+
+    // between saves, many files served once can't crowd out the memory: the most popular are what's kept
+    if (counts_.size() > 4 * HOTSET_FILES)
+        trim(HOTSET_FILES);
+}
+
+
+bool HotSet::save() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (path_.empty())
+        return false;
+
+    trim(HOTSET_FILES);
+
+    std::vector<std::pair<std::string, double>> files(counts_.begin(), counts_.end());
+
+    std::sort(files.begin(), files.end(), [](const std::pair<std::string, double>& a, const std::pair<std::string, double>& b) {
+        return a.second > b.second;
+    });
+
+    // written aside and renamed into place, so a server starting meanwhile never reads half a summary
+    const auto tempPath = path_ + ".tmp";
+    std::ofstream output(tempPath, std::ios::trunc);
+
+    output << "ftp-hotset " << HOTSET_VERSION << "\n";
+
+    for (const auto& file : files)
+        output << file.second << " " << file.first << "\n";
+
+    output.close();
+
+    if (!output || ::rename(tempPath.c_str(), path_.c_str()) != 0) {
+        ::unlink(tempPath.c_str());
+        return false;
+    }
+
+    for (auto it = counts_.begin(); it != counts_.end();) {
+        it->second /= 2;
+
+        if (it->second < HOTSET_FORGOTTEN)
+            it = counts_.erase(it);
+        else ++it;
+    }
+
+    return true;
+}
+
+
+// called with mutex_ held: keeps the keep most popular files
+void HotSet::trim(size_t keep) {
+    if (counts_.size() <= keep)
+        return;
+
+    std::vector<double> counts;
+
+    counts.reserve(counts_.size());
+
+    for (const auto& file : counts_)
+        counts.push_back(file.second);
+
+    std::nth_element(counts.begin(), counts.begin() + (keep - 1), counts.end(), std::greater<double>());
+
+    const auto least = counts[keep - 1];
+
+    // then, if there are still too many, some of those tied with the least popular kept
+    for (const bool tied : { false, true }) {
+        for (auto it = counts_.begin(); it != counts_.end() && counts_.size() > keep;) {
+            if (it->second < least || (tied && it->second == least))
+                it = counts_.erase(it);
+            else ++it;
+        }
+    }
+}
+
+
+// the previous server's counts carry on as ours, so what was popular before a restart still is after it
+void HotSet::load() {
+    std::ifstream input(path_);
+    std::string magic;
+    uint32_t version = 0;
+
+    if (!(input >> magic >> version) || magic != "ftp-hotset" || version != HOTSET_VERSION)
+        return;
+
+    double count;
+    std::string name;
+
+    while (input >> count && input.get() == ' ' && std::getline(input, name)) {
+        if (!name.empty())
+            counts_[name] = count;
+    }
+}
+
+
+void HotSet::run() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        load();
+    }
+
+    warm();
+
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(HOTSET_SAVE_MS));
+        save();
+    }
+}
+
+
+// the most popular files, into the page cache, until the budget runs out. Files too large for what's
+// left of it are passed over for smaller, less popular ones
+void HotSet::warm() {
+    static auto& warmedFiles = metrics::counter("hotset.warmed_files");
+    static auto& warmedBytes = metrics::counter("hotset.warmed_bytes");
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<std::string, double>> files;
+    uint64_t budget;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        files.assign(counts_.begin(), counts_.end());
+        budget = budgetBytes_;
+    }
+
+    if (files.empty())
+        return;
+
+    std::sort(files.begin(), files.end(), [](const std::pair<std::string, double>& a, const std::pair<std::string, double>& b) {
+        return a.second > b.second;
+    });
+
+    // this thread only: the clients arriving meanwhile matter more than getting it done
+    const auto tid = static_cast<id_t>(::syscall(SYS_gettid));
+
+    ::setpriority(PRIO_PROCESS, tid, 19);
+    ::syscall(SYS_ioprio_set, IOPRIO_WHO_THREAD, 0, IOPRIO_IDLE);
+
+    for (const auto& file : files) {
+        const int fd = ::open(file.first.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+
+        if (fd < 0)
+            continue;
+
+        const uint64_t size = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? static_cast<uint64_t>(st.st_size) : 0;
+
+        if (size > 0 && size <= budget) {
+            for (uint64_t offset = 0; offset < size; offset += HOTSET_WARM_CHUNK)
+                ::readahead(fd, static_cast<off64_t>(offset), static_cast<size_t>(std::min(HOTSET_WARM_CHUNK, size - offset)));
+
+            budget -= size;
+            ++warmedFiles;
+            warmedBytes += size;
+        }
+
+        ::close(fd);
+    }
+
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+    // readahead only has to start reading: the files arrive in memory in their own time
+    sync_cout.print("Hot set: reading ", warmedFiles.load(), " files (", warmedBytes.load() / (1024 * 1024), " MiB) into memory, queued in ", ms, " ms", sync_endl);
+}
+#endif
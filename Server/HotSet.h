@@ -0,0 +1,53 @@
+#pragma once
+#ifndef WIN32
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+// The files GET has been serving most, remembered across restarts so a new server doesn't start out
+// reading every one of them from disk. Each GET adds one to its file's count, and every time the
+// counts are saved (every HOTSET_SAVE_MS, and as the server exits) they're halved, so what was
+// popular an hour ago counts for little now. At startup, a thread of its own reads the files with
+// the highest counts into the page cache, most popular first, for as long as they fit the memory
+// budget; it runs at the lowest CPU and disk priority, so the clients arriving meanwhile come first.
+//
+// summary file: "ftp-hotset 1" on the first line, then "<count> <name>" on a line for each file,
+// most popular first
+class HotSet {
+    public:
+        static HotSet& shared();
+
+        // loads the summary at path, if there is one, and starts warming from it and saving to it.
+        // Nothing is recorded until this is called
+        void start(const std::string& path, uint64_t budgetBytes);
+
+        // a session is starting a GET of fileName
+        void record(const std::string& fileName);
+
+        // writes the summary out now, and decays the counts. False if it couldn't be written
+        bool save();
+
+    private:
+        std::mutex mutex_;
+        std::unordered_map<std::string, double> counts_;
+        std::string path_;                              // empty until started
+        uint64_t budgetBytes_;
+
+        HotSet() : budgetBytes_(0) {}
+
+        void load();
+        void run();
+        void warm();
+        void trim(size_t keep);
+
+        HotSet(const HotSet& other) = delete;
+        HotSet& operator=(const HotSet& other) = delete;
+};
+
+constexpr long HOTSET_SAVE_MS = 60000;
+constexpr size_t HOTSET_FILES = 1024;                       // saved, most popular first: more are counted between saves
+constexpr uint64_t HOTSET_BUDGET = 256ull * 1024 * 1024;    // read into the page cache at startup, unless FTP_HOTSET_MB says otherwise
+constexpr uint64_t HOTSET_WARM_CHUNK = 1024 * 1024;         // read ahead at a time, so the disk can serve others in between
+constexpr uint32_t HOTSET_VERSION = 1;
+#endif
@@ -0,0 +1,222 @@
+#include "pch.h"
+#ifndef WIN32
+#include <algorithm>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "Readahead.h"
+#include "StagedUpload.h"
+#include "Metrics.h"
+
+using namespace connection;
+
+
+Readahead& Readahead::shared() {
+    // never destroyed: its thread is still waiting for work as the process exits
+    static auto readahead = new Readahead();
+    return *readahead;
+}
+
+
+void Readahead::set_enabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    enabled_ = enabled;
+}
+
+
+bool Readahead::on_get(const std::string& previous, const std::string& fileName) {
+    static auto& hits = metrics::counter("readahead.hits");
+    static auto& dropped = metrics::counter("readahead.dropped");
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool hit = false;
+
+    if (!enabled_)
+        return false;
+
+    const auto warmed = warmed_.find(fileName);
+
+    if (warmed != warmed_.end()) {
+        hit = std::chrono::steady_clock::now() - warmed->second < std::chrono::milliseconds(READAHEAD_HIT_MS);
+
+        if (hit)
+            ++hits;
+
+        warmed_.erase(warmed);
+    }
+
+    if (queue_.size() >= READAHEAD_QUEUE_LIMIT) {
+        ++dropped;
+        return hit;
+    }
+
+    if (!started_) {
+        std::thread(&Readahead::run, this).detach();
+        started_ = true;
+    }
+
+    queue_.push_back(Get{ previous, fileName });
+    queued_.notify_one();
+
+    return hit;
+}
+
+
+void Readahead::run() {
+    static auto& predicted = metrics::counter("readahead.predicted");
+
+    while (true) {
+        Get get;
+        std::vector<std::string> next;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+
+            queued_.wait(lock, [this]() { return !queue_.empty(); });
+
+            get = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        predict(get, &next);
+
+        for (const auto& fileName : next) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                const auto now = std::chrono::steady_clock::now();
+                const auto warmed = warmed_.find(fileName);
+
+                // already on its way into the cache
+                if (warmed != warmed_.end() && now - warmed->second < std::chrono::milliseconds(READAHEAD_HIT_MS))
+                    continue;
+
+                if (warmed == warmed_.end())
+                    warmedOrder_.push_back(fileName);
+
+                warmed_[fileName] = now;
+
+                // a prediction nobody fetched in all this time was a miss
+                while (warmedOrder_.size() > READAHEAD_MEMORY) {
+                    warmed_.erase(warmedOrder_.front());
+                    warmedOrder_.pop_front();
+                }
+            }
+
+            ++predicted;
+            warm(fileName);
+        }
+    }
+}
+
+
+// what get suggests will be fetched next: whatever followed its file last time, and if its session
+// is going through a directory in name order, the names after it
+void Readahead::predict(const Get& get, std::vector<std::string>* next) {
+    const auto followed = followedBy_.find(get.fileName);
+
+    if (followed != followedBy_.end())
+        next->push_back(followed->second);
+
+    if (get.previous.empty() || get.previous == get.fileName)
+        return;
+
+    // for any session that fetches previous from now on. Records are forgotten oldest first
+    if (followedBy_.find(get.previous) == followedBy_.end())
+        followedOrder_.push_back(get.previous);
+
+    followedBy_[get.previous] = get.fileName;
+
+    while (followedOrder_.size() > READAHEAD_MEMORY) {
+        followedBy_.erase(followedOrder_.front());
+        followedOrder_.pop_front();
+    }
+
+    std::vector<std::string> after;
+
+    // previous may be the last name there is, with nothing after it
+    if (successors(get.previous, 1, &after) && !after.empty() && after.front() == get.fileName && successors(get.fileName, READAHEAD_DEPTH, &after)) {
+        for (size_t i = 1; i < after.size(); ++i) {
+            if (std::find(next->begin(), next->end(), after[i]) == next->end())
+                next->push_back(after[i]);
+        }
+    }
+}
+
+
+// appends to next up to count names that come after fileName in its directory. The directory is
+// listed again only once it has changed. False if it can't be listed
+bool Readahead::successors(const std::string& fileName, size_t count, std::vector<std::string>* next) {
+    const auto slash = fileName.rfind('/');
+    const auto directory = slash == std::string::npos ? std::string(".") : fileName.substr(0, slash);
+    const auto prefix = slash == std::string::npos ? std::string() : fileName.substr(0, slash + 1);
+    const auto name = fileName.substr(prefix.length());
+    struct stat st;
+
+    if (::stat(directory.c_str(), &st) != 0)
+        return false;
+
+    const auto modified = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    auto& listing = listings_[directory];
+
+    if (listing.names.empty() || listing.modified != modified) {
+        DIR* dir = ::opendir(directory.c_str());
+
+        if (!dir) {
+            listings_.erase(directory);
+            return false;
+        }
+
+        listing.modified = modified;
+        listing.names.clear();
+
+        while (const auto entry = ::readdir(dir)) {
+            struct stat entrySt;
+
+            if (is_staging_name(entry->d_name))
+                continue;
+
+            // some filesystems (XFS without ftype, many network ones) don't say what an entry is
+            const bool regular = entry->d_type == DT_UNKNOWN ?
+                ::fstatat(dirfd(dir), entry->d_name, &entrySt, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(entrySt.st_mode) :
+                entry->d_type == DT_REG;
+
+            if (regular)
+                listing.names.push_back(entry->d_name);
+        }
+
+        ::closedir(dir);
+        std::sort(listing.names.begin(), listing.names.end());
+
+        // directories are few; if not, start over rather than tracking which were used last
+        if (listings_.size() > READAHEAD_MEMORY) {
+            Listing kept = std::move(listing);
+
+            listings_.clear();
+            listings_[directory] = std::move(kept);
+        }
+    }
+
+    const auto& names = listings_[directory].names;
+
+    for (auto it = std::upper_bound(names.begin(), names.end(), name); it != names.end() && count > 0; ++it, --count)
+        next->push_back(prefix + *it);
+
+    return true;
+}
+
+
+// the beginning of fileName, into the page cache. readahead(2) may block while the disk catches up,
+// which is why this is never done on the way to answering a GET
+void Readahead::warm(const std::string& fileName) {
+    const int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return;
+
+    if (::readahead(fd, 0, READAHEAD_WINDOW) != 0)
+        ::posix_fadvise(fd, 0, static_cast<off_t>(READAHEAD_WINDOW), POSIX_FADV_WILLNEED);
+
+    ::close(fd);
+}
+#endif
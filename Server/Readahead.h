@@ -0,0 +1,72 @@
+#pragma once
+#ifndef WIN32
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+// Guesses which files GET will be asked for next and has the system read their beginnings into the
+// page cache beforehand, so the first bytes of each go out without waiting on the disk. Two patterns
+// are recognised: a session fetching a directory's files in name order (part-0001, part-0002, ...)
+// is predicted to carry on with the next READAHEAD_DEPTH names, and a file that one session fetched
+// straight after another is predicted to follow it again when any session fetches the first.
+// Predicting and warming happen on a thread of their own: a GET only hands over its file's name
+class Readahead {
+    public:
+        static Readahead& shared();
+
+        // a session is starting a GET of fileName; previous is the file it fetched before, if any.
+        // True if fileName was warmed for it
+        bool on_get(const std::string& previous, const std::string& fileName);
+
+        void set_enabled(bool enabled);
+
+    private:
+        struct Get {
+            std::string previous;
+            std::string fileName;
+        };
+
+        struct Listing {
+            int64_t modified;                           // the directory's mtime, in ns, when it was listed
+            std::vector<std::string> names;             // sorted
+        };
+
+        std::mutex mutex_;
+        std::condition_variable queued_;
+        std::deque<Get> queue_;
+        bool enabled_;
+        bool started_;
+
+        // files warmed and not yet fetched, and when: fetching one within READAHEAD_HIT_MS is a hit.
+        // One not fetched by then has probably left the cache again, and may be warmed again
+        std::map<std::string, std::chrono::steady_clock::time_point> warmed_;
+        std::deque<std::string> warmedOrder_;           // oldest first
+
+        // only the thread touches these
+        std::unordered_map<std::string, std::string> followedBy_;      // file -> the one fetched straight after it
+        std::deque<std::string> followedOrder_;
+        std::map<std::string, Listing> listings_;                      // by directory
+
+        Readahead() : enabled_(true), started_(false) {}
+
+        void run();
+        void predict(const Get& get, std::vector<std::string>* next);
+        bool successors(const std::string& fileName, size_t count, std::vector<std::string>* next);
+        void warm(const std::string& fileName);
+
+        Readahead(const Readahead& other) = delete;
+        Readahead& operator=(const Readahead& other) = delete;
+};
+
+constexpr size_t READAHEAD_DEPTH = 2;                       // files predicted ahead of a session fetching in name order
+constexpr uint64_t READAHEAD_WINDOW = 256 * 1024;           // how much of each predicted file is read ahead: the kernel's own readahead takes over from there
+constexpr long READAHEAD_HIT_MS = 10000;                    // how long a warmed file is expected to stay in the cache
+constexpr size_t READAHEAD_QUEUE_LIMIT = 256;               // GETs waiting to be predicted from; past this they're dropped
+constexpr size_t READAHEAD_MEMORY = 4096;                   // files remembered, for each kind of record kept
+#endif
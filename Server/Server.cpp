@@ -2,27 +2,64 @@
 #include <iostream>
 #include <thread>
 #include <atomic>
+#include <chrono>
 #include "NetworkDataStream.h"
 #include "Connection.h"
 #include "ProtocolVer.h"
 #include "SyncStream.h"
 #include "ClientSession.h"
+#include "Metrics.h"
+#include "BufferPool.h"
+#include "HotRestart.h"
+#include "SocketCompat.h"
+#include "SessionTable.h"
+#include "Trace.h"
 #ifndef WIN32
 #include <signal.h>
 #include <string.h>
+#include "ArchiveFs.h"
+#include "Durability.h"
+#include "DirectoryWatch.h"
+#include "FileCache.h"
+#include "FileWatch.h"
+#include "HotSet.h"
+#include "Readahead.h"
+#include "StagedUpload.h"
 #endif
 
 using namespace std;
 using namespace connection;
 
 atomic_bool g_run = true;
+atomic_bool g_dumpMetrics = false;
+atomic_bool g_flushTrace = false;
+
+constexpr long SESSION_DRAIN_POLL_MS = 100;
 
 void serve_client(Connection::Ptr client);
+void resume_client(Connection::Ptr client, const HotRestart::SessionState& state);
+void park_session(const HotRestart::SessionState& state);
+void begin_handoff(const std::string& handoffPath, socket_t welcomeSocket);
+void listen_local(const std::string& path);
 bool accept_error(const ConnectionException& ce);
 void listen_begins(const std::string& hostName, port_t port);
 void set_interrupt();
 
+void print_metrics() {
+    sync_cout.print("metrics: ", metrics::snapshot(), sync_endl);
+}
+
 bool continue_listening() {
+    // polled regularly by the welcome loop, which makes it a convenient place
+    // to service requests from signal handlers
+    if (g_dumpMetrics.exchange(false))
+        print_metrics();
+
+    if (g_flushTrace.exchange(false))
+        trace::flush();
+
+    SessionTable::shared().expire();
+
     return !g_run.load();
 }
 
@@ -43,11 +80,14 @@ inline string getExe(const char* str) {
 int main(int argc, const char** argv) {
     const auto exeName = getExe(*argv);
 
-    if (argc != 2) {
-        cerr << exeName << " usage: " << exeName << " <PORT>" << endl;
+    if (argc != 2 && argc != 3) {
+        cerr << exeName << " usage: " << exeName << " <PORT> [HANDOFF PATH]" << endl;
+        cerr << "\tstarting with the HANDOFF PATH of a running server takes over from it without dropping connections" << endl;
         return EXIT_FAILURE;
     }
 
+    const std::string handoffPath = argc == 3 ? argv[2] : "";
+
     int port = 0;
 
     // technically zero is a valid port, although it would be an odd choice
@@ -58,6 +98,75 @@ int main(int argc, const char** argv) {
 
     Connection::initialize();
 
+    // transfer buffers come from reserved hugepages only when asked for: they must be set
+    // aside by the administrator (vm.nr_hugepages) and are otherwise silently unavailable
+    if (getenv("FTP_HUGEPAGES"))
+        BufferPool::shared().use_huge_pages(true);
+
+    // clients on this host can also connect over a Unix domain socket and have files passed to them
+    // as descriptors instead of copied through TCP loopback
+    const char* localPath = getenv("FTP_LOCAL_SOCKET");
+
+#ifndef WIN32
+    // tar and zip files in the server's directory are served member by member, their indexes kept here
+    if (const char* indexDir = getenv("FTP_ARCHIVES"))
+        ArchiveFs::shared().mount_all(indexDir);
+
+    // how many files GET keeps open to serve again (see FileCache.h)
+    const char* fdCache = getenv("FTP_FD_CACHE");
+
+    if (fdCache && *fdCache)
+        FileCache::shared().set_capacity(strtoul(fdCache, nullptr, 10));
+
+    // files GET is predicted to be asked for next are read into the page cache ahead of time (see Readahead.h)
+    const char* readahead = getenv("FTP_READAHEAD");
+
+    if (readahead && strcmp(readahead, "off") == 0) {
+        Readahead::shared().set_enabled(false);
+        sync_cout.print("Readahead: off", sync_endl);
+    }
+
+    // the files served most are remembered here, and read into memory again after a restart (see HotSet.h)
+    if (const char* hotSet = getenv("FTP_HOTSET")) {
+        const char* budgetMb = getenv("FTP_HOTSET_MB");
+
+        HotSet::shared().start(hotSet, budgetMb ? strtoull(budgetMb, nullptr, 10) * 1024 * 1024 : HOTSET_BUDGET);
+    }
+
+    // how uploads are made to survive a crash before they're confirmed (see Durability.h)
+    const char* durability = getenv("FTP_DURABILITY");
+
+    if (durability && *durability) {
+        DurabilityMode mode;
+
+        if (!parse_durability(durability, &mode)) {
+            cerr << "FTP_DURABILITY must be none, close or group, not '" << durability << "'" << endl;
+            Connection::deinitialize();
+            return EXIT_FAILURE;
+        }
+
+        const char* window = getenv("FTP_COMMIT_WINDOW_US");
+
+        Durability::shared().configure(mode, window ? atol(window) : 0);
+        sync_cout.print("Upload durability: ", to_string(mode), sync_endl);
+    }
+#endif
+
+    // how long a session whose connection dropped is kept for its client to resume (see SessionTable.h)
+    const char* resumeTtl = getenv("FTP_RESUME_TTL_MS");
+
+    if (resumeTtl && *resumeTtl)
+        SessionTable::shared().set_ttl(atol(resumeTtl));
+
+    // where each command's time goes, phase by phase, as Chrome trace events (see Trace.h)
+    if (const char* tracePath = getenv("FTP_TRACE")) {
+        const char* flushMs = getenv("FTP_TRACE_FLUSH_MS");
+
+        if (trace::start(tracePath, exeName, flushMs ? atol(flushMs) : 0))
+            sync_cout.print("Tracing to ", tracePath, sync_endl);
+        else sync_cerr.print("Can't trace to ", tracePath, ": it can't be written to", sync_endl);
+    }
+
     // allow server to be closed with ctrl+c
     set_interrupt();
 
@@ -70,9 +179,43 @@ int main(int argc, const char** argv) {
     };
 
     try {
+        socket_t welcomeSocket = INVALID_SOCKET;
+
+        if (!handoffPath.empty()) {
+            // once the old server has handed over all of its sessions and exited, we
+            // become the one offering a handoff to whoever comes next
+            welcomeSocket = HotRestart::take_over(handoffPath, resume_client, park_session, [handoffPath, localPath](socket_t inherited) {
+                sync_cout.print("Previous server has exited", sync_endl);
+                begin_handoff(handoffPath, inherited);
+
+                // only now: the previous server removes its socket file as it stops listening
+                if (localPath)
+                    listen_local(localPath);
+            });
+
+            if (welcomeSocket != INVALID_SOCKET)
+                sync_cout.print("Took over listening socket from running server", sync_endl);
+        }
+
+        if (welcomeSocket == INVALID_SOCKET) {
+            welcomeSocket = Connection::create_welcome_socket(static_cast<port_t>(port));
+
+#ifndef WIN32
+            // with the port ours and no server before us still running, any staged upload was left by one that died
+            if (const auto stale = remove_staging_files())
+                sync_cout.print("Removed ", stale, " unfinished uploads left behind by an earlier server", sync_endl);
+#endif
+
+            if (!handoffPath.empty())
+                begin_handoff(handoffPath, welcomeSocket);
+
+            if (localPath)
+                listen_local(localPath);
+        }
+
         // blocks until interrupted: every time a client connects, cest
         // callback will be used (on same thread)
-        Connection::welcome(port, lquery, screate, cest, ecallback);
+        Connection::welcome_on(welcomeSocket, lquery, screate, cest, ecallback);
     }
     catch (const ConnectionException& e) {
         sync_cerr.print("Unhandled error: ", e.what(), sync_endl);
@@ -80,16 +223,76 @@ int main(int argc, const char** argv) {
         return EXIT_FAILURE;
     }
 
+    // after a handoff, sessions still mid-command finish up and move across before we exit
+    if (HotRestart::in_progress()) {
+        sync_cout.print("Handed off to new server, draining ", metrics::counter("server.sessions").load(), " sessions", sync_endl);
+
+        while (metrics::counter("server.sessions").load() > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(SESSION_DRAIN_POLL_MS));
+    }
+
+#ifndef WIN32
+    // what was served since the last save would otherwise be lost to the next server
+    HotSet::shared().save();
+#endif
+
+    trace::finish();
+    print_metrics();
+
     Connection::deinitialize();
     return EXIT_SUCCESS;
 }
 
 
-void serve_client(Connection::Ptr client) {
-    sync_cout.print("Client ", client->identify_remote(), " has connected", sync_endl);
+void begin_handoff(const std::string& handoffPath, socket_t welcomeSocket) {
+    HotRestart::serve_handoff(handoffPath, welcomeSocket, []() {
+        sync_cout.print("New server has taken over the listening socket", sync_endl);
+        g_run.store(false);
+
+        // clients whose connections dropped come back to the new server now
+        if (const auto parked = SessionTable::shared().hand_off_all())
+            sync_cout.print("Handed off ", parked, " sessions waiting for their clients", sync_endl);
+
+#ifndef WIN32
+        // watching and following sessions are never idle: ending their watches lets them move across
+        DirectoryWatch::shared().cancel_all();
+        FileWatch::shared().cancel_all();
+#endif
+    });
+}
+
+
+void listen_local(const std::string& path) {
+#ifndef WIN32
+    std::thread([path]() {
+        Connection::StopListeningQuery lquery = []() { return !g_run.load(); };
+        Connection::ErrorCallback ecallback = accept_error;
+        Connection::ConnectionEstablishedCallback cest = [](Connection::Ptr client) {
+            std::thread(serve_client, client).detach();
+        };
+
+        try {
+            sync_cout.print("Local clients can connect on ", path, sync_endl);
+            Connection::welcome_local(path, lquery, cest, ecallback);
+        }
+        catch (const ConnectionException& e) {
+            sync_cerr.print("Local socket ", path, " failed: ", e.what(), sync_endl);
+        }
+    }).detach();
+#else
+    sync_cerr.print("Local sockets are not supported on this platform", sync_endl);
+#endif
+}
+
+
+void run_session(Connection::Ptr client, std::shared_ptr<ClientSession> session) {
+    static auto& sessions = metrics::counter("server.sessions");
+    ++sessions;
+
+    trace::name_thread(client->identify_remote());
 
     try {
-        ClientSession(client).serve();
+        session->serve();
     }
     catch (const std::exception& e) {
         sync_cerr.print("Error caused by ", client->identify_remote(), "\n\t", e.what(), sync_endl);
@@ -97,12 +300,33 @@ void serve_client(Connection::Ptr client) {
 
     try {
         sync_cout.print("Closing connection to ", client->identify_remote(), "...", sync_endl);
+        session.reset();
         client.reset();
     }
     catch (...) {
         // swallow all exceptions: something has broken, so a graceful shutdown is 
         // probably not going to happen
     }
+
+    --sessions;
+}
+
+
+void serve_client(Connection::Ptr client) {
+    sync_cout.print("Client ", client->identify_remote(), " has connected", sync_endl);
+    run_session(client, std::make_shared<ClientSession>(client));
+}
+
+
+void resume_client(Connection::Ptr client, const HotRestart::SessionState& state) {
+    sync_cout.print("Client ", client->identify_remote(), " has been handed over from previous server", sync_endl);
+
+    std::thread(run_session, client, std::make_shared<ClientSession>(client, state)).detach();
+}
+
+
+void park_session(const HotRestart::SessionState& state) {
+    SessionTable::shared().park(state.token, ParkedSession{ adopt_uploads(state.uploads) });
 }
 
 
@@ -120,6 +344,10 @@ void listen_begins(const std::string& hostName, port_t port) {
 void on_signal(int sig) {
     if (sig == SIGINT)
         g_run.store(false);
+    else if (sig == SIGUSR1)
+        g_dumpMetrics.store(true);
+    else if (sig == SIGUSR2)
+        g_flushTrace.store(true);
 }
 #endif
 
@@ -135,5 +363,11 @@ void set_interrupt() {
     }, TRUE);
 #else
     signal(SIGINT, on_signal);
+    signal(SIGUSR1, on_signal); // kill -USR1 prints current metrics
+    signal(SIGUSR2, on_signal); // kill -USR2 writes out the spans traced so far
+
+    // a client whose connection drops mid-transfer is an error on its session, not the end of the
+    // server: the session can still be parked for the client to resume
+    signal(SIGPIPE, SIG_IGN);
 #endif
 }
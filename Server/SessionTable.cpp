@@ -0,0 +1,172 @@
+#include "pch.h"
+#include <random>
+#include <iomanip>
+#include <sstream>
+#include "SessionTable.h"
+#include "StagedUpload.h"
+#include "Metrics.h"
+#include "SyncStream.h"
+
+using namespace connection;
+
+
+static metrics::Counter& parked_metric() {
+    static auto& count = metrics::counter("sessions.parked");
+    return count;
+}
+
+
+SessionTable& SessionTable::shared() {
+    static SessionTable table;
+    return table;
+}
+
+
+SessionTable::SessionTable() : ttlMs_(SESSION_RESUME_TTL_MS) {}
+
+
+std::string SessionTable::new_token() {
+    static std::mutex mutex;
+    static std::random_device random;
+    std::ostringstream token;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    token << std::hex << std::setfill('0');
+
+    for (int i = 0; i < 4; ++i)
+        token << std::setw(8) << static_cast<uint32_t>(random());
+
+    return token.str();
+}
+
+
+void SessionTable::park(const std::string& token, ParkedSession session) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto now = Clock::now();
+
+    evict_expired(now);
+
+    if (parked_.size() >= SESSION_TABLE_CAPACITY)
+        evict(parked_.find(byAge_.front()));
+
+    byAge_.push_back(token);
+    parked_[token] = Entry{ std::move(session), now + std::chrono::milliseconds(ttlMs_), std::prev(byAge_.end()) };
+
+    ++parked_metric();
+}
+
+
+bool SessionTable::resume(const std::string& token, ParkedSession* session) {
+    static auto& resumed = metrics::counter("sessions.resumed");
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    evict_expired(Clock::now());
+
+    const auto it = parked_.find(token);
+
+    if (it == parked_.end())
+        return false;
+
+    *session = std::move(it->second.session);
+
+    byAge_.erase(it->second.age);
+    parked_.erase(it);
+
+    --parked_metric();
+    ++resumed;
+
+    return true;
+}
+
+
+size_t SessionTable::hand_off_all() {
+    std::map<std::string, Entry> parked;
+    size_t handedOff = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        parked.swap(parked_);
+        byAge_.clear();
+    }
+
+    for (const auto& entry : parked) {
+        HotRestart::SessionState state{ 0, 0, entry.first, describe_uploads(entry.second.session.uploads) };
+
+        --parked_metric();
+
+        if (HotRestart::hand_off_parked(&state)) {
+            disown_uploads(entry.second.session.uploads, state.uploads);
+            ++handedOff;
+        }
+    }
+
+    return handedOff;
+}
+
+
+void SessionTable::expire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    evict_expired(Clock::now());
+}
+
+
+// every session parked for the same time, so they expire in the order they were parked
+void SessionTable::evict_expired(Clock::time_point now) {
+    while (!byAge_.empty()) {
+        const auto it = parked_.find(byAge_.front());
+
+        if (it->second.expires > now)
+            break;
+
+        evict(it);
+    }
+}
+
+
+// the session's half-done uploads go with it, staging files and all
+void SessionTable::evict(std::map<std::string, Entry>::iterator it) {
+    static auto& evicted = metrics::counter("sessions.evicted");
+
+    byAge_.erase(it->second.age);
+    parked_.erase(it);
+
+    --parked_metric();
+    ++evicted;
+}
+
+
+std::vector<HotRestart::UploadState> describe_uploads(const std::map<std::string, StagedUpload::Ptr>& uploads) {
+    std::vector<HotRestart::UploadState> states;
+
+    for (const auto& upload : uploads)
+        states.push_back(HotRestart::UploadState{ upload.first, upload.second->staging_name(), upload.second->size(), upload.second->claimed() });
+
+    return states;
+}
+
+
+std::map<std::string, StagedUpload::Ptr> adopt_uploads(const std::vector<HotRestart::UploadState>& states) {
+    std::map<std::string, StagedUpload::Ptr> uploads;
+
+    for (const auto& state : states) {
+        MSGECODE code = MSGECODE::ERR_UNKNOWN;
+
+        if (auto upload = StagedUpload::adopt(state.name, state.stagingName, state.size, state.written, &code))
+            uploads[state.name] = upload;
+        else sync_cerr.print("hot restart: couldn't carry on with the upload of ", state.name, ": ", strecode(code), sync_endl);
+    }
+
+    return uploads;
+}
+
+
+void disown_uploads(const std::map<std::string, StagedUpload::Ptr>& uploads, const std::vector<HotRestart::UploadState>& handedOff) {
+    for (const auto& state : handedOff) {
+        const auto it = uploads.find(state.name);
+
+        if (it != uploads.end())
+            it->second->disown();
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <chrono>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "HotRestart.h"
+
+class StagedUpload;
+
+// what a dropped session leaves behind for its client to pick up again
+struct ParkedSession {
+    std::map<std::string, std::shared_ptr<StagedUpload>> uploads;   // cut off partway, by file name
+};
+
+
+// a session's interrupted uploads as a hot restart passes them to the next process
+std::vector<HotRestart::UploadState> describe_uploads(const std::map<std::string, std::shared_ptr<StagedUpload>>& uploads);
+
+// the next process's side: takes over the hidden files of uploads that were passed across
+std::map<std::string, std::shared_ptr<StagedUpload>> adopt_uploads(const std::vector<HotRestart::UploadState>& states);
+
+// once they've been passed across, leaves the hidden files of those uploads for the next process
+void disown_uploads(const std::map<std::string, std::shared_ptr<StagedUpload>>& uploads, const std::vector<HotRestart::UploadState>& handedOff);
+
+
+// Sessions whose connection dropped, kept for a while under the token their greeting gave the
+// client (see SessionResume.h). A client that reconnects and presents the token in time takes its
+// session back out; one that doesn't come back loses it, and any upload it left half done, once the
+// session expires. The table holds at most a fixed number of sessions, dropping the oldest to make
+// room for a new one
+class SessionTable {
+    public:
+        static SessionTable& shared();
+
+        // 128 random bits, in hex: hard enough to guess that holding one is proof of being the client
+        static std::string new_token();
+
+        void park(const std::string& token, ParkedSession session);
+
+        // takes the session parked under token out of the table. False if there is none, or it has expired
+        bool resume(const std::string& token, ParkedSession* session);
+
+        // drops the sessions whose clients didn't come back in time, and the uploads they left. Called
+        // as the server polls for connections, so they go even if nothing is parked or resumed for a while
+        void expire();
+
+        // passes every parked session to the server taking over from this one, where it waits its
+        // full time again. Returns how many went; any that couldn't go are dropped with this process
+        size_t hand_off_all();
+
+        void set_ttl(long ttlMs) { ttlMs_ = ttlMs; }
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Entry {
+            ParkedSession session;
+            Clock::time_point expires;
+            std::list<std::string>::iterator age;       // place in byAge_
+        };
+
+        std::mutex mutex_;
+        std::map<std::string, Entry> parked_;
+        std::list<std::string> byAge_;                  // tokens, oldest first: the order they expire in
+        long ttlMs_;
+
+        SessionTable();
+
+        void evict_expired(Clock::time_point now);
+        void evict(std::map<std::string, Entry>::iterator it);
+
+        SessionTable(const SessionTable& other) = delete;
+        SessionTable& operator=(const SessionTable& other) = delete;
+};
+
+constexpr size_t SESSION_TABLE_CAPACITY = 1024;
+constexpr long SESSION_RESUME_TTL_MS = 60000;       // how long a dropped session waits for its client, unless FTP_RESUME_TTL_MS says otherwise
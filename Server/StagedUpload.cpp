@@ -0,0 +1,393 @@
+#include "pch.h"
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <random>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "StagedUpload.h"
+#include "BufferPool.h"
+
+#ifndef WIN32
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Durability.h"
+#endif
+
+using namespace connection;
+
+
+// a name nothing else will pick: the process is random each run, the counter within it
+static std::string next_staging_name() {
+    static const auto run = std::random_device()();
+    static std::atomic<uint64_t> counter(0);
+
+    return STAGING_PREFIX + std::to_string(run) + "-" + std::to_string(++counter);
+}
+
+
+// the directory name is in, as a path to open, and the prefix to put a sibling's name behind
+static std::string directory_of(const std::string& name, std::string* prefix = nullptr) {
+    const auto slash = name.rfind('/');
+
+    if (prefix)
+        *prefix = slash == std::string::npos ? std::string() : name.substr(0, slash + 1);
+
+    return slash == std::string::npos ? "." : slash == 0 ? "/" : name.substr(0, slash);
+}
+
+
+bool is_staging_name(const std::string& name) {
+    return name.compare(0, strlen(STAGING_PREFIX), STAGING_PREFIX) == 0;
+}
+
+
+// one file of an MPUT bundle, written in order as it arrives
+class StagedBundleSink : public BundleSink {
+    StagedUpload::Ptr upload_;
+    uint64_t at_;
+
+    public:
+        explicit StagedBundleSink(StagedUpload::Ptr upload) : upload_(std::move(upload)), at_(0) {}
+
+        bool write(const char* data, size_t len) override {
+            if (!upload_->write_at(at_, data, len))
+                return false;
+
+            at_ += len;
+            return true;
+        }
+
+        std::string commit(uint32_t mode) override {
+            upload_->set_mode(mode);
+            return upload_->commit();
+        }
+};
+
+
+BundleSink::Ptr stage_bundle_entry(const BundleEntry& entry, const std::string& path, std::string* reason) {
+    MSGECODE code = MSGECODE::ERR_UNKNOWN;
+
+    if (is_staging_name(entry.name)) {
+        *reason = connection::strecode(MSGECODE::ERR_INVALID_FILENAME);
+        return nullptr;
+    }
+
+    auto upload = StagedUpload::create(path, entry.size, &code);
+
+    if (!upload) {
+        *reason = connection::strecode(code);
+        return nullptr;
+    }
+
+    return BundleSink::Ptr(new StagedBundleSink(std::move(upload)));
+}
+
+
+#ifndef WIN32
+size_t remove_staging_files() {
+    DIR* dir = ::opendir(".");
+    size_t removed = 0;
+
+    if (dir == nullptr)
+        return 0;
+
+    while (const auto* entry = ::readdir(dir)) {
+        if (is_staging_name(entry->d_name) && ::unlinkat(dirfd(dir), entry->d_name, 0) == 0)
+            ++removed;
+    }
+
+    ::closedir(dir);
+    return removed;
+}
+#endif
+
+
+StagedUpload::Ptr StagedUpload::create(const std::string& name, uint64_t size, MSGECODE* code) {
+    struct stat st;
+    std::string prefix;
+
+    directory_of(name, &prefix);
+
+    // checked again when it's renamed, in case name turns up in the meantime. A symbolic link
+    // counts, even one to nothing
+#ifdef WIN32
+    if (::stat(name.c_str(), &st) == 0) {
+#else
+    if (::lstat(name.c_str(), &st) == 0) {
+#endif
+        *code = MSGECODE::ERR_ALREADY_EXISTS;
+        return nullptr;
+    }
+
+    Ptr upload(new StagedUpload(name, prefix + next_staging_name(), size));
+
+#ifdef WIN32
+    upload->file_.open(upload->stagingName_, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+
+    if (!upload->file_.is_open()) {
+        *code = MSGECODE::ERR_FAILED_TO_OPEN;
+        return nullptr;
+    }
+#else
+    upload->fd_ = ::open(upload->stagingName_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+
+    if (upload->fd_ < 0) {
+        *code = MSGECODE::ERR_FAILED_TO_OPEN;
+        return nullptr;
+    }
+
+    // reserving the space up front keeps ranges written out of order from fragmenting the file,
+    // and turns a full disk into a refusal now rather than a failure halfway through
+    if (size >= STAGING_PREALLOCATE_MIN && ::fallocate(upload->fd_, 0, 0, static_cast<off_t>(size)) != 0 && errno == ENOSPC) {
+        *code = MSGECODE::ERR_FAILED_TO_OPEN;
+        return nullptr;
+    }
+#endif
+
+    return upload;
+}
+
+
+StagedUpload::Ptr StagedUpload::adopt(const std::string& name, const std::string& stagingName, uint64_t size,
+                                      const std::vector<std::pair<uint64_t, uint64_t>>& claimed, MSGECODE* code) {
+    Ptr upload(new StagedUpload(name, stagingName, size));
+
+#ifdef WIN32
+    upload->file_.open(stagingName, std::ios::binary | std::ios::in | std::ios::out);
+
+    if (!upload->file_.is_open()) {
+#else
+    upload->fd_ = ::open(stagingName.c_str(), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+
+    if (upload->fd_ < 0) {
+#endif
+        upload->disowned_ = true; // not ours to remove, whatever it is
+        *code = MSGECODE::ERR_DOES_NOT_EXIST;
+        return nullptr;
+    }
+
+    for (const auto& range : claimed) {
+        if (!upload->claim(range.first, range.second)) {
+            *code = MSGECODE::ERR_INVALID_FILENAME;
+            return nullptr;
+        }
+
+        upload->arrived(range.second);
+    }
+
+    return upload;
+}
+
+
+StagedUpload::StagedUpload(const std::string& name, const std::string& stagingName, uint64_t size)
+    : name_(name), stagingName_(stagingName), size_(size),
+#ifndef WIN32
+    fd_(-1),
+#endif
+    written_(0), committed_(false), disowned_(false) {}
+
+
+StagedUpload::~StagedUpload() {
+#ifdef WIN32
+    file_.close();
+#else
+    if (fd_ >= 0)
+        ::close(fd_);
+#endif
+
+    if (!committed_ && !disowned_)
+        ::remove(stagingName_.c_str());
+}
+
+
+bool StagedUpload::claim(uint64_t offset, uint64_t len) {
+    if (offset > size_ || len > size_ - offset)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // the first range starting at or after offset mustn't start before this one ends, and the one
+    // before it mustn't end after this one starts
+    const auto next = claimed_.lower_bound(offset);
+
+    if (next != claimed_.end() && next->first < offset + len)
+        return false;
+
+    if (next != claimed_.begin() && std::prev(next)->second > offset)
+        return false;
+
+    claimed_[offset] = offset + len;
+    return true;
+}
+
+
+void StagedUpload::release(uint64_t offset, uint64_t kept) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    const auto it = claimed_.find(offset);
+
+    if (it == claimed_.end())
+        return;
+
+    if (kept == 0)
+        claimed_.erase(it);
+    else it->second = std::min(it->second, offset + kept);
+}
+
+
+std::vector<std::pair<uint64_t, uint64_t>> StagedUpload::missing() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<uint64_t, uint64_t>> gaps;
+    uint64_t at = 0;
+
+    for (const auto& range : claimed_) {
+        if (range.first > at)
+            gaps.emplace_back(at, range.first - at);
+
+        at = std::max(at, range.second);
+    }
+
+    if (at < size_)
+        gaps.emplace_back(at, size_ - at);
+
+    return gaps;
+}
+
+
+std::vector<std::pair<uint64_t, uint64_t>> StagedUpload::claimed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+
+    for (const auto& range : claimed_) {
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == range.first)
+            ranges.back().second += range.second - range.first;
+        else if (range.second > range.first)
+            ranges.emplace_back(range.first, range.second - range.first);
+    }
+
+    return ranges;
+}
+
+
+uint64_t StagedUpload::receive(Connection& channel, uint64_t offset, uint64_t len) {
+    auto lease = BufferPool::shared().acquire();
+    uint64_t done = 0;
+
+    try {
+        while (done < len) {
+            const auto want = static_cast<int>(std::min<uint64_t>(len - done, lease.size()));
+            const auto got = channel.transport().receive(lease.data(), want, Connection::TIMEOUT_NEVER, nullptr);
+
+            if (got <= 0 || !write_at(offset + done, lease.data(), static_cast<size_t>(got)))
+                break;
+
+            done += static_cast<uint64_t>(got);
+        }
+    }
+    catch (const ConnectionException&) {
+        // what was written before the connection failed stays written
+    }
+
+    return done;
+}
+
+
+bool StagedUpload::write_at(uint64_t offset, const char* data, size_t len) {
+#ifdef WIN32
+    // one position for the whole file, so ranges take turns
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    file_.seekp(static_cast<std::streamoff>(offset));
+    file_.write(data, static_cast<std::streamsize>(len));
+
+    return file_.good();
+#else
+    while (len > 0) {
+        const auto wrote = ::pwrite(fd_, data, len, static_cast<off_t>(offset));
+
+        if (wrote < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        data += wrote;
+        len -= static_cast<size_t>(wrote);
+        offset += static_cast<uint64_t>(wrote);
+    }
+
+    return true;
+#endif
+}
+
+
+void StagedUpload::set_mode(uint32_t mode) {
+#ifdef WIN32
+    (void)mode;
+#else
+    ::fchmod(fd_, mode);
+#endif
+}
+
+
+bool StagedUpload::arrived(uint64_t len) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    written_ += len;
+    return written_ == size_;
+}
+
+
+std::string StagedUpload::commit() {
+#ifdef WIN32
+    file_.close();
+
+    if (!file_)
+        return "failed to write " + name_;
+
+    // unlike POSIX, rename here won't replace an existing file
+    if (::rename(stagingName_.c_str(), name_.c_str()) != 0)
+        return "failed to put " + name_ + " in place: it may already exist";
+
+    committed_ = true;
+#else
+    std::string error;
+
+    // one request to Durability: the contents are made safe before the name is, or a crash could
+    // leave name with a hole in it, and the directory after, so the name itself survives one
+    const bool durable = Durability::shared().commit(fd_, directory_of(name_), &error, [this]() { return put_in_place(); });
+
+    ::close(fd_);
+    fd_ = -1;
+
+    if (!durable)
+        return error;
+#endif
+
+    return std::string();
+}
+
+
+#ifndef WIN32
+std::string StagedUpload::put_in_place() {
+    // plain rename() would silently replace a file uploaded under the same name meanwhile
+    if (::renameat2(AT_FDCWD, stagingName_.c_str(), AT_FDCWD, name_.c_str(), RENAME_NOREPLACE) != 0) {
+        if (errno == EEXIST)
+            return name_ + " already exists";
+
+        // a filesystem that can't rename without replacing can still link without replacing
+        if (errno != EINVAL || ::link(stagingName_.c_str(), name_.c_str()) != 0)
+            return "failed to put " + name_ + " in place: " + strerror(errno);
+
+        ::unlink(stagingName_.c_str());
+    }
+
+    committed_ = true;
+    return std::string();
+}
+#endif
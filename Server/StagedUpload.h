@@ -0,0 +1,129 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#ifdef WIN32
+#include <fstream>
+#endif
+#include "Connection.h"
+#include "FileBundle.h"
+#include "Message.h"
+
+// An upload is written to a hidden file beside its destination and only renamed to its own name
+// once every byte has arrived (and been synced, if the server keeps uploads durable), so a GET,
+// LS or MGET sees either the whole file or nothing, and an upload that fails leaves nothing
+// behind. The rename won't replace a file that appeared in the meantime.
+//
+// A parallel upload sends disjoint ranges of one file as separate PUTs, each on a stream of its
+// own. They share one StagedUpload, written with pwrite wherever each range lands, and whichever
+// range completes the file puts it in place. A range cut short leaves a gap the same range (or
+// the rest of it) can fill later, as a resumed session does after its connection dropped.
+//
+// MPUT stages each file of its bundle the same way, and COPY (and MOVE, when it has to copy)
+// fills one straight from the file being copied
+class StagedUpload {
+    public:
+        typedef std::shared_ptr<StagedUpload> Ptr;
+
+        // creates the hidden file for an upload of size bytes to name, in the same directory as name
+        // so it can be renamed there. Returns nullptr, with code set, if name is taken or the file
+        // can't be created
+        static Ptr create(const std::string& name, uint64_t size, connection::MSGECODE* code);
+
+        // carries on with an upload another process (the one a hot restart took over from) staged in
+        // the hidden file stagingName, with the ranges claimed already written. nullptr, with code
+        // set, if that file has gone
+        static Ptr adopt(const std::string& name, const std::string& stagingName, uint64_t size,
+                         const std::vector<std::pair<uint64_t, uint64_t>>& claimed, connection::MSGECODE* code);
+
+        ~StagedUpload();    // removes the hidden file, unless it has been put in place or disowned
+
+        // reserves [offset, offset + len) for one sender. False if that goes past the end or
+        // overlaps a range already reserved
+        bool claim(uint64_t offset, uint64_t len);
+
+        // gives back the part of the range claimed at offset past its first kept bytes, for another
+        // sender to claim
+        void release(uint64_t offset, uint64_t kept);
+
+        // writes up to len bytes from channel at offset. Returns how many arrived before the
+        // channel closed or failed, which is len unless something went wrong
+        uint64_t receive(connection::Connection& channel, uint64_t offset, uint64_t len);
+
+        // writes len bytes at offset, for a caller that has them in hand. False if they couldn't be
+        bool write_at(uint64_t offset, const char* data, size_t len);
+
+        // permission bits the file will have once it's in place
+        void set_mode(uint32_t mode);
+
+        // counts len more bytes as written. True for the call that completes the file
+        bool arrived(uint64_t len);
+
+        // offset and length of every part no sender has claimed
+        std::vector<std::pair<uint64_t, uint64_t>> missing() const;
+
+        // offset and length of every part claimed, neighbours merged. With no sender at work, that's
+        // everything written
+        std::vector<std::pair<uint64_t, uint64_t>> claimed() const;
+
+        // leaves the hidden file in place when this goes, for the process that has adopted it
+        void disown() { disowned_ = true; }
+
+        // syncs the file as the durability mode asks and renames it to its name. Returns why it
+        // couldn't be, or an empty string
+        std::string commit();
+
+        const std::string& name() const { return name_; }
+        const std::string& staging_name() const { return stagingName_; }
+        uint64_t size() const { return size_; }
+#ifndef WIN32
+        int fd() const { return fd_; }  // the hidden file, for a copy to fill without going through us
+#endif
+
+    private:
+        std::string name_;
+        std::string stagingName_;
+        uint64_t size_;
+#ifdef WIN32
+        std::fstream file_;
+#else
+        int fd_;
+#endif
+
+        mutable std::mutex mutex_;
+        std::map<uint64_t, uint64_t> claimed_;  // offset -> end of each range reserved
+        uint64_t written_;
+        bool committed_;
+        bool disowned_;
+
+        StagedUpload(const std::string& name, const std::string& stagingName, uint64_t size);
+
+#ifndef WIN32
+        std::string put_in_place();
+#endif
+
+        StagedUpload(const StagedUpload& other) = delete;
+        StagedUpload& operator=(const StagedUpload& other) = delete;
+};
+
+
+// true for the hidden names uploads are staged under, which listings leave out
+bool is_staging_name(const std::string& name);
+
+// a BundleOpener (see FileBundle.h) for MPUT: stages each file, and puts it in place like PUT does
+connection::BundleSink::Ptr stage_bundle_entry(const connection::BundleEntry& entry, const std::string& path, std::string* reason);
+
+#ifndef WIN32
+// removes every staging file in the server's directory, returning how many there were. Only for a
+// server starting with no other running in the same directory: an upload cut off by one that
+// crashed or was killed never will finish, and nothing else would clean up after it. A copy into a
+// subdirectory that was cut off the same way leaves its hidden file there
+size_t remove_staging_files();
+#endif
+
+constexpr const char* STAGING_PREFIX = ".ftp-upload-";
+constexpr uint64_t STAGING_PREALLOCATE_MIN = 1024 * 1024;     // uploads this big have their space reserved before any of it arrives
@@ -0,0 +1,138 @@
+#include "pch.h"
+#include <fstream>
+#include <sys/stat.h>
+#include "StatCache.h"
+#include "BufferPool.h"
+#include "Checksum.h"
+#include "Metrics.h"
+
+using namespace connection;
+
+
+static metrics::Counter& hits_metric() {
+    static auto& count = metrics::counter("statcache.hits");
+    return count;
+}
+
+
+static metrics::Counter& misses_metric() {
+    static auto& count = metrics::counter("statcache.misses");
+    return count;
+}
+
+
+// stat() of path as STAT reports it, and the inode to tell a replaced file by
+static FileStat stat_path(const std::string& path, uint64_t* inode) {
+    FileStat stat{ STAT_MISSING, 0, 0, 0, 0 };
+#ifdef WIN32
+    struct _stat64 st;
+
+    if (_stat64(path.c_str(), &st) != 0)
+        return stat;
+
+    stat.type = (st.st_mode & _S_IFREG) ? STAT_FILE : (st.st_mode & _S_IFDIR) ? STAT_DIRECTORY : STAT_OTHER;
+    stat.mtimeNs = static_cast<uint64_t>(st.st_mtime) * 1000000000ull;
+    *inode = 0;
+#else
+    struct stat st;
+
+    if (::stat(path.c_str(), &st) != 0)
+        return stat;
+
+    stat.type = S_ISREG(st.st_mode) ? STAT_FILE : S_ISDIR(st.st_mode) ? STAT_DIRECTORY : STAT_OTHER;
+    stat.mtimeNs = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ull + static_cast<uint64_t>(st.st_mtim.tv_nsec);
+    *inode = static_cast<uint64_t>(st.st_ino);
+#endif
+    stat.size = stat.type == STAT_FILE ? static_cast<uint64_t>(st.st_size) : 0;
+
+    return stat;
+}
+
+
+static bool checksum_file(const std::string& path, uint32_t* crc) {
+    std::ifstream input(path, std::ios::binary);
+    auto lease = BufferPool::shared().acquire();
+
+    if (!input.is_open())
+        return false;
+
+    *crc = 0;
+
+    while (input.read(lease.data(), lease.size()) || input.gcount() > 0)
+        *crc = crc32(*crc, lease.data(), static_cast<size_t>(input.gcount()));
+
+    return !input.bad();
+}
+
+
+StatCache& StatCache::shared() {
+    static StatCache cache;
+    return cache;
+}
+
+
+FileStat StatCache::lookup(const std::string& path, bool wantCrc, const std::function<bool(const std::string&)>& allowed) {
+    const auto now = std::chrono::steady_clock::now();
+    Entry previous{ FileStat{ STAT_MISSING, 0, 0, 0, 0 }, 0, now };
+    bool hadPrevious = false;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(path);
+
+        if (it != entries_.end()) {
+            const bool fresh = now - it->second.fetched < std::chrono::milliseconds(STAT_CACHE_TTL_MS);
+            const bool complete = !wantCrc || it->second.stat.type != STAT_FILE || (it->second.stat.flags & STAT_HAS_CRC);
+
+            if (fresh && complete) {
+                ++hits_metric();
+                return it->second.stat;
+            }
+
+            previous = it->second;
+            hadPrevious = true;
+        }
+    }
+
+    ++misses_metric();
+
+    Entry entry{ FileStat{ STAT_MISSING, 0, 0, 0, 0 }, 0, now };
+
+    if (!allowed(path))
+        return entry.stat;
+
+    entry.stat = stat_path(path, &entry.inode);
+
+    if (entry.stat.type == STAT_FILE) {
+        const bool unchanged = hadPrevious && (previous.stat.flags & STAT_HAS_CRC) && previous.inode == entry.inode &&
+            previous.stat.size == entry.stat.size && previous.stat.mtimeNs == entry.stat.mtimeNs;
+
+        if (unchanged) {
+            entry.stat.crc = previous.stat.crc;
+            entry.stat.flags |= STAT_HAS_CRC;
+        } else if (wantCrc && checksum_file(path, &entry.stat.crc)) {
+            entry.stat.flags |= STAT_HAS_CRC;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (entries_.size() >= STAT_CACHE_MAX_ENTRIES)
+        entries_.clear();
+
+    entries_[path] = entry;
+
+    return entry.stat;
+}
+
+
+void StatCache::invalidate(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.erase(path);
+}
+
+
+void StatCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+}
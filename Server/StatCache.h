@@ -0,0 +1,42 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "StatBatch.h"
+
+// What STAT reports, kept for a moment so a client polling a large tree doesn't cost a stat() per
+// name per request. Checksums are kept for as long as the file they were computed from is
+// unchanged (same inode, size and modification time), since those mean reading the whole file.
+// The server's own writes invalidate the paths they touch; changes made behind its back show up
+// within STAT_CACHE_TTL_MS
+class StatCache {
+    public:
+        static StatCache& shared();
+
+        // allowed vets a path before it's looked at on disk (STAT_MISSING if it refuses); a path
+        // still cached has been vetted within STAT_CACHE_TTL_MS
+        connection::FileStat lookup(const std::string& path, bool wantCrc, const std::function<bool(const std::string&)>& allowed);
+
+        void invalidate(const std::string& path);
+        void clear();
+
+    private:
+        struct Entry {
+            connection::FileStat stat;
+            uint64_t inode;
+            std::chrono::steady_clock::time_point fetched;
+        };
+
+        std::mutex mutex_;
+        std::unordered_map<std::string, Entry> entries_;
+
+        StatCache() {}
+
+        StatCache(const StatCache& other) = delete;
+        StatCache& operator=(const StatCache& other) = delete;
+};
+
+constexpr long STAT_CACHE_TTL_MS = 1000;
+constexpr size_t STAT_CACHE_MAX_ENTRIES = 200000;          // past this the cache starts over rather than tracking age